@@ -0,0 +1,233 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/*
+ * alloc.c
+ *
+ * Memory allocator for Lua states.
+ *
+ * Each state gets its own heap, so the free lists are only ever used
+ * by the thread running the state and need no locking. Blocks of up
+ * to HEAP_SMALL bytes come from pages of HEAP_PAGESIZE bytes, split
+ * into size classes HEAP_STEP bytes apart; freed blocks go on the
+ * free list of their class. Lua always gives the size of the block it
+ * frees, so blocks carry no header. Larger blocks are passed through
+ * to malloc.
+ *
+ * Pages are only returned to the system when the state is closed,
+ * which is when the last block is freed.
+ *
+ * The heap also keeps the statistics reported by callisto.stats: the
+ * bytes allocated, and the collections of the state with the pauses
+ * they cause, recorded by hooks the collector calls (see luaconf.h).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua/lua.h>
+
+#include "alloc.h"
+
+#define PAGE_HEADER 16 /* the link to the next page, keeping alignment */
+
+#define classof(n) (((n) - 1) / HEAP_STEP)
+#define classsize(c) (((c) + 1) * HEAP_STEP)
+
+static int
+newpage(struct heap *h)
+{
+	char *page;
+	size_t rest;
+
+	if ((page = malloc(HEAP_PAGESIZE)) == NULL)
+		return 0;
+
+	/* keep what is left of the old page */
+	rest = h->end - h->bump;
+	if (rest >= HEAP_STEP) {
+		rest = classof(rest - HEAP_STEP + 1);
+		*(void **)h->bump = h->free[rest];
+		h->free[rest] = h->bump;
+	}
+
+	*(void **)page = h->pages;
+	h->pages = page;
+	h->npages++;
+	h->bump = page + PAGE_HEADER;
+	h->end = page + HEAP_PAGESIZE;
+	return 1;
+}
+
+static void *
+smallalloc(struct heap *h, size_t c)
+{
+	void *p;
+
+	if ((p = h->free[c]) != NULL) {
+		h->free[c] = *(void **)p;
+	} else {
+		if ((size_t)(h->end - h->bump) < classsize(c) && !newpage(h))
+			return NULL;
+		p = h->bump;
+		h->bump += classsize(c);
+	}
+	h->classes[c].allocs++;
+	h->classes[c].inuse++;
+	return p;
+}
+
+static void
+release(struct heap *h, void *p, size_t size)
+{
+	size_t c;
+
+	if (size > HEAP_SMALL) {
+		free(p);
+		h->largeinuse -= size;
+		return;
+	}
+	c = classof(size);
+	*(void **)p = h->free[c];
+	h->free[c] = p;
+	h->classes[c].inuse--;
+}
+
+static void
+destroy(struct heap *h)
+{
+	void *page, *next;
+
+	for (page = h->pages; page != NULL; page = next) {
+		next = *(void **)page;
+		free(page);
+	}
+	free(h);
+}
+
+/*
+ * Returns a new, empty heap for heap_alloc.
+ */
+struct heap *
+heap_new(void)
+{
+	struct heap *h;
+
+	if ((h = calloc(1, sizeof(struct heap))) != NULL)
+		h->created = heap_clock();
+	return h;
+}
+
+/*
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+long long
+heap_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Called by the collector when it starts ('begin') and finishes work
+ * that the program waits for. Finalizers run inside a pause, and a
+ * collection they cause is part of it.
+ */
+void
+heap_gcstep(lua_State *L, int begin)
+{
+	struct heap *h;
+	long long t;
+
+	if ((h = *(struct heap **)lua_getextraspace(L)) == NULL)
+		return;
+	if (begin) {
+		if (h->gcdepth++ == 0)
+			h->gcbegin = heap_clock();
+		return;
+	}
+	if (--h->gcdepth > 0)
+		return;
+	t = heap_clock() - h->gcbegin;
+	h->gcsteps++;
+	h->gctime += t;
+	if (t > h->gcmaxpause)
+		h->gcmaxpause = t;
+}
+
+/*
+ * Called by the collector at the atomic phase of each cycle.
+ */
+void
+heap_gccycle(lua_State *L, int minor)
+{
+	struct heap *h;
+
+	if ((h = *(struct heap **)lua_getextraspace(L)) == NULL)
+		return;
+	if (minor)
+		h->gcminor++;
+	else
+		h->gcmajor++;
+}
+
+/*
+ * The lua_Alloc function for states created with a heap from heap_new
+ * as their userdata. The heap is freed along with the state.
+ */
+void *
+heap_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct heap *h;
+	void *np;
+
+	h = ud;
+	if (ptr == NULL)
+		osize = 0; /* osize is the kind of object being created */
+
+	if (nsize == 0) {
+		if (ptr == NULL)
+			return NULL;
+		release(h, ptr, osize);
+		if ((h->inuse -= osize) == 0) /* the state was closed? */
+			destroy(h);
+		return NULL;
+	}
+
+	if (ptr != NULL && osize <= HEAP_SMALL && nsize <= HEAP_SMALL
+	    && classof(osize) == classof(nsize)) {
+		np = ptr; /* still fits */
+	} else if (nsize <= HEAP_SMALL) {
+		if ((np = smallalloc(h, classof(nsize))) == NULL)
+			return NULL;
+		if (ptr != NULL) {
+			memcpy(np, ptr, osize < nsize ? osize : nsize);
+			release(h, ptr, osize);
+		}
+	} else if (ptr != NULL && osize > HEAP_SMALL) {
+		if ((np = realloc(ptr, nsize)) == NULL)
+			return NULL;
+		h->largeinuse = h->largeinuse - osize + nsize;
+	} else {
+		if ((np = malloc(nsize)) == NULL)
+			return NULL;
+		h->largeallocs++;
+		h->largeinuse += nsize;
+		if (ptr != NULL) {
+			memcpy(np, ptr, osize);
+			release(h, ptr, osize);
+		}
+	}
+
+	if (nsize > osize)
+		h->allocated += nsize - osize;
+	h->inuse = h->inuse - osize + nsize;
+	if (h->inuse > h->peak)
+		h->peak = h->inuse;
+	return np;
+}
@@ -0,0 +1,57 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+#ifndef _ALLOC_H_
+#define _ALLOC_H_
+
+#include <stddef.h>
+
+#include <lua/lua.h>
+
+#define HEAP_SMALL    256   /* largest block served from pages */
+#define HEAP_STEP     8     /* size class granularity */
+#define HEAP_CLASSES  (HEAP_SMALL / HEAP_STEP)
+#define HEAP_PAGESIZE 65536
+
+#define HEAP_REGKEY "_CALLISTO_HEAP" /* registry field holding the heap */
+
+struct heapclass {
+	size_t allocs;  /* blocks handed out in total */
+	size_t inuse;   /* blocks currently in use */
+};
+
+struct heap {
+	void *free[HEAP_CLASSES]; /* free blocks of each class */
+	char *bump;               /* unused part of the newest page */
+	char *end;
+	void *pages;              /* all pages, linked through their start */
+	size_t npages;
+	size_t inuse;             /* bytes in use, small and large */
+	size_t peak;
+	size_t largeallocs;
+	size_t largeinuse;        /* bytes in blocks above HEAP_SMALL */
+	size_t allocated;         /* bytes allocated since the start */
+	struct heapclass classes[HEAP_CLASSES];
+
+	/* kept for callisto.stats */
+	long long created;        /* when the heap was made, in ns */
+	size_t gcminor;           /* young collections */
+	size_t gcmajor;           /* full and incremental cycles */
+	size_t gcsteps;           /* pauses for the collector */
+	long long gctime;         /* time spent in them, in ns */
+	long long gcmaxpause;
+	long long gcbegin;        /* start of the current pause */
+	int gcdepth;
+};
+
+struct heap *heap_new(void);
+void *heap_alloc(void *, void *, size_t, size_t);
+long long heap_clock(void);
+
+/* called by the collector, see luai_gcstepbegin in lua/llimits.h */
+void heap_gcstep(lua_State *, int);
+void heap_gccycle(lua_State *, int);
+
+#endif
@@ -0,0 +1,59 @@
+--
+-- Measures building a 10000-line report with string concatenation,
+-- table.concat and a buffer, and encoding a document to a string and
+-- to a buffer. Prints a report, or the results as JSON with -j.
+--
+--   csto benchmarks/buffer.lua [-j]
+--
+
+local results = {}
+
+local function run(name, fn, options)
+	results[#results + 1] = bench.run(name, fn, options)
+end
+
+local rows = {}
+for i = 1, 10000 do
+	rows[i] = {id = i, name = "user" .. i, score = i * 1.5}
+end
+
+run("report ..", function ()
+	local s = ""
+	for _, r in ipairs(rows) do
+		s = s .. r.id .. "\t" .. r.name .. "\t" .. r.score .. "\n"
+	end
+	return s
+end)
+run("report table.concat", function ()
+	local t = {}
+	for i, r in ipairs(rows) do
+		t[i] = string.format("%d\t%s\t%.1f\n", r.id, r.name, r.score)
+	end
+	return table.concat(t)
+end)
+run("report buffer", function ()
+	local buf = buffer.new()
+	for _, r in ipairs(rows) do
+		buf:putf("%d\t%s\t%.1f\n", r.id, r.name, r.score)
+	end
+	return buf:tostring()
+end)
+local buf = buffer.new()
+run("report reused buffer", function ()
+	buf:reset()
+	for _, r in ipairs(rows) do
+		buf:put(r.id, "\t", r.name, "\t", r.score, "\n")
+	end
+end)
+
+run("json.encode", function () return json.encode(rows) end)
+run("json.encodeto buffer", function ()
+	buf:reset()
+	json.encodeto(buf, rows)
+end)
+
+if arg[1] == "-j" then
+	print(json.encode(results))
+else
+	io.write(bench.report(results))
+end
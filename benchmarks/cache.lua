@@ -0,0 +1,70 @@
+--
+-- Measures starting csto on a large script that requires a large
+-- module, without a bytecode cache, with an empty cache (cold) and
+-- with a cache filled by an earlier run (warm).
+-- Prints a report, or the results as JSON with -j.
+--
+--   csto benchmarks/cache.lua [-j]
+--
+
+local results = {}
+
+local function run(name, fn, options)
+	results[#results + 1] = bench.run(name, fn, options)
+end
+
+local function write(path, s)
+	local f = assert(io.open(path, "w"))
+	f:write(s)
+	f:close()
+end
+
+-- a module of many small functions, and a script calling a few
+local function source(n, prefix)
+	local lines = {"local M = {}"}
+
+	for i = 1, n do
+		lines[#lines + 1] = ("function M.%s%d(a, b)\n"
+			.. "\tlocal t = {a, b, %d, \"%s%d\"}\n"
+			.. "\tif #t > 3 then return t[1] + %d end\n"
+			.. "\treturn b\nend"):format(prefix, i, i, prefix, i, i)
+	end
+	lines[#lines + 1] = "return M"
+	return table.concat(lines, "\n")
+end
+
+local dir = os.tmpname()
+os.remove(dir)
+assert(fs.mkdir(dir))
+write(dir .. "/big.lua", source(3000, "f"))
+write(dir .. "/main.lua", "package.path = " .. ("%q"):format(dir .. "/?.lua")
+	.. "\nlocal big = require(\"big\")\n"
+	.. "local M = (function ()\n" .. source(1000, "g") .. "\nend)()\n"
+	.. "assert(big.f1(1, 2) + M.g1(1, 2) == 4)\n")
+
+local csto = ("%q"):format(arg[-1])
+local script = ("%q"):format(dir .. "/main.lua")
+local cold = 0
+
+local function csto_run(options)
+	assert(os.execute(csto .. " " .. options .. " " .. script))
+end
+
+run("no cache", function () csto_run("") end, {min_time = 2})
+run("cold cache", function ()
+	-- a new directory each time, so nothing is cached yet
+	cold = cold + 1
+	csto_run("-C " .. ("%q"):format(dir .. "/cold" .. cold))
+end, {min_time = 2})
+csto_run("-C " .. ("%q"):format(dir .. "/warm"))
+run("warm cache", function ()
+	csto_run("-C " .. ("%q"):format(dir .. "/warm"))
+end, {min_time = 2})
+
+os.execute("rm -rf " .. ("%q"):format(dir))
+
+if arg[1] == "-j" then
+	print(json.encode(results))
+else
+	io.write(bench.report(results))
+end
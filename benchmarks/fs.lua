@@ -0,0 +1,43 @@
+--
+-- Measures common file system operations in a temporary directory.
+-- Prints a report, or the results as JSON with -j.
+--
+--   csto benchmarks/fs.lua [-j]
+--
+
+local results = {}
+
+local function run(name, fn, options)
+	results[#results + 1] = bench.run(name, fn, options)
+end
+
+local dir = os.tmpname()
+os.remove(dir)
+assert(fs.mkdir(dir))
+local file = dir .. "/file"
+local f = assert(io.open(file, "w"))
+f:write(("x"):rep(65536))
+f:close()
+
+run("basename", function () fs.basename("/usr/local/lib/file.so") end)
+run("dirname", function () fs.dirname("/usr/local/lib/file.so") end)
+run("exists", function () fs.exists(file) end)
+run("isfile", function () fs.isfile(file) end)
+run("isdirectory", function () fs.isdirectory(dir) end)
+run("copy 64k", function () fs.copy(file, dir .. "/copy") end)
+run("mkdir rmdir", function ()
+	fs.mkdir(dir .. "/sub")
+	fs.rmdir(dir .. "/sub")
+end)
+run("move", function ()
+	fs.move(file, dir .. "/moved")
+	fs.move(dir .. "/moved", file)
+end)
+
+fs.remove(dir)
+
+if arg[1] == "-j" then
+	print(json.encode(results))
+else
+	io.write(bench.report(results))
+end
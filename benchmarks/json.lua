@@ -0,0 +1,39 @@
+--
+-- Measures encoding, decoding and querying JSON documents of a few
+-- sizes. Prints a report, or the results as JSON with -j.
+--
+--   csto benchmarks/json.lua [-j]
+--
+
+local results = {}
+
+local function run(name, fn, options)
+	results[#results + 1] = bench.run(name, fn, options)
+end
+
+local function document(n)
+	local items = {}
+	for i = 1, n do
+		items[i] = {id = i, name = "item " .. i, price = i * 1.25,
+			tags = {"a", "b", "c"}, active = i % 2 == 0}
+	end
+	return {id = 1, user = "someone", items = items}
+end
+
+for _, n in ipairs({1, 100, 10000}) do
+	local doc = document(n)
+	local text = json.encode(doc)
+	run(("encode %d"):format(n), function () json.encode(doc) end)
+	run(("decode %d"):format(n), function () json.decode(text) end)
+	run(("parse %d"):format(n), function () json.parse(text) end)
+	run(("get %d"):format(n), function ()
+		json.get(text, "/items/" .. (n - 1) .. "/id")
+	end)
+	run(("validate %d"):format(n), function () json.validate(text) end)
+end
+
+if arg[1] == "-j" then
+	print(json.encode(results))
+else
+	io.write(bench.report(results))
+end
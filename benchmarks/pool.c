@@ -0,0 +1,79 @@
+/*
+ * Compares the time to serve a request in a state of its own made by
+ * callisto_newstate and in one checked out of a pool, for a request
+ * that uses a few libraries and one that only does arithmetic.
+ *
+ *   make benchmarks/pool && benchmarks/pool [requests]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "callisto.h"
+
+static const char *const requests[] = {
+	"local doc = json.decode('{\"path\": \"/srv/www/index.html\"}')\n"
+	"result = json.encode({name = fs.basename(doc.path),"
+	" pid = process.pid()})",
+	"local n = 0 for i = 1, 100 do n = n + i end result = n",
+	NULL
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+serve(lua_State *L, const char *request)
+{
+	if (luaL_dostring(L, request) != LUA_OK) {
+		fprintf(stderr, "%s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct callisto_pool *pool;
+	lua_State *L;
+	double start, fresh, pooled;
+	int i, n, r;
+
+	n = argc > 1 ? atoi(argv[1]) : 10000;
+	if ((pool = callisto_newpool(1)) == NULL) {
+		fprintf(stderr, "cannot make pool\n");
+		return 1;
+	}
+	for (r = 0; requests[r] != NULL; r++) {
+		start = now();
+		for (i = 0; i < n; i++) {
+			L = callisto_newstate();
+			serve(L, requests[r]);
+			lua_close(L);
+		}
+		fresh = (now() - start) / n;
+
+		start = now();
+		for (i = 0; i < n; i++) {
+			L = callisto_checkout(pool);
+			serve(L, requests[r]);
+			callisto_checkin(pool, L);
+		}
+		pooled = (now() - start) / n;
+
+		printf("request %d: newstate %8.2f us, pool %8.2f us, %5.1fx\n",
+		    r + 1, fresh * 1e6, pooled * 1e6, fresh / pooled);
+	}
+	callisto_closepool(pool);
+	return 0;
+}
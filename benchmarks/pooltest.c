@@ -0,0 +1,85 @@
+/*
+ * Checks that a state checked into a pool comes back out of it reset:
+ * globals, registry entries, replaced library functions, metatables
+ * and json.config options set by a request do not reach the next one.
+ *
+ *   make benchmarks/pooltest && benchmarks/pooltest
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "callisto.h"
+
+/* changes everything a request should not leave behind */
+static const char dirty[] =
+	"x = 1\n"
+	"fs.exists = function () return 'replaced' end\n"
+	"package.loaded.extra = {}\n"
+	"debug.getregistry().extra = true\n"
+	"getmetatable('').__index = {}\n"
+	"setmetatable(_G, {})\n"
+	"json.config('encode:number-precision', 3)\n"
+	"json.config('encode:keep-buffer', false)\n"
+	"json.config('encode:escape-forward-slash', false)\n";
+
+/* fails if anything from dirty is left */
+static const char check[] =
+	"assert(x == nil, 'global kept')\n"
+	"assert(fs.exists('/') == true, 'library function kept')\n"
+	"assert(package.loaded.extra == nil, 'loaded module kept')\n"
+	"assert(debug.getregistry().extra == nil, 'registry entry kept')\n"
+	"assert(('x'):upper() == 'X', 'string metatable kept')\n"
+	"assert(getmetatable(_G) == nil, 'global metatable kept')\n"
+	"assert(json.encode(1/3) == '0.33333333333333', 'json.config kept')\n"
+	"assert(json.encode('/') == '\"\\\\/\"', 'json.config kept')\n";
+
+static void
+run(lua_State *L, const char *chunk, const char *what)
+{
+	if (luaL_dostring(L, chunk) != LUA_OK) {
+		fprintf(stderr, "pooltest: %s: %s\n", what, lua_tostring(L, -1));
+		exit(1);
+	}
+}
+
+int
+main(void)
+{
+	struct callisto_pool *pool;
+	lua_State *L, *L2;
+
+	if ((pool = callisto_newpool(1)) == NULL) {
+		fprintf(stderr, "pooltest: cannot make pool\n");
+		return 1;
+	}
+
+	/* a fresh state passes the check */
+	L = callisto_checkout(pool);
+	run(L, check, "new state");
+	run(L, dirty, "request");
+	callisto_checkin(pool, L);
+
+	/* the idle state is handed out again, reset */
+	if ((L2 = callisto_checkout(pool)) != L) {
+		fprintf(stderr, "pooltest: idle state not reused\n");
+		return 1;
+	}
+	run(L2, check, "reset state");
+
+	/* a state made when none is idle is closed when the pool is full */
+	L = callisto_checkout(pool);
+	run(L, check, "extra state");
+	callisto_checkin(pool, L2);
+	callisto_checkin(pool, L);
+	L = callisto_checkout(pool);
+	run(L, check, "state after overflow");
+	callisto_checkin(pool, L);
+
+	callisto_closepool(pool);
+	printf("pooltest: all tests completed successfully\n");
+	return 0;
+}
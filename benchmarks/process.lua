@@ -0,0 +1,24 @@
+--
+-- Measures looking up processes and signals, and starting a process.
+-- Prints a report, or the results as JSON with -j.
+--
+--   csto benchmarks/process.lua [-j]
+--
+
+local results = {}
+
+local function run(name, fn, options)
+	results[#results + 1] = bench.run(name, fn, options)
+end
+
+run("pid", function () process.pid() end)
+run("signum", function () process.signum("SIGTERM") end)
+run("pidof", function () process.pidof("csto") end)
+run("popen true", function () io.popen("true"):close() end,
+	{min_time = 2})
+
+if arg[1] == "-j" then
+	print(json.encode(results))
+else
+	io.write(bench.report(results))
+end
@@ -0,0 +1,63 @@
+--
+-- Decodes, transforms and encodes a batch of JSON documents without
+-- threads, then with 1 to N threads, where N is the first argument or
+-- the number of processors, and prints the time taken and speedup of
+-- each run.
+--
+--   csto benchmarks/thread-json.lua [threads] [documents]
+--
+
+local maxthreads = tonumber(arg[1]) or thread.cpus()
+local ndocs = tonumber(arg[2]) or 20000
+
+local docs = {}
+for i = 1, ndocs do
+	local items = {}
+	for j = 1, 20 do
+		items[j] = {id = i * 100 + j, name = "item " .. j, price = j * 1.25,
+			tags = {"a", "b", "c"}}
+	end
+	docs[i] = json.encode({id = i, user = "user" .. i, items = items})
+end
+
+-- the work done on each document, run in every thread
+local transform = [[
+	local docs = ...
+	local bytes = 0
+	for i = 1, #docs do
+		local doc = json.decode(docs[i])
+		local total = 0
+		for _, item in ipairs(doc.items) do
+			total = total + item.price
+			item.name = item.name:upper()
+		end
+		doc.total = total
+		bytes = bytes + #json.encode(doc)
+	end
+	return bytes
+]]
+
+local start = bench.clock()
+local bytes = load(transform)(docs)
+local base = bench.clock() - start
+print(("%-11s  %7.3f s  %5.2fx  (%d bytes)"):format(
+	"no threads", base, 1, bytes))
+
+for n = 1, maxthreads do
+	local start = bench.clock()
+	local threads = {}
+	local per = math.ceil(ndocs / n)
+	for t = 1, n do
+		local first = (t - 1) * per + 1
+		local last = math.min(t * per, ndocs)
+		threads[t] = thread.spawn(transform,
+			table.move(docs, first, last, 1, {}))
+	end
+	local bytes = 0
+	for t = 1, n do
+		bytes = bytes + threads[t]:join()
+	end
+	local elapsed = bench.clock() - start
+	print(("%3d threads  %7.3f s  %5.2fx  (%d bytes)"):format(
+		n, elapsed, base / elapsed, bytes))
+end
@@ -0,0 +1,26 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+#ifndef _BUFFER_H_
+#define _BUFFER_H_
+
+#include <stddef.h>
+#include <string.h>
+
+#include <json/strbuf.h>
+
+/*
+ * The userdata of a Buffer. The bytes from 'off' up to the length of
+ * 'sb' have been written and not read yet; other libraries can append
+ * to 'sb' with the strbuf functions and read from 'sb.buf + off'. While
+ * they append, they set 'sb.nomem' to raise an error, since strbuf
+ * exits the program when it cannot grow.
+ */
+struct callisto_buffer {
+	strbuf_t sb;
+	size_t off; /* bytes read from the start of sb.buf */
+};
+
+#endif
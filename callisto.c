@@ -3,54 +3,375 @@
  * Copyright (c) 2023-2024 Jeremy Baxter.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include <lua/lauxlib.h>
 #include <lua/lua.h>
 #include <lua/lualib.h>
 
+#include "alloc.h"
 #include "callisto.h"
+#include "util.h"
+
+#define LAZY_REGKEY "_CALLISTO_LAZY" /* registry field of pending libraries */
 
+int luaopen_callisto(lua_State *);
+int luaopen_bench(lua_State *);
+int luaopen_buffer(lua_State *);
+int luaopen_cbor(lua_State *);
 int luaopen_cl(lua_State *);
 int luaopen_environ(lua_State *);
+int luaopen_event(lua_State *);
 int luaopen_extra(lua_State *);
 int luaopen_fs(lua_State *);
 int luaopen_json(lua_State *);
+int luaopen_msgpack(lua_State *);
 int luaopen_process(lua_State *);
+int luaopen_profiler(lua_State *);
+int luaopen_thread(lua_State *);
 
 /* clang-format off */
 static const luaL_Reg loadedlibs[] = {
-	{ CALLISTO_CLLIBNAME,   luaopen_cl      },
-	{ CALLISTO_ENVLIBNAME,  luaopen_environ },
-	{ CALLISTO_FSYSLIBNAME, luaopen_fs      },
-	{ CALLISTO_JSONLIBNAME, luaopen_json    },
-	{ CALLISTO_PROCLIBNAME, luaopen_process },
-	{ NULL,                 NULL            }
+	{ CALLISTO_RTLIBNAME,    luaopen_callisto },
+	{ CALLISTO_BNCHLIBNAME,  luaopen_bench    },
+	{ CALLISTO_BUFFLIBNAME,  luaopen_buffer   },
+	{ CALLISTO_CBORLIBNAME,  luaopen_cbor     },
+	{ CALLISTO_CLLIBNAME,    luaopen_cl       },
+	{ CALLISTO_ENVLIBNAME,   luaopen_environ  },
+	{ CALLISTO_EVNTLIBNAME,  luaopen_event    },
+	{ CALLISTO_FSYSLIBNAME,  luaopen_fs       },
+	{ CALLISTO_JSONLIBNAME,  luaopen_json     },
+	{ CALLISTO_MPACKLIBNAME, luaopen_msgpack  },
+	{ CALLISTO_PROCLIBNAME,  luaopen_process  },
+	{ CALLISTO_PROFLIBNAME,  luaopen_profiler },
+	{ CALLISTO_THRDLIBNAME,  luaopen_thread   },
+	{ NULL,                  NULL             }
 };
 /* clang-format on */
 
+/*
+ * The panic and warning functions are those of luaL_newstate, which
+ * cannot be given an allocator.
+ */
+static int
+panic(lua_State *L)
+{
+	const char *msg = (lua_type(L, -1) == LUA_TSTRING)
+	    ? lua_tostring(L, -1)
+	    : "error object is not a string";
+	lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n",
+	    msg);
+	return 0; /* return to Lua to abort */
+}
+
+static void warnfoff(void *, const char *, int);
+static void warnfon(void *, const char *, int);
+static void warnfcont(void *, const char *, int);
+
+/*
+ * Checks whether message is a control message. If so, executes the
+ * control or ignores it if unknown.
+ */
+static int
+checkcontrol(lua_State *L, const char *message, int tocont)
+{
+	if (tocont || *(message++) != '@') /* not a control message? */
+		return 0;
+	if (strcmp(message, "off") == 0)
+		lua_setwarnf(L, warnfoff, L); /* turn warnings off */
+	else if (strcmp(message, "on") == 0)
+		lua_setwarnf(L, warnfon, L); /* turn warnings on */
+	return 1; /* it was a control message */
+}
+
+static void
+warnfoff(void *ud, const char *message, int tocont)
+{
+	checkcontrol((lua_State *)ud, message, tocont);
+}
+
+/*
+ * Writes the message and handles 'tocont', finishing the message
+ * if needed and setting the next warn function.
+ */
+static void
+warnfcont(void *ud, const char *message, int tocont)
+{
+	lua_State *L = (lua_State *)ud;
+	lua_writestringerror("%s", message); /* write message */
+	if (tocont) /* not the last part? */
+		lua_setwarnf(L, warnfcont, L); /* to be continued */
+	else { /* last part */
+		lua_writestringerror("%s", "\n"); /* finish message with end-of-line */
+		lua_setwarnf(L, warnfon, L); /* next call is a new message */
+	}
+}
+
+static void
+warnfon(void *ud, const char *message, int tocont)
+{
+	if (checkcontrol((lua_State *)ud, message, tocont)) /* control message? */
+		return; /* nothing else to be done */
+	lua_writestringerror("%s", "Lua warning: "); /* start a new warning */
+	warnfcont(ud, message, tocont); /* finish processing */
+}
+
 lua_State *
 callisto_newstate(void)
 {
 	lua_State *L;
+	struct heap *h;
 
-	L = luaL_newstate();
+	/* each state allocates from its own heap, freed by lua_close */
+	if ((h = heap_new()) == NULL)
+		return NULL;
+	/*
+	 * If this fails after allocating anything, h is freed with it;
+	 * otherwise its few bytes are lost, as memory has run out anyway.
+	 */
+	if ((L = lua_newstate(heap_alloc, h)) == NULL)
+		return NULL;
+	*(struct heap **)lua_getextraspace(L) = h;
+	lua_atpanic(L, &panic);
+	lua_setwarnf(L, warnfoff, L); /* default is warnings off */
+	lua_pushlightuserdata(L, h);
+	lua_setfield(L, LUA_REGISTRYINDEX, HEAP_REGKEY);
 	callisto_openlibs(L);
 	callisto_setversion(L);
 
 	return L;
 }
 
+/*
+ * Call counting.
+ *
+ * Counting is off unless the embedder asks for it, as csto -S does,
+ * since it slows every call a little. callisto_countcalls then
+ * replaces each C function of the opened libraries by a closure
+ * counting its calls, which calls the function directly: there
+ * is no extra stack frame, so errors still name the function. An
+ * upvalue of the function is copied to the closure in front of the
+ * counter, where the function expects it; functions with more than one
+ * upvalue are left alone. The counters are kept in the registry, named
+ * library.function, for callisto.stats.
+ */
+
+static int
+counted(lua_State *L)
+{
+	struct callcount *c = lua_touserdata(L, lua_upvalueindex(1));
+
+	c->calls++;
+	return c->func(L);
+}
+
+static int
+counted1(lua_State *L)
+{
+	struct callcount *c = lua_touserdata(L, lua_upvalueindex(2));
+
+	c->calls++;
+	return c->func(L);
+}
+
+/*
+ * Wraps the functions of the library on the top of the stack, named
+ * 'lib'.
+ */
+static void
+countcalls(lua_State *L, const char *lib)
+{
+	struct callcount *c;
+	lua_CFunction func;
+	int nup;
+
+	/* the runtime library only reports, so its calls are not counted */
+	if (lib == NULL || strcmp(lib, CALLISTO_RTLIBNAME) == 0
+	    || !lua_istable(L, -1))
+		return;
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, CALLS_REGKEY);
+	lua_pushnil(L);
+	while (lua_next(L, -3)) {
+		if (lua_type(L, -2) != LUA_TSTRING
+		    || (func = lua_tocfunction(L, -1)) == NULL) {
+			lua_pop(L, 1);
+			continue;
+		}
+		nup = lua_getupvalue(L, -1, 1) != NULL;
+		if (nup && lua_getupvalue(L, -2, 2) != NULL) {
+			lua_pop(L, 3);
+			continue;
+		}
+		c = lua_newuserdatauv(L, sizeof(*c), 0);
+		c->calls = 0;
+		c->func = func;
+		lua_pushfstring(L, "%s.%s", lib, lua_tostring(L, -3 - nup));
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -6 - nup);
+		lua_pushcclosure(L, nup ? counted1 : counted, nup + 1);
+		lua_pushvalue(L, -3);
+		lua_insert(L, -2);
+		lua_rawset(L, -6); /* replacing a field's value is allowed */
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+ * Starts counting the calls made to the functions of the Callisto
+ * libraries opened in L, and of those opened later, for callisto.stats.
+ * Only the functions in the library tables are counted, so it should
+ * be called before a script can copy them elsewhere.
+ */
 void
-callisto_openall(lua_State *L)
+callisto_countcalls(lua_State *L)
 {
 	const luaL_Reg *lib;
 
-	/* for each Callisto library except extra */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, CALLS_REGKEY) != LUA_TNIL) {
+		lua_pop(L, 1);
+		return; /* already counting */
+	}
+	lua_pop(L, 1);
+	/* libraries opened later see it and are counted as they open */
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, CALLS_REGKEY);
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
 	for (lib = loadedlibs; lib->func; lib++) {
-		lua_newtable(L); /* make a new table for the library */
-		lib->func(L);    /* load library */
-		lua_setglobal(L, lib->name);
+		lua_getfield(L, -1, lib->name);
+		countcalls(L, lib->name);
+		lua_pop(L, 1);
 	}
-	/* inject extra into the global environment */
+	lua_pop(L, 1);
+}
+
+/*
+ * Lazy opening.
+ *
+ * Opening every library takes longer than many scripts take to run, so
+ * callisto_openlazy only sets the global of each library to an empty
+ * table, its stub, and adds a loader for it to package.preload. The
+ * first time a stub is indexed, assigned to, traversed or measured, or
+ * the library is required, the library is opened and its fields and
+ * metatable are moved into the stub, which from then on is the library
+ * table: the global, package.loaded and require() all give the same
+ * table, and the global table is left as it is. The stubs still
+ * pending are kept in the registry, each with its entry in loadedlibs.
+ */
+
+/* opens the library of the stub at 'idx' unless it is open already */
+static void
+openstub(lua_State *L, int idx)
+{
+	const luaL_Reg *lib;
+	int top;
+
+	idx = lua_absindex(L, idx);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LAZY_REGKEY) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, -2) != LUA_TLIGHTUSERDATA) {
+		lua_pop(L, 2);
+		return;
+	}
+	lib = lua_touserdata(L, -1);
+	top = lua_gettop(L);
+	lib->func(L);           /* load library */
+	lua_settop(L, top + 1); /* keep only its table */
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, idx);
+	}
+	if (!lua_getmetatable(L, -1))
+		lua_pushnil(L);
+	lua_setmetatable(L, idx);
+	/* not before, so the library stays pending if opening it fails */
+	lua_pushvalue(L, idx);
+	lua_pushnil(L);
+	lua_rawset(L, top - 1);
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	lua_pushvalue(L, idx);
+	lua_setfield(L, -2, lib->name);
+	lua_settop(L, top - 2);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, CALLS_REGKEY) != LUA_TNIL) {
+		lua_pushvalue(L, idx);
+		countcalls(L, lib->name);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+}
+
+static int
+lazy_index(lua_State *L)
+{
+	openstub(L, 1);
+	lua_settop(L, 2);
+	lua_gettable(L, 1);
+	return 1;
+}
+
+static int
+lazy_newindex(lua_State *L)
+{
+	openstub(L, 1);
+	lua_settop(L, 3);
+	lua_settable(L, 1);
+	return 0;
+}
+
+static int
+lazy_len(lua_State *L)
+{
+	openstub(L, 1);
+	lua_len(L, 1);
+	return 1;
+}
+
+static int
+lazy_next(lua_State *L)
+{
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 2);
+	if (lua_next(L, 1))
+		return 2;
+	lua_pushnil(L);
+	return 1;
+}
+
+static int
+lazy_pairs(lua_State *L)
+{
+	openstub(L, 1);
+	if (luaL_getmetafield(L, 1, "__pairs") != LUA_TNIL) {
+		lua_pushvalue(L, 1);
+		lua_call(L, 1, 3);
+		return 3;
+	}
+	lua_pushcfunction(L, lazy_next);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+/* package.preload loader; upvalue 1 is the stub */
+static int
+lazy_load(lua_State *L)
+{
+	openstub(L, lua_upvalueindex(1));
+	lua_pushvalue(L, lua_upvalueindex(1));
+	return 1;
+}
+
+/* inject extra into the global environment */
+static void
+openextra(lua_State *L)
+{
 	luaopen_extra(L);
 	lua_pushnil(L);
 	while (lua_next(L, -2) != 0) { /* for each key in the extra library */
@@ -62,13 +383,66 @@ callisto_openall(lua_State *L)
 		/* assign the value to a global */
 		lua_setglobal(L, lua_tostring(L, -2));
 	}
+	lua_pop(L, 1);
+}
+
+void
+callisto_openall(lua_State *L)
+{
+	if (lua_getfield(L, LUA_REGISTRYINDEX, LAZY_REGKEY) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		callisto_openlazy(L);
+		lua_getfield(L, LUA_REGISTRYINDEX, LAZY_REGKEY);
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2)) { /* for each pending library */
+		lua_pop(L, 1);
+		openstub(L, -1); /* clearing a field is allowed while traversing */
+	}
+	lua_pop(L, 1);
+}
+
+void
+callisto_openlazy(lua_State *L)
+{
+	const luaL_Reg *lib;
+	/* clang-format off */
+	static const luaL_Reg metamethods[] = {
+		{ "__index",    lazy_index    },
+		{ "__len",      lazy_len      },
+		{ "__newindex", lazy_newindex },
+		{ "__pairs",    lazy_pairs    },
+		{ NULL,         NULL          }
+	};
+	/* clang-format on */
+
+	lua_newtable(L); /* pending libraries */
+	lua_pushvalue(L, -1);
+	lua_setfield(L, LUA_REGISTRYINDEX, LAZY_REGKEY);
+	luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);
+	luaL_newlib(L, metamethods);
+	/* for each Callisto library except extra */
+	for (lib = loadedlibs; lib->func; lib++) {
+		lua_newtable(L); /* its stub */
+		lua_pushvalue(L, -2);
+		lua_setmetatable(L, -2);
+		lua_pushvalue(L, -1);
+		lua_pushlightuserdata(L, (void *)lib);
+		lua_rawset(L, -6);
+		lua_pushvalue(L, -1);
+		lua_pushcclosure(L, lazy_load, 1);
+		lua_setfield(L, -4, lib->name);
+		lua_setglobal(L, lib->name);
+	}
+	lua_pop(L, 3);
+	openextra(L);
 }
 
 void
 callisto_openlibs(lua_State *L)
 {
 	luaL_openlibs(L);
-	callisto_openall(L);
+	callisto_openlazy(L);
 }
 
 void
@@ -19,18 +19,38 @@
 #define CALLISTO_COPYRIGHT \
 	CALLISTO_VERSION " (" LUA_RELEASE ")  Copyright (C) 1994-2022 Lua.org, PUC-Rio"
 
-#define CALLISTO_CLLIBNAME   "cl"
-#define CALLISTO_ENVLIBNAME  "environ"
-#define CALLISTO_EXTLIBNAME  "_G" /* global table */
-#define CALLISTO_FSYSLIBNAME "fs"
-#define CALLISTO_JSONLIBNAME "json"
-#define CALLISTO_PROCLIBNAME "process"
-
+#define CALLISTO_BNCHLIBNAME  "bench"
+#define CALLISTO_BUFFLIBNAME  "buffer"
+#define CALLISTO_CBORLIBNAME  "cbor"
+#define CALLISTO_CLLIBNAME    "cl"
+#define CALLISTO_ENVLIBNAME   "environ"
+#define CALLISTO_EVNTLIBNAME  "event"
+#define CALLISTO_EXTLIBNAME   "_G" /* global table */
+#define CALLISTO_FSYSLIBNAME  "fs"
+#define CALLISTO_JSONLIBNAME  "json"
+#define CALLISTO_MPACKLIBNAME "msgpack"
+#define CALLISTO_PROCLIBNAME  "process"
+#define CALLISTO_PROFLIBNAME  "profiler"
+#define CALLISTO_RTLIBNAME    "callisto" /* the runtime itself */
+#define CALLISTO_THRDLIBNAME  "thread"
+
+#define CALLISTO_BUFFER  "Buffer"
+#define CALLISTO_CHANNEL "Channel"
 #define CALLISTO_ENVIRON "environ"
+#define CALLISTO_THREAD  "Thread"
+
+struct callisto_pool;
 
 lua_State *callisto_newstate(void);
+void callisto_countcalls(lua_State *);
 void callisto_openall(lua_State *);
+void callisto_openlazy(lua_State *);
 void callisto_openlibs(lua_State *);
 void callisto_setversion(lua_State *);
 
+struct callisto_pool *callisto_newpool(int);
+lua_State *callisto_checkout(struct callisto_pool *);
+void callisto_checkin(struct callisto_pool *, lua_State *);
+void callisto_closepool(struct callisto_pool *);
+
 #endif
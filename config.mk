@@ -0,0 +1,10 @@
+# generated by configure
+
+_CC       = gcc
+_CFLAGS   = -std=c99 -O3
+_CPPFLAGS = 
+_LDFLAGS  =-lm -pthread -Wl,-E -fuse-ld=gold -Wl,--gc-sections
+
+_EXT_CPPFLAGS = -DLUA_USE_POSIX -DLUA_USE_DLOPEN
+
+_LUAOBJS = external/lua/lapi.o external/lua/lcode.o external/lua/lctype.o external/lua/ldebug.o external/lua/ldo.o external/lua/ldump.o external/lua/lfunc.o external/lua/lgc.o external/lua/llex.o external/lua/lmem.o external/lua/lobject.o external/lua/lopcodes.o external/lua/lparser.o external/lua/lstate.o external/lua/lstring.o external/lua/ltable.o external/lua/ltm.o external/lua/lundump.o external/lua/lvm.o external/lua/lzio.o external/lua/lauxlib.o external/lua/lbaselib.o external/lua/lcorolib.o external/lua/ldblib.o external/lua/liolib.o external/lua/lmathlib.o external/lua/loadlib.o external/lua/loslib.o external/lua/lstrlib.o external/lua/ltablib.o external/lua/lutf8lib.o external/lua/linit.o
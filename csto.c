@@ -4,7 +4,19 @@
  * Copyright (c) 2023-2024 Jeremy Baxter.
  */
 
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,6 +27,7 @@
 #include <lua/lualib.h>
 
 #include "callisto.h"
+#include "util.h"
 
 #if !defined(LUA_PROGNAME)
 #define LUA_PROGNAME "csto"
@@ -26,6 +39,22 @@
 
 #define LUA_INITVARVERSION LUA_INIT_VAR LUA_VERSUFFIX
 
+#if !defined(CALLISTO_CACHE_VAR)
+#define CALLISTO_CACHE_VAR "CALLISTO_CACHE_DIR"
+#endif
+
+#if !defined(CALLISTO_HEAP_RATE_VAR)
+#define CALLISTO_HEAP_RATE_VAR "CALLISTO_HEAP_RATE"
+#endif
+
+#if !defined(CALLISTO_TRACE_FILTER_VAR)
+#define CALLISTO_TRACE_FILTER_VAR "CALLISTO_TRACE_FILTER"
+#endif
+
+#if !defined(CALLISTO_TRACE_MIN_VAR)
+#define CALLISTO_TRACE_MIN_VAR "CALLISTO_TRACE_MIN"
+#endif
+
 static lua_State *globalL = NULL;
 
 static const char *progname = LUA_PROGNAME;
@@ -72,23 +101,41 @@ static void
 print_usage(const char *badoption)
 {
 	lua_writestringerror("%s: ", progname);
-	if (badoption[1] == 'e' || badoption[1] == 'l')
+	if (badoption[1] == 'C' || badoption[1] == 'G' || badoption[1] == 'M'
+	    || badoption[1] == 'P' || badoption[1] == 'T' || badoption[1] == 'e'
+	    || badoption[1] == 'l')
 		lua_writestringerror("'%s' needs argument\n", badoption);
 	else
 		lua_writestringerror("unrecognized option '%s'\n", badoption);
 	lua_writestringerror(
-		"usage: %s [-EivW] [-e stat] [-l mod|g=mod] [script [args]]\n"
+		"usage: %s [-EiRSvW] [-C dir] [-G mode] [-M file] [-P file]\n"
+		"            [-T file] [-e stat] [-l mod|g=mod] [script [args]]\n",
+		progname);
+	lua_writestringerror("       %s --bundle out script [module ...]\n",
+		progname);
+	lua_writestringerror("       %s --serve socket [module ...]\n",
+		progname);
+	lua_writestringerror("       %s --client socket script [args]\n",
+		progname);
+	lua_writestringerror("%s",
 		"available options are:\n"
+		"    -C dir          cache compiled scripts and modules in 'dir'\n"
+		"    -G mode         set the garbage collector's mode, one of\n"
+		"                    'inc[:pause[,stepmul]]' or 'gen[:minor[,major]]'\n"
+		"    -M file         write a heap profile of the script to 'file'\n"
+		"    -P file         write a profile of the script to 'file'\n"
+		"    -T file         write a trace of the script's calls to 'file'\n"
 		"    -e stat         execute string 'stat'\n"
 		"    -i              enter interactive mode after executing 'script'\n"
 		"    -l mod          require library 'mod' into global 'mod'\n"
 		"    -l g=mod        require library 'mod' into global 'g'\n"
 		"    -v              show version information\n"
 		"    -E              ignore environment variables\n"
+		"    -R              find modules through an index of their directories\n"
+		"    -S              print statistics about the run at exit\n"
 		"    -W              turn warnings on\n"
 		"    --              stop handling options\n"
-		"    -               stop handling options and execute stdin\n",
-		progname);
+		"    -               stop handling options and execute stdin\n");
 }
 
 /*
@@ -187,6 +234,467 @@ createargtable(lua_State *L, char **argv, int argc, int script)
 	lua_setglobal(L, "arg");
 }
 
+/*
+ * {==================================================================
+ * Bytecode cache
+ * ===================================================================
+ */
+
+/*
+ * When a cache directory is given with -C or CALLISTO_CACHE_DIR, the
+ * compiled form of every script and module loaded from a file is kept
+ * there, named after a hash of its path. Each cache file starts with a
+ * header describing the source it was compiled from; a cached chunk is
+ * only used while the source has the same modification time and size
+ * and the interpreter has the same Lua version.
+ */
+
+static const char *cachedir = NULL;
+
+#define CACHE_MAGIC "\033Csc"
+
+struct cacheheader {
+	char magic[4];
+	long version; /* LUA_VERSION_RELEASE_NUM */
+	long long size;
+	long long mtime;
+	long mtimensec;
+	size_t keylen; /* length of the key following the header */
+};
+
+struct cachereader {
+	FILE *fp;
+	char buf[BUFSIZ];
+};
+
+static const char *
+cachegetchunk(lua_State *L, void *ud, size_t *size)
+{
+	struct cachereader *cr = (struct cachereader *)ud;
+	(void)L;
+	*size = fread(cr->buf, 1, sizeof(cr->buf), cr->fp);
+	return *size > 0 ? cr->buf : NULL;
+}
+
+static int
+cachewriter(lua_State *L, const void *p, size_t size, void *ud)
+{
+	(void)L;
+	return fwrite(p, 1, size, (FILE *)ud) != size;
+}
+
+/*
+ * FNV-1a, used to name cache files after their key.
+ */
+static unsigned long long
+cachehash(const char *s, size_t len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)s[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * Loads the cached chunk for 'cachefile' if its header and key match.
+ * Only files owned by the current user are trusted. Returns LUA_OK
+ * with the chunk pushed, or -1 with nothing pushed.
+ */
+static int
+cacheload(lua_State *L, const char *cachefile,
+	const struct cacheheader *hdr, const char *key)
+{
+	struct cachereader cr;
+	struct cacheheader h;
+	struct stat st;
+	char buf[PATH_MAX * 2 + 2];
+	int status = -1;
+
+	if ((cr.fp = fopen(cachefile, "rb")) == NULL)
+		return -1;
+	if (fstat(fileno(cr.fp), &st) == 0 && st.st_uid == geteuid()
+		&& fread(&h, sizeof(h), 1, cr.fp) == 1
+		&& memcmp(&h, hdr, sizeof(h)) == 0
+		&& fread(buf, 1, h.keylen, cr.fp) == h.keylen
+		&& memcmp(buf, key, h.keylen) == 0) {
+		/* the chunk name follows the real path in the key */
+		status = lua_load(L, cachegetchunk, &cr, key + strlen(key) + 1, "b");
+		if (status != LUA_OK) { /* damaged cache file? */
+			lua_pop(L, 1);
+			status = -1;
+		}
+	}
+	fclose(cr.fp);
+	return status;
+}
+
+/*
+ * Writes the chunk on the top of the stack to 'cachefile'. The chunk
+ * is written to a temporary file first and then renamed, so readers
+ * never see a partial file. Errors are ignored; the cache is only an
+ * optimisation.
+ */
+static void
+cachestore(lua_State *L, const char *cachefile,
+	const struct cacheheader *hdr, const char *key)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+	int fd, err;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", cachefile) >= (int)sizeof(tmp))
+		return;
+	if ((fd = mkstemp(tmp)) == -1)
+		return;
+	if ((fp = fdopen(fd, "wb")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		return;
+	}
+	err = fwrite(hdr, sizeof(*hdr), 1, fp) != 1
+		|| fwrite(key, 1, hdr->keylen, fp) != hdr->keylen
+		|| lua_dump(L, cachewriter, fp, 0) != 0;
+	err |= fclose(fp) != 0;
+	if (err || rename(tmp, cachefile) != 0)
+		unlink(tmp);
+}
+
+/*
+ * Loads the Lua file 'fname' like luaL_loadfile, going through the
+ * bytecode cache if it is enabled.
+ */
+static int
+loadfile(lua_State *L, const char *fname)
+{
+	struct cacheheader hdr;
+	struct stat st;
+	char cachefile[PATH_MAX];
+	char key[PATH_MAX * 2 + 2];
+	size_t len;
+	int status;
+
+	if (cachedir == NULL || fname == NULL || stat(fname, &st) != 0
+		|| !S_ISREG(st.st_mode) || realpath(fname, key) == NULL)
+		return luaL_loadfile(L, fname);
+
+	/* the key is the real path followed by the chunk name */
+	len = strlen(key) + 1;
+	if (snprintf(key + len, sizeof(key) - len, "@%s", fname)
+		>= (int)(sizeof(key) - len))
+		return luaL_loadfile(L, fname);
+	len += strlen(key + len);
+	if (snprintf(cachefile, sizeof(cachefile), "%s/%016llx", cachedir,
+		cachehash(key, len)) >= (int)sizeof(cachefile))
+		return luaL_loadfile(L, fname);
+
+	memset(&hdr, 0, sizeof(hdr)); /* clear any padding */
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version = LUA_VERSION_RELEASE_NUM;
+	hdr.size = st.st_size;
+	hdr.mtime = st.st_mtim.tv_sec;
+	hdr.mtimensec = st.st_mtim.tv_nsec;
+	hdr.keylen = len;
+
+	if (cacheload(L, cachefile, &hdr, key) == LUA_OK)
+		return LUA_OK;
+	if ((status = luaL_loadfile(L, fname)) == LUA_OK)
+		cachestore(L, cachefile, &hdr, key);
+	return status;
+}
+
+/*
+ * Replacement for the Lua file searcher of 'require' that loads
+ * modules through the cache. Upvalue 1 is the package table.
+ */
+static int
+searcher_cached(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	const char *filename;
+	lua_getfield(L, lua_upvalueindex(1), "searchpath");
+	lua_pushvalue(L, 1);
+	if (lua_getfield(L, lua_upvalueindex(1), "path") != LUA_TSTRING)
+		return luaL_error(L, "'package.path' must be a string");
+	lua_call(L, 2, 2);
+	if (lua_isnil(L, -2))
+		return 1; /* module not found; return the message */
+	lua_pop(L, 1);
+	filename = lua_tostring(L, -1);
+	if (loadfile(L, filename) != LUA_OK)
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+			name, filename, lua_tostring(L, -1));
+	lua_insert(L, -2); /* loader, then file name as its extra value */
+	return 2;
+}
+
+/*
+ * Enables the cache in 'dir', creating the directory if needed, and
+ * makes 'require' use it for Lua modules.
+ */
+static void
+setcachedir(lua_State *L, const char *dir)
+{
+	if (mkdir(dir, 0700) != 0 && errno != EEXIST)
+		return; /* run without the cache */
+	cachedir = dir;
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "searchers");
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, searcher_cached, 1);
+	lua_rawseti(L, -2, 2); /* replace the Lua searcher */
+	lua_pop(L, 2);
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Module index
+ * ===================================================================
+ */
+
+/*
+ * With -R or CALLISTO_MODULE_INDEX, 'require' finds Lua and C modules
+ * through an index of the directories in package.path and
+ * package.cpath instead of trying to open each file the paths could
+ * name. A directory is read once, the first time a module could be in
+ * it, and its entries are kept in a table keyed by the directory's
+ * name; a directory below the fixed part of a path template is only
+ * read if its parent lists it. Files added to a directory after it
+ * was read are not found.
+ */
+
+#if !defined(CALLISTO_INDEX_VAR)
+#define CALLISTO_INDEX_VAR "CALLISTO_MODULE_INDEX"
+#endif
+
+#define LUA_POF   "luaopen_" /* as in loadlib.c */
+#define LUA_OFSEP "_"
+
+#define INDEX_FILE 1
+#define INDEX_DIR  2
+
+/*
+ * Replaces the directory name on top of the stack with its entries
+ * from the index at 'idx', reading the directory if the index does
+ * not have it yet, or with false if it cannot be read. Each entry
+ * maps a name to INDEX_FILE, INDEX_DIR or both if the kind is not
+ * known, as for links.
+ */
+static void
+indexdir(lua_State *L, int idx)
+{
+	struct dirent *d;
+	DIR *dp;
+	int kind;
+
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, idx) != LUA_TNIL) {
+		lua_remove(L, -2);
+		return;
+	}
+	lua_pop(L, 1);
+	if ((dp = opendir(lua_tostring(L, -1))) == NULL)
+		lua_pushboolean(L, 0);
+	else {
+		lua_newtable(L);
+		while ((d = readdir(dp)) != NULL) {
+			if (d->d_type == DT_REG)
+				kind = INDEX_FILE;
+			else if (d->d_type == DT_DIR)
+				kind = INDEX_DIR;
+			else
+				kind = INDEX_FILE | INDEX_DIR;
+			lua_pushinteger(L, kind);
+			lua_setfield(L, -2, d->d_name);
+		}
+		closedir(dp);
+	}
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, idx);
+	lua_remove(L, -2);
+}
+
+/*
+ * Returns whether the index at 'idx' has the file 'f', whose first
+ * 'rootlen' characters name the directory it is searched from.
+ */
+static int
+indexhas(lua_State *L, int idx, const char *f, size_t rootlen)
+{
+	const char *p, *slash;
+	int found = 0;
+	int top = lua_gettop(L);
+
+	if (rootlen > 1)
+		lua_pushlstring(L, f, rootlen - 1); /* without the slash */
+	else if (rootlen == 1 || f[0] == *LUA_DIRSEP)
+		lua_pushliteral(L, LUA_DIRSEP);
+	else
+		lua_pushliteral(L, ".");
+	for (p = f + rootlen; ; p = slash + 1) {
+		indexdir(L, idx);
+		if (!lua_istable(L, -1))
+			break;
+		while (*p == *LUA_DIRSEP)
+			p++;
+		if ((slash = strchr(p, *LUA_DIRSEP)) == NULL) {
+			lua_getfield(L, -1, p);
+			found = lua_tointeger(L, -1) & INDEX_FILE;
+			break;
+		}
+		lua_pushlstring(L, p, slash - p);
+		if (!(lua_rawget(L, -2) == LUA_TNUMBER
+			&& lua_tointeger(L, -1) & INDEX_DIR))
+			break;
+		lua_pushlstring(L, f, slash - f); /* the next directory */
+	}
+	lua_settop(L, top);
+	return found;
+}
+
+/*
+ * Like package.searchpath, but looks files up in the index at 'idx'.
+ * Returns the first file for 'name' in 'path' the index has, or NULL
+ * with a message listing the files tried pushed.
+ */
+static const char *
+indexsearch(lua_State *L, int idx, const char *name, const char *path)
+{
+	luaL_Buffer b;
+	const char *end, *f, *p;
+	size_t rootlen;
+
+	name = luaL_gsub(L, name, ".", LUA_DIRSEP);
+	for (p = path; *p != '\0'; p = *end == '\0' ? end : end + 1) {
+		if ((end = strchr(p, *LUA_PATH_SEP)) == NULL)
+			end = p + strlen(p);
+		if (end == p)
+			continue; /* empty template */
+		/* the fixed part ends at the last slash before the mark */
+		lua_pushlstring(L, p, end - p);
+		f = lua_tostring(L, -1);
+		for (rootlen = 0; f[rootlen] != '\0' && f[rootlen] != *LUA_PATH_MARK;
+			rootlen++)
+			;
+		while (rootlen > 0 && f[rootlen - 1] != *LUA_DIRSEP)
+			rootlen--;
+		f = luaL_gsub(L, f, LUA_PATH_MARK, name);
+		lua_remove(L, -2);
+		if (indexhas(L, idx, f, rootlen))
+			return f;
+		lua_pop(L, 1);
+	}
+	/* the same message package.searchpath gives */
+	path = luaL_gsub(L, path, LUA_PATH_MARK, name);
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "no file '");
+	luaL_addgsub(&b, path, LUA_PATH_SEP, "'\n\tno file '");
+	luaL_addstring(&b, "'");
+	luaL_pushresult(&b);
+	return NULL;
+}
+
+/*
+ * Replacement for the Lua file searcher of 'require' using the index.
+ * Upvalue 1 is the package table and upvalue 2 the index.
+ */
+static int
+searcher_indexlua(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	const char *filename;
+	if (lua_getfield(L, lua_upvalueindex(1), "path") != LUA_TSTRING)
+		return luaL_error(L, "'package.path' must be a string");
+	filename = indexsearch(L, lua_upvalueindex(2), name, lua_tostring(L, -1));
+	if (filename == NULL)
+		return 1; /* module not found; return the message */
+	if (loadfile(L, filename) != LUA_OK)
+		return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+			name, filename, lua_tostring(L, -1));
+	lua_pushstring(L, filename);
+	return 2;
+}
+
+/*
+ * Calls package.loadlib for the function 'sym' in 'filename'. Leaves
+ * the function, or nil, a message and where loading failed, and
+ * returns whether the function was found.
+ */
+static int
+loadopenfunc(lua_State *L, const char *filename, const char *sym)
+{
+	lua_getfield(L, lua_upvalueindex(1), "loadlib");
+	lua_pushstring(L, filename);
+	lua_pushstring(L, sym);
+	lua_call(L, 2, 3);
+	if (lua_isnil(L, -3))
+		return 0;
+	lua_pop(L, 2);
+	return 1;
+}
+
+/*
+ * Replacement for the C searcher of 'require' using the index, with
+ * the same upvalues. As with the C searcher, a name with a hyphen is
+ * opened with the part before the hyphen first.
+ */
+static int
+searcher_indexc(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	const char *filename, *modname, *mark;
+	if (lua_getfield(L, lua_upvalueindex(1), "cpath") != LUA_TSTRING)
+		return luaL_error(L, "'package.cpath' must be a string");
+	filename = indexsearch(L, lua_upvalueindex(2), name, lua_tostring(L, -1));
+	if (filename == NULL)
+		return 1; /* module not found; return the message */
+	modname = luaL_gsub(L, name, ".", LUA_OFSEP);
+	if ((mark = strchr(modname, *LUA_IGMARK)) != NULL) {
+		if (loadopenfunc(L, filename, lua_pushfstring(L, LUA_POF "%s",
+			lua_pushlstring(L, modname, mark - modname))))
+			goto found;
+		if (strcmp(luaL_optstring(L, -1, ""), "init") != 0)
+			goto fail; /* the library itself could not be opened */
+		lua_pop(L, 3);
+		modname = mark + 1;
+	}
+	if (loadopenfunc(L, filename, lua_pushfstring(L, LUA_POF "%s", modname)))
+		goto found;
+fail:
+	return luaL_error(L, "error loading module '%s' from file '%s':\n\t%s",
+		name, filename, lua_tostring(L, -2));
+found:
+	lua_pushstring(L, filename);
+	return 2;
+}
+
+/*
+ * Makes 'require' find modules through an index, replacing the Lua
+ * and C searchers.
+ */
+static void
+setmoduleindex(lua_State *L)
+{
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "searchers");
+	lua_pushvalue(L, -2);
+	lua_newtable(L); /* the index */
+	lua_pushvalue(L, -2);
+	lua_pushvalue(L, -2);
+	lua_pushcclosure(L, searcher_indexlua, 2);
+	lua_rawseti(L, -4, 2);
+	lua_pushcclosure(L, searcher_indexc, 2);
+	lua_rawseti(L, -2, 3);
+	lua_pop(L, 2);
+}
+
+/* }================================================================== */
+
 static int
 dochunk(lua_State *L, int status)
 {
@@ -198,7 +706,7 @@ dochunk(lua_State *L, int status)
 static int
 dofile(lua_State *L, const char *name)
 {
-	return dochunk(L, luaL_loadfile(L, name));
+	return dochunk(L, loadfile(L, name));
 }
 
 static int
@@ -253,7 +761,7 @@ handle_script(lua_State *L, char **argv)
 	const char *fname = argv[0];
 	if (strcmp(fname, "-") == 0 && strcmp(argv[-1], "--") != 0)
 		fname = NULL; /* stdin */
-	status = luaL_loadfile(L, fname);
+	status = loadfile(L, fname);
 	if (status == LUA_OK) {
 		int n = pushargs(L); /* push arguments to script */
 		status = docall(L, n, LUA_MULTRET);
@@ -267,6 +775,13 @@ handle_script(lua_State *L, char **argv)
 #define has_v     4  /* -v */
 #define has_e     8  /* -e */
 #define has_E     16 /* -E */
+#define has_C     32 /* -C */
+#define has_P     64 /* -P */
+#define has_T     128 /* -T */
+#define has_M     256 /* -M */
+#define has_S     512 /* -S */
+#define has_G     1024 /* -G */
+#define has_R     2048 /* -R */
 
 /*
  * Traverses all arguments from 'argv', returning a mask with those
@@ -296,6 +811,16 @@ collectargs(char **argv, int *first)
 				return has_error;   /* invalid option */
 			args |= has_E;
 			break;
+		case 'R':
+			if (argv[i][2] != '\0') /* extra characters? */
+				return has_error;   /* invalid option */
+			args |= has_R;
+			break;
+		case 'S':
+			if (argv[i][2] != '\0') /* extra characters? */
+				return has_error;   /* invalid option */
+			args |= has_S;
+			break;
 		case 'W':
 			if (argv[i][2] != '\0') /* extra characters? */
 				return has_error;   /* invalid option */
@@ -309,7 +834,22 @@ collectargs(char **argv, int *first)
 			break;
 		case 'e':
 			args |= has_e;            /* FALLTHROUGH */
-		case 'l':                     /* both options need an argument */
+		case 'C':
+		case 'G':
+		case 'M':
+		case 'P':
+		case 'T':
+		case 'l':                     /* these options need an argument */
+			if (argv[i][1] == 'C')
+				args |= has_C;
+			else if (argv[i][1] == 'G')
+				args |= has_G;
+			else if (argv[i][1] == 'M')
+				args |= has_M;
+			else if (argv[i][1] == 'P')
+				args |= has_P;
+			else if (argv[i][1] == 'T')
+				args |= has_T;
 			if (argv[i][2] == '\0') { /* no concatenated argument? */
 				i++;                  /* try next 'argv' */
 				if (argv[i] == NULL || argv[i][0] == '-')
@@ -350,6 +890,14 @@ runargs(lua_State *L, char **argv, int n)
 				return 0;
 			break;
 		}
+		case 'C':                 /* already handled */
+		case 'G':
+		case 'M':
+		case 'P':
+		case 'T':
+			if (argv[i][2] == '\0')
+				i++;              /* skip the argument */
+			break;
 		case 'W':
 			lua_warning(L, "@on", 0); /* warnings on */
 			break;
@@ -358,6 +906,30 @@ runargs(lua_State *L, char **argv, int n)
 	return 1;
 }
 
+/*
+ * Returns the argument given to the last occurrence of 'opt', which
+ * is one of the options that need an argument.
+ */
+static char *
+getoptarg(char **argv, int n, int opt)
+{
+	char *arg = NULL;
+	int i;
+	for (i = 1; i < n; i++) {
+		int option = argv[i][1];
+		if (option == 'C' || option == 'G' || option == 'M'
+		    || option == 'P' || option == 'T' || option == 'e'
+		    || option == 'l') {
+			char *extra = argv[i] + 2;
+			if (*extra == '\0')
+				extra = argv[++i];
+			if (option == opt)
+				arg = extra;
+		}
+	}
+	return arg;
+}
+
 static int
 handle_luainit(lua_State *L)
 {
@@ -603,40 +1175,1198 @@ doREPL(lua_State *L)
 /* }================================================================== */
 
 /*
- * Main body of stand-alone interpreter (to be called in protected mode).
- * Reads the options and handles them all.
+ * {==================================================================
+ * Bundles
+ * ===================================================================
+ */
+
+/*
+ * 'csto --bundle out script [module ...]' writes a copy of the
+ * interpreter to 'out' followed by a payload holding the stripped
+ * bytecode of each file. An interpreter carrying a payload maps it
+ * when started and runs the first chunk with all of its arguments,
+ * without handling options or LUA_INIT. The other chunks are found by
+ * 'require' through an in-memory searcher, named after their path
+ * with any './' prefix, '.lua' suffix and '/init' removed and '/'
+ * replaced by '.'.
+ *
+ * The payload holds the chunks, their NUL-terminated names, an array
+ * of struct bundleentry, and a struct bundletrailer at the very end of
+ * the file. It starts at an 8-byte aligned offset.
+ */
+
+#define BUNDLE_MAGIC "\033CstoBdl"
+
+struct bundleentry {
+	uint32_t name; /* offsets from the start of the payload */
+	uint32_t chunk;
+	uint32_t chunklen;
+};
+
+struct bundletrailer {
+	uint64_t size; /* of the payload, trailer included */
+	uint32_t count;
+	uint32_t index; /* offset of the entries */
+	char magic[8];
+};
+
+static struct {
+	const char *payload;
+	size_t size;
+	const struct bundleentry *entries;
+	uint32_t count;
+} bundle;
+
+/*
+ * Opens the interpreter's own executable.
  */
 static int
-pmain(lua_State *L)
+openself(const char *argv0)
 {
-	int argc = (int)lua_tointeger(L, 1);
-	char **argv = (char **)lua_touserdata(L, 2);
-	int script;
-	int args = collectargs(argv, &script);
-	luaL_checkversion(L); /* check that interpreter has correct version */
-	if (argv[0] && argv[0][0])
-		progname = argv[0];
-	if (args == has_error) {       /* bad arg? */
-		print_usage(argv[script]); /* 'script' has index of bad arg. */
+	int fd = open("/proc/self/exe", O_RDONLY);
+	if (fd == -1 && argv0 != NULL && strchr(argv0, '/') != NULL)
+		fd = open(argv0, O_RDONLY);
+	return fd;
+}
+
+/*
+ * Returns the size of the executable open on 'fd' without its
+ * payload, filling 't' with the payload's trailer if it has one.
+ */
+static off_t
+exesize(int fd, struct bundletrailer *t)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return -1;
+	if (st.st_size < (off_t)sizeof(*t)
+		|| pread(fd, t, sizeof(*t), st.st_size - sizeof(*t)) != sizeof(*t)
+		|| memcmp(t->magic, BUNDLE_MAGIC, sizeof(t->magic)) != 0
+		|| t->size > (uint64_t)st.st_size
+		|| t->index % sizeof(uint32_t) != 0 || t->index > t->size
+		|| (uint64_t)t->count * sizeof(struct bundleentry)
+			> t->size - sizeof(*t) - t->index) {
+		t->count = 0; /* no payload */
+		return st.st_size;
+	}
+	return st.st_size - t->size;
+}
+
+/*
+ * Maps the payload of the running executable, if it has one.
+ */
+static int
+bundleopen(const char *argv0)
+{
+	struct bundletrailer t;
+	off_t start, mapstart;
+	char *map;
+	int fd;
+
+	if ((fd = openself(argv0)) == -1)
+		return 0;
+	start = exesize(fd, &t);
+	if (start < 0 || t.count == 0) {
+		close(fd);
 		return 0;
 	}
-	if (args & has_v) /* option '-v'? */
-		print_version();
-	if (args & has_E) {        /* option '-E'? */
-		lua_pushboolean(L, 1); /* signal for libraries to ignore env. vars. */
-		lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
+	mapstart = start - start % sysconf(_SC_PAGESIZE);
+	map = mmap(NULL, start - mapstart + t.size, PROT_READ, MAP_PRIVATE,
+		fd, mapstart);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	bundle.payload = map + (start - mapstart);
+	bundle.size = t.size - sizeof(t);
+	bundle.count = t.count;
+	bundle.entries = (const struct bundleentry *)(bundle.payload + t.index);
+	return 1;
+}
+
+/*
+ * Loads chunk 'i' of the bundle.
+ */
+static int
+bundleload(lua_State *L, uint32_t i)
+{
+	const struct bundleentry *e = &bundle.entries[i];
+	if (e->name >= bundle.size || e->chunk > bundle.size
+		|| e->chunklen > bundle.size - e->chunk) {
+		lua_pushliteral(L, "damaged bundle");
+		return LUA_ERRSYNTAX;
 	}
-	createargtable(L, argv, argc, script); /* create table 'arg' */
-	lua_gc(L, LUA_GCGEN, 0, 0);            /* GC in generational mode */
-	if (!(args & has_E)) {                 /* no option '-E'? */
-		if (handle_luainit(L) != LUA_OK)   /* run LUA_INIT */
-			return 0;                      /* error running LUA_INIT */
+	return luaL_loadbufferx(L, bundle.payload + e->chunk, e->chunklen,
+		bundle.payload + e->name, "b");
+}
+
+/*
+ * Searcher for 'require' that finds modules in the bundle.
+ */
+static int
+searcher_bundle(lua_State *L)
+{
+	const char *name = luaL_checkstring(L, 1);
+	uint32_t i;
+	for (i = 1; i < bundle.count; i++) {
+		const struct bundleentry *e = &bundle.entries[i];
+		if (e->name < bundle.size
+			&& strncmp(bundle.payload + e->name, name, bundle.size - e->name) == 0) {
+			if (bundleload(L, i) != LUA_OK)
+				return luaL_error(L, "error loading module '%s' from bundle:\n\t%s",
+					name, lua_tostring(L, -1));
+			lua_pushliteral(L, ":bundle:");
+			return 2;
+		}
+	}
+	lua_pushfstring(L, "no module '%s' in bundle", name);
+	return 1;
+}
+
+/*
+ * Runs the first chunk of the bundle with the arguments in 'argv'.
+ */
+static int
+runbundle(lua_State *L, char **argv, int argc)
+{
+	int i, n, status;
+	createargtable(L, argv, argc, 0);
+	lua_gc(L, LUA_GCGEN, 0, 0);
+	/* insert the bundle searcher after the preload searcher */
+	lua_getglobal(L, LUA_LOADLIBNAME);
+	lua_getfield(L, -1, "searchers");
+	for (i = (int)luaL_len(L, -1); i >= 2; i--) {
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushcfunction(L, searcher_bundle);
+	lua_rawseti(L, -2, 2);
+	lua_pop(L, 2);
+	status = bundleload(L, 0);
+	if (status == LUA_OK) {
+		n = pushargs(L);
+		status = docall(L, n, LUA_MULTRET);
 	}
-	if (!runargs(L, argv, script)) /* execute arguments -e and -l */
-		return 0;                  /* something failed */
-	if (script < argc &&           /* execute main script (if there is one) */
-		handle_script(L, argv + script) != LUA_OK)
+	return report(L, status) == LUA_OK;
+}
+
+static int
+bundlewriter(lua_State *L, const void *p, size_t size, void *ud)
+{
+	(void)L;
+	return fwrite(p, 1, size, (FILE *)ud) != size;
+}
+
+/*
+ * Pads 'fp' with zeros to a multiple of 'align' bytes from 'start'.
+ */
+static void
+bundlepad(FILE *fp, long start, int align)
+{
+	while ((ftell(fp) - start) % align != 0)
+		fputc('\0', fp);
+}
+
+/*
+ * Writes the module name for 'path' into 'name'.
+ */
+static void
+bundlename(char *name, size_t size, const char *path)
+{
+	size_t len;
+	char *p;
+	while (strncmp(path, "./", 2) == 0)
+		path += 2;
+	strbcpy(name, path, size);
+	len = strlen(name);
+	if (len > 4 && strcmp(name + len - 4, ".lua") == 0)
+		name[len -= 4] = '\0';
+	if (len > 5 && strcmp(name + len - 5, "/init") == 0)
+		name[len - 5] = '\0';
+	for (p = name; *p != '\0'; p++) {
+		if (*p == '/')
+			*p = '.';
+	}
+}
+
+/*
+ * Handles 'csto --bundle out script [module ...]'.
+ */
+static int
+dobundle(lua_State *L, char **argv, int argc)
+{
+	struct bundleentry *entries;
+	struct bundletrailer t;
+	struct stat st;
+	char buf[BUFSIZ];
+	char name[PATH_MAX];
+	const char *out = argv[2];
+	off_t size;
+	long start;
+	FILE *fp;
+	ssize_t n;
+	int i, in, outfd, count, err;
+
+	if (argc < 4) {
+		lua_writestringerror("usage: %s --bundle out script [module ...]\n",
+			progname);
+		return 0;
+	}
+	count = argc - 3;
+	entries = lua_newuserdatauv(L, count * sizeof(*entries), 0);
+
+	if ((in = openself(argv[0])) == -1 || fstat(in, &st) != 0)
+		return luaL_error(L, "cannot open interpreter: %s", strerror(errno));
+	if ((outfd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0755)) == -1
+		|| (fp = fdopen(outfd, "wb")) == NULL) {
+		close(in);
+		return luaL_error(L, "cannot open %s: %s", out, strerror(errno));
+	}
+
+	/* the interpreter, which never has a payload: a bundle runs it */
+	for (n = 0, size = st.st_size; size > 0; size -= n) {
+		n = read(in, buf, size < (off_t)sizeof(buf)
+			? (size_t)size : sizeof(buf));
+		if (n <= 0)
+			break;
+		fwrite(buf, 1, n, fp);
+	}
+	err = errno;
+	close(in);
+	if (size != 0) {
+		fclose(fp);
+		unlink(out);
+		return luaL_error(L, "cannot read interpreter: %s",
+			n == 0 ? "file shrank while copying" : strerror(err));
+	}
+	bundlepad(fp, 0, 8);
+	start = ftell(fp);
+
+	for (i = 0; i < count; i++) {
+		if (luaL_loadfile(L, argv[i + 3]) != LUA_OK) {
+			fclose(fp);
+			unlink(out);
+			return lua_error(L);
+		}
+		entries[i].chunk = ftell(fp) - start;
+		lua_dump(L, bundlewriter, fp, 1);
+		entries[i].chunklen = ftell(fp) - start - entries[i].chunk;
+		lua_pop(L, 1);
+	}
+	for (i = 0; i < count; i++) {
+		bundlename(name, sizeof(name), argv[i + 3]);
+		entries[i].name = ftell(fp) - start;
+		fwrite(name, 1, strlen(name) + 1, fp);
+	}
+	bundlepad(fp, start, 8);
+	memset(&t, 0, sizeof(t));
+	t.index = ftell(fp) - start;
+	fwrite(entries, sizeof(*entries), count, fp);
+	bundlepad(fp, start, 8);
+
+	t.size = ftell(fp) - start + sizeof(t);
+	t.count = count;
+	memcpy(t.magic, BUNDLE_MAGIC, sizeof(t.magic));
+	fwrite(&t, sizeof(t), 1, fp);
+	if (ferror(fp) | fclose(fp)) {
+		unlink(out);
+		return luaL_error(L, "cannot write %s: %s", out, strerror(errno));
+	}
+	return 1;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Profiling
+ * ===================================================================
+ */
+
+/*
+ * With -P, the profiler library samples the -e and -l options and the
+ * script. The folded stacks go to the named file, one per line with
+ * its sample count, and the functions that used the most time are
+ * listed on the standard error.
+ *
+ * With -T, the same code is traced instead, and the calls made are
+ * written to the named file in the trace event format. The variables
+ * CALLISTO_TRACE_FILTER and CALLISTO_TRACE_MIN give the filter and
+ * min options of profiler.tracestart.
+ *
+ * With -M, allocations are sampled with the heap profiler, at the rate
+ * given by CALLISTO_HEAP_RATE if set, and its report is written to the
+ * named file.
+ */
+
+#define PROFILE_TOP 20 /* functions listed in the summary */
+
+struct profentry {
+	const char *name;
+	lua_Integer self;
+	lua_Integer total;
+};
+
+static int profref = LUA_NOREF; /* the profiler library */
+
+/*
+ * Pushes the function 'name' of the profiler library, which is kept
+ * in case the script replaces the global.
+ */
+static void
+getproffunc(lua_State *L, const char *name)
+{
+	if (profref == LUA_NOREF) {
+		lua_getglobal(L, CALLISTO_PROFLIBNAME);
+		profref = luaL_ref(L, LUA_REGISTRYINDEX);
+	}
+	lua_rawgeti(L, LUA_REGISTRYINDEX, profref);
+	lua_getfield(L, -1, name);
+	lua_remove(L, -2);
+}
+
+static int
+profcompare(const void *a, const void *b)
+{
+	const struct profentry *x = a, *y = b;
+	if (x->self != y->self)
+		return x->self < y->self ? 1 : -1;
+	return (x->total < y->total) - (x->total > y->total);
+}
+
+/*
+ * Starts the profiler. Returns 0 if it could not be started.
+ */
+static int
+startprofile(lua_State *L)
+{
+	getproffunc(L, "start");
+	return report(L, docall(L, 0, 0)) == LUA_OK;
+}
+
+/*
+ * Prints the functions in the table on the top of the stack with the
+ * highest self counts.
+ */
+static void
+printprofile(lua_State *L, lua_Integer samples)
+{
+	struct profentry *ents;
+	size_t i, n;
+
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		n++;
+		lua_pop(L, 1);
+	}
+	if (n == 0 || samples == 0)
+		return;
+	ents = lua_newuserdatauv(L, n * sizeof(*ents), 0);
+	i = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -3)) {
+		ents[i].name = lua_tostring(L, -2);
+		lua_getfield(L, -1, "self");
+		ents[i].self = lua_tointeger(L, -1);
+		lua_getfield(L, -2, "total");
+		ents[i].total = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+		i++;
+	}
+	qsort(ents, n, sizeof(*ents), profcompare);
+	fprintf(stderr, "%6s %6s  %s\n", "self", "total", "function");
+	for (i = 0; i < n && i < PROFILE_TOP; i++) {
+		fprintf(stderr, "%5.1f%% %5.1f%%  %s\n",
+		    100.0 * ents[i].self / samples,
+		    100.0 * ents[i].total / samples, ents[i].name);
+	}
+	fflush(stderr);
+	lua_pop(L, 1);
+}
+
+/*
+ * Stops the profiler and writes what it recorded to 'fname'.
+ */
+static void
+stopprofile(lua_State *L, const char *fname)
+{
+	FILE *fp;
+	lua_Integer samples;
+
+	getproffunc(L, "stop");
+	if (report(L, docall(L, 0, 2)) != LUA_OK)
+		return;
+
+	if ((fp = fopen(fname, "w")) == NULL) {
+		lua_pushfstring(L, "cannot open %s: %s", fname, strerror(errno));
+		l_message(progname, lua_tostring(L, -1));
+		lua_pop(L, 3);
+		return;
+	}
+	samples = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -3)) {
+		fprintf(fp, "%s " LUA_INTEGER_FMT "\n", lua_tostring(L, -2),
+		    lua_tointeger(L, -1));
+		samples += lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	if (fclose(fp) != 0) {
+		lua_pushfstring(L, "cannot write %s: %s", fname, strerror(errno));
+		l_message(progname, lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	fprintf(stderr, "%s: " LUA_INTEGER_FMT " samples written to %s\n",
+	    progname, samples, fname);
+	printprofile(L, samples);
+	lua_pop(L, 2);
+}
+
+/*
+ * Starts the heap profiler, with the rate from the environment unless
+ * 'noenv'. Returns 0 if it could not be started.
+ */
+static int
+startheap(lua_State *L, int noenv)
+{
+	const char *rate;
+	int n;
+
+	getproffunc(L, "heapstart");
+	n = 0;
+	if (!noenv && (rate = getenv(CALLISTO_HEAP_RATE_VAR)) != NULL) {
+		if (lua_stringtonumber(L, rate) == 0) {
+			lua_pushfstring(L, "bad value for %s: '%s'",
+			    CALLISTO_HEAP_RATE_VAR, rate);
+			l_message(progname, lua_tostring(L, -1));
+			lua_pop(L, 2);
+			return 0;
+		}
+		n = 1;
+	}
+	return report(L, docall(L, n, 0)) == LUA_OK;
+}
+
+/*
+ * Writes the heap profiler's report to 'fname' and stops it.
+ */
+static void
+stopheap(lua_State *L, const char *fname)
+{
+	getproffunc(L, "heapreport");
+	lua_pushstring(L, fname);
+	if (report(L, docall(L, 1, 2)) == LUA_OK) {
+		if (lua_isnil(L, -2)) {
+			lua_pushfstring(L, "cannot write %s: %s", fname,
+			    lua_tostring(L, -1));
+			l_message(progname, lua_tostring(L, -1));
+			lua_pop(L, 1);
+		} else {
+			fprintf(stderr, "%s: heap profile written to %s\n",
+			    progname, fname);
+			fflush(stderr);
+		}
+		lua_pop(L, 2);
+	}
+	getproffunc(L, "heapstop");
+	report(L, docall(L, 0, 0));
+}
+
+/*
+ * Starts tracing, with options from the environment unless 'noenv'.
+ * Returns 0 if tracing could not be started.
+ */
+static int
+starttrace(lua_State *L, int noenv)
+{
+	const char *filter, *min;
+
+	getproffunc(L, "tracestart");
+	lua_createtable(L, 0, 2);
+	if (!noenv) {
+		if ((filter = getenv(CALLISTO_TRACE_FILTER_VAR)) != NULL) {
+			lua_pushstring(L, filter);
+			lua_setfield(L, -2, "filter");
+		}
+		if ((min = getenv(CALLISTO_TRACE_MIN_VAR)) != NULL) {
+			if (lua_stringtonumber(L, min) == 0) {
+				lua_pushfstring(L, "bad value for %s: '%s'",
+				    CALLISTO_TRACE_MIN_VAR, min);
+				l_message(progname, lua_tostring(L, -1));
+				lua_pop(L, 3);
+				return 0;
+			}
+			lua_setfield(L, -2, "min");
+		}
+	}
+	return report(L, docall(L, 1, 0)) == LUA_OK;
+}
+
+/*
+ * Stops tracing and writes the trace to 'fname'.
+ */
+static void
+stoptrace(lua_State *L, const char *fname)
+{
+	getproffunc(L, "tracestop");
+	lua_pushstring(L, fname);
+	if (report(L, docall(L, 1, 2)) != LUA_OK)
+		return;
+	if (lua_isnil(L, -2)) {
+		lua_pushfstring(L, "cannot write %s: %s", fname,
+		    lua_tostring(L, -1));
+		l_message(progname, lua_tostring(L, -1));
+		lua_pop(L, 3);
+		return;
+	}
+	fprintf(stderr, "%s: " LUA_INTEGER_FMT " calls written to %s\n",
+	    progname, lua_tointeger(L, -2), fname);
+	fflush(stderr);
+	lua_pop(L, 2);
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Statistics
+ * ===================================================================
+ */
+
+/*
+ * With -G, the collector is put in the given mode instead of the
+ * generational mode, with the parameters that follow it; a missing or
+ * zero parameter keeps its default. With -S, callisto.stats is called
+ * when the script is done and its results are printed on the standard
+ * error.
+ */
+
+#define STATS_LIBS 32 /* libraries listed in the calls line */
+
+static int statsref = LUA_NOREF; /* callisto.stats */
+
+/*
+ * Sets the mode of the collector from 'mode', an option of -G.
+ * Returns 0 if it is not valid.
+ */
+static int
+setgcmode(lua_State *L, const char *mode)
+{
+	long param[2] = { 0, 0 };
+	const char *p;
+	char *end;
+	int inc, n;
+
+	if (strncmp(mode, "inc", 3) == 0)
+		inc = 1;
+	else if (strncmp(mode, "gen", 3) == 0)
+		inc = 0;
+	else
+		goto bad;
+	p = mode + 3;
+	for (n = 0; *p != '\0' && n < 2; n++) {
+		if (*p++ != (n == 0 ? ':' : ','))
+			goto bad;
+		errno = 0;
+		param[n] = strtol(p, &end, 10);
+		if (end == p || errno != 0 || param[n] < 0 || param[n] > 1000)
+			goto bad;
+		p = end;
+	}
+	if (*p != '\0')
+		goto bad;
+
+	if (inc)
+		lua_gc(L, LUA_GCINC, (int)param[0], (int)param[1], 0);
+	else
+		lua_gc(L, LUA_GCGEN, (int)param[0], (int)param[1]);
+	return 1;
+
+bad:
+	lua_pushfstring(L, "bad collector mode '%s'", mode);
+	l_message(progname, lua_tostring(L, -1));
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+ * Starts counting library calls and keeps callisto.stats for
+ * printstats, in case the script replaces the global.
+ */
+static void
+startstats(lua_State *L)
+{
+	callisto_countcalls(L);
+	lua_getglobal(L, CALLISTO_RTLIBNAME);
+	lua_getfield(L, -1, "stats");
+	statsref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pop(L, 1);
+}
+
+static int
+namecompare(const void *a, const void *b)
+{
+	return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+static lua_Number
+getnumber(lua_State *L, int index, const char *k)
+{
+	lua_Number n;
+
+	lua_getfield(L, index, k);
+	n = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return n;
+}
+
+/*
+ * Prints the statistics of the state.
+ */
+static void
+printstats(lua_State *L)
+{
+	const char *libs[STATS_LIBS];
+	size_t i, n;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, statsref);
+	if (report(L, docall(L, 0, 2)) != LUA_OK)
+		return;
+	if (lua_isnil(L, -2)) {
+		l_message(progname, lua_tostring(L, -1));
+		lua_pop(L, 2);
+		return;
+	}
+	lua_pop(L, 1);
+
+	fprintf(stderr,
+	    "%s: %.3f s wall, %.3f s cpu (%.3f user, %.3f system), "
+	    "%.1f MiB peak rss\n", progname,
+	    getnumber(L, -1, "wall"), getnumber(L, -1, "cpu"),
+	    getnumber(L, -1, "user"), getnumber(L, -1, "system"),
+	    getnumber(L, -1, "rss") / (1024 * 1024));
+	fprintf(stderr, "%s: %.1f MiB allocated, %.1f MiB in use\n", progname,
+	    getnumber(L, -1, "allocated") / (1024 * 1024),
+	    getnumber(L, -1, "inuse") / (1024 * 1024));
+	lua_getfield(L, -1, "gc");
+	fprintf(stderr,
+	    "%s: gc: %.0f minor and %.0f major collections, %.0f pauses "
+	    "of %.3f ms in total, %.3f ms at most\n", progname,
+	    getnumber(L, -1, "minor"), getnumber(L, -1, "major"),
+	    getnumber(L, -1, "pauses"), getnumber(L, -1, "pausetime") * 1000,
+	    getnumber(L, -1, "maxpause") * 1000);
+	lua_pop(L, 1);
+
+	lua_getfield(L, -1, "calls");
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (n < STATS_LIBS)
+			libs[n++] = lua_tostring(L, -2);
+		lua_pop(L, 1);
+	}
+	qsort(libs, n, sizeof(*libs), namecompare);
+	fprintf(stderr, "%s: calls:", progname);
+	for (i = 0; i < n; i++) {
+		fprintf(stderr, "%s %s %.0f", i ? "," : "", libs[i],
+		    getnumber(L, -1, libs[i]));
+	}
+	fprintf(stderr, "%s\n", n ? "" : " none");
+	fflush(stderr);
+	lua_pop(L, 2);
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Server mode
+ * ===================================================================
+ */
+
+/*
+ * csto --serve keeps a state with every library opened, and the
+ * modules named on its command line loaded, listening on a Unix
+ * socket. csto --client connects to it and sends the script to run
+ * with its arguments, working directory and environment, passing its
+ * standard input, output and error with SCM_RIGHTS. For each client
+ * the server forks a child that takes over the client's descriptors
+ * and runs the script in its copy of the warm state. The server sends
+ * the client the child's process ID, so that the client can forward
+ * the signals it gets, and then the child's wait status, which the
+ * client exits with.
+ *
+ * A request is a 32-bit length, sent with the descriptors, then the
+ * number of arguments and of environment variables as 32-bit
+ * integers, followed by the working directory, the script, its
+ * arguments and the environment, each terminated by a zero byte.
+ */
+
+#define SERVE_BACKLOG 64
+#define SERVE_MAXREQ  (1 << 20) /* largest request accepted */
+
+extern char **environ;
+
+struct job {
+	pid_t pid;
+	int fd; /* connection to the client */
+};
+
+static int childpipe[2] = {-1, -1}; /* written to on SIGCHLD */
+static volatile pid_t clientjob;    /* the job of the client */
+
+static int
+writeall(int fd, const void *p, size_t n)
+{
+	const char *s = p;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(fd, s, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		s += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int
+readall(int fd, void *p, size_t n)
+{
+	char *s = p;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = read(fd, s, n)) <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			if (r == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		s += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static void
+unixaddr(struct sockaddr_un *sun, const char *path)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	strncpy(sun->sun_path, path, sizeof(sun->sun_path) - 1);
+}
+
+/*
+ * Returns a socket listening on 'path', or -1 and sets errno. A socket
+ * left by a server that is no longer running is replaced.
+ */
+static int
+listenon(const char *path)
+{
+	struct sockaddr_un sun;
+	int fd, probe;
+
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	unixaddr(&sun, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+		if (errno != EADDRINUSE
+		    || (probe = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+			goto fail;
+		if (connect(probe, (struct sockaddr *)&sun, sizeof(sun)) == 0
+		    || errno != ECONNREFUSED) {
+			close(probe);
+			errno = EADDRINUSE;
+			goto fail;
+		}
+		close(probe);
+		if (unlink(path) == -1
+		    || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+			goto fail;
+	}
+	/* whoever can connect can run code as the server */
+	if (chmod(path, 0600) == -1 || listen(fd, SERVE_BACKLOG) == -1)
+		goto fail;
+	return fd;
+fail:
+	close(fd);
+	return -1;
+}
+
+static void
+childaction(int sig)
+{
+	int saved = errno;
+
+	(void)sig;
+	if (write(childpipe[1], "", 1) == -1) {
+		/* the pipe is full, so the server will look anyway */
+	}
+	errno = saved;
+}
+
+/*
+ * Runs the job sent on 'conn' in a child of the server, and exits.
+ */
+static void
+servejob(lua_State *L, int conn)
+{
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	uint32_t len, counts[2];
+	char *body, *p, *end, *cwd;
+	char **args, **env;
+	int fds[3], i, status;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	if (recvmsg(conn, &msg, 0) != sizeof(len)
+	    || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+	    || cmsg->cmsg_type != SCM_RIGHTS
+	    || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+	    || len < sizeof(counts) || len > SERVE_MAXREQ)
+		_exit(EXIT_FAILURE);
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+	if ((body = malloc(len + 1)) == NULL || readall(conn, body, len) == -1)
+		_exit(EXIT_FAILURE);
+	close(conn);
+	body[len] = '\0';
+	memcpy(counts, body, sizeof(counts));
+	if (counts[0] < 1 || counts[0] > len || counts[1] > len
+	    || (args = calloc(counts[0] + 2, sizeof(*args))) == NULL
+	    || (env = calloc(counts[1] + 1, sizeof(*env))) == NULL)
+		_exit(EXIT_FAILURE);
+
+	p = body + sizeof(counts);
+	end = body + len;
+	cwd = p;
+	p += strlen(p) + 1;
+	args[0] = (char *)progname;
+	for (i = 0; i < (int)counts[0] && p < end; i++, p += strlen(p) + 1)
+		args[i + 1] = p;
+	for (i = 0; i < (int)counts[1] && p < end; i++, p += strlen(p) + 1)
+		env[i] = p;
+	if (args[counts[0]] == NULL)
+		_exit(EXIT_FAILURE);
+
+	for (i = 0; i < 3; i++) {
+		dup2(fds[i], i);
+		if (fds[i] > 2)
+			close(fds[i]);
+	}
+	environ = env;
+	if (chdir(cwd) == -1) {
+		l_message(progname, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	createargtable(L, args, counts[0] + 1, 1);
+	status = handle_script(L, args + 1);
+	/* exit flushes the files of the script; the state is not closed */
+	exit(status == LUA_OK ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+/*
+ * Opens everything the jobs could use in the state, then listens on
+ * the socket and forks a child for each client. Only returns on error.
+ */
+static int
+doserve(lua_State *L, char **argv, int argc)
+{
+	struct pollfd fds[2];
+	struct job *jobs, *nj;
+	int32_t pid32, status32;
+	size_t njobs, jobssize, i;
+	const char *dir;
+	pid_t pid;
+	int conn, lfd, status;
+	char c;
+
+	if (argc < 3) {
+		lua_writestringerror("usage: %s --serve socket [module ...]\n",
+			progname);
+		return 0;
+	}
+	/* open the pending libraries once, rather than in every child */
+	callisto_openall(L);
+	if ((dir = getenv(CALLISTO_CACHE_VAR)) != NULL && dir[0] != '\0')
+		setcachedir(L, dir);
+	if ((dir = getenv(CALLISTO_INDEX_VAR)) != NULL && dir[0] != '\0')
+		setmoduleindex(L);
+	lua_gc(L, LUA_GCGEN, 0, 0);
+	for (i = 3; i < (size_t)argc; i++) {
+		if (dolibrary(L, argv[i]) != LUA_OK)
+			return 0;
+	}
+	lua_gc(L, LUA_GCCOLLECT); /* so the children start clean */
+
+	if ((lfd = listenon(argv[2])) == -1)
+		return luaL_error(L, "cannot listen on %s: %s", argv[2],
+		    strerror(errno));
+	if (pipe(childpipe) == -1
+	    || fcntl(childpipe[0], F_SETFL, O_NONBLOCK) == -1
+	    || fcntl(childpipe[1], F_SETFL, O_NONBLOCK) == -1)
+		return luaL_error(L, "cannot make pipe: %s", strerror(errno));
+	setsignal(SIGCHLD, childaction);
+	setsignal(SIGPIPE, SIG_IGN);
+
+	jobs = NULL;
+	njobs = jobssize = 0;
+	fds[0].fd = lfd;
+	fds[0].events = POLLIN;
+	fds[1].fd = childpipe[0];
+	fds[1].events = POLLIN;
+	for (;;) {
+		if (poll(fds, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return luaL_error(L, "poll: %s", strerror(errno));
+		}
+		if (fds[1].revents) {
+			while (read(childpipe[0], &c, 1) == 1)
+				;
+			while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+				for (i = 0; i < njobs && jobs[i].pid != pid; i++)
+					;
+				if (i == njobs)
+					continue;
+				status32 = status;
+				writeall(jobs[i].fd, &status32, sizeof(status32));
+				close(jobs[i].fd);
+				jobs[i] = jobs[--njobs];
+			}
+		}
+		if (!fds[0].revents)
+			continue;
+		if ((conn = accept(lfd, NULL, NULL)) == -1)
+			continue;
+		if (njobs == jobssize) {
+			jobssize = jobssize ? jobssize * 2 : 16;
+			if ((nj = realloc(jobs, jobssize * sizeof(*jobs))) == NULL)
+				return luaL_error(L, "not enough memory");
+			jobs = nj;
+		}
+		fflush(NULL);
+		if ((pid = fork()) == 0) {
+			close(lfd);
+			close(childpipe[0]);
+			close(childpipe[1]);
+			for (i = 0; i < njobs; i++)
+				close(jobs[i].fd);
+			setsignal(SIGCHLD, SIG_DFL);
+			setsignal(SIGPIPE, SIG_DFL);
+			servejob(L, conn);
+		}
+		pid32 = pid;
+		if (pid == -1 || writeall(conn, &pid32, sizeof(pid32)) == -1) {
+			close(conn); /* the client sees the server hang up */
+			continue;
+		}
+		jobs[njobs].pid = pid;
+		jobs[njobs++].fd = conn;
+	}
+}
+
+/* passes a signal the client gets on to its job */
+static void
+forwardaction(int sig)
+{
+	if (clientjob > 0)
+		kill(clientjob, sig);
+}
+
+/*
+ * Runs a script in the server listening on argv[2], and returns the
+ * exit status of the job. Needs no state.
+ */
+static int
+doclient(int argc, char **argv)
+{
+	static const int forwarded[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM};
+	char cbuf[CMSG_SPACE(3 * sizeof(int))];
+	struct sockaddr_un sun;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char cwd[PATH_MAX];
+	uint32_t len, counts[2];
+	int32_t pid32, status32;
+	char *body, *p, **e;
+	size_t size, n;
+	int fd, i, stdfds[3] = {0, 1, 2};
+
+	if (argv[0] && argv[0][0])
+		progname = argv[0];
+	if (argc < 4) {
+		lua_writestringerror("usage: %s --client socket script [args]\n",
+			progname);
+		return EXIT_FAILURE;
+	}
+	if (getcwd(cwd, sizeof(cwd)) == NULL) {
+		l_message(progname, strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	size = sizeof(counts) + strlen(cwd) + 1;
+	for (i = 3; i < argc; i++)
+		size += strlen(argv[i]) + 1;
+	for (counts[1] = 0, e = environ; *e != NULL; e++, counts[1]++)
+		size += strlen(*e) + 1;
+	if (size > SERVE_MAXREQ || (body = malloc(size)) == NULL) {
+		l_message(progname, "arguments and environment too large");
+		return EXIT_FAILURE;
+	}
+	counts[0] = argc - 3;
+	memcpy(body, counts, sizeof(counts));
+	p = body + sizeof(counts);
+	n = strlen(cwd) + 1;
+	memcpy(p, cwd, n);
+	p += n;
+	for (i = 3; i < argc; i++, p += n)
+		memcpy(p, argv[i], n = strlen(argv[i]) + 1);
+	for (e = environ; *e != NULL; e++, p += n)
+		memcpy(p, *e, n = strlen(*e) + 1);
+
+	len = size;
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	iov.iov_base = &len;
+	iov.iov_len = sizeof(len);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(stdfds));
+	memcpy(CMSG_DATA(cmsg), stdfds, sizeof(stdfds));
+
+	setsignal(SIGPIPE, SIG_IGN);
+	unixaddr(&sun, argv[2]);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+	    || connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1
+	    || sendmsg(fd, &msg, 0) != sizeof(len)
+	    || writeall(fd, body, size) == -1) {
+		fprintf(stderr, "%s: cannot send job to %s: %s\n", progname,
+		    argv[2], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	free(body);
+
+	if (readall(fd, &pid32, sizeof(pid32)) == -1) {
+		fprintf(stderr, "%s: server hung up\n", progname);
+		return EXIT_FAILURE;
+	}
+	clientjob = pid32;
+	for (i = 0; i < (int)(sizeof(forwarded) / sizeof(*forwarded)); i++)
+		setsignal(forwarded[i], forwardaction);
+	if (readall(fd, &status32, sizeof(status32)) == -1) {
+		fprintf(stderr, "%s: server hung up\n", progname);
+		return EXIT_FAILURE;
+	}
+	if (WIFSIGNALED(status32)) {
+		/* die the same way, for the shell */
+		setsignal(WTERMSIG(status32), SIG_DFL);
+		raise(WTERMSIG(status32));
+		return 128 + WTERMSIG(status32);
+	}
+	return WEXITSTATUS(status32);
+}
+
+/* }================================================================== */
+
+/*
+ * Main body of stand-alone interpreter (to be called in protected mode).
+ * Reads the options and handles them all.
+ */
+static int
+pmain(lua_State *L)
+{
+	int argc = (int)lua_tointeger(L, 1);
+	char **argv = (char **)lua_touserdata(L, 2);
+	const char *dir;
+	int script;
+	int args, ok;
+	luaL_checkversion(L); /* check that interpreter has correct version */
+	if (argv[0] && argv[0][0])
+		progname = argv[0];
+	if (bundleopen(argv[0])) /* running a bundle? */
+		return runbundle(L, argv, argc);
+	if (argv[1] != NULL && strcmp(argv[1], "--bundle") == 0)
+		return dobundle(L, argv, argc);
+	if (argv[1] != NULL && strcmp(argv[1], "--serve") == 0)
+		return doserve(L, argv, argc);
+	args = collectargs(argv, &script);
+	if (args == has_error) {       /* bad arg? */
+		print_usage(argv[script]); /* 'script' has index of bad arg. */
+		return 0;
+	}
+	if (args & has_v) /* option '-v'? */
+		print_version();
+	if (args & has_E) {        /* option '-E'? */
+		lua_pushboolean(L, 1); /* signal for libraries to ignore env. vars. */
+		lua_setfield(L, LUA_REGISTRYINDEX, "LUA_NOENV");
+	}
+	if (args & has_C) /* option '-C'? */
+		setcachedir(L, getoptarg(argv, script, 'C'));
+	else if (!(args & has_E)) {
+		dir = getenv(CALLISTO_CACHE_VAR);
+		if (dir != NULL && dir[0] != '\0')
+			setcachedir(L, dir);
+	}
+	if (args & has_R) /* option '-R'? */
+		setmoduleindex(L);
+	else if (!(args & has_E)) {
+		dir = getenv(CALLISTO_INDEX_VAR);
+		if (dir != NULL && dir[0] != '\0')
+			setmoduleindex(L);
+	}
+	createargtable(L, argv, argc, script); /* create table 'arg' */
+	if (!(args & has_G))
+		lua_gc(L, LUA_GCGEN, 0, 0); /* GC in generational mode */
+	else if (!setgcmode(L, getoptarg(argv, script, 'G')))
+		return 0;
+	if (args & has_S) /* option '-S'? */
+		startstats(L);
+	if (!(args & has_E)) {                 /* no option '-E'? */
+		if (handle_luainit(L) != LUA_OK)   /* run LUA_INIT */
+			return 0;                      /* error running LUA_INIT */
+	}
+	if ((args & has_M) && !startheap(L, args & has_E)) /* option '-M'? */
+		return 0;
+	if ((args & has_T) && !starttrace(L, args & has_E)) /* option '-T'? */
+		return 0;
+	if ((args & has_P) && !startprofile(L)) /* option '-P'? */
 		return 0;
+	ok = runargs(L, argv, script) && /* execute arguments -e and -l */
+		(script >= argc ||           /* execute main script (if there is one) */
+		handle_script(L, argv + script) == LUA_OK);
+	if (args & has_P)
+		stopprofile(L, getoptarg(argv, script, 'P'));
+	if (args & has_T)
+		stoptrace(L, getoptarg(argv, script, 'T'));
+	if (args & has_M)
+		stopheap(L, getoptarg(argv, script, 'M'));
+	if (args & has_S)
+		printstats(L);
+	if (!ok)
+		return 0; /* something failed */
 	if (args & has_i) /* -i option? */
 		doREPL(L);    /* do read-eval-print loop */
 	else if (script == argc && !(args & (has_e | has_v))) { /* no arguments? */
@@ -654,7 +2384,10 @@ int
 main(int argc, char **argv)
 {
 	int status, result;
-	lua_State *L = callisto_newstate(); /* create state */
+	lua_State *L;
+	if (argc > 1 && strcmp(argv[1], "--client") == 0)
+		return doclient(argc, argv); /* needs no state of its own */
+	L = callisto_newstate(); /* create state */
 	if (L == NULL) {
 		l_message(argv[0], "cannot create state: not enough memory");
 		return EXIT_FAILURE;
@@ -37,15 +37,23 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <float.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 #include <math.h>
 #include <limits.h>
+#include <unistd.h>
 #include <lua.h>
 #include <lauxlib.h>
 
 #include "strbuf.h"
 #include "fpconv.h"
+#include "lua_cjson.h"
+
+#include "buffer.h"
+#include "callisto.h"
 
 #ifndef CJSON_MODNAME
 #define CJSON_MODNAME   "json"
@@ -75,6 +83,8 @@
 #define DEFAULT_SPARSE_SAFE 10
 #define DEFAULT_ENCODE_MAX_DEPTH 1000
 #define DEFAULT_DECODE_MAX_DEPTH 1000
+#define DEFAULT_DECODE_KEEP_BUFFER 1
+#define DEFAULT_DECODE_BUFFER_LIMIT (1024 * 1024)
 #define DEFAULT_ENCODE_INVALID_NUMBERS 0
 #define DEFAULT_DECODE_INVALID_NUMBERS 1
 #define DEFAULT_ENCODE_KEEP_BUFFER 1
@@ -84,6 +94,21 @@
 #define DEFAULT_ENCODE_ESCAPE_FORWARD_SLASH 1
 #define DEFAULT_ENCODE_SKIP_UNSUPPORTED_VALUE_TYPES 0
 
+/* Size of each read performed by json.lines, and the amount of encoded
+ * data json.writelines accumulates before writing it out */
+#define JSON_LINES_BUFSIZE 65536
+#define JSON_INDENT_MAX 16
+
+/* Recently decoded object keys are cached per config, in a table of
+ * JSON_KEY_CACHE_SIZE slots (a power of 2). Longer keys are not cached */
+#define JSON_KEY_CACHE_SIZE 256
+#define JSON_KEY_CACHE_MAXLEN 32
+
+/* Number of array values or object members collected on the stack before
+ * the table holding them is created, so small tables get their final
+ * size up front */
+#define JSON_DECODE_PRESIZE 32
+
 #ifdef DISABLE_INVALID_NUMBERS
 #undef DEFAULT_DECODE_INVALID_NUMBERS
 #define DEFAULT_DECODE_INVALID_NUMBERS 0
@@ -145,14 +170,45 @@ static const char *json_token_type_name[] = {
     NULL
 };
 
+/* Output of json.encodeto. While it is set, the encoder writes out its
+ * buffer between elements once it holds threshold bytes */
 typedef struct {
+    FILE *fp;               /* NULL when writing to fd */
+    int fd;
+    size_t threshold;
+    const char *indent;     /* NULL for compact output */
+    size_t indent_len;
+    int error;              /* errno of the first failed write */
+} json_sink_t;
+
+struct json_config {
     json_token_type_t ch2token[256];
     char escape2char[256];  /* Decoding */
 
-    /* encode_buf is only allocated and used when
-     * encode_keep_buffer is set */
+    /* encode_buf is only used when encode_keep_buffer is set. Both
+     * buffers are allocated on first use by json_config_buffer() */
     strbuf_t encode_buf;
 
+    /* decode_buf is the scratch space used for decoded strings. It is
+     * kept between calls while decode_keep_buffer is set and it is no
+     * larger than decode_buffer_limit */
+    strbuf_t decode_buf;
+
+    /* The bytes of the keys anchored in the key cache table, which is
+     * the config's user value once the first key is decoded */
+    struct {
+        const char *str;
+        size_t len;
+    } key_cache[JSON_KEY_CACHE_SIZE];
+
+    /* Only set while json.encodeto runs the encoder, which clears it
+     * again even when encoding raises an error */
+    json_sink_t *encode_sink;
+
+    /* The array metatables, compared by identity when encoding */
+    const void *array_mt;
+    const void *empty_array_mt;
+
     int encode_sparse_convert;
     int encode_sparse_ratio;
     int encode_sparse_safe;
@@ -165,18 +221,35 @@ typedef struct {
 
     int decode_invalid_numbers;
     int decode_max_depth;
+    int decode_keep_buffer;
+    int decode_buffer_limit;
+    int decode_busy;        /* Parsers currently using decode_buf */
     int decode_array_with_array_mt;
     int encode_skip_unsupported_value_types;
-} json_config_t;
+};
 
 typedef struct {
     const char *data;
     const char *ptr;
-    strbuf_t *tmp;    /* Temporary storage for strings */
+    strbuf_t *tmp;    /* Temporary storage for strings, or NULL */
     json_config_t *cfg;
     int current_depth;
+    int key_cache;        /* Stack index of the key cache table, or 0 */
+    int guard;            /* Stack index of the config to be closed */
+    lua_Integer line;     /* json.lines line number, 0 otherwise */
+    lua_Integer offset;   /* Byte offset of data within its stream */
 } json_parse_t;
 
+typedef struct {
+    FILE *fp;
+    int close;            /* fp was opened by json.lines */
+    strbuf_t buf;         /* Read buffer */
+    size_t pos;           /* Start of unconsumed data in buf */
+    int eof;
+    lua_Integer line;     /* Lines read so far */
+    lua_Integer offset;   /* Stream offset of buf.buf[0] */
+} json_lines_t;
+
 typedef struct {
     json_token_type_t type;
     int index;
@@ -185,10 +258,13 @@ typedef struct {
         double number;
         int boolean;
     } value;
-    int string_len;
+    size_t string_len;
 } json_token_t;
 
-static const char *char2escape[256] = {
+/* '/' is escaped unless the config's encode_escape_forward_slash is
+ * off, which json_append_string checks: the table is shared by every
+ * state and thread, so it is never written */
+static const char *const char2escape[256] = {
     "\\u0000", "\\u0001", "\\u0002", "\\u0003",
     "\\u0004", "\\u0005", "\\u0006", "\\u0007",
     "\\b", "\\t", "\\n", "\\u000b",
@@ -287,7 +363,7 @@ int strncasecmp(const char *s1, const char *s2, size_t n)
 
 /* ===== CONFIGURATION ===== */
 
-static json_config_t *json_fetch_config(lua_State *l)
+json_config_t *json_fetch_config(lua_State *l)
 {
     json_config_t *cfg;
 
@@ -359,6 +435,62 @@ static int json_enum_option(lua_State *l, int optindex, int *setting,
 
 #define streq(s1, s2) (strcmp((s1), (s2)) == 0)
 
+/* Returns the empty buffer b of a config, allocating it if it was never
+ * used or was freed. Loading the module allocates nothing, since most
+ * scripts that have it never encode or decode */
+static strbuf_t *json_config_buffer(strbuf_t *b)
+{
+    if (!strbuf_allocated(b))
+        strbuf_init(b, 0);
+    else
+        strbuf_reset(b);
+
+    return b;
+}
+
+/* Pushes the key cache table of the config at index cfg_index, creating
+ * it the first time a key is decoded */
+static void json_push_key_cache(lua_State *l, int cfg_index)
+{
+    if (lua_getiuservalue(l, cfg_index, 1) != LUA_TNIL)
+        return;
+    lua_pop(l, 1);
+
+    lua_createtable(l, JSON_KEY_CACHE_SIZE, 0);
+    lua_pushvalue(l, -1);
+    lua_setiuservalue(l, cfg_index, 1);
+}
+
+/* Shrinks the decode buffer back to its initial size if it is not kept
+ * between calls or has grown beyond the limit. Never done while a parser
+ * is using it, since parsers rely on the space they reserved */
+static void json_trim_decode_buffer(json_config_t *cfg)
+{
+    strbuf_t *b = &cfg->decode_buf;
+
+    if (cfg->decode_busy > 0 || b->size <= STRBUF_DEFAULT_SIZE)
+        return;
+    if (cfg->decode_keep_buffer &&
+        b->size <= (size_t)cfg->decode_buffer_limit + 1)
+        return;
+
+    strbuf_free(b);
+}
+
+static void json_release_decode_buffer(json_config_t *cfg)
+{
+    cfg->decode_busy--;
+    json_trim_decode_buffer(cfg);
+}
+
+/* __close metamethod of the config */
+static int json_close_config(lua_State *l)
+{
+    json_release_decode_buffer(lua_touserdata(l, 1));
+
+    return 0;
+}
+
 #if defined(DISABLE_INVALID_NUMBERS) && !defined(USE_INTERNAL_FPCONV)
 void json_verify_invalid_number_setting(lua_State *l, int *setting)
 {
@@ -392,6 +524,12 @@ static int json_config(lua_State *l)
     } else if (streq(setting, "decode:max-depth")) {
         cfg = json_arg_init(l, 2);
         return json_integer_option(l, 2, &cfg->decode_max_depth, 1, INT_MAX);
+    } else if (streq(setting, "decode:keep-buffer")) {
+        cfg = json_arg_init(l, 3);
+        json_enum_option(l, 2, &cfg->decode_keep_buffer, NULL, 1);
+        json_integer_option(l, 3, &cfg->decode_buffer_limit, 0, INT_MAX);
+        json_trim_decode_buffer(cfg);
+        return 2;
     } else if (streq(setting, "encode:number-precision")) {
         cfg = json_arg_init(l, 2);
         return json_integer_option(l, 2, &cfg->encode_number_precision, 1, 16);
@@ -414,13 +552,9 @@ static int json_config(lua_State *l)
 
         json_enum_option(l, 2, &cfg->encode_keep_buffer, NULL, 1);
 
-        /* Init / free the buffer if the setting has changed */
-        if (old_value ^ cfg->encode_keep_buffer) {
-            if (cfg->encode_keep_buffer)
-                strbuf_init(&cfg->encode_buf, 0);
-            else
-                strbuf_free(&cfg->encode_buf);
-        }
+        /* Free the buffer if it is no longer kept */
+        if (old_value && !cfg->encode_keep_buffer)
+            strbuf_free(&cfg->encode_buf);
         return 1;
     } else if (streq(setting, "encode:invalid-numbers")) {
         static const char *options[] = { "off", "on", "null", NULL };
@@ -439,16 +573,8 @@ static int json_config(lua_State *l)
 
         return 1;
     } else if (streq(setting, "encode:escape-forward-slash")) {
-        int ret;
-
         cfg = json_arg_init(l, 2);
-        ret = json_enum_option(l, 2, &cfg->encode_escape_forward_slash, NULL, 1);
-        if (cfg->encode_escape_forward_slash) {
-            char2escape['/'] = "\\/";
-        } else {
-            char2escape['/'] = NULL;
-        }
-        return ret;
+        return json_enum_option(l, 2, &cfg->encode_escape_forward_slash, NULL, 1);
     } else {
         luaL_argerror(l, 1, "invalid setting");
         return 0;
@@ -488,6 +614,19 @@ static int json_cfg_decode_max_depth(lua_State *l)
     return json_integer_option(l, 1, &cfg->decode_max_depth, 1, INT_MAX);
 }
 
+/* Configures decode buffer persistence. The buffer is only kept while
+ * it is no larger than limit bytes */
+static int json_cfg_decode_keep_buffer(lua_State *l)
+{
+    json_config_t *cfg = json_arg_init(l, 2);
+
+    json_enum_option(l, 1, &cfg->decode_keep_buffer, NULL, 1);
+    json_integer_option(l, 2, &cfg->decode_buffer_limit, 0, INT_MAX);
+    json_trim_decode_buffer(cfg);
+
+    return 2;
+}
+
 /* Configures number precision when converting doubles to text */
 static int json_cfg_encode_number_precision(lua_State *l)
 {
@@ -534,13 +673,9 @@ static int json_cfg_encode_keep_buffer(lua_State *l)
 
     json_enum_option(l, 1, &cfg->encode_keep_buffer, NULL, 1);
 
-    /* Init / free the buffer if the setting has changed */
-    if (old_value ^ cfg->encode_keep_buffer) {
-        if (cfg->encode_keep_buffer)
-            strbuf_init(&cfg->encode_buf, 0);
-        else
-            strbuf_free(&cfg->encode_buf);
-    }
+    /* Free the buffer if it is no longer kept */
+    if (old_value && !cfg->encode_keep_buffer)
+        strbuf_free(&cfg->encode_buf);
 
     return 1;
 }
@@ -570,16 +705,9 @@ static int json_cfg_decode_invalid_numbers(lua_State *l)
 
 static int json_cfg_encode_escape_forward_slash(lua_State *l)
 {
-    int            ret;
     json_config_t *cfg = json_arg_init(l, 1);
 
-    ret = json_enum_option(l, 1, &cfg->encode_escape_forward_slash, NULL, 1);
-    if (cfg->encode_escape_forward_slash) {
-        char2escape['/'] = "\\/";
-    } else {
-        char2escape['/'] = NULL;
-    }
-    return ret;
+    return json_enum_option(l, 1, &cfg->encode_escape_forward_slash, NULL, 1);
 }
 
 static int json_destroy_config(lua_State *l)
@@ -587,31 +715,25 @@ static int json_destroy_config(lua_State *l)
     json_config_t *cfg;
 
     cfg = lua_touserdata(l, 1);
-    if (cfg)
+    if (cfg) {
         strbuf_free(&cfg->encode_buf);
+        strbuf_free(&cfg->decode_buf);
+    }
     cfg = NULL;
 
     return 0;
 }
 
-static void json_create_config(lua_State *l)
+/* Sets the options that json.config can change to their defaults */
+static void json_config_defaults(json_config_t *cfg)
 {
-    json_config_t *cfg;
-    int i;
-
-    cfg = lua_newuserdata(l, sizeof(*cfg));
-
-    /* Create GC method to clean up strbuf */
-    lua_newtable(l);
-    lua_pushcfunction(l, json_destroy_config);
-    lua_setfield(l, -2, "__gc");
-    lua_setmetatable(l, -2);
-
     cfg->encode_sparse_convert = DEFAULT_SPARSE_CONVERT;
     cfg->encode_sparse_ratio = DEFAULT_SPARSE_RATIO;
     cfg->encode_sparse_safe = DEFAULT_SPARSE_SAFE;
     cfg->encode_max_depth = DEFAULT_ENCODE_MAX_DEPTH;
     cfg->decode_max_depth = DEFAULT_DECODE_MAX_DEPTH;
+    cfg->decode_keep_buffer = DEFAULT_DECODE_KEEP_BUFFER;
+    cfg->decode_buffer_limit = DEFAULT_DECODE_BUFFER_LIMIT;
     cfg->encode_invalid_numbers = DEFAULT_ENCODE_INVALID_NUMBERS;
     cfg->decode_invalid_numbers = DEFAULT_DECODE_INVALID_NUMBERS;
     cfg->encode_keep_buffer = DEFAULT_ENCODE_KEEP_BUFFER;
@@ -620,10 +742,43 @@ static void json_create_config(lua_State *l)
     cfg->decode_array_with_array_mt = DEFAULT_DECODE_ARRAY_WITH_ARRAY_MT;
     cfg->encode_escape_forward_slash = DEFAULT_ENCODE_ESCAPE_FORWARD_SLASH;
     cfg->encode_skip_unsupported_value_types = DEFAULT_ENCODE_SKIP_UNSUPPORTED_VALUE_TYPES;
+}
 
-#if DEFAULT_ENCODE_KEEP_BUFFER > 0
-    strbuf_init(&cfg->encode_buf, 0);
-#endif
+static void json_create_config(lua_State *l)
+{
+    json_config_t *cfg;
+    int i;
+
+    cfg = lua_newuserdata(l, sizeof(*cfg));
+
+    /* Create GC method to clean up strbuf */
+    lua_newtable(l);
+    lua_pushcfunction(l, json_destroy_config);
+    lua_setfield(l, -2, "__gc");
+    lua_pushcfunction(l, json_close_config);
+    lua_setfield(l, -2, "__close");
+    lua_setmetatable(l, -2);
+
+    for (i = 0; i < JSON_KEY_CACHE_SIZE; i++) {
+        cfg->key_cache[i].str = NULL;
+        cfg->key_cache[i].len = 0;
+    }
+
+    json_config_defaults(cfg);
+    cfg->decode_busy = 0;
+
+    memset(&cfg->encode_buf, 0, sizeof(cfg->encode_buf));
+    memset(&cfg->decode_buf, 0, sizeof(cfg->decode_buf));
+    cfg->encode_sink = NULL;
+
+    /* The registry keeps the array metatables alive */
+    lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
+    lua_rawget(l, LUA_REGISTRYINDEX);
+    cfg->array_mt = lua_topointer(l, -1);
+    lua_pushlightuserdata(l, json_lightudata_mask(&json_empty_array));
+    lua_rawget(l, LUA_REGISTRYINDEX);
+    cfg->empty_array_mt = lua_topointer(l, -1);
+    lua_pop(l, 2);
 
     /* Decoding init */
 
@@ -673,22 +828,24 @@ static void json_create_config(lua_State *l)
 
 /* ===== ENCODING ===== */
 
-static void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *json, int lindex,
-                                  const char *reason)
+/* The buffer being encoded into is left to its owner: it may be the
+ * config's, one anchored on the stack or a Buffer given to encodeto */
+void json_encode_exception(lua_State *l, json_config_t *cfg, strbuf_t *json, int lindex,
+                           const char *reason)
 {
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
     luaL_error(l, "Cannot serialise %s: %s",
                   lua_typename(l, lua_type(l, lindex)), reason);
 }
 
 /* json_append_string args:
  * - lua_State
+ * - JSON config
  * - JSON strbuf
  * - String (Lua stack index)
  *
  * Returns nothing. Doesn't remove string from Lua stack */
-static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
+static void json_append_string(lua_State *l, json_config_t *cfg,
+                               strbuf_t *json, int lindex)
 {
     const char *escstr;
     unsigned i;
@@ -706,7 +863,7 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
     strbuf_append_char_unsafe(json, '\"');
     for (i = 0; i < len; i++) {
         escstr = char2escape[(unsigned char)str[i]];
-        if (escstr)
+        if (escstr && (str[i] != '/' || cfg->encode_escape_forward_slash))
             strbuf_append_string(json, escstr);
         else
             strbuf_append_char_unsafe(json, str[i]);
@@ -720,21 +877,36 @@ static void json_append_string(lua_State *l, strbuf_t *json, int lindex)
  */
 static int lua_array_length(lua_State *l, json_config_t *cfg, strbuf_t *json)
 {
-    double k;
-    int max;
-    int items;
+    lua_Integer k, max, items;
+    lua_Unsigned n;
 
     max = 0;
     items = 0;
 
+    /* Probe the key following the border. Array slots are traversed
+     * first, so for a table with a sequence and other keys this is
+     * usually one of the other keys, and rules out an array without
+     * scanning the sequence. */
+    n = lua_rawlen(l, -1);
+    if (n > 0 && n <= INT_MAX) {
+        lua_pushinteger(l, (lua_Integer)n);
+        if (lua_next(l, -2) != 0) {
+            /* table, key, value */
+            k = lua_isinteger(l, -2) ? lua_tointeger(l, -2) : 0;
+            lua_pop(l, 2);
+            if (k < 1 || k > INT_MAX)
+                return -1;
+        }
+    }
+
     lua_pushnil(l);
     /* table, startkey */
     while (lua_next(l, -2) != 0) {
         /* table, key, value */
-        if (lua_type(l, -2) == LUA_TNUMBER &&
-            (k = lua_tonumber(l, -2))) {
+        if (lua_isinteger(l, -2)) {
             /* Integer >= 1 ? */
-            if (floor(k) == k && k >= 1) {
+            k = lua_tointeger(l, -2);
+            if (k >= 1 && k <= INT_MAX) {
                 if (k > max)
                     max = k;
                 items++;
@@ -761,8 +933,8 @@ static int lua_array_length(lua_State *l, json_config_t *cfg, strbuf_t *json)
     return max;
 }
 
-static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
-                                    int current_depth, strbuf_t *json)
+void json_check_encode_depth(lua_State *l, json_config_t *cfg,
+                             int current_depth, strbuf_t *json)
 {
     /* Ensure there are enough slots free to traverse a table (key,
      * value) and push a string for a potential error message.
@@ -777,16 +949,85 @@ static void json_check_encode_depth(lua_State *l, json_config_t *cfg,
     if (current_depth <= cfg->encode_max_depth && lua_checkstack(l, 3))
         return;
 
-    if (!cfg->encode_keep_buffer)
-        strbuf_free(json);
-
     luaL_error(l, "Cannot serialise, excessive nesting (%d)",
                current_depth);
 }
 
+static int json_sink_write(json_sink_t *sink, const char *p, size_t len)
+{
+    ssize_t n;
+
+    if (sink->fp)
+        return fwrite(p, 1, len, sink->fp) == len;
+
+    while (len > 0) {
+        n = write(sink->fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 1;
+}
+
+/* After a failed write the rest of the output is discarded, so the
+ * buffer does not grow while the encoder runs to completion */
+static void json_sink_flush(json_sink_t *sink, strbuf_t *json)
+{
+    if (!sink->error && !json_sink_write(sink, json->buf, json->length))
+        sink->error = errno ? errno : EIO;
+    strbuf_reset(json);
+}
+
+static inline void json_sink_check(json_config_t *cfg, strbuf_t *json)
+{
+    json_sink_t *sink = cfg->encode_sink;
+
+    if (sink && strbuf_length(json) >= sink->threshold)
+        json_sink_flush(sink, json);
+}
+
+/* Starts a new line indented to depth for pretty output */
+static void json_append_newline(json_config_t *cfg, strbuf_t *json,
+                                int depth)
+{
+    json_sink_t *sink = cfg->encode_sink;
+    int i;
+
+    strbuf_ensure_empty_length(json, 1 + sink->indent_len * depth);
+    strbuf_append_char_unsafe(json, '\n');
+    for (i = 0; i < depth; i++)
+        strbuf_append_mem_unsafe(json, sink->indent, sink->indent_len);
+}
+
 static int json_append_data(lua_State *l, json_config_t *cfg,
                              int current_depth, strbuf_t *json);
 
+/* Appends the value on the top of the stack as an array element.
+ * comma counts the elements appended so far */
+static void json_append_element(lua_State *l, json_config_t *cfg,
+                                int current_depth, strbuf_t *json,
+                                int *comma, int pretty)
+{
+    size_t json_pos;
+
+    json_pos = strbuf_length(json);
+    if ((*comma)++ > 0)
+        strbuf_append_char(json, ',');
+    if (pretty)
+        json_append_newline(cfg, json, current_depth);
+
+    if (json_append_data(l, cfg, current_depth, json)) {
+        strbuf_set_length(json, json_pos);
+        if (*comma == 1)
+            *comma = 0;
+    }
+}
+
 /* json_append_array args:
  * - lua_State
  * - JSON strbuf
@@ -794,36 +1035,125 @@ static int json_append_data(lua_State *l, json_config_t *cfg,
 static void json_append_array(lua_State *l, json_config_t *cfg, int current_depth,
                               strbuf_t *json, int array_length)
 {
-    int comma, i, json_pos, err;
+    int comma, i, pretty;
 
+    pretty = cfg->encode_sink && cfg->encode_sink->indent;
     strbuf_append_char(json, '[');
 
     comma = 0;
     for (i = 1; i <= array_length; i++) {
-        json_pos = strbuf_length(json);
-        if (comma++ > 0)
-            strbuf_append_char(json, ',');
-
         lua_rawgeti(l, -1, i);
-        err = json_append_data(l, cfg, current_depth, json);
-        if (err) {
-            strbuf_set_length(json, json_pos);
-            if (comma == 1) {
-                comma = 0;
-            }
+        json_append_element(l, cfg, current_depth, json, &comma, pretty);
+        lua_pop(l, 1);
+        json_sink_check(cfg, json);
+    }
+
+    if (pretty && comma > 0)
+        json_append_newline(cfg, json, current_depth - 1);
+    strbuf_append_char(json, ']');
+}
+
+/* Encodes the table on the top of the stack as an array in a single
+ * pass over its keys when it looks like a sequence: it has no
+ * metatable and its length border is the last key traversed. Returns
+ * 0 if it is not such a table, undoing any output when a key outside
+ * the sequence turns up, and the caller encodes it as usual.
+ *
+ * Output that was flushed cannot be undone, so this is skipped while
+ * encodeto writes to a file */
+static int json_append_sequence(lua_State *l, json_config_t *cfg,
+                                int current_depth, strbuf_t *json)
+{
+    json_sink_t *sink = cfg->encode_sink;
+    lua_Unsigned n;
+    lua_Integer i;
+    size_t start;
+    int comma, pretty;
+
+    if (sink && sink->threshold != (size_t)-1)
+        return 0;
+    n = lua_rawlen(l, -1);
+    if (n == 0 || n > INT_MAX)
+        return 0;
+    if (lua_getmetatable(l, -1)) {
+        lua_pop(l, 1);
+        return 0;
+    }
+    lua_pushinteger(l, (lua_Integer)n);
+    if (lua_next(l, -2) != 0) {
+        lua_pop(l, 2);
+        return 0;
+    }
+
+    /* Array slots are traversed first and in order, so the keys of a
+     * sequence come as 1, 2, ... n. Integer keys in the hash part may
+     * come in any order, and are left to lua_array_length() */
+    pretty = sink && sink->indent;
+    start = strbuf_length(json);
+    strbuf_append_char(json, '[');
+
+    comma = 0;
+    lua_pushnil(l);
+    for (i = 1; lua_next(l, -2) != 0; i++) {
+        if (!lua_isinteger(l, -2) || lua_tointeger(l, -2) != i) {
+            lua_pop(l, 2);
+            strbuf_set_length(json, start);
+            return 0;
         }
+        json_append_element(l, cfg, current_depth, json, &comma, pretty);
         lua_pop(l, 1);
     }
 
+    if (pretty && comma > 0)
+        json_append_newline(cfg, json, current_depth - 1);
     strbuf_append_char(json, ']');
+
+    return 1;
+}
+
+/* Integers with at most precision digits are printed identically by
+ * "%.<precision>g", so they are converted without snprintf() */
+static int json_append_integer(json_config_t *cfg, strbuf_t *json,
+                               lua_Integer num)
+{
+    static const lua_Integer limit[17] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+        1000000000, 10000000000, 100000000000, 1000000000000,
+        10000000000000, 100000000000000, 1000000000000000,
+        10000000000000000
+    };
+    char digits[24], *p;
+    lua_Unsigned u;
+
+    if (num <= -limit[cfg->encode_number_precision] ||
+        num >= limit[cfg->encode_number_precision])
+        return 0;
+
+    p = digits + sizeof(digits);
+    u = num < 0 ? 0 - (lua_Unsigned)num : (lua_Unsigned)num;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u > 0);
+    if (num < 0)
+        *--p = '-';
+    strbuf_append_mem(json, p, digits + sizeof(digits) - p);
+
+    return 1;
 }
 
 static void json_append_number(lua_State *l, json_config_t *cfg,
                                strbuf_t *json, int lindex)
 {
-    double num = lua_tonumber(l, lindex);
+    double num;
     int len;
 
+    if (lua_isinteger(l, lindex) &&
+        json_append_integer(cfg, json, lua_tointeger(l, lindex)))
+        return;
+
+    num = lua_tonumber(l, lindex);
+
     if (cfg->encode_invalid_numbers == 0) {
         /* Prevent encoding invalid numbers */
         if (isinf(num) || isnan(num))
@@ -859,7 +1189,10 @@ static void json_append_number(lua_State *l, json_config_t *cfg,
 static void json_append_object(lua_State *l, json_config_t *cfg,
                                int current_depth, strbuf_t *json)
 {
-    int comma, keytype, json_pos, err;
+    int comma, keytype, err, pretty;
+    size_t json_pos;
+
+    pretty = cfg->encode_sink && cfg->encode_sink->indent;
 
     /* Object */
     strbuf_append_char(json, '{');
@@ -871,6 +1204,8 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
         json_pos = strbuf_length(json);
         if (comma++ > 0)
             strbuf_append_char(json, ',');
+        if (pretty)
+            json_append_newline(cfg, json, current_depth);
 
         /* table, key, value */
         keytype = lua_type(l, -2);
@@ -879,13 +1214,15 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
             json_append_number(l, cfg, json, -2);
             strbuf_append_mem(json, "\":", 2);
         } else if (keytype == LUA_TSTRING) {
-            json_append_string(l, json, -2);
+            json_append_string(l, cfg, json, -2);
             strbuf_append_char(json, ':');
         } else {
             json_encode_exception(l, cfg, json, -2,
                                   "table key must be a number or string");
             /* never returns */
         }
+        if (pretty)
+            strbuf_append_char(json, ' ');
 
         /* table, key, value */
         err = json_append_data(l, cfg, current_depth, json);
@@ -898,22 +1235,47 @@ static void json_append_object(lua_State *l, json_config_t *cfg,
 
         lua_pop(l, 1);
         /* table, key */
+        json_sink_check(cfg, json);
     }
 
+    if (pretty && comma > 0)
+        json_append_newline(cfg, json, current_depth - 1);
     strbuf_append_char(json, '}');
 }
 
+/* Returns the number of elements if the table on the top of the stack
+ * is to be encoded as an array, or -1 if it is to be an object */
+int json_table_length(lua_State *l, json_config_t *cfg,
+                      strbuf_t *json)
+{
+    const void *mt = NULL;
+    int len;
+
+    if (lua_getmetatable(l, -1)) {
+        mt = lua_topointer(l, -1);
+        lua_pop(l, 1);
+        if (mt == cfg->array_mt)
+            return lua_objlen(l, -1);
+    }
+
+    len = lua_array_length(l, cfg, json);
+    if (len > 0 || (len == 0 && !cfg->encode_empty_table_as_object))
+        return len;
+    if (mt && mt == cfg->empty_array_mt)
+        return 0;
+
+    return -1;
+}
+
 /* Serialise Lua data into JSON string. Return 1 if error an error happened, else 0 */
 static int json_append_data(lua_State *l, json_config_t *cfg,
                              int current_depth, strbuf_t *json)
 {
     int len;
-    int as_array = 0;
-    int has_metatable;
 
     switch (lua_type(l, -1)) {
     case LUA_TSTRING:
-        json_append_string(l, json, -1);
+        json_append_string(l, cfg, json, -1);
         break;
     case LUA_TNUMBER:
         json_append_number(l, cfg, json, -1);
@@ -928,39 +1290,13 @@ static int json_append_data(lua_State *l, json_config_t *cfg,
         current_depth++;
         json_check_encode_depth(l, cfg, current_depth, json);
 
-        has_metatable = lua_getmetatable(l, -1);
-
-        if (has_metatable) {
-            lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
-            lua_rawget(l, LUA_REGISTRYINDEX);
-            as_array = lua_rawequal(l, -1, -2);
-            lua_pop(l, 2);
-        }
-
-        if (as_array) {
-            len = lua_objlen(l, -1);
+        if (json_append_sequence(l, cfg, current_depth, json))
+            break;
+        len = json_table_length(l, cfg, json);
+        if (len >= 0)
             json_append_array(l, cfg, current_depth, json, len);
-        } else {
-            len = lua_array_length(l, cfg, json);
-
-            if (len > 0 || (len == 0 && !cfg->encode_empty_table_as_object)) {
-                json_append_array(l, cfg, current_depth, json, len);
-            } else {
-                if (has_metatable) {
-                    lua_getmetatable(l, -1);
-                    lua_pushlightuserdata(l, json_lightudata_mask(
-                                          &json_empty_array));
-                    lua_rawget(l, LUA_REGISTRYINDEX);
-                    as_array = lua_rawequal(l, -1, -2);
-                    lua_pop(l, 2); /* pop pointer + metatable */
-                    if (as_array) {
-                        json_append_array(l, cfg, current_depth, json, 0);
-                        break;
-                    }
-                }
-                json_append_object(l, cfg, current_depth, json);
-            }
-        }
+        else
+            json_append_object(l, cfg, current_depth, json);
         break;
     case LUA_TNIL:
         strbuf_append_mem(json, "null", 4);
@@ -989,21 +1325,19 @@ static int json_append_data(lua_State *l, json_config_t *cfg,
 static int json_encode(lua_State *l)
 {
     json_config_t *cfg = json_fetch_config(l);
-    strbuf_t local_encode_buf;
     strbuf_t *encode_buf;
     char *json;
-    int len;
+    size_t len;
 
     luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
 
     if (!cfg->encode_keep_buffer) {
-        /* Use private buffer */
-        encode_buf = &local_encode_buf;
-        strbuf_init(encode_buf, 0);
+        /* Use private buffer, freed by the collector if encoding fails */
+        encode_buf = json_new_strbuf(l, 0);
+        lua_insert(l, 1);
     } else {
         /* Reuse existing buffer */
-        encode_buf = &cfg->encode_buf;
-        strbuf_reset(encode_buf);
+        encode_buf = json_config_buffer(&cfg->encode_buf);
     }
 
     json_append_data(l, cfg, 0, encode_buf);
@@ -1097,9 +1431,10 @@ static int codepoint_to_utf8(char *utf8, int codepoint)
 /* Called when index pointing to beginning of UTF-16 code escape: \uXXXX
  * \u is guaranteed to exist, but the remaining hex characters may be
  * missing.
- * Translate to UTF-8 and append to temporary token string.
+ * Translate to UTF-8 and append to temporary token string, or only
+ * count the bytes when there is none (json.validate).
  * Must advance index to the next character to be processed.
- * Returns: 0   success
+ * Returns: number of UTF-8 bytes on success
  *          -1  error
  */
 static int json_append_unicode_escape(json_parse_t *json)
@@ -1154,10 +1489,11 @@ static int json_append_unicode_escape(json_parse_t *json)
         return -1;
 
     /* Append bytes and advance parse index */
-    strbuf_append_mem_unsafe(json->tmp, utf8, len);
+    if (json->tmp)
+        strbuf_append_mem_unsafe(json->tmp, utf8, len);
     json->ptr += escape_len;
 
-    return 0;
+    return len;
 }
 
 static void json_set_token_error(json_token_t *token, json_parse_t *json,
@@ -1168,11 +1504,60 @@ static void json_set_token_error(json_token_t *token, json_parse_t *json,
     token->value.string = errtype;
 }
 
+/* Checks a string without storing it, for parsers without json->tmp.
+ * Only the decoded length is recorded in the token */
+static void json_skip_string_token(json_parse_t *json, json_token_t *token)
+{
+    char *escape2char = json->cfg->escape2char;
+    size_t len = 0;
+    char ch;
+    int n;
+
+    json->ptr++;
+
+    while ((ch = *json->ptr) != '"') {
+        if (!ch) {
+            json_set_token_error(token, json, "unexpected end of string");
+            return;
+        }
+
+        if (ch == '\\') {
+            ch = escape2char[(unsigned char)json->ptr[1]];
+            if (ch == 'u') {
+                if ((n = json_append_unicode_escape(json)) < 0) {
+                    json_set_token_error(token, json,
+                                         "invalid unicode escape code");
+                    return;
+                }
+                len += n;
+                continue;
+            }
+            if (!ch) {
+                json_set_token_error(token, json, "invalid escape code");
+                return;
+            }
+            json->ptr++;
+        }
+        len++;
+        json->ptr++;
+    }
+    json->ptr++;
+
+    token->type = T_STRING;
+    token->value.string = NULL;
+    token->string_len = len;
+}
+
 static void json_next_string_token(json_parse_t *json, json_token_t *token)
 {
     char *escape2char = json->cfg->escape2char;
     char ch;
 
+    if (!json->tmp) {
+        json_skip_string_token(json, token);
+        return;
+    }
+
     /* Caller must ensure a string is next */
     assert(*json->ptr == '"');
 
@@ -1200,7 +1585,7 @@ static void json_next_string_token(json_parse_t *json, json_token_t *token)
             /* Translate escape code and append to tmp string */
             ch = escape2char[(unsigned char)ch];
             if (ch == 'u') {
-                if (json_append_unicode_escape(json) == 0)
+                if (json_append_unicode_escape(json) >= 0)
                     continue;
 
                 json_set_token_error(token, json,
@@ -1376,18 +1761,54 @@ static void json_next_token(json_parse_t *json, json_token_t *token)
     json_set_token_error(token, json, "invalid token");
 }
 
-/* This function does not return.
- * DO NOT CALL WITH DYNAMIC MEMORY ALLOCATED.
- * The only supported exception is the temporary parser string
- * json->tmp struct.
- * json and token should exist on the stack somewhere.
- * luaL_error() will long_jmp and release the stack */
-static void json_throw_parse_error(lua_State *l, json_parse_t *json,
-                                   const char *exp, json_token_t *token)
+/* Points json->tmp at the config's decode buffer, with room for len
+ * bytes. Decoded strings are never longer than the text holding them,
+ * so the tokenizer needs no further length checks. Only for parsers
+ * that cannot raise errors; others use json_parse_buffer() */
+static void json_reserve_decode_buffer(json_parse_t *json, size_t len)
 {
-    const char *found;
+    json->tmp = json_config_buffer(&json->cfg->decode_buf);
+    json->cfg->decode_busy++;
+    strbuf_ensure_empty_length(json->tmp, len);
+}
+
+/* Reserves the decode buffer for a parser that may raise errors. The
+ * config userdata must be on the top of the stack. For long texts it is
+ * marked to be closed, so the buffer is released however the calling
+ * function exits, including through a parse or memory error.
+ * json_parse_done() releases it and removes the config from the stack.
+ *
+ * Short texts skip this: even a buffer trimmed by a parser nested in a
+ * finalizer has room for them, so they need not mark it busy */
+static void json_parse_buffer(lua_State *l, json_parse_t *json, size_t len)
+{
+    if (len < STRBUF_DEFAULT_SIZE) {
+        lua_pop(l, 1);
+        json->guard = 0;
+        json->tmp = json_config_buffer(&json->cfg->decode_buf);
+        strbuf_ensure_empty_length(json->tmp, len);
+        return;
+    }
+
+    json->guard = lua_gettop(l);
+    lua_toclose(l, json->guard);
+    json_reserve_decode_buffer(json, len);
+}
+
+static void json_parse_done(lua_State *l, json_parse_t *json)
+{
+    if (!json->guard) {
+        json_trim_decode_buffer(json->cfg);
+        return;
+    }
+    lua_closeslot(l, json->guard);
+    lua_remove(l, json->guard);
+}
 
-    strbuf_free(json->tmp);
+static void json_push_parse_error(lua_State *l, json_parse_t *json,
+                                  const char *exp, json_token_t *token)
+{
+    const char *found;
 
     if (token->type == T_ERROR)
         found = token->value.string;
@@ -1395,13 +1816,45 @@ static void json_throw_parse_error(lua_State *l, json_parse_t *json,
         found = json_token_type_name[token->type];
 
     /* Note: token->index is 0 based, display starting from 1 */
-    luaL_error(l, "Expected %s but found %s at character %d",
-               exp, found, token->index + 1);
+    if (json->line > 0)
+        lua_pushfstring(l, "Expected %s but found %s at character %d of line %I "
+                        "(byte offset %I)", exp, found, token->index + 1,
+                        json->line, json->offset + token->index);
+    else
+        lua_pushfstring(l, "Expected %s but found %s at character %d",
+                        exp, found, token->index + 1);
 }
 
-static inline void json_decode_ascend(json_parse_t *json)
+static void json_throw_parse_error(lua_State *l, json_parse_t *json,
+                                   const char *exp, json_token_t *token)
 {
-    json->current_depth--;
+    json_push_parse_error(l, json, exp, token);
+    lua_error(l);
+}
+
+static inline void json_decode_ascend(json_parse_t *json)
+{
+    json->current_depth--;
+}
+
+static void json_push_depth_error(lua_State *l, json_parse_t *json)
+{
+    int index = json->ptr - json->data;
+
+    if (json->line > 0)
+        lua_pushfstring(l, "Found too many nested data structures (%d) at "
+                        "character %d of line %I (byte offset %I)",
+                        json->current_depth, index, json->line,
+                        json->offset + index);
+    else
+        lua_pushfstring(l, "Found too many nested data structures (%d) at "
+                        "character %d", json->current_depth, index);
+}
+
+static void json_throw_depth_error(lua_State *l, json_parse_t *json)
+{
+    json_push_depth_error(l, json);
+    lua_error(l);
 }
 
 static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
@@ -1413,172 +1866,2250 @@ static void json_decode_descend(lua_State *l, json_parse_t *json, int slots)
         return;
     }
 
-    strbuf_free(json->tmp);
-    luaL_error(l, "Found too many nested data structures (%d) at character %d",
-        json->current_depth, json->ptr - json->data);
+    json_throw_depth_error(l, json);
+}
+
+/* Shape of a document, gathered by json.validate */
+typedef struct {
+    int depth;
+    lua_Integer objects;
+    lua_Integer arrays;
+    lua_Integer keys;
+    lua_Integer strings;
+    lua_Integer numbers;
+    lua_Integer booleans;
+    lua_Integer nulls;
+    lua_Integer string_bytes;   /* Decoded bytes of strings and keys */
+} json_stats_t;
+
+#define JSON_SKIP_DEPTH -2
+
+/* Walks over the value beginning with token without creating any Lua
+ * values, counting what it contains in stats if it is not NULL.
+ * Returns 0 on success. On a syntax error returns -1 with *exp set to
+ * what was expected and token describing what was found.
+ * Returns JSON_SKIP_DEPTH if the value is nested too deeply. */
+static int json_skip_value(json_parse_t *json, json_token_t *token,
+                           const char **exp, json_stats_t *stats)
+{
+    json_token_type_t end;
+    int ret;
+
+    switch (token->type) {
+    case T_STRING:
+        if (stats) {
+            stats->strings++;
+            stats->string_bytes += token->string_len;
+        }
+        return 0;
+    case T_NUMBER:
+        if (stats)
+            stats->numbers++;
+        return 0;
+    case T_BOOLEAN:
+        if (stats)
+            stats->booleans++;
+        return 0;
+    case T_NULL:
+        if (stats)
+            stats->nulls++;
+        return 0;
+    case T_OBJ_BEGIN:
+        end = T_OBJ_END;
+        break;
+    case T_ARR_BEGIN:
+        end = T_ARR_END;
+        break;
+    default:
+        *exp = "value";
+        return -1;
+    }
+
+    if (++json->current_depth > json->cfg->decode_max_depth)
+        return JSON_SKIP_DEPTH;
+    if (stats) {
+        if (end == T_OBJ_END)
+            stats->objects++;
+        else
+            stats->arrays++;
+        if (json->current_depth > stats->depth)
+            stats->depth = json->current_depth;
+    }
+
+    json_next_token(json, token);
+    if (token->type != end) {
+        while (1) {
+            if (end == T_OBJ_END) {
+                if (token->type != T_STRING) {
+                    *exp = "object key string";
+                    return -1;
+                }
+                if (stats) {
+                    stats->keys++;
+                    stats->string_bytes += token->string_len;
+                }
+                json_next_token(json, token);
+                if (token->type != T_COLON) {
+                    *exp = "colon";
+                    return -1;
+                }
+                json_next_token(json, token);
+            }
+
+            if ((ret = json_skip_value(json, token, exp, stats)) != 0)
+                return ret;
+
+            json_next_token(json, token);
+            if (token->type == end)
+                break;
+            if (token->type != T_COMMA) {
+                *exp = end == T_OBJ_END ? "comma or object end"
+                                        : "comma or array end";
+                return -1;
+            }
+            json_next_token(json, token);
+        }
+    }
+
+    json->current_depth--;
+
+    return 0;
+}
+
+static void json_skip(lua_State *l, json_parse_t *json, json_token_t *token)
+{
+    const char *exp;
+    int ret;
+
+    ret = json_skip_value(json, token, &exp, NULL);
+    if (ret == JSON_SKIP_DEPTH)
+        json_throw_depth_error(l, json);
+    else if (ret != 0)
+        json_throw_parse_error(l, json, exp, token);
+}
+
+/* Push the object key held by token, reusing the string from the key
+ * cache when the same key was decoded recently */
+static void json_push_key(lua_State *l, json_parse_t *json,
+                          json_token_t *token)
+{
+    json_config_t *cfg = json->cfg;
+    const unsigned char *str = (const unsigned char *)token->value.string;
+    size_t len = token->string_len;
+    unsigned int slot;
+
+    if (json->key_cache == 0 || len == 0 || len > JSON_KEY_CACHE_MAXLEN) {
+        lua_pushlstring(l, token->value.string, len);
+        return;
+    }
+
+    slot = (len * 31 + str[0] * 7 + str[len / 2] * 3 + str[len - 1]) &
+           (JSON_KEY_CACHE_SIZE - 1);
+    if (cfg->key_cache[slot].len == len &&
+        !memcmp(cfg->key_cache[slot].str, str, len)) {
+        lua_rawgeti(l, json->key_cache, slot + 1);
+        return;
+    }
+
+    lua_pushlstring(l, token->value.string, len);
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, json->key_cache, slot + 1);
+    cfg->key_cache[slot].str = lua_tostring(l, -1);
+    cfg->key_cache[slot].len = len;
 }
 
 static void json_parse_object_context(lua_State *l, json_parse_t *json)
 {
     json_token_t token;
+    int base, i, n;
+
+    /* The first JSON_DECODE_PRESIZE members are collected on the stack
+     * as key, value pairs. 3 more slots are required:
+     * .., table, key, value */
+    json_decode_descend(l, json, 2 * JSON_DECODE_PRESIZE + 3);
+
+    base = lua_gettop(l);
+    n = 0;
+
+    json_next_token(json, &token);
+
+    /* Handle empty objects */
+    if (token.type != T_OBJ_END) {
+        while (1) {
+            if (token.type != T_STRING)
+                json_throw_parse_error(l, json, "object key string", &token);
+
+            /* Push key */
+            json_push_key(l, json, &token);
+
+            json_next_token(json, &token);
+            if (token.type != T_COLON)
+                json_throw_parse_error(l, json, "colon", &token);
+
+            /* Fetch value */
+            json_next_token(json, &token);
+            json_process_value(l, json, &token);
+            n++;
+
+            json_next_token(json, &token);
+
+            if (token.type == T_OBJ_END || n == JSON_DECODE_PRESIZE)
+                break;
+
+            if (token.type != T_COMMA)
+                json_throw_parse_error(l, json, "comma or object end", &token);
+
+            json_next_token(json, &token);
+        }
+    }
+
+    /* Set the members in order, so the last of any duplicate keys wins */
+    lua_createtable(l, 0, n);
+    for (i = 1; i <= 2 * n; i += 2) {
+        lua_pushvalue(l, base + i);
+        lua_pushvalue(l, base + i + 1);
+        lua_rawset(l, -3);
+    }
+    if (n > 0) {
+        lua_replace(l, base + 1);
+        lua_settop(l, base + 1);
+    }
+
+    while (token.type != T_OBJ_END) {
+        if (token.type != T_COMMA)
+            json_throw_parse_error(l, json, "comma or object end", &token);
+
+        json_next_token(json, &token);
+        if (token.type != T_STRING)
+            json_throw_parse_error(l, json, "object key string", &token);
+
+        /* Push key */
+        json_push_key(l, json, &token);
+
+        json_next_token(json, &token);
+        if (token.type != T_COLON)
+            json_throw_parse_error(l, json, "colon", &token);
+
+        /* Fetch value */
+        json_next_token(json, &token);
+        json_process_value(l, json, &token);
+
+        /* Set key = value */
+        lua_rawset(l, -3);
+
+        json_next_token(json, &token);
+    }
+
+    json_decode_ascend(json);
+}
+
+/* Handle the array context */
+static void json_parse_array_context(lua_State *l, json_parse_t *json)
+{
+    json_token_t token;
+    int base, i, n;
+
+    /* The first JSON_DECODE_PRESIZE values are collected on the stack.
+     * 2 more slots are required:
+     * .., table, value */
+    json_decode_descend(l, json, JSON_DECODE_PRESIZE + 2);
+
+    base = lua_gettop(l);
+    n = 0;
+
+    json_next_token(json, &token);
+
+    /* Handle empty arrays */
+    if (token.type != T_ARR_END) {
+        while (1) {
+            json_process_value(l, json, &token);
+            n++;
+
+            json_next_token(json, &token);
+
+            if (token.type == T_ARR_END || n == JSON_DECODE_PRESIZE)
+                break;
+
+            if (token.type != T_COMMA)
+                json_throw_parse_error(l, json, "comma or array end", &token);
+
+            json_next_token(json, &token);
+        }
+    }
+
+    lua_createtable(l, n, 0);
+
+    /* set array_mt on the table at the top of the stack */
+    if (json->cfg->decode_array_with_array_mt) {
+        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
+        lua_rawget(l, LUA_REGISTRYINDEX);
+        lua_setmetatable(l, -2);
+    }
+
+    for (i = 1; i <= n; i++) {
+        lua_pushvalue(l, base + i);
+        lua_rawseti(l, -2, i);            /* arr[i] = value */
+    }
+    if (n > 0) {
+        lua_replace(l, base + 1);
+        lua_settop(l, base + 1);
+    }
+
+    for (i = n + 1; token.type != T_ARR_END; i++) {
+        if (token.type != T_COMMA)
+            json_throw_parse_error(l, json, "comma or array end", &token);
+
+        json_next_token(json, &token);
+        json_process_value(l, json, &token);
+        lua_rawseti(l, -2, i);            /* arr[i] = value */
+
+        json_next_token(json, &token);
+    }
+
+    json_decode_ascend(json);
+}
+
+/* Handle the "value" context */
+static void json_process_value(lua_State *l, json_parse_t *json,
+                               json_token_t *token)
+{
+    switch (token->type) {
+    case T_STRING:
+        lua_pushlstring(l, token->value.string, token->string_len);
+        break;;
+    case T_NUMBER:
+        lua_pushnumber(l, token->value.number);
+        break;;
+    case T_BOOLEAN:
+        lua_pushboolean(l, token->value.boolean);
+        break;;
+    case T_OBJ_BEGIN:
+        json_parse_object_context(l, json);
+        break;;
+    case T_ARR_BEGIN:
+        json_parse_array_context(l, json);
+        break;;
+    case T_NULL:
+        /* In Lua, setting "t[k] = nil" will delete k from the table.
+         * Hence a NULL pointer lightuserdata object is used instead */
+        lua_pushlightuserdata(l, NULL);
+        break;;
+    default:
+        json_throw_parse_error(l, json, "value", token);
+    }
+}
+
+/* Decode the value at json->ptr and ensure nothing but whitespace
+ * follows it. The decoded value is left on the top of the Lua stack */
+static void json_decode_value(lua_State *l, json_parse_t *json)
+{
+    json_token_t token;
+
+    json_next_token(json, &token);
+    json_process_value(l, json, &token);
+
+    /* Ensure there is no more input left */
+    json_next_token(json, &token);
+
+    if (token.type != T_END)
+        json_throw_parse_error(l, json, "the end", &token);
+}
+
+static int json_decode(lua_State *l)
+{
+    struct callisto_buffer *b;
+    json_parse_t json;
+    size_t json_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    json.cfg = json_fetch_config(l);
+    if ((b = luaL_testudata(l, 1, CALLISTO_BUFFER)) != NULL) {
+        /* Decode the unread bytes in place; the parser needs the
+         * terminator a Lua string would have */
+        strbuf_ensure_null(&b->sb);
+        json.data = b->sb.buf + b->off;
+        json_len = b->sb.length - b->off;
+    } else {
+        json.data = luaL_checklstring(l, 1, &json_len);
+    }
+    json.current_depth = 0;
+    json.ptr = json.data;
+    json.line = 0;
+    json.offset = 0;
+
+    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
+     *
+     * CJSON can support any simple data type, hence only the first
+     * character is guaranteed to be ASCII (at worst: '"'). This is
+     * still enough to detect whether the wrong encoding is in use. */
+    if (json_len >= 2 && (!json.data[0] || !json.data[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+
+    json_push_key_cache(l, lua_upvalueindex(1));
+    json.key_cache = 2;
+
+    lua_pushvalue(l, lua_upvalueindex(1));
+    json_parse_buffer(l, &json, json_len);
+    json_decode_value(l, &json);
+    json_parse_done(l, &json);
+
+    return 1;
+}
+
+/* ===== JSON LINES ===== */
+
+static FILE *json_check_file(lua_State *l, int lindex)
+{
+    luaL_Stream *stream;
+
+    stream = luaL_checkudata(l, lindex, LUA_FILEHANDLE);
+    if (stream->closef == NULL)
+        luaL_error(l, "attempt to use a closed file");
+
+    return stream->f;
+}
+
+static void json_lines_close(json_lines_t *lines)
+{
+    if (lines->close && lines->fp)
+        fclose(lines->fp);
+    lines->fp = NULL;
+    strbuf_free(&lines->buf);
+}
+
+static int json_lines_gc(lua_State *l)
+{
+    json_lines_close(lua_touserdata(l, 1));
+
+    return 0;
+}
+
+/* Returns the next line of the stream, refilling the read buffer as
+ * required. The line is NUL terminated in place and stays valid until
+ * the next call. Returns NULL at the end of the stream. */
+static char *json_lines_read(lua_State *l, json_lines_t *lines, size_t *len)
+{
+    strbuf_t *b = &lines->buf;
+    char *start, *nl;
+    size_t n;
+
+    while (1) {
+        start = b->buf + lines->pos;
+        nl = memchr(start, '\n', b->length - lines->pos);
+        if (nl) {
+            *nl = '\0';
+            *len = nl - start;
+            lines->pos += *len + 1;
+            return start;
+        }
+
+        if (lines->eof) {
+            if (lines->pos == b->length)
+                return NULL;
+
+            /* Final line without a trailing newline */
+            strbuf_ensure_null(b);
+            *len = b->length - lines->pos;
+            lines->pos = b->length;
+            return start;
+        }
+
+        /* Move the partial line to the front and read some more */
+        if (lines->pos > 0) {
+            memmove(b->buf, start, b->length - lines->pos);
+            lines->offset += lines->pos;
+            b->length -= lines->pos;
+            lines->pos = 0;
+        }
+        strbuf_ensure_empty_length(b, JSON_LINES_BUFSIZE);
+        n = fread(strbuf_empty_ptr(b), 1, strbuf_empty_length(b), lines->fp);
+        if (n == 0) {
+            if (ferror(lines->fp))
+                luaL_error(l, "Cannot read line %I: %s",
+                           lines->line + 1, strerror(errno));
+            lines->eof = 1;
+        }
+        strbuf_extend_length(b, n);
+    }
+}
+
+static int json_lines_next(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_lines_t *lines = lua_touserdata(l, lua_upvalueindex(2));
+    json_parse_t json;
+    const char *p;
+    char *line;
+    size_t len;
+
+    if (!lines->fp)
+        return 0;
+
+    /* Skip blank lines */
+    do {
+        line = json_lines_read(l, lines, &len);
+        if (!line) {
+            json_lines_close(lines);
+            return 0;
+        }
+        lines->line++;
+        for (p = line; cfg->ch2token[(unsigned char)*p] == T_WHITESPACE; p++)
+            ;
+    } while (*p == '\0');
+
+    json.cfg = cfg;
+    json.data = line;
+    json.ptr = line;
+    json.current_depth = 0;
+    json_push_key_cache(l, lua_upvalueindex(1));
+    json.key_cache = lua_gettop(l);
+    json.line = lines->line;
+    json.offset = lines->offset + (line - lines->buf.buf);
+
+    /* Decoded strings are never longer than the line holding them */
+    lua_pushvalue(l, lua_upvalueindex(1));
+    json_parse_buffer(l, &json, len);
+    json_decode_value(l, &json);
+    json_parse_done(l, &json);
+
+    return 1;
+}
+
+static int json_lines(lua_State *l)
+{
+    json_lines_t *lines;
+    const char *path;
+
+    json_fetch_config(l);
+    lua_settop(l, 1);
+
+    lines = lua_newuserdata(l, sizeof(*lines));
+    lines->fp = NULL;
+    lines->close = 0;
+    lines->pos = 0;
+    lines->eof = 0;
+    lines->line = 0;
+    lines->offset = 0;
+    strbuf_init(&lines->buf, JSON_LINES_BUFSIZE);
+
+    if (luaL_newmetatable(l, "cjson.lines")) {
+        lua_pushcfunction(l, json_lines_gc);
+        lua_setfield(l, -2, "__gc");
+        lua_pushcfunction(l, json_lines_gc);
+        lua_setfield(l, -2, "__close");
+    }
+    lua_setmetatable(l, -2);
+
+    if (lua_type(l, 1) == LUA_TSTRING) {
+        path = lua_tostring(l, 1);
+        lines->fp = fopen(path, "r");
+        if (!lines->fp)
+            return luaL_error(l, "%s: %s", path, strerror(errno));
+        lines->close = 1;
+    } else {
+        lines->fp = json_check_file(l, 1);
+    }
+
+    /* iterator, nil, nil, to-be-closed state */
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_pushvalue(l, -2);
+    lua_pushcclosure(l, json_lines_next, 2);
+    lua_pushnil(l);
+    lua_pushnil(l);
+    lua_pushvalue(l, -4);
+
+    return 4;
+}
+
+static int json_strbuf_gc(lua_State *l)
+{
+    strbuf_free(lua_touserdata(l, 1));
+
+    return 0;
+}
+
+/* Returns a strbuf owned by a new userdata at the top of the stack, so
+ * it is released even if encoding or the caller's iterator throws */
+strbuf_t *json_new_strbuf(lua_State *l, size_t len)
+{
+    strbuf_t *s;
+
+    s = lua_newuserdata(l, sizeof(*s));
+    strbuf_init(s, len);
+    if (luaL_newmetatable(l, "cjson.strbuf")) {
+        lua_pushcfunction(l, json_strbuf_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_setmetatable(l, -2);
+
+    return s;
+}
+
+static int json_write_strbuf(FILE *fp, strbuf_t *s)
+{
+    size_t len = strbuf_length(s);
+
+    if (len > 0 && fwrite(s->buf, 1, len, fp) != len)
+        return 0;
+    strbuf_reset(s);
+
+    return 1;
+}
+
+static int json_writelines(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    strbuf_t *buf;
+    lua_Integer n;
+    FILE *fp;
+    int is_function;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    fp = json_check_file(l, 1);
+    is_function = lua_isfunction(l, 2);
+    if (!is_function)
+        luaL_checktype(l, 2, LUA_TTABLE);
+
+    /* An iterator may encode values itself, which would reset the
+     * shared buffer while it holds lines not yet written */
+    if (cfg->encode_keep_buffer && !is_function) {
+        buf = json_config_buffer(&cfg->encode_buf);
+    } else {
+        buf = json_new_strbuf(l, JSON_LINES_BUFSIZE);
+    }
+
+    for (n = 0; ; n++) {
+        if (is_function) {
+            lua_pushvalue(l, 2);
+            lua_call(l, 0, 1);
+        } else {
+            lua_rawgeti(l, 2, n + 1);
+        }
+        if (lua_isnil(l, -1)) {
+            lua_pop(l, 1);
+            break;
+        }
+
+        json_append_data(l, cfg, 0, buf);
+        strbuf_append_char(buf, '\n');
+        lua_pop(l, 1);
+
+        if (strbuf_length(buf) >= JSON_LINES_BUFSIZE &&
+            !json_write_strbuf(fp, buf))
+            return luaL_fileresult(l, 0, NULL);
+    }
+
+    if (!json_write_strbuf(fp, buf))
+        return luaL_fileresult(l, 0, NULL);
+
+    lua_pushinteger(l, n);
+
+    return 1;
+}
+
+/* Raises an error in the state given as ud when a Buffer being
+ * encoded into cannot grow, rather than letting strbuf exit */
+static void json_buffer_nomem(void *ud)
+{
+    luaL_error((lua_State *)ud, "not enough memory");
+}
+
+/* Encodes the value on top of the stack into the strbuf given as
+ * argument 2 with the config given as argument 1. json.encodeto runs it
+ * under lua_pcall so the sink is cleared even if encoding fails */
+static int json_encodeto_run(lua_State *l)
+{
+    json_append_data(l, lua_touserdata(l, 1), 0, lua_touserdata(l, 2));
+
+    return 0;
+}
+
+/* json.encodeto(file, value [, options]) encodes value to an open file
+ * or a file descriptor, writing the buffer out whenever it holds
+ * flush_threshold bytes so the document is never held in memory.
+ * Given a Buffer, it appends to the buffer's own strbuf instead, which
+ * is grown as needed and never allocated up front, raises an error if
+ * it cannot grow, and drops what it appended if encoding fails */
+static int json_encodeto(lua_State *l)
+{
+    static const char spaces[JSON_INDENT_MAX + 1] = "                ";
+    json_config_t *cfg = json_fetch_config(l);
+    struct callisto_buffer *target;
+    json_sink_t sink;
+    strbuf_t *buf;
+    lua_Integer n;
+    size_t start;
+    int status;
+
+    luaL_argcheck(l, lua_gettop(l) >= 2 && lua_gettop(l) <= 3, 2,
+                  "expected 2 or 3 arguments");
+
+    sink.fp = NULL;
+    sink.fd = -1;
+    sink.threshold = JSON_LINES_BUFSIZE;
+    sink.indent = NULL;
+    sink.indent_len = 0;
+    sink.error = 0;
+
+    if ((target = luaL_testudata(l, 1, CALLISTO_BUFFER)) != NULL) {
+        sink.threshold = (size_t)-1;    /* Never flushed */
+    } else if (lua_isinteger(l, 1)) {
+        n = lua_tointeger(l, 1);
+        luaL_argcheck(l, n >= 0 && n <= INT_MAX, 1, "invalid file descriptor");
+        sink.fd = n;
+    } else {
+        sink.fp = json_check_file(l, 1);
+    }
+
+    if (!lua_isnoneornil(l, 3)) {
+        luaL_checktype(l, 3, LUA_TTABLE);
+        if (lua_getfield(l, 3, "flush_threshold") != LUA_TNIL
+            && !target) {
+            n = luaL_checkinteger(l, -1);
+            luaL_argcheck(l, n > 0, 3, "flush_threshold must be positive");
+            sink.threshold = n;
+        }
+        switch (lua_getfield(l, 3, "indent")) {
+        case LUA_TNIL:
+            break;
+        case LUA_TNUMBER:
+            n = luaL_checkinteger(l, -1);
+            luaL_argcheck(l, n >= 0 && n <= JSON_INDENT_MAX, 3,
+                          "indent out of range");
+            sink.indent = spaces;
+            sink.indent_len = n;
+            break;
+        default:
+            /* Anchored by the options table */
+            sink.indent = luaL_checklstring(l, -1, &sink.indent_len);
+        }
+        lua_pop(l, 2);
+    }
+    lua_settop(l, 3);
+
+    if (target) {
+        buf = &target->sb;
+    } else if (cfg->encode_keep_buffer) {
+        buf = json_config_buffer(&cfg->encode_buf);
+    } else {
+        buf = json_new_strbuf(l, sink.threshold);
+    }
+    lua_pushcfunction(l, json_encodeto_run);
+    lua_pushlightuserdata(l, cfg);
+    lua_pushlightuserdata(l, buf);
+    lua_pushvalue(l, 2);
+
+    if (target) {
+        buf->nomem = json_buffer_nomem;
+        buf->nomem_ud = l;
+    }
+    cfg->encode_sink = &sink;
+    start = strbuf_length(buf);
+    status = lua_pcall(l, 3, 0, 0);
+    cfg->encode_sink = NULL;
+    if (target) {
+        buf->nomem = NULL;
+        buf->nomem_ud = NULL;
+    }
+    if (status != LUA_OK) {
+        if (target)
+            strbuf_set_length(buf, start);
+        return lua_error(l);
+    }
+    if (!target)
+        json_sink_flush(&sink, buf);
+
+    if (sink.error) {
+        errno = sink.error;
+        return luaL_fileresult(l, 0, NULL);
+    }
+    lua_pushboolean(l, 1);
+
+    return 1;
+}
+
+/* ===== LAZY DOCUMENTS ===== */
+
+/* json.parse() records the structure of a document on a tape holding
+ * one node per value, in document order. Containers store the index
+ * of the node following their subtree so siblings can be reached
+ * without visiting children. Object members are a key node followed
+ * by the value node. Scalars are only converted when accessed. */
+typedef struct {
+    unsigned char type;         /* json_token_type_t of the value */
+    unsigned int offset;        /* Offset of the value in the source */
+    unsigned int next;          /* Tape index following this subtree */
+    unsigned int count;         /* Array elements or object members */
+} json_node_t;
+
+typedef struct {
+    json_node_t *tape;
+    unsigned int length;
+    unsigned int size;
+    const char *data;           /* Source text, anchored by user value 1 */
+    size_t data_len;
+    json_config_t *cfg;         /* Anchored by user value 3 */
+} json_doc_t;
+
+typedef struct {
+    json_doc_t *doc;            /* Anchored by user value 1 */
+    unsigned int index;
+    unsigned int last_pos;      /* Last array element looked up */
+    unsigned int last_node;     /* and its tape index */
+} json_proxy_t;
+
+#define JSON_DOC_MT     "cjson.document"
+#define JSON_PROXY_MT   "cjson.node"
+#define JSON_WEAK_MT    "cjson.weak"
+
+/* Extracts the next reference token of a JSON Pointer (RFC 6901) into
+ * seg, which must be as large as the pointer.
+ * Returns: 1   segment stored in seg and *len
+ *          0   end of the pointer
+ *          -1  invalid pointer */
+static int json_pointer_next(const char **ptr, char *seg, size_t *len)
+{
+    const char *p = *ptr;
+    size_t n = 0;
+
+    if (*p == '\0')
+        return 0;
+    if (*p++ != '/')
+        return -1;
+
+    while (*p && *p != '/') {
+        if (*p == '~') {
+            if (p[1] == '0')
+                seg[n++] = '~';
+            else if (p[1] == '1')
+                seg[n++] = '/';
+            else
+                return -1;
+            p += 2;
+        } else {
+            seg[n++] = *p++;
+        }
+    }
+
+    *ptr = p;
+    *len = n;
+
+    return 1;
+}
+
+/* Converts a reference token to a zero based array index.
+ * Returns -1 if the token is not a valid index */
+static lua_Integer json_pointer_index(const char *seg, size_t len)
+{
+    lua_Integer index = 0;
+    size_t i;
+
+    /* Leading zeros are not allowed */
+    if (len == 0 || len > 18 || (seg[0] == '0' && len > 1))
+        return -1;
+
+    for (i = 0; i < len; i++) {
+        if (seg[i] < '0' || seg[i] > '9')
+            return -1;
+        index = index * 10 + (seg[i] - '0');
+    }
+
+    return index;
+}
+
+static int json_doc_gc(lua_State *l)
+{
+    json_doc_t *doc = lua_touserdata(l, 1);
+
+    free(doc->tape);
+    doc->tape = NULL;
+
+    return 0;
+}
+
+static void json_tape_grow(lua_State *l, json_doc_t *doc)
+{
+    json_node_t *tape;
+    unsigned int size;
+
+    size = doc->size ? doc->size * 2 : 64;
+    if (size < doc->size)
+        luaL_error(l, "Document too large");
+
+    tape = realloc(doc->tape, size * sizeof(*tape));
+    if (!tape)
+        luaL_error(l, "Out of memory");
+
+    doc->tape = tape;
+    doc->size = size;
+}
+
+/* Records the value starting with token, and everything it contains,
+ * on the document tape */
+static void json_tape_value(lua_State *l, json_parse_t *json,
+                            json_doc_t *doc, json_token_t *token)
+{
+    unsigned int node, count;
+
+    if (doc->length == doc->size)
+        json_tape_grow(l, doc);
+    node = doc->length++;
+    doc->tape[node].type = token->type;
+    doc->tape[node].offset = token->index;
+    count = 0;
+
+    switch (token->type) {
+    case T_OBJ_BEGIN:
+        json_decode_descend(l, json, 1);
+        json_next_token(json, token);
+        while (token->type != T_OBJ_END) {
+            if (token->type != T_STRING)
+                json_throw_parse_error(l, json, "object key string", token);
+            json_tape_value(l, json, doc, token);
+
+            json_next_token(json, token);
+            if (token->type != T_COLON)
+                json_throw_parse_error(l, json, "colon", token);
+
+            json_next_token(json, token);
+            json_tape_value(l, json, doc, token);
+            count++;
+
+            json_next_token(json, token);
+            if (token->type == T_OBJ_END)
+                break;
+            if (token->type != T_COMMA)
+                json_throw_parse_error(l, json, "comma or object end", token);
+            json_next_token(json, token);
+        }
+        json_decode_ascend(json);
+        break;
+    case T_ARR_BEGIN:
+        json_decode_descend(l, json, 1);
+        json_next_token(json, token);
+        while (token->type != T_ARR_END) {
+            json_tape_value(l, json, doc, token);
+            count++;
+
+            json_next_token(json, token);
+            if (token->type == T_ARR_END)
+                break;
+            if (token->type != T_COMMA)
+                json_throw_parse_error(l, json, "comma or array end", token);
+            json_next_token(json, token);
+        }
+        json_decode_ascend(json);
+        break;
+    case T_STRING:
+    case T_NUMBER:
+    case T_BOOLEAN:
+    case T_NULL:
+        break;
+    default:
+        json_throw_parse_error(l, json, "value", token);
+    }
+
+    doc->tape[node].count = count;
+    doc->tape[node].next = doc->length;
+}
+
+/* Returns the length of the text of tape node i: up to the start of the
+ * node following its subtree, or the end of the document. Strings
+ * decoded from the node are never longer */
+static size_t json_doc_extent(json_doc_t *doc, unsigned int i)
+{
+    unsigned int next = doc->tape[i].next;
+
+    if (next < doc->length)
+        return doc->tape[next].offset - doc->tape[i].offset;
+
+    return doc->data_len - doc->tape[i].offset;
+}
+
+/* Prepare to tokenize the document again from the given offset. The
+ * document has already been validated, so the scratch buffer only
+ * needs to hold the text of the node, see json_doc_extent(). The
+ * caller reserves it */
+static void json_doc_parser(json_parse_t *json, json_doc_t *doc,
+                            unsigned int offset)
+{
+    json->cfg = doc->cfg;
+    json->data = doc->data;
+    json->ptr = doc->data + offset;
+    json->current_depth = 0;
+    json->key_cache = 0;
+    json->line = 0;
+    json->offset = 0;
+}
+
+/* Push the value of tape node i: scalars are converted, containers are
+ * represented by a proxy. doc_index is the stack index of the document */
+static void json_doc_push(lua_State *l, int doc_index, unsigned int i)
+{
+    json_doc_t *doc = lua_touserdata(l, doc_index);
+    json_proxy_t *proxy;
+    json_parse_t json;
+    json_token_t token;
+
+    if (doc->tape[i].type != T_OBJ_BEGIN && doc->tape[i].type != T_ARR_BEGIN) {
+        json_doc_parser(&json, doc, doc->tape[i].offset);
+        lua_getiuservalue(l, doc_index, 3);
+        json_parse_buffer(l, &json, json_doc_extent(doc, i));
+        json_next_token(&json, &token);
+        json_process_value(l, &json, &token);
+        json_parse_done(l, &json);
+        return;
+    }
+
+    /* Reuse the proxy for this node while it is still referenced */
+    lua_getiuservalue(l, doc_index, 2);
+    if (lua_rawgeti(l, -1, i) == LUA_TUSERDATA) {
+        lua_remove(l, -2);
+        return;
+    }
+    lua_pop(l, 1);
+
+    proxy = lua_newuserdatauv(l, sizeof(*proxy), 1);
+    proxy->doc = doc;
+    proxy->index = i;
+    proxy->last_pos = 0;
+    proxy->last_node = 0;
+    luaL_setmetatable(l, JSON_PROXY_MT);
+    lua_pushvalue(l, doc_index);
+    lua_setiuservalue(l, -2, 1);
+
+    lua_pushvalue(l, -1);
+    lua_rawseti(l, -3, i);
+    lua_remove(l, -2);
+}
+
+/* Returns whether the key at tape node i is equal to key */
+static int json_doc_key_equals(json_doc_t *doc, unsigned int i,
+                               const char *key, size_t len)
+{
+    const char *p = doc->data + doc->tape[i].offset + 1;
+    json_parse_t json;
+    json_token_t token;
+    size_t k;
+    int equal;
+
+    /* Compare the source text directly until an escape is found */
+    for (k = 0; p[k] != '\\'; k++) {
+        if (p[k] == '"')
+            return k == len;
+        if (k >= len || p[k] != key[k])
+            return 0;
+    }
+
+    /* Tokenizing a validated key cannot raise errors */
+    json_doc_parser(&json, doc, doc->tape[i].offset);
+    json_reserve_decode_buffer(&json, json_doc_extent(doc, i));
+    json_next_token(&json, &token);
+    equal = token.string_len == len &&
+            !memcmp(token.value.string, key, len);
+    json_release_decode_buffer(json.cfg);
+
+    return equal;
+}
+
+/* Returns the tape index of the value of member key in the object at
+ * tape node i, or 0 if there is no such member */
+static unsigned int json_doc_member(json_doc_t *doc, unsigned int i,
+                                    const char *key, size_t len)
+{
+    unsigned int count = doc->tape[i].count;
+    unsigned int k;
+
+    for (i++, k = 0; k < count; k++) {
+        if (json_doc_key_equals(doc, i, key, len))
+            return i + 1;
+        i = doc->tape[i + 1].next;
+    }
+
+    return 0;
+}
+
+/* Returns the tape index of element pos (1 based) of the proxied array */
+static unsigned int json_proxy_element(json_proxy_t *proxy, unsigned int pos)
+{
+    json_node_t *tape = proxy->doc->tape;
+    unsigned int i, k;
+
+    /* Sequential access continues from the previous element */
+    if (proxy->last_pos && proxy->last_pos <= pos) {
+        k = proxy->last_pos;
+        i = proxy->last_node;
+    } else {
+        k = 1;
+        i = proxy->index + 1;
+    }
+    for (; k < pos; k++)
+        i = tape[i].next;
+
+    proxy->last_pos = pos;
+    proxy->last_node = i;
+
+    return i;
+}
+
+/* Resolves a JSON Pointer relative to tape node i.
+ * Returns the tape index of the value, or 0 if it does not exist */
+static unsigned int json_doc_resolve(lua_State *l, json_doc_t *doc,
+                                     unsigned int i, const char *ptr)
+{
+    lua_Integer index;
+    size_t len;
+    char *seg;
+    int ret;
+
+    seg = lua_newuserdatauv(l, strlen(ptr) + 1, 0);
+    while ((ret = json_pointer_next(&ptr, seg, &len)) > 0) {
+        if (doc->tape[i].type == T_OBJ_BEGIN) {
+            i = json_doc_member(doc, i, seg, len);
+        } else if (doc->tape[i].type == T_ARR_BEGIN) {
+            index = json_pointer_index(seg, len);
+            if (index < 0 || index >= doc->tape[i].count)
+                i = 0;
+            else
+                for (i++; index > 0; index--)
+                    i = doc->tape[i].next;
+        } else {
+            i = 0;
+        }
+        if (i == 0)
+            break;
+    }
+    if (ret < 0)
+        luaL_error(l, "Invalid JSON pointer");
+    lua_pop(l, 1);
+
+    return i;
+}
+
+static int json_proxy_index(lua_State *l)
+{
+    json_proxy_t *proxy = luaL_checkudata(l, 1, JSON_PROXY_MT);
+    json_doc_t *doc = proxy->doc;
+    json_node_t *node = &doc->tape[proxy->index];
+    const char *key;
+    unsigned int i;
+    size_t len;
+
+    lua_settop(l, 2);
+
+    /* Methods take precedence over object members; members with the
+     * same name remain reachable through node:decode("/name") */
+    lua_pushvalue(l, 2);
+    if (lua_rawget(l, lua_upvalueindex(1)) != LUA_TNIL)
+        return 1;
+    lua_getiuservalue(l, 1, 1);
+
+    if (node->type == T_ARR_BEGIN && lua_isinteger(l, 2)) {
+        lua_Integer pos = lua_tointeger(l, 2);
+
+        if (pos < 1 || pos > node->count)
+            return 0;
+        json_doc_push(l, 4, json_proxy_element(proxy, pos));
+        return 1;
+    }
+
+    if (node->type == T_OBJ_BEGIN && lua_type(l, 2) == LUA_TSTRING) {
+        key = lua_tolstring(l, 2, &len);
+        i = json_doc_member(doc, proxy->index, key, len);
+        if (i) {
+            json_doc_push(l, 4, i);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int json_proxy_len(lua_State *l)
+{
+    json_proxy_t *proxy = luaL_checkudata(l, 1, JSON_PROXY_MT);
+
+    lua_pushinteger(l, proxy->doc->tape[proxy->index].count);
+
+    return 1;
+}
+
+/* Iterator for __pairs. Upvalues: proxy, elements visited, tape index
+ * of the next element */
+static int json_proxy_next(lua_State *l)
+{
+    json_proxy_t *proxy = lua_touserdata(l, lua_upvalueindex(1));
+    json_node_t *tape = proxy->doc->tape;
+    lua_Integer k = lua_tointeger(l, lua_upvalueindex(2));
+    unsigned int i = lua_tointeger(l, lua_upvalueindex(3));
+    int doc_index;
+
+    if (k >= tape[proxy->index].count)
+        return 0;
+
+    lua_getiuservalue(l, lua_upvalueindex(1), 1);
+    doc_index = lua_gettop(l);
+
+    if (tape[proxy->index].type == T_ARR_BEGIN) {
+        lua_pushinteger(l, k + 1);
+        json_doc_push(l, doc_index, i);
+        i = tape[i].next;
+    } else {
+        json_doc_push(l, doc_index, i);
+        json_doc_push(l, doc_index, i + 1);
+        i = tape[i + 1].next;
+    }
+
+    lua_pushinteger(l, k + 1);
+    lua_replace(l, lua_upvalueindex(2));
+    lua_pushinteger(l, i);
+    lua_replace(l, lua_upvalueindex(3));
+
+    return 2;
+}
+
+static int json_proxy_pairs(lua_State *l)
+{
+    json_proxy_t *proxy = luaL_checkudata(l, 1, JSON_PROXY_MT);
+
+    lua_pushvalue(l, 1);
+    lua_pushinteger(l, 0);
+    lua_pushinteger(l, proxy->index + 1);
+    lua_pushcclosure(l, json_proxy_next, 3);
+    lua_pushvalue(l, 1);
+    lua_pushnil(l);
+
+    return 3;
+}
+
+/* node:decode([pointer]) converts the node, or the value the pointer
+ * refers to, into plain Lua values */
+static int json_proxy_decode(lua_State *l)
+{
+    json_proxy_t *proxy = luaL_checkudata(l, 1, JSON_PROXY_MT);
+    json_doc_t *doc = proxy->doc;
+    json_parse_t json;
+    json_token_t token;
+    unsigned int i;
+
+    i = proxy->index;
+    if (!lua_isnoneornil(l, 2)) {
+        i = json_doc_resolve(l, doc, i, luaL_checkstring(l, 2));
+        if (i == 0)
+            return 0;
+    }
+
+    lua_getiuservalue(l, 1, 1);
+    json_doc_parser(&json, doc, doc->tape[i].offset);
+    lua_getiuservalue(l, -1, 3);
+    json_parse_buffer(l, &json, json_doc_extent(doc, i));
+    json_next_token(&json, &token);
+    json_process_value(l, &json, &token);
+    json_parse_done(l, &json);
+
+    return 1;
+}
+
+static void json_create_doc_metatables(lua_State *l)
+{
+    static const luaL_Reg methods[] = {
+        { "decode", json_proxy_decode },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, JSON_DOC_MT)) {
+        lua_pushcfunction(l, json_doc_gc);
+        lua_setfield(l, -2, "__gc");
+    }
+    lua_pop(l, 1);
+
+    if (luaL_newmetatable(l, JSON_WEAK_MT)) {
+        lua_pushliteral(l, "v");
+        lua_setfield(l, -2, "__mode");
+    }
+    lua_pop(l, 1);
+
+    if (luaL_newmetatable(l, JSON_PROXY_MT)) {
+        luaL_newlib(l, methods);
+        lua_pushcclosure(l, json_proxy_index, 1);
+        lua_setfield(l, -2, "__index");
+        lua_pushcfunction(l, json_proxy_len);
+        lua_setfield(l, -2, "__len");
+        lua_pushcfunction(l, json_proxy_pairs);
+        lua_setfield(l, -2, "__pairs");
+    }
+    lua_pop(l, 1);
+}
+
+static int json_parse(lua_State *l)
+{
+    json_parse_t json;
+    json_token_t token;
+    json_doc_t *doc;
+    size_t json_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+
+    json.cfg = json_fetch_config(l);
+    json.data = luaL_checklstring(l, 1, &json_len);
+    json.current_depth = 0;
+    json.key_cache = 0;
+    json.ptr = json.data;
+    json.line = 0;
+    json.offset = 0;
+
+    luaL_argcheck(l, json_len < UINT_MAX, 1, "document too large");
+    if (json_len >= 2 && (!json.data[0] || !json.data[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+
+    /* Document: user values are the source text, the proxy cache
+     * and the config */
+    doc = lua_newuserdatauv(l, sizeof(*doc), 3);
+    doc->tape = NULL;
+    doc->length = 0;
+    doc->size = 0;
+    doc->data = json.data;
+    doc->data_len = json_len;
+    doc->cfg = json.cfg;
+    json_create_doc_metatables(l);
+    luaL_setmetatable(l, JSON_DOC_MT);
+    lua_pushvalue(l, 1);
+    lua_setiuservalue(l, 2, 1);
+    lua_newtable(l);
+    luaL_setmetatable(l, JSON_WEAK_MT);
+    lua_setiuservalue(l, 2, 2);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_setiuservalue(l, 2, 3);
+
+    lua_pushvalue(l, lua_upvalueindex(1));
+    json_parse_buffer(l, &json, json_len);
+
+    json_next_token(&json, &token);
+    json_tape_value(l, &json, doc, &token);
+
+    json_next_token(&json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, &json, "the end", &token);
+
+    /* Release the unused part of the tape */
+    if (doc->length < doc->size) {
+        json_node_t *tape = realloc(doc->tape, doc->length * sizeof(*tape));
+        if (tape) {
+            doc->tape = tape;
+            doc->size = doc->length;
+        }
+    }
+
+    json_parse_done(l, &json);
+    json_doc_push(l, 2, 0);
+
+    return 1;
+}
+
+/* ===== POINTER EXTRACTION ===== */
+
+/* json.get() and json.extract() walk the document once, converting
+ * only the values the JSON Pointers refer to and skipping everything
+ * else with the tokenizer. Scanning stops as soon as every pointer has
+ * been resolved, so of duplicate object keys the first is used, unlike
+ * json.decode, which keeps the last. */
+typedef struct {
+    const char *next;       /* Unparsed remainder of the pointer */
+    char *seg;              /* Reference token for the next level */
+    size_t seg_len;
+    lua_Integer seg_index;  /* seg as an array index, or -1 */
+    int has_seg;            /* 0 once every token has been matched */
+    int depth;              /* Reference tokens matched so far */
+    int done;
+} json_path_t;
+
+typedef struct {
+    json_path_t *paths;
+    int count;
+    int pending;            /* Paths not resolved yet */
+    int keys;               /* Stack index of the result keys, or 0 */
+    int result;             /* Stack index of the result table or slot */
+} json_extract_t;
+
+static void json_path_advance(lua_State *l, json_path_t *path)
+{
+    path->has_seg = json_pointer_next(&path->next, path->seg, &path->seg_len);
+    if (path->has_seg < 0)
+        luaL_error(l, "Invalid JSON pointer");
+    path->seg_index = path->has_seg ?
+                      json_pointer_index(path->seg, path->seg_len) : -1;
+}
+
+/* seg must be large enough to hold the whole pointer */
+static void json_path_init(lua_State *l, json_path_t *path, const char *ptr,
+                           char *seg)
+{
+    size_t len;
+    int ret;
+
+    /* Reject invalid pointers before scanning */
+    path->next = ptr;
+    while ((ret = json_pointer_next(&path->next, seg, &len)) > 0)
+        ;
+    if (ret < 0)
+        luaL_error(l, "Invalid JSON pointer '%s'", ptr);
+
+    path->next = ptr;
+    path->seg = seg;
+    path->depth = 0;
+    path->done = 0;
+    json_path_advance(l, path);
+}
+
+/* Stores the value on the top of the stack as the result of path i,
+ * following any reference tokens left through the converted value */
+static void json_extract_store(lua_State *l, json_extract_t *ex, int i)
+{
+    json_path_t *path = &ex->paths[i];
+
+    while (path->has_seg) {
+        if (lua_type(l, -1) != LUA_TTABLE) {
+            lua_pop(l, 1);
+            lua_pushnil(l);
+            break;
+        }
+        lua_pushlstring(l, path->seg, path->seg_len);
+        if (lua_rawget(l, -2) == LUA_TNIL && path->seg_index >= 0) {
+            lua_pop(l, 1);
+            lua_rawgeti(l, -1, path->seg_index + 1);
+        }
+        lua_remove(l, -2);
+        json_path_advance(l, path);
+    }
+
+    if (ex->keys) {
+        lua_rawgeti(l, ex->keys, i + 1);
+        lua_insert(l, -2);
+        lua_rawset(l, ex->result);
+    } else {
+        lua_replace(l, ex->result);
+    }
+
+    path->done = 1;
+    ex->pending--;
+}
+
+/* Marks paths that matched at least depth reference tokens as done;
+ * the values they refer to do not exist */
+static void json_extract_finish(json_extract_t *ex, int depth)
+{
+    int i;
+
+    for (i = 0; i < ex->count; i++) {
+        if (!ex->paths[i].done && ex->paths[i].depth >= depth) {
+            ex->paths[i].done = 1;
+            ex->pending--;
+        }
+    }
+}
+
+/* Walks the value beginning with token, which the paths at the given
+ * depth have reached. Returns 1 once every path has been resolved */
+static int json_extract_value(lua_State *l, json_parse_t *json,
+                              json_token_t *token, json_extract_t *ex,
+                              int depth)
+{
+    json_path_t *paths = ex->paths;
+    json_token_type_t end;
+    lua_Integer index;
+    int i, matched, ending;
+
+    ending = 0;
+    for (i = 0; i < ex->count; i++) {
+        if (!paths[i].done && paths[i].depth == depth && !paths[i].has_seg)
+            ending = 1;
+    }
+
+    /* Convert the value if a path ends here. Paths continuing below it
+     * are resolved through the converted value */
+    if (ending) {
+        json_process_value(l, json, token);
+        for (i = 0; i < ex->count; i++) {
+            if (!paths[i].done && paths[i].depth == depth) {
+                lua_pushvalue(l, -1);
+                json_extract_store(l, ex, i);
+            }
+        }
+        lua_pop(l, 1);
+        return ex->pending == 0;
+    }
+
+    if (token->type == T_OBJ_BEGIN) {
+        end = T_OBJ_END;
+    } else if (token->type == T_ARR_BEGIN) {
+        end = T_ARR_END;
+    } else {
+        /* Scalars contain nothing the paths could refer to */
+        json_skip(l, json, token);
+        json_extract_finish(ex, depth);
+        return ex->pending == 0;
+    }
+
+    json_decode_descend(l, json, 2);
+
+    json_next_token(json, token);
+    /* Only an empty container can end before its first element */
+    for (index = 0; token->type != end || index > 0; index++) {
+        matched = 0;
+        if (end == T_OBJ_END) {
+            if (token->type != T_STRING)
+                json_throw_parse_error(l, json, "object key string", token);
+            for (i = 0; i < ex->count; i++) {
+                if (!paths[i].done && paths[i].depth == depth &&
+                    paths[i].seg_len == token->string_len &&
+                    !memcmp(paths[i].seg, token->value.string,
+                            paths[i].seg_len)) {
+                    paths[i].depth++;
+                    json_path_advance(l, &paths[i]);
+                    matched = 1;
+                }
+            }
+
+            json_next_token(json, token);
+            if (token->type != T_COLON)
+                json_throw_parse_error(l, json, "colon", token);
+            json_next_token(json, token);
+        } else {
+            for (i = 0; i < ex->count; i++) {
+                if (!paths[i].done && paths[i].depth == depth &&
+                    paths[i].seg_index == index) {
+                    paths[i].depth++;
+                    json_path_advance(l, &paths[i]);
+                    matched = 1;
+                }
+            }
+        }
+
+        if (matched) {
+            if (json_extract_value(l, json, token, ex, depth + 1))
+                return 1;
+            json_extract_finish(ex, depth + 1);
+        } else {
+            json_skip(l, json, token);
+        }
+
+        json_next_token(json, token);
+        if (token->type == end)
+            break;
+        if (token->type != T_COMMA)
+            json_throw_parse_error(l, json, end == T_OBJ_END ?
+                                   "comma or object end" : "comma or array end",
+                                   token);
+        json_next_token(json, token);
+    }
+
+    json_decode_ascend(json);
+    json_extract_finish(ex, depth);
+
+    return ex->pending == 0;
+}
+
+static void json_extract_run(lua_State *l, json_parse_t *json,
+                             json_extract_t *ex)
+{
+    json_token_t token;
+
+    json_next_token(json, &token);
+    if (json_extract_value(l, json, &token, ex, 0) && json->current_depth > 0)
+        return;
+
+    /* The whole document was scanned; ensure nothing follows it */
+    json_next_token(json, &token);
+    if (token.type != T_END)
+        json_throw_parse_error(l, json, "the end", &token);
+}
+
+static void json_extract_init(lua_State *l, json_parse_t *json, int lindex)
+{
+    size_t json_len;
+
+    json->cfg = json_fetch_config(l);
+    json->data = luaL_checklstring(l, lindex, &json_len);
+    json->current_depth = 0;
+    json->key_cache = 0;
+    json->ptr = json->data;
+    json->line = 0;
+    json->offset = 0;
+
+    if (json_len >= 2 && (!json->data[0] || !json->data[1]))
+        luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
+
+    lua_pushvalue(l, lua_upvalueindex(1));
+    json_parse_buffer(l, json, json_len);
+}
+
+static int json_get(lua_State *l)
+{
+    json_extract_t ex;
+    json_path_t path;
+    json_parse_t json;
+    const char *ptr;
+    size_t ptr_len;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+
+    ptr = luaL_checklstring(l, 2, &ptr_len);
+
+    lua_pushnil(l);
+    json_path_init(l, &path, ptr, lua_newuserdatauv(l, ptr_len + 1, 0));
+    json_extract_init(l, &json, 1);
+
+    ex.paths = &path;
+    ex.count = 1;
+    ex.pending = 1;
+    ex.keys = 0;
+    ex.result = 3;
+    json_extract_run(l, &json, &ex);
+    json_parse_done(l, &json);
+
+    lua_settop(l, 3);
+
+    return 1;
+}
+
+static int json_extract(lua_State *l)
+{
+    json_extract_t ex;
+    json_parse_t json;
+    json_path_t *paths;
+    const char *ptr;
+    size_t len, total;
+    char *seg;
+    int i, count;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 2 arguments");
+    luaL_checktype(l, 2, LUA_TTABLE);
+
+    /* Collect the result keys; their pointers stay anchored by the
+     * paths table */
+    lua_newtable(l);
+    count = 0;
+    total = 0;
+    lua_pushnil(l);
+    while (lua_next(l, 2) != 0) {
+        luaL_argcheck(l, lua_type(l, -1) == LUA_TSTRING, 2,
+                      "paths must be strings");
+        total += lua_rawlen(l, -1) + 1;
+        lua_pop(l, 1);
+        lua_pushvalue(l, -1);
+        lua_rawseti(l, 3, ++count);
+    }
+
+    paths = lua_newuserdatauv(l, count * sizeof(*paths) + total, 0);
+    seg = (char *)(paths + count);
+    for (i = 0; i < count; i++) {
+        lua_rawgeti(l, 3, i + 1);
+        lua_rawget(l, 2);
+        ptr = lua_tolstring(l, -1, &len);
+        json_path_init(l, &paths[i], ptr, seg);
+        seg += len + 1;
+        lua_pop(l, 1);
+    }
+
+    lua_createtable(l, 0, count);
+
+    json_extract_init(l, &json, 1);
+    ex.paths = paths;
+    ex.count = count;
+    ex.pending = count;
+    ex.keys = 3;
+    ex.result = 5;
+    if (count > 0)
+        json_extract_run(l, &json, &ex);
+    json_parse_done(l, &json);
+
+    return 1;
+}
+
+/* ===== VALIDATION ===== */
+
+static void json_push_stats(lua_State *l, json_stats_t *stats)
+{
+    lua_createtable(l, 0, 9);
+    lua_pushinteger(l, stats->depth);
+    lua_setfield(l, -2, "depth");
+    lua_pushinteger(l, stats->objects);
+    lua_setfield(l, -2, "objects");
+    lua_pushinteger(l, stats->arrays);
+    lua_setfield(l, -2, "arrays");
+    lua_pushinteger(l, stats->keys);
+    lua_setfield(l, -2, "keys");
+    lua_pushinteger(l, stats->strings);
+    lua_setfield(l, -2, "strings");
+    lua_pushinteger(l, stats->numbers);
+    lua_setfield(l, -2, "numbers");
+    lua_pushinteger(l, stats->booleans);
+    lua_setfield(l, -2, "booleans");
+    lua_pushinteger(l, stats->nulls);
+    lua_setfield(l, -2, "nulls");
+    lua_pushinteger(l, stats->string_bytes);
+    lua_setfield(l, -2, "string_bytes");
+}
+
+/* json.validate(str [, options]) checks str without building any Lua
+ * values. options may override max_depth and invalid_numbers for this
+ * call, and request statistics with stats = true */
+static int json_validate(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_stats_t stats;
+    json_parse_t json;
+    json_token_t token;
+    const char *exp;
+    size_t json_len;
+    int max_depth, invalid_numbers, want_stats;
+    int saved_max_depth, saved_invalid_numbers;
+    int ret, index;
+
+    json.data = luaL_checklstring(l, 1, &json_len);
+
+    max_depth = cfg->decode_max_depth;
+    invalid_numbers = cfg->decode_invalid_numbers;
+    want_stats = 0;
+    if (!lua_isnoneornil(l, 2)) {
+        luaL_checktype(l, 2, LUA_TTABLE);
+        if (lua_getfield(l, 2, "max_depth") != LUA_TNIL) {
+            max_depth = luaL_checkinteger(l, -1);
+            luaL_argcheck(l, max_depth >= 1, 2, "max_depth must be positive");
+        }
+        if (lua_getfield(l, 2, "invalid_numbers") != LUA_TNIL)
+            invalid_numbers = lua_toboolean(l, -1);
+        lua_getfield(l, 2, "stats");
+        want_stats = lua_toboolean(l, -1);
+        lua_pop(l, 3);
+    }
+
+    if (json_len >= 2 && (!json.data[0] || !json.data[1])) {
+        luaL_pushfail(l);
+        lua_pushliteral(l, "JSON parser does not support UTF-16 or UTF-32");
+        lua_pushinteger(l, 0);
+        return 3;
+    }
+
+    json.cfg = cfg;
+    json.ptr = json.data;
+    json.current_depth = 0;
+    json.key_cache = 0;
+    json.line = 0;
+    json.offset = 0;
+    json.tmp = NULL;    /* Strings are checked, not stored */
+    memset(&stats, 0, sizeof(stats));
+
+    /* Nothing below can throw, so the overrides are always restored */
+    saved_max_depth = cfg->decode_max_depth;
+    saved_invalid_numbers = cfg->decode_invalid_numbers;
+    cfg->decode_max_depth = max_depth;
+    cfg->decode_invalid_numbers = invalid_numbers;
+
+    json_next_token(&json, &token);
+    ret = json_skip_value(&json, &token, &exp, &stats);
+    if (ret == 0) {
+        json_next_token(&json, &token);
+        if (token.type != T_END) {
+            exp = "the end";
+            ret = -1;
+        }
+    }
+
+    cfg->decode_max_depth = saved_max_depth;
+    cfg->decode_invalid_numbers = saved_invalid_numbers;
+
+    if (ret != 0) {
+        luaL_pushfail(l);
+        if (ret == JSON_SKIP_DEPTH) {
+            json_push_depth_error(l, &json);
+            index = json.ptr - json.data;
+        } else {
+            json_push_parse_error(l, &json, exp, &token);
+            index = token.index;
+        }
+        lua_pushinteger(l, index);
+        return 3;
+    }
+
+    lua_pushboolean(l, 1);
+    if (!want_stats)
+        return 1;
+    json_push_stats(l, &stats);
+
+    return 2;
+}
+
+/* ===== COMPILED CODECS ===== */
+
+/* json.compile() builds a codec for objects of a fixed shape. Each
+ * field has its key pre-interned for lua_rawget()/lua_rawset() and
+ * pre-escaped for output. Values that do not have the declared type
+ * are handled by the generic encoder and decoder. */
+typedef enum {
+    JSON_FIELD_ANY,
+    JSON_FIELD_STRING,
+    JSON_FIELD_NUMBER,
+    JSON_FIELD_INTEGER,
+    JSON_FIELD_BOOLEAN,
+    JSON_FIELD_OBJECT,          /* Object described by a nested codec */
+    JSON_FIELD_ARRAY            /* Array of nested codec objects */
+} json_field_type_t;
+
+struct json_codec;
+
+typedef struct {
+    const char *name;           /* Anchored by the key table */
+    size_t name_len;
+    const char *key;            /* "name": escaped, anchored likewise */
+    size_t key_len;
+    json_field_type_t type;
+    int optional;               /* Omitted from the output when nil */
+    struct json_codec *codec;   /* Nested codec, anchored likewise */
+} json_field_t;
+
+/* The codec's first user value is its key table, holding the field
+ * names at [1..n], the escaped keys at [n+1..2n] and nested codecs at
+ * [2n+1..3n]. The second is the config */
+typedef struct json_codec {
+    int nfields;
+    json_field_t field[];
+} json_codec_t;
+
+#define JSON_CODEC_MT   "cjson.codec"
+
+static void json_codec_append(lua_State *l, json_config_t *cfg,
+                              json_codec_t *codec, int current_depth,
+                              strbuf_t *json);
+
+/* Appends the value on the top of the stack, which the field declares
+ * to be of type codec, with the nested key table below it */
+static void json_codec_append_nested(lua_State *l, json_config_t *cfg,
+                                     json_field_t *f, int current_depth,
+                                     strbuf_t *json)
+{
+    int i, n;
+
+    if (f->type == JSON_FIELD_OBJECT) {
+        json_codec_append(l, cfg, f->codec, current_depth, json);
+        return;
+    }
+
+    current_depth++;
+    json_check_encode_depth(l, cfg, current_depth, json);
+
+    n = lua_rawlen(l, -1);
+    strbuf_append_char(json, '[');
+    for (i = 1; i <= n; i++) {
+        if (i > 1)
+            strbuf_append_char(json, ',');
+        lua_pushvalue(l, -2);
+        lua_rawgeti(l, -2, i);
+        json_codec_append(l, cfg, f->codec, current_depth, json);
+        lua_pop(l, 2);
+    }
+    strbuf_append_char(json, ']');
+}
+
+/* Encodes the value on the top of the stack with the codec's key table
+ * below it. Fields are emitted in schema order */
+static void json_codec_append(lua_State *l, json_config_t *cfg,
+                              json_codec_t *codec, int current_depth,
+                              strbuf_t *json)
+{
+    json_field_t *f;
+    size_t json_pos;
+    int comma, i, type, err;
+
+    if (!lua_istable(l, -1)) {
+        json_append_data(l, cfg, current_depth, json);
+        return;
+    }
+
+    current_depth++;
+    json_check_encode_depth(l, cfg, current_depth, json);
+    luaL_checkstack(l, 6, NULL);
+
+    strbuf_append_char(json, '{');
+    comma = 0;
+    for (i = 0; i < codec->nfields; i++) {
+        f = &codec->field[i];
+
+        /* keys, table, value */
+        lua_rawgeti(l, -2, i + 1);
+        type = lua_rawget(l, -2);
+        if (type == LUA_TNIL && f->optional) {
+            lua_pop(l, 1);
+            continue;
+        }
+
+        json_pos = strbuf_length(json);
+        if (comma++ > 0)
+            strbuf_append_char(json, ',');
+        strbuf_append_mem(json, f->key, f->key_len);
+
+        err = 0;
+        if (f->type == JSON_FIELD_STRING && type == LUA_TSTRING) {
+            json_append_string(l, cfg, json, -1);
+        } else if ((f->type == JSON_FIELD_NUMBER ||
+                    f->type == JSON_FIELD_INTEGER) && type == LUA_TNUMBER) {
+            json_append_number(l, cfg, json, -1);
+        } else if (f->type == JSON_FIELD_BOOLEAN && type == LUA_TBOOLEAN) {
+            if (lua_toboolean(l, -1))
+                strbuf_append_mem(json, "true", 4);
+            else
+                strbuf_append_mem(json, "false", 5);
+        } else if (f->codec && type == LUA_TTABLE) {
+            /* keys, table, value, nested codec, nested keys, value */
+            lua_rawgeti(l, -3, 2 * codec->nfields + i + 1);
+            lua_getiuservalue(l, -1, 1);
+            lua_pushvalue(l, -3);
+            json_codec_append_nested(l, cfg, f, current_depth, json);
+            lua_pop(l, 3);
+        } else {
+            err = json_append_data(l, cfg, current_depth, json);
+        }
+
+        if (err) {
+            strbuf_set_length(json, json_pos);
+            if (comma == 1)
+                comma = 0;
+        }
+        lua_pop(l, 1);
+    }
+    strbuf_append_char(json, '}');
+}
+
+static void json_codec_object(lua_State *l, json_parse_t *json,
+                              json_token_t *token, json_codec_t *codec);
+
+/* Decodes an array of nested codec objects, with the nested key table
+ * on the top of the stack */
+static void json_codec_array(lua_State *l, json_parse_t *json,
+                             json_token_t *token, json_codec_t *codec)
+{
+    int i;
 
-    /* 3 slots required:
-     * .., table, key, value */
+    if (token->type != T_ARR_BEGIN) {
+        json_process_value(l, json, token);
+        return;
+    }
+
+    /* keys, table, keys, value */
     json_decode_descend(l, json, 3);
 
     lua_newtable(l);
+    if (json->cfg->decode_array_with_array_mt) {
+        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
+        lua_rawget(l, LUA_REGISTRYINDEX);
+        lua_setmetatable(l, -2);
+    }
 
-    json_next_token(json, &token);
-
-    /* Handle empty objects */
-    if (token.type == T_OBJ_END) {
+    json_next_token(json, token);
+    if (token->type == T_ARR_END) {
         json_decode_ascend(json);
         return;
     }
 
-    while (1) {
-        if (token.type != T_STRING)
-            json_throw_parse_error(l, json, "object key string", &token);
-
-        /* Push key */
-        lua_pushlstring(l, token.value.string, token.string_len);
-
-        json_next_token(json, &token);
-        if (token.type != T_COLON)
-            json_throw_parse_error(l, json, "colon", &token);
-
-        /* Fetch value */
-        json_next_token(json, &token);
-        json_process_value(l, json, &token);
-
-        /* Set key = value */
-        lua_rawset(l, -3);
-
-        json_next_token(json, &token);
+    for (i = 1; ; i++) {
+        lua_pushvalue(l, -2);
+        json_codec_object(l, json, token, codec);
+        lua_remove(l, -2);
+        lua_rawseti(l, -2, i);
 
-        if (token.type == T_OBJ_END) {
+        json_next_token(json, token);
+        if (token->type == T_ARR_END) {
             json_decode_ascend(json);
             return;
         }
+        if (token->type != T_COMMA)
+            json_throw_parse_error(l, json, "comma or array end", token);
 
-        if (token.type != T_COMMA)
-            json_throw_parse_error(l, json, "comma or object end", &token);
-
-        json_next_token(json, &token);
+        json_next_token(json, token);
     }
 }
 
-/* Handle the array context */
-static void json_parse_array_context(lua_State *l, json_parse_t *json)
+/* Returns the index of the field named by the key token, trying the
+ * field after the previous match first, or -1 */
+static int json_codec_field(json_codec_t *codec, json_token_t *token,
+                            int expect)
 {
-    json_token_t token;
-    int i;
+    json_field_t *f;
+    int i, n;
+
+    for (n = 0; n < codec->nfields; n++) {
+        i = (expect + n) % codec->nfields;
+        f = &codec->field[i];
+        if (f->name_len == token->string_len &&
+            !memcmp(f->name, token->value.string, f->name_len))
+            return i;
+    }
 
-    /* 2 slots required:
-     * .., table, value */
-    json_decode_descend(l, json, 2);
+    return -1;
+}
 
-    lua_newtable(l);
+/* Decodes the value beginning with token as an object described by the
+ * codec, whose key table is on the top of the stack */
+static void json_codec_object(lua_State *l, json_parse_t *json,
+                              json_token_t *token, json_codec_t *codec)
+{
+    json_field_t *f;
+    lua_Integer n;
+    int i, expect;
 
-    /* set array_mt on the table at the top of the stack */
-    if (json->cfg->decode_array_with_array_mt) {
-        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
-        lua_rawget(l, LUA_REGISTRYINDEX);
-        lua_setmetatable(l, -2);
+    if (token->type != T_OBJ_BEGIN) {
+        json_process_value(l, json, token);
+        return;
     }
 
-    json_next_token(json, &token);
+    /* keys, table, key, nested keys, value */
+    json_decode_descend(l, json, 5);
 
-    /* Handle empty arrays */
-    if (token.type == T_ARR_END) {
+    lua_createtable(l, 0, codec->nfields);
+
+    json_next_token(json, token);
+    if (token->type == T_OBJ_END) {
         json_decode_ascend(json);
         return;
     }
 
-    for (i = 1; ; i++) {
-        json_process_value(l, json, &token);
-        lua_rawseti(l, -2, i);            /* arr[i] = value */
+    expect = 0;
+    while (1) {
+        if (token->type != T_STRING)
+            json_throw_parse_error(l, json, "object key string", token);
+
+        i = codec->nfields > 0 ? json_codec_field(codec, token, expect) : -1;
+        if (i >= 0) {
+            f = &codec->field[i];
+            lua_rawgeti(l, -2, i + 1);
+            expect = i + 1;
+        } else {
+            f = NULL;
+            lua_pushlstring(l, token->value.string, token->string_len);
+        }
 
-        json_next_token(json, &token);
+        json_next_token(json, token);
+        if (token->type != T_COLON)
+            json_throw_parse_error(l, json, "colon", token);
+
+        json_next_token(json, token);
+        if (!f) {
+            json_process_value(l, json, token);
+        } else if (f->type == JSON_FIELD_INTEGER && token->type == T_NUMBER &&
+                   lua_numbertointeger(token->value.number, &n) &&
+                   (lua_Number)n == token->value.number) {
+            lua_pushinteger(l, n);
+        } else if (f->codec) {
+            lua_rawgeti(l, -3, 2 * codec->nfields + i + 1);
+            lua_getiuservalue(l, -1, 1);
+            lua_remove(l, -2);
+            if (f->type == JSON_FIELD_OBJECT)
+                json_codec_object(l, json, token, f->codec);
+            else
+                json_codec_array(l, json, token, f->codec);
+            lua_remove(l, -2);
+        } else {
+            json_process_value(l, json, token);
+        }
+
+        lua_rawset(l, -3);
 
-        if (token.type == T_ARR_END) {
+        json_next_token(json, token);
+        if (token->type == T_OBJ_END) {
             json_decode_ascend(json);
             return;
         }
+        if (token->type != T_COMMA)
+            json_throw_parse_error(l, json, "comma or object end", token);
 
-        if (token.type != T_COMMA)
-            json_throw_parse_error(l, json, "comma or array end", &token);
-
-        json_next_token(json, &token);
+        json_next_token(json, token);
     }
 }
 
-/* Handle the "value" context */
-static void json_process_value(lua_State *l, json_parse_t *json,
-                               json_token_t *token)
+static int json_codec_encode(lua_State *l)
 {
-    switch (token->type) {
-    case T_STRING:
-        lua_pushlstring(l, token->value.string, token->string_len);
-        break;;
-    case T_NUMBER:
-        lua_pushnumber(l, token->value.number);
-        break;;
-    case T_BOOLEAN:
-        lua_pushboolean(l, token->value.boolean);
-        break;;
-    case T_OBJ_BEGIN:
-        json_parse_object_context(l, json);
-        break;;
-    case T_ARR_BEGIN:
-        json_parse_array_context(l, json);
-        break;;
-    case T_NULL:
-        /* In Lua, setting "t[k] = nil" will delete k from the table.
-         * Hence a NULL pointer lightuserdata object is used instead */
-        lua_pushlightuserdata(l, NULL);
-        break;;
-    default:
-        json_throw_parse_error(l, json, "value", token);
+    json_codec_t *codec = luaL_checkudata(l, 1, JSON_CODEC_MT);
+    json_config_t *cfg;
+    strbuf_t *buf;
+    const char *json;
+    size_t len;
+
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 1 argument");
+
+    lua_getiuservalue(l, 1, 2);
+    cfg = lua_touserdata(l, -1);
+    lua_pop(l, 1);
+
+    if (cfg->encode_keep_buffer) {
+        buf = json_config_buffer(&cfg->encode_buf);
+    } else {
+        buf = json_new_strbuf(l, 0);
     }
+
+    lua_getiuservalue(l, 1, 1);
+    lua_pushvalue(l, 2);
+    json_codec_append(l, cfg, codec, 0, buf);
+
+    json = strbuf_string(buf, &len);
+    lua_pushlstring(l, json, len);
+
+    return 1;
 }
 
-static int json_decode(lua_State *l)
+static int json_codec_decode(lua_State *l)
 {
+    json_codec_t *codec = luaL_checkudata(l, 1, JSON_CODEC_MT);
     json_parse_t json;
     json_token_t token;
     size_t json_len;
 
-    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    luaL_argcheck(l, lua_gettop(l) == 2, 2, "expected 1 argument");
 
-    json.cfg = json_fetch_config(l);
-    json.data = luaL_checklstring(l, 1, &json_len);
+    lua_getiuservalue(l, 1, 2);
+    json.cfg = lua_touserdata(l, -1);
+    json.data = luaL_checklstring(l, 2, &json_len);
     json.current_depth = 0;
+    json.key_cache = 0;
     json.ptr = json.data;
+    json.line = 0;
+    json.offset = 0;
 
-    /* Detect Unicode other than UTF-8 (see RFC 4627, Sec 3)
-     *
-     * CJSON can support any simple data type, hence only the first
-     * character is guaranteed to be ASCII (at worst: '"'). This is
-     * still enough to detect whether the wrong encoding is in use. */
     if (json_len >= 2 && (!json.data[0] || !json.data[1]))
         luaL_error(l, "JSON parser does not support UTF-16 or UTF-32");
 
-    /* Ensure the temporary buffer can hold the entire string.
-     * This means we no longer need to do length checks since the decoded
-     * string must be smaller than the entire json string */
-    json.tmp = strbuf_new(json_len);
+    lua_getiuservalue(l, 1, 2);
+    json_parse_buffer(l, &json, json_len);
 
+    lua_getiuservalue(l, 1, 1);
     json_next_token(&json, &token);
-    json_process_value(l, &json, &token);
+    json_codec_object(l, &json, &token, codec);
 
-    /* Ensure there is no more input left */
     json_next_token(&json, &token);
-
     if (token.type != T_END)
         json_throw_parse_error(l, &json, "the end", &token);
+    json_parse_done(l, &json);
+
+    return 1;
+}
+
+static json_field_type_t json_codec_type(lua_State *l, int field,
+                                         json_codec_t **nested)
+{
+    static const char *const names[] = {
+        "any", "string", "number", "integer", "boolean", NULL
+    };
+    const char *name;
+    int i;
+
+    *nested = NULL;
+    switch (lua_type(l, -1)) {
+    case LUA_TNIL:
+        return JSON_FIELD_ANY;
+    case LUA_TSTRING:
+        name = lua_tostring(l, -1);
+        for (i = 0; names[i]; i++) {
+            if (streq(name, names[i]))
+                return i;
+        }
+        return luaL_error(l, "field %d: invalid type '%s'", field, name);
+    case LUA_TTABLE:
+        /* {codec} is an array of objects */
+        lua_rawgeti(l, -1, 1);
+        *nested = luaL_testudata(l, -1, JSON_CODEC_MT);
+        lua_pop(l, 1);
+        if (*nested)
+            return JSON_FIELD_ARRAY;
+        break;
+    case LUA_TUSERDATA:
+        *nested = luaL_testudata(l, -1, JSON_CODEC_MT);
+        if (*nested)
+            return JSON_FIELD_OBJECT;
+        break;
+    }
+
+    return luaL_error(l, "field %d: invalid type (a %s value)", field,
+                      luaL_typename(l, -1));
+}
+
+static void json_create_codec_metatable(lua_State *l)
+{
+    static const luaL_Reg methods[] = {
+        { "encode", json_codec_encode },
+        { "decode", json_codec_decode },
+        { NULL, NULL }
+    };
+
+    if (luaL_newmetatable(l, JSON_CODEC_MT)) {
+        luaL_newlib(l, methods);
+        lua_setfield(l, -2, "__index");
+    }
+    lua_pop(l, 1);
+}
+
+/* json.compile({{name, type, optional = bool}, ...}) */
+static int json_compile(lua_State *l)
+{
+    json_config_t *cfg = json_fetch_config(l);
+    json_codec_t *codec;
+    json_field_t *f;
+    strbuf_t *buf;
+    int i, n;
+
+    luaL_argcheck(l, lua_gettop(l) == 1, 1, "expected 1 argument");
+    luaL_checktype(l, 1, LUA_TTABLE);
+
+    n = luaL_len(l, 1);
+    luaL_argcheck(l, n >= 0 && n <= INT_MAX / 3, 1, "too many fields");
+
+    buf = json_new_strbuf(l, 0);
+    codec = lua_newuserdatauv(l, sizeof(*codec) + n * sizeof(json_field_t), 2);
+    codec->nfields = 0;
+    json_create_codec_metatable(l);
+    luaL_setmetatable(l, JSON_CODEC_MT);
+    lua_createtable(l, 3 * n, 0);
+    lua_pushvalue(l, lua_upvalueindex(1));
+    lua_setiuservalue(l, -3, 2);
+
+    /* schema, buf, codec, keys */
+    for (i = 0; i < n; i++) {
+        f = &codec->field[i];
+        if (lua_rawgeti(l, 1, i + 1) != LUA_TTABLE)
+            return luaL_error(l, "field %d: expected a table", i + 1);
+
+        if (lua_rawgeti(l, -1, 1) != LUA_TSTRING)
+            return luaL_error(l, "field %d: name must be a string", i + 1);
+        f->name = lua_tolstring(l, -1, &f->name_len);
+        lua_rawseti(l, -3, i + 1);
+
+        strbuf_reset(buf);
+        lua_rawgeti(l, -2, i + 1);
+        json_append_string(l, cfg, buf, -1);
+        strbuf_append_char(buf, ':');
+        lua_pop(l, 1);
+        lua_pushlstring(l, buf->buf, strbuf_length(buf));
+        f->key = lua_tolstring(l, -1, &f->key_len);
+        lua_rawseti(l, -3, n + i + 1);
+
+        lua_rawgeti(l, -1, 2);
+        f->type = json_codec_type(l, i + 1, &f->codec);
+        if (f->codec) {
+            if (f->type == JSON_FIELD_ARRAY)
+                lua_rawgeti(l, -1, 1);
+            else
+                lua_pushvalue(l, -1);
+            lua_rawseti(l, -4, 2 * n + i + 1);
+        }
+        lua_pop(l, 1);
+
+        lua_getfield(l, -1, "optional");
+        f->optional = lua_toboolean(l, -1);
+        lua_pop(l, 2);
 
-    strbuf_free(json.tmp);
+        codec->nfields = i + 1;
+    }
+
+    lua_setiuservalue(l, -2, 1);
 
     return 1;
 }
@@ -1637,19 +4168,121 @@ static int json_protect_conversion(lua_State *l)
     return luaL_error(l, "Memory allocation error in CJSON protected call");
 }
 
+static void json_create_array_metatables(lua_State *l)
+{
+    /* Test if array metatables are in registry */
+    lua_pushlightuserdata(l, json_lightudata_mask(&json_empty_array));
+    lua_rawget(l, LUA_REGISTRYINDEX);
+    if (lua_isnil(l, -1)) {
+        /* Create array metatables.
+         *
+         * If multiple calls to lua_cjson_new() are made,
+         * this prevents overriding the tables at the given
+         * registry's index with a new one.
+         */
+        lua_pop(l, 1);
+
+        /* empty_array_mt */
+        lua_pushlightuserdata(l, json_lightudata_mask(&json_empty_array));
+        lua_newtable(l);
+        lua_rawset(l, LUA_REGISTRYINDEX);
+
+        /* array_mt */
+        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
+        lua_newtable(l);
+        lua_rawset(l, LUA_REGISTRYINDEX);
+    } else {
+        lua_pop(l, 1);
+    }
+}
+
+/* Key of the config shared with msgpack and cbor */
+static const char json_config_key = 'c';
+
+/* Pushes the config shared by the default json module, msgpack and
+ * cbor, creating it for whichever is opened first */
+void json_push_shared_config(lua_State *l)
+{
+    if (lua_rawgetp(l, LUA_REGISTRYINDEX, &json_config_key) != LUA_TNIL)
+        return;
+    lua_pop(l, 1);
+
+    json_create_array_metatables(l);
+    json_create_config(l);
+    lua_pushvalue(l, -1);
+    lua_rawsetp(l, LUA_REGISTRYINDEX, &json_config_key);
+}
+
+/* Sets the options of the shared config back to their defaults, as
+ * json.config found them */
+void json_reset_shared_config(lua_State *l)
+{
+    json_config_t *cfg;
+
+    if (lua_rawgetp(l, LUA_REGISTRYINDEX, &json_config_key) == LUA_TUSERDATA) {
+        cfg = lua_touserdata(l, -1);
+        json_config_defaults(cfg);
+    }
+    lua_pop(l, 1);
+}
+
+/* Accessors for the binary formats, see lua_cjson.h */
+
+strbuf_t *json_shared_encode_buffer(json_config_t *cfg)
+{
+    if (!cfg->encode_keep_buffer)
+        return NULL;
+    return json_config_buffer(&cfg->encode_buf);
+}
+
+int json_is_empty_array(lua_State *l, int lindex)
+{
+    return lua_touserdata(l, lindex) == json_lightudata_mask(&json_array);
+}
+
+void json_set_array_mt(lua_State *l, json_config_t *cfg)
+{
+    if (cfg->decode_array_with_array_mt) {
+        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
+        lua_rawget(l, LUA_REGISTRYINDEX);
+        lua_setmetatable(l, -2);
+    }
+}
+
+int json_decode_max_depth(json_config_t *cfg)
+{
+    return cfg->decode_max_depth;
+}
+
+int json_encode_skip_unsupported(json_config_t *cfg)
+{
+    return cfg->encode_skip_unsupported_value_types;
+}
+
+static int lua_cjson_new(lua_State *l);
+
 /* Return cjson module table */
-static int lua_cjson_new(lua_State *l)
+static int lua_cjson_create(lua_State *l, int shared)
 {
     luaL_Reg reg[] = {
         { "encode", json_encode },
         { "decode", json_decode },
         { "config", json_config },
+        { "lines", json_lines },
+        { "writelines", json_writelines },
+        { "encodeto", json_encodeto },
+        { "parse", json_parse },
+        { "get", json_get },
+        { "extract", json_extract },
+        { "validate", json_validate },
+        { "compile", json_compile },
         /*
         { "encode_empty_table_as_object", json_cfg_encode_empty_table_as_object },
         { "decode_array_with_array_mt", json_cfg_decode_array_with_array_mt },
         { "encode_sparse_array", json_cfg_encode_sparse_array },
         { "encode_max_depth", json_cfg_encode_max_depth },
         { "decode_max_depth", json_cfg_decode_max_depth },
+        { "decode_keep_buffer", json_cfg_decode_keep_buffer },
         { "encode_number_precision", json_cfg_encode_number_precision },
         { "encode_keep_buffer", json_cfg_encode_keep_buffer },
         { "encode_invalid_numbers", json_cfg_encode_invalid_numbers },
@@ -1664,36 +4297,17 @@ static int lua_cjson_new(lua_State *l)
     /* Initialise number conversions */
     fpconv_init();
 
-    /* Test if array metatables are in registry */
-    lua_pushlightuserdata(l, json_lightudata_mask(&json_empty_array));
-    lua_rawget(l, LUA_REGISTRYINDEX);
-    if (lua_isnil(l, -1)) {
-        /* Create array metatables.
-         *
-         * If multiple calls to lua_cjson_new() are made,
-         * this prevents overriding the tables at the given
-         * registry's index with a new one.
-         */
-        lua_pop(l, 1);
-
-        /* empty_array_mt */
-        lua_pushlightuserdata(l, json_lightudata_mask(&json_empty_array));
-        lua_newtable(l);
-        lua_rawset(l, LUA_REGISTRYINDEX);
-
-        /* array_mt */
-        lua_pushlightuserdata(l, json_lightudata_mask(&json_array));
-        lua_newtable(l);
-        lua_rawset(l, LUA_REGISTRYINDEX);
-    }
+    json_create_array_metatables(l);
 
     /* cjson module table */
     lua_newtable(l);
 
     /* Register functions with config data as upvalue */
-    json_create_config(l);
+    if (shared)
+        json_push_shared_config(l);
+    else
+        json_create_config(l);
     compat_luaL_setfuncs(l, reg, 1);
-
     /* Set cjson.null */
     lua_pushlightuserdata(l, NULL);
     lua_setfield(l, -2, "null");
@@ -1721,6 +4335,11 @@ static int lua_cjson_new(lua_State *l)
     return 1;
 }
 
+static int lua_cjson_new(lua_State *l)
+{
+    return lua_cjson_create(l, 0);
+}
+
 /* Return cjson.safe module table */
 static int lua_cjson_safe_new(lua_State *l)
 {
@@ -1744,7 +4363,7 @@ static int lua_cjson_safe_new(lua_State *l)
 
 int luaopen_cjson(lua_State *l)
 {
-    lua_cjson_new(l);
+    lua_cjson_create(l, 1);
 
 #ifdef ENABLE_CJSON_GLOBAL
     /* Register a global "cjson" table. */
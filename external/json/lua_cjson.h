@@ -0,0 +1,49 @@
+/* Parts of the JSON encoder shared with the MessagePack and CBOR
+ * codecs (pack.c), which follow the table conventions and the config
+ * of the json module. Not installed with the public headers. */
+
+#ifndef LUA_CJSON_H
+#define LUA_CJSON_H
+
+#include <lua/lua.h>
+
+#include "strbuf.h"
+
+typedef struct json_config json_config_t;
+
+/* Returns the config of the running function, its first upvalue */
+json_config_t *json_fetch_config(lua_State *l);
+
+/* Pushes the config shared by the json, msgpack and cbor modules */
+void json_push_shared_config(lua_State *l);
+
+/* Sets the options of the shared config back to their defaults */
+void json_reset_shared_config(lua_State *l);
+
+/* Returns the config's encode buffer, reset, or NULL if the config
+ * does not keep one */
+strbuf_t *json_shared_encode_buffer(json_config_t *cfg);
+
+/* Returns a strbuf owned by a new userdata at the top of the stack */
+strbuf_t *json_new_strbuf(lua_State *l, size_t len);
+
+void json_encode_exception(lua_State *l, json_config_t *cfg,
+                           strbuf_t *json, int lindex, const char *reason);
+void json_check_encode_depth(lua_State *l, json_config_t *cfg,
+                             int current_depth, strbuf_t *json);
+
+/* Returns the number of elements if the table on the top of the stack
+ * is to be encoded as an array, or -1 if it is to be an object */
+int json_table_length(lua_State *l, json_config_t *cfg, strbuf_t *json);
+
+/* Returns 1 if the value at lindex is json.empty_array */
+int json_is_empty_array(lua_State *l, int lindex);
+
+/* Sets array_mt on the table at the top of the stack if the config
+ * decodes arrays with it */
+void json_set_array_mt(lua_State *l, json_config_t *cfg);
+
+int json_decode_max_depth(json_config_t *cfg);
+int json_encode_skip_unsupported(json_config_t *cfg);
+
+#endif
@@ -41,11 +41,11 @@ static void die(const char *fmt, ...)
     exit(-1);
 }
 
-void strbuf_init(strbuf_t *s, int len)
+void strbuf_init(strbuf_t *s, size_t len)
 {
-    int size;
+    size_t size;
 
-    if (len <= 0)
+    if (len == 0)
         size = STRBUF_DEFAULT_SIZE;
     else
         size = len + 1;         /* \0 terminator */
@@ -57,6 +57,8 @@ void strbuf_init(strbuf_t *s, int len)
     s->dynamic = 0;
     s->reallocs = 0;
     s->debug = 0;
+    s->nomem = NULL;
+    s->nomem_ud = NULL;
 
     s->buf = malloc(size);
     if (!s->buf)
@@ -65,7 +67,7 @@ void strbuf_init(strbuf_t *s, int len)
     strbuf_ensure_null(s);
 }
 
-strbuf_t *strbuf_new(int len)
+strbuf_t *strbuf_new(size_t len)
 {
     strbuf_t *s;
 
@@ -94,7 +96,7 @@ void strbuf_set_increment(strbuf_t *s, int increment)
 static inline void debug_stats(strbuf_t *s)
 {
     if (s->debug) {
-        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %d, size: %d\n",
+        fprintf(stderr, "strbuf(%lx) reallocs: %d, length: %zu, size: %zu\n",
                 (long)s, s->reallocs, s->length, s->size);
     }
 }
@@ -113,7 +115,7 @@ void strbuf_free(strbuf_t *s)
         free(s);
 }
 
-char *strbuf_free_to_string(strbuf_t *s, int *len)
+char *strbuf_free_to_string(strbuf_t *s, size_t *len)
 {
     char *buf;
 
@@ -131,11 +133,11 @@ char *strbuf_free_to_string(strbuf_t *s, int *len)
     return buf;
 }
 
-static int calculate_new_size(strbuf_t *s, int len)
+static size_t calculate_new_size(strbuf_t *s, size_t len)
 {
-    int reqsize, newsize;
+    size_t reqsize, newsize;
 
-    if (len <= 0)
+    if (len == 0 || len == (size_t)-1)
         die("BUG: Invalid strbuf length requested");
 
     /* Ensure there is room for optional NULL termination */
@@ -148,11 +150,14 @@ static int calculate_new_size(strbuf_t *s, int len)
     newsize = s->size;
     if (s->increment < 0) {
         /* Exponential sizing */
-        while (newsize < reqsize)
+        while (newsize < reqsize) {
+            if (newsize > (size_t)-1 / -s->increment)
+                return reqsize;
             newsize *= -s->increment;
+        }
     } else if (s->increment != 0)  {
         /* Linear sizing */
-        newsize = ((newsize + s->increment - 1) / s->increment) * s->increment;
+        newsize = ((reqsize + s->increment - 1) / s->increment) * s->increment;
     }
 
     return newsize;
@@ -161,27 +166,32 @@ static int calculate_new_size(strbuf_t *s, int len)
 
 /* Ensure strbuf can handle a string length bytes long (ignoring NULL
  * optional termination). */
-void strbuf_resize(strbuf_t *s, int len)
+void strbuf_resize(strbuf_t *s, size_t len)
 {
-    int newsize;
+    size_t newsize;
+    char *buf;
 
     newsize = calculate_new_size(s, len);
 
     if (s->debug > 1) {
-        fprintf(stderr, "strbuf(%lx) resize: %d => %d\n",
+        fprintf(stderr, "strbuf(%lx) resize: %zu => %zu\n",
                 (long)s, s->size, newsize);
     }
 
-    s->size = newsize;
-    s->buf = realloc(s->buf, s->size);
-    if (!s->buf)
+    buf = realloc(s->buf, newsize);
+    if (!buf) {
+        if (s->nomem)
+            s->nomem(s->nomem_ud);
         die("Out of memory");
+    }
+    s->buf = buf;
+    s->size = newsize;
     s->reallocs++;
 }
 
 void strbuf_append_string(strbuf_t *s, const char *str)
 {
-    int space, i;
+    size_t space, i;
 
     space = strbuf_empty_length(s);
 
@@ -199,7 +209,7 @@ void strbuf_append_string(strbuf_t *s, const char *str)
 
 /* strbuf_append_fmt() should only be used when an upper bound
  * is known for the output string. */
-void strbuf_append_fmt(strbuf_t *s, int len, const char *fmt, ...)
+void strbuf_append_fmt(strbuf_t *s, size_t len, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len;
@@ -222,7 +232,7 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
 {
     va_list arg;
     int fmt_len, try;
-    int empty_len;
+    size_t empty_len;
 
     /* If the first attempt to append fails, resize the buffer appropriately
      * and try again */
@@ -236,7 +246,7 @@ void strbuf_append_fmt_retry(strbuf_t *s, const char *fmt, ...)
         fmt_len = vsnprintf(s->buf + s->length, empty_len + 1, fmt, arg);
         va_end(arg);
 
-        if (fmt_len <= empty_len)
+        if ((size_t)fmt_len <= empty_len)
             break;  /* SUCCESS */
         if (try > 0)
             die("BUG: length of formatted string changed");
@@ -1530,6 +1530,7 @@ static lu_mem atomic (lua_State *L) {
   g->grayagain = NULL;
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
+  luai_gccycle(L, g->gckind == KGC_GEN);
   g->gcstate = GCSatomic;
   markobject(g, L);  /* mark running thread */
   /* registry and global metatables may be changed by API */
@@ -1692,10 +1693,12 @@ void luaC_step (lua_State *L) {
   if (!gcrunning(g))  /* not running? */
     luaE_setdebt(g, -2000);
   else {
+    luai_gcstepbegin(L);
     if(isdecGCmodegen(g))
       genstep(L, g);
     else
       incstep(L, g);
+    luai_gcstepend(L);
   }
 }
 
@@ -1731,10 +1734,12 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
   g->gcemergency = isemergency;  /* set flag */
+  luai_gcstepbegin(L);
   if (g->gckind == KGC_INC)
     fullinc(L, g);
   else
     fullgen(L, g);
+  luai_gcstepend(L);
   g->gcemergency = 0;
 }
 
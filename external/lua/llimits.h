@@ -274,6 +274,24 @@ typedef l_uint32 Instruction;
 #endif
 
 
+/*
+** Callisto counts the collections of its states and times the pauses
+** they cause (see alloc.c). The extra space of a thread points to the
+** heap of its state, and is NULL for states made with lua_newstate.
+** LUA_CALLISTO is only defined when building the core, so that the
+** installed headers stay as they are.
+*/
+#if defined(LUA_CALLISTO)
+void heap_gcstep (lua_State *L, int begin);
+void heap_gccycle (lua_State *L, int minor);
+
+#define luai_userstateopen(L)	(*(void **)lua_getextraspace(L) = NULL)
+#define luai_gcstepbegin(L)	heap_gcstep(L, 1)
+#define luai_gcstepend(L)	heap_gcstep(L, 0)
+#define luai_gccycle(L,minor)	heap_gccycle(L, minor)
+#endif
+
+
 /*
 ** these macros allow user-specific actions when a thread is
 ** created/deleted/resumed/yielded.
@@ -302,6 +320,24 @@ typedef l_uint32 Instruction;
 #define luai_userstateyield(L,n)	((void)L)
 #endif
 
+/*
+** luai_gcstepbegin/luai_gcstepend bracket each piece of work done by
+** the collector while the program waits for it, and luai_gccycle is
+** called at the atomic phase of each cycle, telling whether it is a
+** minor (young) collection.
+*/
+#if !defined(luai_gcstepbegin)
+#define luai_gcstepbegin(L)		((void)L)
+#endif
+
+#if !defined(luai_gcstepend)
+#define luai_gcstepend(L)		((void)L)
+#endif
+
+#if !defined(luai_gccycle)
+#define luai_gccycle(L,minor)		((void)L)
+#endif
+
 
 
 /*
@@ -0,0 +1,468 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Timing small pieces of code.
+ *
+ * *bench.run* calls a function over and over and reports how long a
+ * call takes, in wall-clock time measured with a monotonic clock that
+ * is not adjusted by NTP. It first runs the function for a while
+ * without measuring it, to let caches and the garbage collector
+ * settle, and finds a number of calls that takes long enough to be
+ * timed accurately. It then times batches of that many calls, called
+ * samples, and reports statistics of the time per call over them, so
+ * that a slow sample caused by another process does not skew the
+ * result as much as it would skew a single measurement.
+ *
+ * @module bench
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "alloc.h"
+#include "callisto.h"
+
+#define BENCH_MINTIME 1.0   /* default seconds of samples */
+#define BENCH_WARMUP  0.1   /* default seconds of warm-up */
+#define BENCH_SAMPLES 50    /* samples wanted in the time given */
+#define BENCH_MAXSAMP 10000 /* default limit of samples */
+#define BENCH_BATCH   1e-3  /* shortest sample in seconds */
+
+enum {
+	GC_COLLECT, /* full collection before each sample */
+	GC_STOP,    /* stopped during samples */
+	GC_NORMAL   /* left alone */
+};
+
+struct bench {
+	lua_State *L;
+	int fn;         /* stack index of the function, in runbench */
+	int gcmode;
+	int gcwasrunning;
+	int cycles;     /* whether to read the cycle counter */
+	double warmup;
+	double mintime;
+	size_t maxsamples;
+	lua_Integer batch; /* calls per sample */
+	double *samples;   /* seconds per call */
+	size_t nsamples;
+	double elapsed;    /* seconds in all samples */
+	double bytes;      /* allocated in all samples */
+	double ncycles;
+};
+
+static const char *const gcmodes[] = {"collect", "stop", "normal", NULL};
+
+static double
+clocktime(void)
+{
+	struct timespec ts;
+
+#if defined(CLOCK_MONOTONIC_RAW)
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Returns the time stamp counter of the processor, or 0 where there
+ * is none.
+ */
+static uint64_t
+cyclecount(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	uint32_t lo, hi;
+
+	__asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+	return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm__ __volatile__ ("mrs %0, cntvct_el0" : "=r" (v));
+	return v;
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Returns the bytes allocated by the state so far. The Callisto
+ * allocator counts them exactly; for other states the amount in use is
+ * the best guess, and is only right while the collector is stopped.
+ */
+static double
+allocated(lua_State *L)
+{
+	struct heap *h;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HEAP_REGKEY);
+	h = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (h != NULL)
+		return (double)h->allocated;
+	return lua_gc(L, LUA_GCCOUNT) * 1024.0 + lua_gc(L, LUA_GCCOUNTB);
+}
+
+/*
+ * Calls the function 'n' times and returns the seconds it took.
+ */
+static double
+batch(struct bench *b, lua_Integer n)
+{
+	lua_State *L = b->L;
+	double start;
+	lua_Integer i;
+
+	start = clocktime();
+	for (i = 0; i < n; i++) {
+		lua_pushvalue(L, b->fn);
+		lua_call(L, 0, 0);
+	}
+	return clocktime() - start;
+}
+
+/*
+ * Runs the function for the warm-up time, first raising the calls in
+ * a batch until one takes long enough to be a sample.
+ */
+static void
+warmup(struct bench *b)
+{
+	double target, t, scale, start;
+
+	target = b->mintime / BENCH_SAMPLES;
+	if (target < BENCH_BATCH)
+		target = BENCH_BATCH;
+	start = clocktime();
+	b->batch = 1;
+	while ((t = batch(b, b->batch)) < target
+	    && b->batch < LUA_MAXINTEGER / 100) {
+		/* aim a little past the target, growing by 2 to 100 times */
+		scale = t > 0 ? target / t * 1.2 : 100;
+		b->batch *= scale > 100 ? 100 : (scale < 2 ? 2 : scale);
+	}
+	while (clocktime() - start < b->warmup)
+		batch(b, b->batch);
+}
+
+static void
+sample(struct bench *b)
+{
+	lua_State *L = b->L;
+	uint64_t c;
+	double a, t;
+
+	if (b->gcmode == GC_COLLECT)
+		lua_gc(L, LUA_GCCOLLECT);
+	a = allocated(L);
+	c = cyclecount();
+	t = batch(b, b->batch);
+	if (b->cycles)
+		b->ncycles += (double)(cyclecount() - c);
+	b->bytes += allocated(L) - a;
+	b->elapsed += t;
+	b->samples[b->nsamples++] = t / b->batch;
+	if (b->gcmode == GC_STOP)
+		lua_gc(L, LUA_GCCOLLECT); /* outside the sample */
+}
+
+/* the body of run, called protected so the collector is restarted */
+static int
+runbench(lua_State *L)
+{
+	struct bench *b = lua_touserdata(L, 1);
+
+	if (b->gcmode == GC_STOP)
+		lua_gc(L, LUA_GCSTOP);
+	warmup(b);
+	do
+		sample(b);
+	while (b->nsamples < b->maxsamples
+	    && (b->elapsed < b->mintime || b->nsamples < 5));
+	return 0;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+setfield(lua_State *L, const char *k, double v)
+{
+	lua_pushnumber(L, v);
+	lua_setfield(L, -2, k);
+}
+
+/* returns the 'p'th percentile of the sorted samples by nearest rank */
+static double
+percentile(struct bench *b, double p)
+{
+	size_t i;
+
+	i = (size_t)ceil(p / 100 * b->nsamples);
+	return b->samples[i > 0 ? i - 1 : 0];
+}
+
+static void
+pushresult(lua_State *L, struct bench *b, const char *name)
+{
+	double mean, median, var, ops;
+	size_t i, n;
+
+	n = b->nsamples;
+	qsort(b->samples, n, sizeof(*b->samples), compare);
+	ops = (double)n * b->batch;
+	mean = b->elapsed / ops;
+	median = n % 2 ? b->samples[n / 2]
+	    : (b->samples[n / 2 - 1] + b->samples[n / 2]) / 2;
+	for (var = 0, i = 0; i < n; i++)
+		var += (b->samples[i] - mean) * (b->samples[i] - mean);
+	var /= n > 1 ? n - 1 : 1;
+
+	lua_createtable(L, 0, 14);
+	lua_pushstring(L, name);
+	lua_setfield(L, -2, "name");
+	lua_pushinteger(L, (lua_Integer)n);
+	lua_setfield(L, -2, "samples");
+	lua_pushinteger(L, b->batch);
+	lua_setfield(L, -2, "batch");
+	lua_pushinteger(L, (lua_Integer)n * b->batch);
+	lua_setfield(L, -2, "iterations");
+	setfield(L, "mean", mean);
+	setfield(L, "median", median);
+	setfield(L, "p95", percentile(b, 95));
+	setfield(L, "min", b->samples[0]);
+	setfield(L, "max", b->samples[n - 1]);
+	setfield(L, "stddev", sqrt(var));
+	setfield(L, "ops", median > 0 ? 1 / median : HUGE_VAL);
+	setfield(L, "bytes", b->bytes / ops);
+	if (b->cycles && cyclecount() != 0)
+		setfield(L, "cycles", b->ncycles / ops);
+}
+
+/***
+ * Measures how long a function takes to run.
+ *
+ * *fn* is called with no arguments, first during the warm-up and then
+ * in samples until they have taken *min_time* seconds in total, and
+ * at least 5 have been taken.
+ *
+ * *options* can have the following fields:
+ *
+ * - *warmup*: seconds to run the function before measuring it; the
+ *   default is 0.1.
+ * - *min_time*: seconds to spend in samples; the default is 1.
+ * - *max_samples*: the most samples to take; the default is 10000.
+ * - *gc*: what to do with the garbage collector. `"collect"`, the
+ *   default, makes a full collection before each sample, so that
+ *   garbage left by one does not have to be collected in the next.
+ *   `"stop"` stops the collector during samples and collects between
+ *   them, leaving out the time spent collecting the garbage the
+ *   function makes. `"normal"` leaves the collector alone.
+ * - *cycles*: if true, also counts processor cycles with the time
+ *   stamp counter, where there is one.
+ *
+ * The table returned has the following fields, with times in seconds
+ * per call:
+ *
+ * - *name*: the name given.
+ * - *samples*: the number of samples taken.
+ * - *batch*: the number of calls in each sample.
+ * - *iterations*: the number of calls timed.
+ * - *median*, *mean*, *p95*, *min*, *max* and *stddev*: statistics of
+ *   the time per call over the samples.
+ * - *ops*: calls per second, from the median.
+ * - *bytes*: bytes allocated per call.
+ * - *cycles*: processor cycles per call, if asked for. On ARM the
+ *   counter runs at a fixed rate instead of the processor's.
+ *
+ * The table holds only strings and numbers, so it can be saved with
+ * `json.encode` and compared with the results of another run.
+ *
+ * @function run
+ * @usage
+local r = bench.run("concat", function ()
+	local t = {}
+	for i = 1, 100 do
+		t[i] = i
+	end
+	return table.concat(t, ",")
+end, {gc = "stop"})
+print(("%s: %.2f us, %d bytes"):format(r.name, r.median * 1e6, r.bytes))
+ * @tparam string name The name of the benchmark.
+ * @tparam function fn The function to measure.
+ * @tparam[opt] table options Options.
+ * @treturn table The results.
+ */
+static int
+bench_run(lua_State *L)
+{
+	struct bench b;
+	const char *gc;
+	lua_Integer maxsamples;
+	int status;
+
+	luaL_checkstring(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	memset(&b, 0, sizeof(b));
+	b.L = L;
+	b.fn = 2; /* after the bench */
+	b.warmup = BENCH_WARMUP;
+	b.mintime = BENCH_MINTIME;
+	maxsamples = BENCH_MAXSAMP;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "warmup");
+		b.warmup = luaL_optnumber(L, -1, BENCH_WARMUP);
+		lua_getfield(L, 3, "min_time");
+		b.mintime = luaL_optnumber(L, -1, BENCH_MINTIME);
+		lua_getfield(L, 3, "max_samples");
+		maxsamples = luaL_optinteger(L, -1, BENCH_MAXSAMP);
+		lua_getfield(L, 3, "gc");
+		gc = luaL_optstring(L, -1, "collect");
+		for (b.gcmode = 0; gcmodes[b.gcmode] != NULL; b.gcmode++)
+			if (strcmp(gc, gcmodes[b.gcmode]) == 0)
+				break;
+		if (gcmodes[b.gcmode] == NULL)
+			return luaL_argerror(L, 3,
+			    lua_pushfstring(L, "invalid gc mode '%s'", gc));
+		lua_getfield(L, 3, "cycles");
+		b.cycles = lua_toboolean(L, -1);
+		lua_pop(L, 5);
+	}
+	luaL_argcheck(L, b.warmup >= 0, 3, "warmup must not be negative");
+	luaL_argcheck(L, b.mintime >= 0, 3, "min_time must not be negative");
+	luaL_argcheck(L, maxsamples >= 5 && (size_t)maxsamples < SIZE_MAX
+	    / sizeof(double), 3, "max_samples out of range");
+	b.maxsamples = (size_t)maxsamples;
+	b.samples = lua_newuserdatauv(L, b.maxsamples * sizeof(double), 0);
+
+	b.gcwasrunning = lua_gc(L, LUA_GCISRUNNING);
+	lua_pushcfunction(L, runbench);
+	lua_pushlightuserdata(L, &b);
+	lua_pushvalue(L, 2);
+	status = lua_pcall(L, 2, 0, 0);
+	if (b.gcwasrunning)
+		lua_gc(L, LUA_GCRESTART);
+	if (status != LUA_OK)
+		return lua_error(L);
+	pushresult(L, &b, lua_tostring(L, 1));
+	return 1;
+}
+
+/***
+ * Returns the time of the clock used by *run*, in seconds.
+ *
+ * The time is counted from an unspecified point, so only differences
+ * between two readings are meaningful.
+ *
+ * @function clock
+ * @usage
+local start = bench.clock()
+work()
+print(bench.clock() - start)
+ * @treturn number The time in seconds.
+ */
+static int
+bench_clock(lua_State *L)
+{
+	lua_pushnumber(L, clocktime());
+	return 1;
+}
+
+/***
+ * Formats the results of *run* as a table for a terminal.
+ *
+ * Each line shows the name, the median and 95th percentile time per
+ * call, the standard deviation as a percentage of the mean, the calls
+ * per second and the bytes allocated per call.
+ *
+ * @function report
+ * @usage
+local results = {}
+results[#results + 1] = bench.run("a", a)
+results[#results + 1] = bench.run("b", b)
+io.write(bench.report(results))
+ * @tparam table results An array of results from *run*.
+ * @treturn string The report.
+ */
+static double
+getnumber(lua_State *L, int idx, const char *k)
+{
+	double v;
+
+	lua_getfield(L, idx, k);
+	v = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return v;
+}
+
+static int
+bench_report(lua_State *L)
+{
+	static const char *const units[] = {"s", "ms", "us", "ns"};
+	luaL_Buffer buf;
+	lua_Integer i, n;
+	double median, mean, scale;
+	char line[160];
+	int u;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	n = luaL_len(L, 1);
+	luaL_buffinit(L, &buf);
+	snprintf(line, sizeof(line), "%-24s %12s %12s %8s %14s %10s\n",
+	    "name", "median", "p95", "stddev", "ops/s", "bytes/op");
+	luaL_addstring(&buf, line);
+	for (i = 1; i <= n; i++) {
+		lua_geti(L, 1, i);
+		luaL_argexpected(L, lua_istable(L, -1), 1, "array of results");
+		median = getnumber(L, -1, "median");
+		mean = getnumber(L, -1, "mean");
+		for (u = 0, scale = 1; u < 3 && median * scale < 1; u++)
+			scale *= 1000;
+		lua_getfield(L, -1, "name");
+		snprintf(line, sizeof(line),
+		    "%-24.24s %9.3f %-2s %9.3f %-2s %7.2f%% %14.0f %10.1f\n",
+		    luaL_optstring(L, -1, "?"), median * scale, units[u],
+		    getnumber(L, -2, "p95") * scale, units[u],
+		    mean > 0 ? getnumber(L, -2, "stddev") / mean * 100 : 0,
+		    getnumber(L, -2, "ops"), getnumber(L, -2, "bytes"));
+		lua_pop(L, 2);
+		luaL_addstring(&buf, line);
+	}
+	luaL_pushresult(&buf);
+	return 1;
+}
+
+/* clang-format off */
+
+static const luaL_Reg benchlib[] = {
+	{"clock",  bench_clock},
+	{"report", bench_report},
+	{"run",    bench_run},
+	{NULL, NULL}
+};
+
+int
+luaopen_bench(lua_State *L)
+{
+	luaL_newlib(L, benchlib);
+	return 1;
+}
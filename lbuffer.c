@@ -0,0 +1,756 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Growable byte buffers for building and consuming strings.
+ *
+ * A buffer holds bytes outside of Lua's string table: putting a
+ * piece in a buffer copies it to the end of the buffer's memory, and
+ * no Lua string is made until the contents are asked for with
+ * *Buffer:get* or *Buffer:tostring*. Building a large output in a
+ * buffer therefore makes far less garbage than concatenating strings
+ * or collecting pieces for *table.concat*.
+ *
+ * Bytes are read from the front of a buffer and written to its end,
+ * so a buffer can also be used as a queue. Buffers can be written to
+ * and read from files directly, are accepted by *json.encodeto* as
+ * the output of the encoder, and by *json.decode* as its input.
+ *
+ * @module buffer
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <float.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+
+#include "buffer.h"
+#include "callisto.h"
+#include "util.h"
+
+#define BUFFER_NUMLEN   44   /* longest number written by put */
+#define BUFFER_READSIZE 8192 /* bytes read at a time by readfrom */
+#define BUFFER_FORMAT   32   /* longest conversion of putf, as in lstrlib */
+
+/* longest item formatted by putf, MAX_ITEMF in lstrlib.c */
+#define BUFFER_MAXITEM  (110 + l_floatatt(MAX_10_EXP))
+
+/* flags allowed by each conversion of putf, as in lstrlib.c */
+#define FMTFLAGSF "-+#0 "
+#define FMTFLAGSX "-#0"
+#define FMTFLAGSI "-+0 "
+#define FMTFLAGSU "-0"
+#define FMTFLAGSC "-"
+
+static struct callisto_buffer *
+checkbuffer(lua_State *L, int idx)
+{
+	return (struct callisto_buffer *)luaL_checkudata(L, idx, CALLISTO_BUFFER);
+}
+
+/* returns the number of bytes not read yet */
+static size_t
+buflen(struct callisto_buffer *b)
+{
+	return b->sb.length - b->off;
+}
+
+/*
+ * Grows the memory of the buffer to hold 'n' more bytes and a null
+ * terminator, doubling its size as strbuf does. The strbuf functions
+ * exit the program when memory runs out, so the buffer is grown here
+ * with an error raised instead.
+ */
+static void
+bufgrow(lua_State *L, struct callisto_buffer *b, size_t n)
+{
+	size_t need, size;
+	char *p;
+
+	if (n > SIZE_MAX - 1 - b->sb.length)
+		luaL_error(L, "not enough memory");
+	need = b->sb.length + n + 1;
+	for (size = b->sb.size > 0 ? b->sb.size : 1; size < need; size *= 2) {
+		if (size > SIZE_MAX / 2) {
+			size = need;
+			break;
+		}
+	}
+	if ((p = realloc(b->sb.buf, size)) == NULL)
+		luaL_error(L, "not enough memory");
+	b->sb.buf = p;
+	b->sb.size = size;
+	b->sb.reallocs++;
+}
+
+/*
+ * Makes room for 'n' more bytes at the end of the buffer, moving the
+ * unread bytes to the front first if that gives enough room.
+ */
+static void
+bufspace(lua_State *L, struct callisto_buffer *b, size_t n)
+{
+	if (n > strbuf_empty_length(&b->sb) && b->off > 0) {
+		memmove(b->sb.buf, b->sb.buf + b->off, buflen(b));
+		b->sb.length -= b->off;
+		b->off = 0;
+	}
+	if (n > strbuf_empty_length(&b->sb))
+		bufgrow(L, b, n);
+}
+
+/* marks 'n' bytes as read, rewinding the buffer once it is empty */
+static void
+bufconsume(struct callisto_buffer *b, size_t n)
+{
+	b->off += n;
+	if (b->off == b->sb.length)
+		b->off = b->sb.length = 0;
+}
+
+static void
+bufappend(lua_State *L, struct callisto_buffer *b, const char *s, size_t len)
+{
+	bufspace(L, b, len);
+	strbuf_append_mem_unsafe(&b->sb, s, len);
+}
+
+/* appends the number at 'idx' as tostring would write it */
+static void
+bufputnumber(lua_State *L, struct callisto_buffer *b, int idx)
+{
+	char *p;
+	int n;
+
+	bufspace(L, b, BUFFER_NUMLEN);
+	p = strbuf_empty_ptr(&b->sb);
+	if (lua_isinteger(L, idx))
+		n = snprintf(p, BUFFER_NUMLEN, LUA_INTEGER_FMT,
+			(LUAI_UACINT)lua_tointeger(L, idx));
+	else {
+		n = snprintf(p, BUFFER_NUMLEN, LUA_NUMBER_FMT,
+			(LUAI_UACNUMBER)lua_tonumber(L, idx));
+		if (p[strspn(p, "-0123456789")] == '\0') { /* looks like an int? */
+			p[n++] = '.';
+			p[n++] = '0';
+		}
+	}
+	strbuf_extend_length(&b->sb, n);
+}
+
+/*
+ * Appends the value at 'idx': a string, a number, another buffer's
+ * unread bytes, or a value with a __tostring metamethod.
+ */
+static void
+bufput(lua_State *L, struct callisto_buffer *b, int idx)
+{
+	struct callisto_buffer *src;
+	const char *s;
+	size_t len;
+
+	switch (lua_type(L, idx)) {
+	case LUA_TSTRING:
+		s = lua_tolstring(L, idx, &len);
+		bufappend(L, b, s, len);
+		return;
+	case LUA_TNUMBER:
+		bufputnumber(L, b, idx);
+		return;
+	}
+	if ((src = luaL_testudata(L, idx, CALLISTO_BUFFER)) != NULL) {
+		len = buflen(src);
+		bufspace(L, b, len); /* may move the bytes of src if src == b */
+		strbuf_append_mem_unsafe(&b->sb, src->sb.buf + src->off, len);
+		return;
+	}
+	if (luaL_getmetafield(L, idx, "__tostring") == LUA_TNIL)
+		luaL_typeerror(L, idx, "string");
+	lua_pop(L, 1);
+	s = luaL_tolstring(L, idx, &len);
+	bufappend(L, b, s, len);
+	lua_pop(L, 1);
+}
+
+/*
+ * Returns the file at 'idx', or NULL and the descriptor in 'fd' if
+ * an integer was given.
+ */
+static FILE *
+checkfile(lua_State *L, int idx, int *fd)
+{
+	luaL_Stream *p;
+	lua_Integer n;
+
+	*fd = -1;
+	if (lua_isinteger(L, idx)) {
+		n = lua_tointeger(L, idx);
+		luaL_argcheck(L, n >= 0 && n <= INT32_MAX, idx,
+		    "invalid file descriptor");
+		*fd = (int)n;
+		return NULL;
+	}
+	p = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+	luaL_argcheck(L, p->closef != NULL, idx, "file is closed");
+	return p->f;
+}
+
+/***
+ * Returns a new, empty buffer.
+ *
+ * @function new
+ * @usage
+local buf = buffer.new()
+ * @tparam[opt] integer size The number of bytes to allocate up front.
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_new(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer size;
+
+	size = luaL_optinteger(L, 1, 0);
+	luaL_argcheck(L, size >= 0 && size < INT32_MAX, 1, "invalid size");
+	b = lua_newuserdatauv(L, sizeof(*b), 0);
+	memset(b, 0, sizeof(*b));
+	b->sb.increment = STRBUF_DEFAULT_INCREMENT;
+	luaL_setmetatable(L, CALLISTO_BUFFER); /* frees sb if growing fails */
+	bufgrow(L, b, size > 0 ? (size_t)size : STRBUF_DEFAULT_SIZE - 1);
+	b->sb.buf[0] = '\0';
+	return 1;
+}
+
+/***
+ * Appends values to the buffer.
+ *
+ * Strings are appended as they are, numbers as *tostring* would
+ * write them, and buffers by the bytes they have not had read. Other
+ * values must have a *__tostring* metamethod.
+ *
+ * @function Buffer:put
+ * @usage
+buf:put("id=", 42, "\n")
+ * @param ... The values to append.
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_put(lua_State *L)
+{
+	struct callisto_buffer *b;
+	int i, top;
+
+	b = checkbuffer(L, 1);
+	top = lua_gettop(L);
+	for (i = 2; i <= top; i++)
+		bufput(L, b, i);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/* as getformat in lstrlib.c; returns the address of the conversion */
+static const char *
+getformat(lua_State *L, const char *fmt, char *form)
+{
+	size_t len;
+
+	len = strspn(fmt, FMTFLAGSF "123456789.") + 1;
+	if (len >= BUFFER_FORMAT - 10)
+		luaL_error(L, "invalid format (too long)");
+	*form++ = '%';
+	memcpy(form, fmt, len);
+	form[len] = '\0';
+	return fmt + len - 1;
+}
+
+/* as checkformat in lstrlib.c */
+static void
+checkformat(lua_State *L, const char *form, const char *flags,
+	int precision)
+{
+	const char *spec = form + 1;
+
+	spec += strspn(spec, flags);
+	if (*spec != '0') { /* a width cannot start with '0' */
+		spec += isdigit((unsigned char)*spec) != 0;
+		spec += isdigit((unsigned char)*spec) != 0;
+		if (*spec == '.' && precision) {
+			spec++;
+			spec += isdigit((unsigned char)*spec) != 0;
+			spec += isdigit((unsigned char)*spec) != 0;
+		}
+	}
+	if (!isalpha((unsigned char)*spec)) /* did not go to the end? */
+		luaL_error(L, "invalid conversion specification: '%s'", form);
+}
+
+/* adds 'lenmod' before the conversion of 'form' */
+static void
+addlenmod(char *form, const char *lenmod)
+{
+	size_t l, lm;
+	char spec;
+
+	l = strlen(form);
+	lm = strlen(lenmod);
+	spec = form[l - 1];
+	memcpy(form + l - 1, lenmod, lm);
+	form[l + lm - 1] = spec;
+	form[l + lm] = '\0';
+}
+
+/***
+ * Appends values formatted like *string.format* would format them.
+ *
+ * Numbers and strings are formatted straight into the buffer. The
+ * *%q* and *%p* conversions, and *%s* with a width or precision, are
+ * handed to *string.format*.
+ *
+ * @function Buffer:putf
+ * @usage
+buf:putf("%-10s %8.3f\n", name, seconds)
+ * @tparam string format The format string.
+ * @param ... The values to format.
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_putf(lua_State *L)
+{
+	struct callisto_buffer *b;
+	char form[BUFFER_FORMAT];
+	const char *fmt, *end, *p;
+	size_t len;
+	int arg, top;
+
+	b = checkbuffer(L, 1);
+	fmt = luaL_checklstring(L, 2, &len);
+	end = fmt + len;
+	top = lua_gettop(L);
+	arg = 2;
+	while (fmt < end) {
+		if ((p = memchr(fmt, '%', end - fmt)) == NULL)
+			p = end;
+		bufappend(L, b, fmt, p - fmt);
+		if ((fmt = p) == end)
+			break;
+		if (*++fmt == '%') {
+			bufappend(L, b, fmt++, 1);
+			continue;
+		}
+		if (++arg > top)
+			return luaL_argerror(L, arg, "no value");
+		fmt = getformat(L, fmt, form);
+		bufspace(L, b, BUFFER_MAXITEM);
+		switch (*fmt++) {
+		case 'c':
+			checkformat(L, form, FMTFLAGSC, 0);
+			strbuf_append_fmt_retry(&b->sb, form,
+				(int)luaL_checkinteger(L, arg));
+			break;
+		case 'd':
+		case 'i':
+			checkformat(L, form, FMTFLAGSI, 1);
+			goto intcase;
+		case 'u':
+			checkformat(L, form, FMTFLAGSU, 1);
+			goto intcase;
+		case 'o':
+		case 'x':
+		case 'X':
+			checkformat(L, form, FMTFLAGSX, 1);
+		intcase:
+			addlenmod(form, LUA_INTEGER_FRMLEN);
+			strbuf_append_fmt_retry(&b->sb, form,
+				(LUAI_UACINT)luaL_checkinteger(L, arg));
+			break;
+		case 'a':
+		case 'A':
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'g':
+		case 'G':
+			checkformat(L, form, FMTFLAGSF, 1);
+			addlenmod(form, LUA_NUMBER_FRMLEN);
+			strbuf_append_fmt_retry(&b->sb, form,
+				(LUAI_UACNUMBER)luaL_checknumber(L, arg));
+			break;
+		case 's':
+			if (form[2] == '\0') { /* no modifiers? */
+				if (lua_type(L, arg) == LUA_TSTRING
+				    || lua_type(L, arg) == LUA_TNUMBER
+				    || luaL_testudata(L, arg, CALLISTO_BUFFER) != NULL)
+					bufput(L, b, arg);
+				else {
+					p = luaL_tolstring(L, arg, &len);
+					bufappend(L, b, p, len);
+					lua_pop(L, 1);
+				}
+				break;
+			}
+			/* FALLTHROUGH */
+		case 'p':
+		case 'q':
+			luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+			lua_getfield(L, -1, LUA_STRLIBNAME);
+			lua_getfield(L, -1, "format");
+			lua_pushstring(L, form);
+			lua_pushvalue(L, arg);
+			lua_call(L, 2, 1);
+			p = lua_tolstring(L, -1, &len);
+			bufappend(L, b, p, len);
+			lua_pop(L, 3);
+			break;
+		default:
+			return luaL_error(L, "invalid conversion '%s' to 'putf'", form);
+		}
+	}
+	lua_settop(L, 1);
+	return 1;
+}
+
+/***
+ * Makes room for at least *size* more bytes, for C code to write to.
+ *
+ * Returns a light userdata pointing to the free space at the end of
+ * the buffer and the number of bytes there. The bytes written there
+ * are added to the buffer with *Buffer:commit*. The space is only
+ * valid until the buffer is next changed.
+ *
+ * @function Buffer:reserve
+ * @usage
+local ptr, len = buf:reserve(4096)
+ * @tparam integer size The number of bytes wanted.
+ * @treturn lightuserdata The start of the free space.
+ * @treturn integer The number of bytes free.
+ */
+static int
+buffer_reserve(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer n;
+
+	b = checkbuffer(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0 && n < INT32_MAX, 2, "invalid size");
+	bufspace(L, b, n);
+	lua_pushlightuserdata(L, strbuf_empty_ptr(&b->sb));
+	lua_pushinteger(L, strbuf_empty_length(&b->sb));
+	return 2;
+}
+
+/***
+ * Adds *size* bytes written to the space given by *Buffer:reserve*
+ * to the buffer.
+ *
+ * @function Buffer:commit
+ * @usage buf:commit(n)
+ * @tparam integer size The number of bytes written.
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_commit(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer n;
+
+	b = checkbuffer(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0 && (size_t)n <= strbuf_empty_length(&b->sb), 2,
+	    "size out of range");
+	strbuf_extend_length(&b->sb, n);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/***
+ * Reads bytes from the front of the buffer.
+ *
+ * Returns a string of at most *len* bytes for each length given, or
+ * all of the bytes if no length is given. Strings are empty once the
+ * buffer has been read to its end.
+ *
+ * @function Buffer:get
+ * @usage
+local header, body = buf:get(4, 128)
+ * @tparam[opt] integer len The number of bytes to read.
+ * @param ... Further lengths.
+ * @treturn string The bytes read.
+ */
+static int
+buffer_get(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer n;
+	size_t len;
+	int i, top;
+
+	b = checkbuffer(L, 1);
+	top = lua_gettop(L);
+	if (top == 1) {
+		lua_pushlstring(L, b->sb.buf + b->off, buflen(b));
+		bufconsume(b, buflen(b));
+		return 1;
+	}
+	luaL_checkstack(L, top, "too many results");
+	for (i = 2; i <= top; i++) {
+		n = luaL_checkinteger(L, i);
+		luaL_argcheck(L, n >= 0, i, "invalid length");
+		len = (size_t)n < buflen(b) ? (size_t)n : buflen(b);
+		lua_pushlstring(L, b->sb.buf + b->off, len);
+		bufconsume(b, len);
+	}
+	return top - 1;
+}
+
+/***
+ * Discards bytes from the front of the buffer.
+ *
+ * @function Buffer:skip
+ * @usage buf:skip(4)
+ * @tparam integer len The number of bytes to discard; all of them
+ *   if the buffer holds fewer.
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_skip(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer n;
+
+	b = checkbuffer(L, 1);
+	n = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, n >= 0, 2, "invalid length");
+	bufconsume(b, (size_t)n < buflen(b) ? (size_t)n : buflen(b));
+	lua_settop(L, 1);
+	return 1;
+}
+
+/***
+ * Returns the bytes of the buffer as a string, without reading them.
+ *
+ * Buffers can also be converted with *tostring*.
+ *
+ * @function Buffer:tostring
+ * @usage
+local s = buf:tostring()
+ * @treturn string The contents of the buffer.
+ */
+static int
+buffer_tostring(lua_State *L)
+{
+	struct callisto_buffer *b;
+
+	b = checkbuffer(L, 1);
+	lua_pushlstring(L, b->sb.buf + b->off, buflen(b));
+	return 1;
+}
+
+/***
+ * Empties the buffer, keeping its memory for reuse.
+ *
+ * @function Buffer:reset
+ * @usage buf:reset()
+ * @treturn Buffer The buffer.
+ */
+static int
+buffer_reset(lua_State *L)
+{
+	struct callisto_buffer *b;
+
+	b = checkbuffer(L, 1);
+	b->off = 0;
+	strbuf_reset(&b->sb);
+	lua_settop(L, 1);
+	return 1;
+}
+
+/***
+ * Empties the buffer and frees its memory.
+ *
+ * The buffer can still be used afterwards.
+ *
+ * @function Buffer:free
+ * @usage buf:free()
+ */
+static int
+buffer_free(lua_State *L)
+{
+	struct callisto_buffer *b;
+	char *p;
+
+	b = checkbuffer(L, 1);
+	b->off = b->sb.length = 0;
+	/* if shrinking fails, the memory is kept */
+	if ((p = realloc(b->sb.buf, 1)) != NULL) {
+		b->sb.buf = p;
+		b->sb.size = 1;
+	}
+	b->sb.buf[0] = '\0';
+	return 0;
+}
+
+/***
+ * Writes the bytes of the buffer to a file, and reads them from the
+ * buffer.
+ *
+ * Returns true on success, or nil, an error message and an error code
+ * if writing failed, in which case the bytes written are read from
+ * the buffer and the rest are kept.
+ *
+ * @function Buffer:writeto
+ * @usage
+local f = io.open("report.txt", "w")
+buf:writeto(f)
+f:close()
+ * @tparam file|integer f The file, or file descriptor, to write to.
+ */
+static int
+buffer_writeto(lua_State *L)
+{
+	struct callisto_buffer *b;
+	FILE *fp;
+	size_t len;
+	ssize_t n;
+	int fd;
+
+	b = checkbuffer(L, 1);
+	fp = checkfile(L, 2, &fd);
+	if (fp != NULL) {
+		len = fwrite(b->sb.buf + b->off, 1, buflen(b), fp);
+		bufconsume(b, len);
+		if (buflen(b) > 0)
+			return lfail(L);
+	}
+	while (fp == NULL && buflen(b) > 0) {
+		if ((n = write(fd, b->sb.buf + b->off, buflen(b))) == -1) {
+			if (errno == EINTR)
+				continue;
+			return lfail(L);
+		}
+		bufconsume(b, n);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/***
+ * Appends bytes read from a file to the buffer.
+ *
+ * Reads up to *len* bytes, or until the end of the file if *len* is
+ * not given. Returns the number of bytes read, which is 0 at the end
+ * of the file, or nil, an error message and an error code if reading
+ * failed, in which case the bytes read before the failure are kept.
+ *
+ * @function Buffer:readfrom
+ * @usage
+local buf = buffer.new()
+buf:readfrom(io.open("data.json"))
+local t = json.decode(buf)
+ * @tparam file|integer f The file, or file descriptor, to read from.
+ * @tparam[opt] integer len The most bytes to read.
+ */
+static int
+buffer_readfrom(lua_State *L)
+{
+	struct callisto_buffer *b;
+	lua_Integer want;
+	FILE *fp;
+	size_t total, chunk;
+	ssize_t n;
+	int fd;
+
+	b = checkbuffer(L, 1);
+	fp = checkfile(L, 2, &fd);
+	want = luaL_optinteger(L, 3, LUA_MAXINTEGER);
+	luaL_argcheck(L, want >= 0, 3, "invalid length");
+	for (total = 0; total < (lua_Unsigned)want; total += n) {
+		chunk = (lua_Unsigned)want - total < BUFFER_READSIZE
+			? (lua_Unsigned)want - total : BUFFER_READSIZE;
+		bufspace(L, b, chunk);
+		if (fp != NULL) {
+			n = fread(strbuf_empty_ptr(&b->sb), 1, chunk, fp);
+			if (n == 0 && ferror(fp))
+				return lfail(L);
+		} else if ((n = read(fd, strbuf_empty_ptr(&b->sb), chunk)) == -1) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return lfail(L);
+		}
+		if (n == 0)
+			break; /* end of file */
+		strbuf_extend_length(&b->sb, n);
+	}
+	lua_pushinteger(L, total);
+	return 1;
+}
+
+static int
+buffer_len(lua_State *L)
+{
+	lua_pushinteger(L, buflen(checkbuffer(L, 1)));
+	return 1;
+}
+
+static int
+buffer_gc(lua_State *L)
+{
+	strbuf_free(&checkbuffer(L, 1)->sb);
+	return 0;
+}
+
+/* clang-format off */
+
+static const luaL_Reg buffermethods[] = {
+	{"commit",   buffer_commit},
+	{"free",     buffer_free},
+	{"get",      buffer_get},
+	{"put",      buffer_put},
+	{"putf",     buffer_putf},
+	{"readfrom", buffer_readfrom},
+	{"reserve",  buffer_reserve},
+	{"reset",    buffer_reset},
+	{"skip",     buffer_skip},
+	{"tostring", buffer_tostring},
+	{"writeto",  buffer_writeto},
+	{NULL, NULL}
+};
+
+static const luaL_Reg buffermeta[] = {
+	{"__gc",       buffer_gc},
+	{"__len",      buffer_len},
+	{"__tostring", buffer_tostring},
+	{NULL, NULL}
+};
+
+static const luaL_Reg bufferlib[] = {
+	{"new", buffer_new},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+int
+luaopen_buffer(lua_State *L)
+{
+	luaL_newlib(L, bufferlib);
+	if (luaL_newmetatable(L, CALLISTO_BUFFER)) {
+		luaL_setfuncs(L, buffermeta, 0);
+		luaL_newlib(L, buffermethods);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_pop(L, 1);
+	return 1;
+}
@@ -0,0 +1,237 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Information about the Callisto runtime itself.
+ *
+ * @module callisto
+ */
+
+#include <sys/resource.h>
+#include <string.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "alloc.h"
+#include "callisto.h"
+#include "util.h"
+
+static void
+setfieldint(lua_State *L, const char *k, size_t v)
+{
+	lua_pushinteger(L, (lua_Integer)v);
+	lua_setfield(L, -2, k);
+}
+
+static void
+setfieldnum(lua_State *L, const char *k, double v)
+{
+	lua_pushnumber(L, (lua_Number)v);
+	lua_setfield(L, -2, k);
+}
+
+static struct heap *
+getheap(lua_State *L)
+{
+	struct heap *h;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, HEAP_REGKEY);
+	h = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	return h;
+}
+
+/***
+ * Returns statistics about the memory allocator of the state.
+ *
+ * States created by Callisto allocate blocks of up to 256 bytes from
+ * pages of 64 KiB, divided into size classes 8 bytes apart; larger
+ * blocks come from the system allocator. Pages are kept until the
+ * state is closed.
+ *
+ * The table returned has the following fields:
+ *
+ * - *inuse*: bytes currently allocated.
+ * - *peak*: the highest value *inuse* has had.
+ * - *pages*: the number of pages allocated.
+ * - *pagesize*: the size of a page in bytes.
+ * - *large*: a table with fields *allocs*, the number of blocks
+ *   allocated from the system, and *inuse*, the bytes they hold.
+ * - *classes*: an array with a table for each size class, with
+ *   fields *size*, the size of its blocks, *allocs*, the number of
+ *   blocks allocated, and *inuse*, the number still in use.
+ *
+ * If the state was not created by Callisto, returns nil and an error
+ * message.
+ *
+ * @function allocstats
+ * @usage
+local stats = callisto.allocstats()
+print(("%d KiB in use, %d KiB at most"):format(
+	stats.inuse // 1024, stats.peak // 1024))
+ * @treturn table Allocator statistics.
+ */
+static int
+callisto_allocstats(lua_State *L)
+{
+	struct heap *h;
+	int c;
+
+	if ((h = getheap(L)) == NULL)
+		return lfailm(L, "state does not use the Callisto allocator");
+
+	lua_createtable(L, 0, 6);
+	setfieldint(L, "inuse", h->inuse);
+	setfieldint(L, "peak", h->peak);
+	setfieldint(L, "pages", h->npages);
+	setfieldint(L, "pagesize", HEAP_PAGESIZE);
+	lua_createtable(L, 0, 2);
+	setfieldint(L, "allocs", h->largeallocs);
+	setfieldint(L, "inuse", h->largeinuse);
+	lua_setfield(L, -2, "large");
+	lua_createtable(L, HEAP_CLASSES, 0);
+	for (c = 0; c < HEAP_CLASSES; c++) {
+		lua_createtable(L, 0, 3);
+		setfieldint(L, "size", (c + 1) * HEAP_STEP);
+		setfieldint(L, "allocs", h->classes[c].allocs);
+		setfieldint(L, "inuse", h->classes[c].inuse);
+		lua_rawseti(L, -2, c + 1);
+	}
+	lua_setfield(L, -2, "classes");
+	return 1;
+}
+
+/*
+ * Pushes a table of the calls made to each library function, then one
+ * of the calls made to each library.
+ */
+static void
+pushcalls(lua_State *L)
+{
+	struct callcount *c;
+	const char *name, *dot;
+	int funcs;
+
+	lua_newtable(L);
+	funcs = lua_gettop(L);
+	lua_newtable(L);
+	/* not made here, since libraries opened later check for it */
+	if (lua_getfield(L, LUA_REGISTRYINDEX, CALLS_REGKEY) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		c = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		if (c->calls == 0)
+			continue;
+		name = lua_tostring(L, -1);
+		lua_pushinteger(L, (lua_Integer)c->calls);
+		lua_setfield(L, funcs, name);
+		if ((dot = strchr(name, '.')) == NULL)
+			continue;
+		lua_pushlstring(L, name, dot - name);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, funcs + 1);
+		lua_pushinteger(L, lua_tointeger(L, -1) + (lua_Integer)c->calls);
+		lua_remove(L, -2);
+		lua_rawset(L, funcs + 1);
+	}
+	lua_pop(L, 1);
+}
+
+/***
+ * Returns statistics about the state and the process running it.
+ *
+ * The table returned has the following fields:
+ *
+ * - *wall*: seconds since the state was created.
+ * - *cpu*: processor time used by the process in seconds, the sum of
+ *   *user* and *system*.
+ * - *rss*: the largest resident set size of the process in bytes.
+ * - *allocated*: bytes allocated by the state since it was created.
+ * - *inuse*: bytes currently allocated.
+ * - *gc*: a table about the garbage collector, with fields *minor*,
+ *   the number of young collections made in generational mode,
+ *   *major*, the number of full collections and incremental cycles,
+ *   *pauses*, the number of times the program waited for the
+ *   collector, *pausetime*, the seconds it waited in total, and
+ *   *maxpause*, the longest wait in seconds. Finalizers run during
+ *   pauses.
+ * - *calls*: the number of calls made to the functions of each
+ *   Callisto library, by library name.
+ * - *functions*: the number of calls made to each function of the
+ *   Callisto libraries, by names such as `fs.stat`.
+ *
+ * Libraries whose functions were never called are left out of
+ * *calls* and *functions*. Calls are only counted once the program
+ * embedding Lua asks for it, as *csto -S* does; otherwise both tables
+ * are empty.
+ *
+ * If the state was not created by Callisto, returns nil and an error
+ * message.
+ *
+ * @function stats
+ * @usage
+local stats = callisto.stats()
+print(("%d collections, longest pause %.1f ms"):format(
+	stats.gc.minor + stats.gc.major, stats.gc.maxpause * 1000))
+ * @treturn table Statistics.
+ */
+static int
+callisto_stats(lua_State *L)
+{
+	struct heap *h;
+	struct rusage ru;
+	double user, sys;
+
+	if ((h = getheap(L)) == NULL)
+		return lfailm(L, "state does not use the Callisto allocator");
+
+	getrusage(RUSAGE_SELF, &ru);
+	user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+
+	lua_createtable(L, 0, 10);
+	setfieldnum(L, "wall", (heap_clock() - h->created) / 1e9);
+	setfieldnum(L, "cpu", user + sys);
+	setfieldnum(L, "user", user);
+	setfieldnum(L, "system", sys);
+#if defined(__APPLE__)
+	setfieldint(L, "rss", ru.ru_maxrss);        /* in bytes */
+#else
+	setfieldint(L, "rss", ru.ru_maxrss * 1024); /* in kilobytes */
+#endif
+	setfieldint(L, "allocated", h->allocated);
+	setfieldint(L, "inuse", h->inuse);
+	lua_createtable(L, 0, 5);
+	setfieldint(L, "minor", h->gcminor);
+	setfieldint(L, "major", h->gcmajor);
+	setfieldint(L, "pauses", h->gcsteps);
+	setfieldnum(L, "pausetime", h->gctime / 1e9);
+	setfieldnum(L, "maxpause", h->gcmaxpause / 1e9);
+	lua_setfield(L, -2, "gc");
+	pushcalls(L);
+	lua_setfield(L, -3, "calls");
+	lua_setfield(L, -2, "functions");
+	return 1;
+}
+
+/* clang-format off */
+
+static const luaL_Reg callistolib[] = {
+	{"allocstats", callisto_allocstats},
+	{"stats",      callisto_stats},
+	{NULL, NULL}
+};
+
+int
+luaopen_callisto(lua_State *L)
+{
+	luaL_newlib(L, callistolib);
+	return 1;
+}
@@ -0,0 +1,115 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Encoding and decoding of Concise Binary Object Representation
+ * (CBOR, RFC 8949) values.
+ *
+ * Integers and floats are stored in binary, so they are decoded
+ * exactly as they were encoded, and strings are copied without
+ * escaping. Both definite and indefinite length items are decoded.
+ *
+ * Tables are handled as in the *json* library, and the *json*
+ * configuration (see *json.config*) also applies here: maximum
+ * nesting depth, sparse arrays, empty tables, the array metatables
+ * and skipping of unsupported types. CBOR null and undefined decode
+ * to *cbor.null*.
+ *
+ * @module cbor
+ */
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "callisto.h"
+#include "pack.h"
+
+/***
+ * Returns the given value encoded as CBOR.
+ *
+ * Values of types CBOR cannot represent, such as functions, are
+ * passed to *ext* if it is given. It should return a tag number and
+ * the value to encode with that tag, or nil to treat the value as
+ * unsupported.
+ *
+ * @function encode
+ * @usage
+local data = cbor.encode({id = 1, tags = {"a", "b"}})
+ * @param value The value to encode.
+ * @tparam[opt] function ext The extension hook.
+ */
+
+/***
+ * Returns the value encoded in the given CBOR string.
+ *
+ * Tagged values are passed to *ext* as a tag number and the decoded
+ * value, and are replaced by what it returns. Without *ext*, tags
+ * are ignored.
+ *
+ * @function decode
+ * @usage
+local t = cbor.decode(data)
+print(t.id)
+ * @tparam string data The CBOR data.
+ * @tparam[opt] function ext The extension hook.
+ */
+
+/***
+ * Returns a streaming decoder, which decodes values from data
+ * that arrives in chunks.
+ *
+ * *decoder:feed(chunk)* adds data to the decoder, and *decoder:next()*
+ * returns the next complete value, or nil if the data fed so far
+ * does not contain one.
+ *
+ * @function decoder
+ * @usage
+local d = cbor.decoder()
+d:feed(sock:read(4096))
+local value = d:next()
+ * @tparam[opt] function ext The extension hook, as for *cbor.decode*.
+ */
+
+/***
+ * The value that null is decoded to, equal to *json.null*.
+ *
+ * @field null
+ */
+
+static int
+cbor_encode(lua_State *L)
+{
+	return pack_encode(L, PACK_CBOR);
+}
+
+static int
+cbor_decode(lua_State *L)
+{
+	return pack_decode(L, PACK_CBOR);
+}
+
+static int
+cbor_decoder(lua_State *L)
+{
+	return pack_decoder(L, PACK_CBOR);
+}
+
+/* clang-format off */
+
+static const luaL_Reg cborlib[] = {
+	{"decode",  cbor_decode},
+	{"decoder", cbor_decoder},
+	{"encode",  cbor_encode},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+int
+luaopen_cbor(lua_State *L)
+{
+	pack_newlib(L, cborlib);
+	return 1;
+}
@@ -0,0 +1,987 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * An event loop running coroutines that wait for file descriptors,
+ * timers, child processes and signals.
+ *
+ * Functions given to *spawn* become tasks, coroutines resumed by
+ * *run*. A task waits with *readable*, *writable*, *sleep*, *child*
+ * or *signal*, which suspend it and let the other tasks run until what
+ * it waits for happens. A task that yields with `coroutine.yield` is
+ * run again after the other tasks that are ready. The wait functions
+ * can only be called by a task itself, not by a coroutine it resumes.
+ *
+ * The loop is built on epoll, with a timerfd for its timers, pidfds
+ * for children and signalfds for signals, so it is only available on
+ * Linux; elsewhere its functions raise an error.
+ *
+ * @module event
+ */
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#endif
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+
+#include "util.h"
+
+#if defined(__linux__)
+
+#if !defined(SYS_pidfd_open)
+#define SYS_pidfd_open 434
+#endif
+
+#define EVENT_BATCH  256 /* events taken from epoll at once */
+#define EVENT_REGKEY "_CALLISTO_EVENT" /* registry field of the loop */
+
+enum {
+	W_READ,
+	W_WRITE,
+	W_SLEEP,
+	W_CHILD,
+	W_SIGNAL
+};
+
+/* a suspended task */
+struct waiter {
+	int ref;        /* the coroutine, in the task table */
+	int kind;
+	int fd;         /* the descriptor waited on, or -1 */
+	pid_t pid;      /* the child, for W_CHILD */
+	size_t timer;   /* index in the timer heap plus one, or 0 */
+	long long when; /* when the timer expires, in ns, or 0 */
+};
+
+/* the tasks waiting on a descriptor */
+struct fdwait {
+	struct waiter *r;
+	struct waiter *w;
+	int registered; /* with epoll */
+};
+
+struct loop {
+	int epfd;
+	int tfd;                /* timerfd, armed for the first timer */
+	long long armed;        /* when it is armed for, or 0 */
+	struct waiter **timers; /* min-heap by 'when' */
+	size_t ntimers;
+	size_t timerssize;
+	struct fdwait *fds;     /* indexed by descriptor */
+	size_t nfds;
+	int *ready;             /* ring of tasks to resume, by reference */
+	size_t readyhead;
+	size_t nready;
+	size_t readysize;       /* at least the number of tasks */
+	size_t ntasks;
+	size_t waiting;         /* tasks suspended */
+	lua_State *current;     /* the task running */
+	int currentref;
+	int parked;             /* whether the task running has suspended */
+	int running;            /* whether run is active */
+};
+
+static long long
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * {==================================================================
+ * Timers
+ * ===================================================================
+ */
+
+static void
+heapset(struct loop *lp, size_t i, struct waiter *w)
+{
+	lp->timers[i] = w;
+	w->timer = i + 1;
+}
+
+static void
+siftup(struct loop *lp, size_t i)
+{
+	struct waiter *w = lp->timers[i];
+	size_t parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (lp->timers[parent]->when <= w->when)
+			break;
+		heapset(lp, i, lp->timers[parent]);
+		i = parent;
+	}
+	heapset(lp, i, w);
+}
+
+static void
+siftdown(struct loop *lp, size_t i)
+{
+	struct waiter *w = lp->timers[i];
+	size_t child;
+
+	while ((child = 2 * i + 1) < lp->ntimers) {
+		if (child + 1 < lp->ntimers
+		    && lp->timers[child + 1]->when < lp->timers[child]->when)
+			child++;
+		if (w->when <= lp->timers[child]->when)
+			break;
+		heapset(lp, i, lp->timers[child]);
+		i = child;
+	}
+	heapset(lp, i, w);
+}
+
+/*
+ * Arms the timerfd for the first timer, or disarms it.
+ */
+static void
+armtimer(struct loop *lp)
+{
+	struct itimerspec its;
+	long long when;
+
+	when = lp->ntimers > 0 ? lp->timers[0]->when : 0;
+	if (when == lp->armed)
+		return;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = when / 1000000000;
+	its.it_value.tv_nsec = when % 1000000000;
+	timerfd_settime(lp->tfd, TFD_TIMER_ABSTIME, &its, NULL);
+	lp->armed = when;
+}
+
+/* room must have been made with reserve */
+static void
+addtimer(struct loop *lp, struct waiter *w)
+{
+	lp->timers[lp->ntimers++] = w;
+	siftup(lp, lp->ntimers - 1);
+	armtimer(lp);
+}
+
+/* the timerfd is left to be armed again by the caller */
+static void
+removetimer(struct loop *lp, struct waiter *w)
+{
+	size_t i;
+
+	if (w->timer == 0)
+		return;
+	i = w->timer - 1;
+	w->timer = 0;
+	if (i != --lp->ntimers) {
+		heapset(lp, i, lp->timers[lp->ntimers]);
+		if (i > 0 && lp->timers[i]->when < lp->timers[(i - 1) / 2]->when)
+			siftup(lp, i);
+		else
+			siftdown(lp, i);
+	}
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Descriptors
+ * ===================================================================
+ */
+
+/*
+ * Tells epoll which events the tasks waiting on 'fd' want. Returns -1
+ * and sets errno on failure.
+ */
+static int
+updatefd(struct loop *lp, int fd)
+{
+	struct fdwait *f = &lp->fds[fd];
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.data.fd = fd;
+	if (f->r != NULL)
+		ev.events |= EPOLLIN;
+	if (f->w != NULL)
+		ev.events |= EPOLLOUT;
+
+	if (ev.events == 0) {
+		if (f->registered)
+			epoll_ctl(lp->epfd, EPOLL_CTL_DEL, fd, NULL);
+		f->registered = 0;
+		return 0;
+	}
+	/* a descriptor closed by the script has left epoll already */
+	if (f->registered && epoll_ctl(lp->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	if (epoll_ctl(lp->epfd, EPOLL_CTL_ADD, fd, &ev) == 0
+	    || (errno == EEXIST
+	    && epoll_ctl(lp->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)) {
+		f->registered = 1;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * Makes 'w' wait on 'fd', which has room in the table made by
+ * reserve. Returns -1 and sets errno on failure.
+ */
+static int
+addfd(struct loop *lp, struct waiter *w, int fd)
+{
+	struct waiter **slot;
+
+	slot = w->kind == W_WRITE ? &lp->fds[fd].w : &lp->fds[fd].r;
+	if (*slot != NULL) {
+		errno = EBUSY; /* another task waits for the same */
+		return -1;
+	}
+	*slot = w;
+	if (updatefd(lp, fd) == -1) {
+		*slot = NULL;
+		return -1;
+	}
+	w->fd = fd;
+	return 0;
+}
+
+static void
+removefd(struct loop *lp, struct waiter *w)
+{
+	struct fdwait *f;
+
+	if (w->fd == -1)
+		return;
+	f = &lp->fds[w->fd];
+	if (f->w == w)
+		f->w = NULL;
+	if (f->r == w)
+		f->r = NULL;
+	updatefd(lp, w->fd);
+	w->fd = -1;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Tasks
+ * ===================================================================
+ */
+
+static int
+loop_gc(lua_State *L)
+{
+	struct loop *lp = lua_touserdata(L, 1);
+	struct waiter *w;
+	size_t i;
+
+	for (i = 0; i < lp->nfds; i++) {
+		if ((w = lp->fds[i].r) != NULL && w->kind != W_READ)
+			close(i); /* a pidfd or signalfd */
+		if (w != NULL && w->timer == 0)
+			free(w);
+		if ((w = lp->fds[i].w) != NULL && w->timer == 0)
+			free(w);
+	}
+	for (i = 0; i < lp->ntimers; i++)
+		free(lp->timers[i]);
+	free(lp->timers);
+	free(lp->fds);
+	free(lp->ready);
+	if (lp->epfd != -1)
+		close(lp->epfd);
+	if (lp->tfd != -1)
+		close(lp->tfd);
+	return 0;
+}
+
+/*
+ * Returns the loop of the state, creating it the first time. Its user
+ * value is the task table, holding the coroutines of the tasks.
+ */
+static struct loop *
+getloop(lua_State *L)
+{
+	struct loop *lp;
+	struct epoll_event ev;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, EVENT_REGKEY) != LUA_TNIL) {
+		lp = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+		return lp;
+	}
+	lua_pop(L, 1);
+
+	lp = lua_newuserdatauv(L, sizeof(*lp), 1);
+	memset(lp, 0, sizeof(*lp));
+	lp->epfd = lp->tfd = -1;
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	lua_newtable(L);
+	lua_pushcfunction(L, loop_gc);
+	lua_setfield(L, -2, "__gc");
+	lua_setmetatable(L, -2);
+
+	lp->epfd = epoll_create1(EPOLL_CLOEXEC);
+	lp->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = lp->tfd;
+	if (lp->epfd == -1 || lp->tfd == -1
+	    || epoll_ctl(lp->epfd, EPOLL_CTL_ADD, lp->tfd, &ev) == -1)
+		luaL_error(L, "cannot create event loop: %s", strerror(errno));
+	lua_setfield(L, LUA_REGISTRYINDEX, EVENT_REGKEY);
+	return lp;
+}
+
+/* pushes the task table */
+static void
+gettasks(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, EVENT_REGKEY);
+	lua_getiuservalue(L, -1, 1);
+	lua_remove(L, -2);
+}
+
+/*
+ * Makes room for a new task in the ready ring, so that no task ever
+ * fails to be queued.
+ */
+static void
+reservetask(lua_State *L, struct loop *lp)
+{
+	int *ready;
+	size_t i, size;
+
+	if (lp->ntasks < lp->readysize)
+		return;
+	size = lp->readysize ? lp->readysize * 2 : 64;
+	if ((ready = malloc(size * sizeof(*ready))) == NULL)
+		luaL_error(L, "not enough memory");
+	for (i = 0; i < lp->nready; i++)
+		ready[i] = lp->ready[(lp->readyhead + i) % lp->readysize];
+	free(lp->ready);
+	lp->ready = ready;
+	lp->readyhead = 0;
+	lp->readysize = size;
+}
+
+static void
+pushready(struct loop *lp, int ref)
+{
+	lp->ready[(lp->readyhead + lp->nready++) % lp->readysize] = ref;
+}
+
+/*
+ * Makes room for a waiter with a timer and one on descriptor 'fd', if
+ * it is not -1, so that nothing raises an error once the waiter is
+ * made.
+ */
+static void
+reserve(lua_State *L, struct loop *lp, int fd)
+{
+	struct waiter **timers;
+	struct fdwait *fds;
+	size_t n;
+
+	if (lp->ntimers == lp->timerssize) {
+		n = lp->timerssize ? lp->timerssize * 2 : 64;
+		if ((timers = realloc(lp->timers, n * sizeof(*timers))) == NULL)
+			luaL_error(L, "not enough memory");
+		lp->timers = timers;
+		lp->timerssize = n;
+	}
+	if (fd >= 0 && (size_t)fd >= lp->nfds) {
+		n = lp->nfds ? lp->nfds : 64;
+		while (n <= (size_t)fd)
+			n *= 2;
+		if ((fds = realloc(lp->fds, n * sizeof(*fds))) == NULL)
+			luaL_error(L, "not enough memory");
+		memset(fds + lp->nfds, 0, (n - lp->nfds) * sizeof(*fds));
+		lp->fds = fds;
+		lp->nfds = n;
+	}
+}
+
+/*
+ * Returns the loop if 'L' is the task it is running, raising an error
+ * otherwise.
+ */
+static struct loop *
+checktask(lua_State *L)
+{
+	struct loop *lp = getloop(L);
+
+	if (lp->current != L)
+		luaL_error(L, "not called by a task of the event loop");
+	return lp;
+}
+
+/*
+ * Returns a new waiter for the running task, with the timeout given
+ * at index 'idx'. Returns NULL if there is no memory.
+ */
+static struct waiter *
+newwaiter(lua_State *L, struct loop *lp, int kind, int idx)
+{
+	struct waiter *w;
+	lua_Number t;
+
+	t = luaL_optnumber(L, idx, -1);
+	if ((w = calloc(1, sizeof(*w))) == NULL)
+		return NULL;
+	w->ref = lp->currentref;
+	w->kind = kind;
+	w->fd = -1;
+	if (t >= 0)
+		w->when = now() + (long long)(t * 1e9);
+	return w;
+}
+
+/*
+ * Suspends the running task in 'w' until it is woken up.
+ */
+static int
+park(lua_State *L, struct loop *lp, struct waiter *w)
+{
+	if (w->when != 0)
+		addtimer(lp, w);
+	lp->parked = 1;
+	lp->waiting++;
+	lua_settop(L, 0); /* wake pushes the results alone */
+	return lua_yield(L, 0);
+}
+
+/*
+ * Wakes the task suspended in 'w', giving it the results of what it
+ * waited for, and frees 'w'. The task is resumed with the others that
+ * are ready.
+ */
+static void
+wake(lua_State *L, struct loop *lp, struct waiter *w, int timedout)
+{
+	struct signalfd_siginfo si;
+	lua_State *co;
+	int status;
+
+	gettasks(L);
+	lua_rawgeti(L, -1, w->ref);
+	co = lua_tothread(L, -1);
+	lua_pop(L, 2);
+	lua_checkstack(co, 3);
+
+	if (timedout && w->kind != W_SLEEP) {
+		luaL_pushfail(co);
+		lua_pushliteral(co, "timed out");
+	} else if (w->kind == W_READ || w->kind == W_WRITE) {
+		lua_pushboolean(co, 1);
+	} else if (w->kind == W_CHILD) {
+		if (waitpid(w->pid, &status, WNOHANG) <= 0) {
+			lfail(co);
+		} else if (WIFSIGNALED(status)) {
+			luaL_pushfail(co);
+			lua_pushliteral(co, "signal");
+			lua_pushinteger(co, WTERMSIG(status));
+		} else {
+			if (WEXITSTATUS(status) == 0)
+				lua_pushboolean(co, 1);
+			else
+				luaL_pushfail(co);
+			lua_pushliteral(co, "exit");
+			lua_pushinteger(co, WEXITSTATUS(status));
+		}
+	} else if (w->kind == W_SIGNAL) {
+		if (read(w->fd, &si, sizeof(si)) != sizeof(si))
+			lfail(co);
+		else
+			lua_pushinteger(co, si.ssi_signo);
+	}
+
+	removetimer(lp, w);
+	if (w->kind == W_CHILD || w->kind == W_SIGNAL) {
+		int fd = w->fd;
+		removefd(lp, w);
+		close(fd); /* made for the wait */
+	} else
+		removefd(lp, w);
+	pushready(lp, w->ref);
+	lp->waiting--;
+	free(w);
+}
+
+/*
+ * Handles an event from epoll. Tasks woken up are only queued, so
+ * none can change the descriptors while events are being handled.
+ */
+static void
+dispatch(lua_State *L, struct loop *lp, struct epoll_event *ev)
+{
+	struct fdwait *f;
+	uint64_t expirations;
+	long long t;
+	int fd;
+
+	fd = ev->data.fd;
+	if (fd == lp->tfd) {
+		if (read(lp->tfd, &expirations, sizeof(expirations)) > 0)
+			lp->armed = 0; /* the timer is disarmed once it fires */
+		t = now();
+		while (lp->ntimers > 0 && lp->timers[0]->when <= t)
+			wake(L, lp, lp->timers[0], 1);
+	} else if ((size_t)fd < lp->nfds) {
+		f = &lp->fds[fd];
+		if ((ev->events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && f->r != NULL)
+			wake(L, lp, f->r, 0);
+		if ((ev->events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) && f->w != NULL)
+			wake(L, lp, f->w, 0);
+	}
+	armtimer(lp);
+}
+
+/*
+ * Resumes the next ready task. Returns 0 if it raised an error, which
+ * is left on the stack with a traceback.
+ */
+static int
+resume(lua_State *L, struct loop *lp)
+{
+	lua_State *co;
+	int nargs, nres, ref, status;
+
+	ref = lp->ready[lp->readyhead];
+	lp->readyhead = (lp->readyhead + 1) % lp->readysize;
+	lp->nready--;
+
+	gettasks(L);
+	lua_rawgeti(L, -1, ref);
+	co = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	nargs = lua_gettop(co);
+	if (lua_status(co) == LUA_OK)
+		nargs--; /* not started yet; the function is below */
+
+	lp->current = co;
+	lp->currentref = ref;
+	lp->parked = 0;
+	status = lua_resume(co, L, nargs, &nres);
+	lp->current = NULL;
+
+	if (status == LUA_YIELD) {
+		lua_pop(co, nres);
+		if (!lp->parked) /* yielded by itself */
+			pushready(lp, ref);
+		lua_pop(L, 1);
+		return 1;
+	}
+	luaL_unref(L, -1, ref);
+	lua_pop(L, 1);
+	lp->ntasks--;
+	if (status == LUA_OK)
+		return 1;
+	if (lua_type(co, -1) == LUA_TSTRING)
+		luaL_traceback(L, co, lua_tostring(co, -1), 0);
+	else
+		lua_xmove(co, L, 1);
+	return 0;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Library
+ * ===================================================================
+ */
+
+/*
+ * Returns the file descriptor at 'idx', given as an integer or as a
+ * file.
+ */
+static int
+checkfd(lua_State *L, int idx)
+{
+	luaL_Stream *p;
+	lua_Integer fd;
+
+	if (lua_isinteger(L, idx)) {
+		fd = lua_tointeger(L, idx);
+		luaL_argcheck(L, fd >= 0 && fd <= INT32_MAX, idx,
+		    "invalid file descriptor");
+		return (int)fd;
+	}
+	p = luaL_checkudata(L, idx, LUA_FILEHANDLE);
+	luaL_argcheck(L, p->closef != NULL, idx, "file is closed");
+	return fileno(p->f);
+}
+
+static int
+waitfd(lua_State *L, int kind)
+{
+	struct loop *lp;
+	struct waiter *w;
+	int fd;
+
+	fd = checkfd(L, 1);
+	lp = checktask(L);
+	reserve(L, lp, fd);
+	if ((w = newwaiter(L, lp, kind, 2)) == NULL)
+		return luaL_error(L, "not enough memory");
+	if (addfd(lp, w, fd) == -1) {
+		free(w);
+		return lfail(L);
+	}
+	return park(L, lp, w);
+}
+
+/***
+ * Waits until a file descriptor can be read from without blocking.
+ *
+ * Returns true when it can, or nil and an error message if *timeout*
+ * seconds pass first. A descriptor that was closed or hung up at the
+ * other end counts as readable. Only one task can wait to read from a
+ * descriptor at a time.
+ *
+ * @function readable
+ * @usage
+local f = io.popen("sleep 1; echo done")
+event.spawn(function ()
+	event.readable(f)
+	print(f:read("l"))
+end)
+event.run()
+ * @tparam integer|file fd The descriptor, or a file.
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ */
+static int
+event_readable(lua_State *L)
+{
+	return waitfd(L, W_READ);
+}
+
+/***
+ * Waits until a file descriptor can be written to without blocking.
+ *
+ * Works like *readable*.
+ *
+ * @function writable
+ * @tparam integer|file fd The descriptor, or a file.
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ */
+static int
+event_writable(lua_State *L)
+{
+	return waitfd(L, W_WRITE);
+}
+
+/***
+ * Waits the given amount of seconds, letting other tasks run.
+ *
+ * @function sleep
+ * @usage
+event.spawn(function ()
+	for i = 1, 3 do
+		print(i)
+		event.sleep(1)
+	end
+end)
+event.run()
+ * @tparam number seconds The amount of seconds to wait.
+ */
+static int
+event_sleep(lua_State *L)
+{
+	struct loop *lp;
+	struct waiter *w;
+
+	luaL_checknumber(L, 1);
+	lp = checktask(L);
+	reserve(L, lp, -1);
+	if ((w = newwaiter(L, lp, W_SLEEP, 1)) == NULL)
+		return luaL_error(L, "not enough memory");
+	if (w->when == 0) /* negative */
+		w->when = now();
+	return park(L, lp, w);
+}
+
+/***
+ * Waits for a child process to exit, and reaps it.
+ *
+ * Returns the same values as `os.execute`: true or nil, then `"exit"`
+ * and the exit status if the process exited, or `"signal"` and the
+ * signal that killed it. If *timeout* seconds pass first, returns nil
+ * and an error message, and the process is left running.
+ *
+ * @function child
+ * @usage
+event.spawn(function ()
+	print(event.child(pid))
+end)
+ * @tparam integer pid The process ID of the child.
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ */
+static int
+event_child(lua_State *L)
+{
+	struct loop *lp;
+	struct waiter *w;
+	lua_Integer pid;
+	int fd;
+
+	pid = luaL_checkinteger(L, 1);
+	luaL_argcheck(L, pid > 0, 1, "invalid process ID");
+	lp = checktask(L);
+	reserve(L, lp, -1);
+	if ((fd = (int)syscall(SYS_pidfd_open, (pid_t)pid, 0)) == -1)
+		return lfail(L);
+	reserve(L, lp, fd); /* the descriptor is freed if this fails */
+	if ((w = newwaiter(L, lp, W_CHILD, 2)) == NULL) {
+		close(fd);
+		return luaL_error(L, "not enough memory");
+	}
+	w->pid = (pid_t)pid;
+	if (addfd(lp, w, fd) == -1) {
+		close(fd);
+		free(w);
+		return lfail(L);
+	}
+	return park(L, lp, w);
+}
+
+/*
+ * Returns the signal at 'idx', a number or a name that process.signum
+ * knows.
+ */
+static int
+checksignal(lua_State *L, int idx)
+{
+	lua_Integer sig;
+
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		lua_getglobal(L, "require");
+		lua_pushliteral(L, "process");
+		lua_call(L, 1, 1);
+		lua_getfield(L, -1, "signum");
+		lua_pushvalue(L, idx);
+		lua_call(L, 1, 1);
+		lua_replace(L, idx);
+		lua_pop(L, 1);
+	}
+	sig = luaL_checkinteger(L, idx);
+	luaL_argcheck(L, sig > 0 && sig < NSIG && sig != SIGKILL
+	    && sig != SIGSTOP, idx, "invalid signal");
+	return (int)sig;
+}
+
+/***
+ * Waits for a signal to be delivered to the process.
+ *
+ * Returns the number of the signal, or nil and an error message if
+ * *timeout* seconds pass first. The signal is blocked from the first
+ * wait on, so that instead of its usual action it is kept pending
+ * until a task waits for it again.
+ *
+ * @function signal
+ * @usage
+event.spawn(function ()
+	event.signal("SIGTERM")
+	print("shutting down")
+end)
+ * @tparam integer|string signal The signal, as a number or a name
+ *   such as `"SIGINT"`.
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ */
+static int
+event_signal(lua_State *L)
+{
+	struct loop *lp;
+	struct waiter *w;
+	sigset_t set;
+	int fd;
+
+	sigemptyset(&set);
+	sigaddset(&set, checksignal(L, 1));
+	lp = checktask(L);
+	reserve(L, lp, -1);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+	if ((fd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+		return lfail(L);
+	reserve(L, lp, fd);
+	if ((w = newwaiter(L, lp, W_SIGNAL, 2)) == NULL) {
+		close(fd);
+		return luaL_error(L, "not enough memory");
+	}
+	if (addfd(lp, w, fd) == -1) {
+		close(fd);
+		free(w);
+		return lfail(L);
+	}
+	return park(L, lp, w);
+}
+
+/***
+ * Makes a function into a task.
+ *
+ * The function is called with the other arguments the next time the
+ * loop runs its ready tasks. Returns the coroutine running it.
+ *
+ * @function spawn
+ * @usage
+event.spawn(function (name)
+	event.sleep(1)
+	print("hello, " .. name)
+end, "world")
+event.run()
+ * @tparam function f The function to run.
+ * @param ... The arguments to call it with.
+ * @treturn thread The task.
+ */
+static int
+event_spawn(lua_State *L)
+{
+	struct loop *lp;
+	lua_State *co;
+	int n;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	n = lua_gettop(L);
+	lp = getloop(L);
+	reservetask(L, lp);
+	co = lua_newthread(L);
+	lua_insert(L, 1);
+	lua_xmove(L, co, n);
+
+	gettasks(L);
+	lua_pushvalue(L, 1);
+	pushready(lp, luaL_ref(L, -2));
+	lp->ntasks++;
+	lua_pop(L, 1);
+	return 1;
+}
+
+static int
+noop(lua_State *L)
+{
+	(void)L;
+	return 0;
+}
+
+/***
+ * Runs the tasks until none are left.
+ *
+ * If a task raises an error, it is ended and the error is raised
+ * again by *run*, with the task's traceback added to a string error.
+ * The other tasks are kept and run if *run* is called again.
+ *
+ * @function run
+ * @usage
+event.spawn(function ()
+	event.sleep(0.1)
+end)
+event.run()
+ */
+static int
+event_run(lua_State *L)
+{
+	struct epoll_event evs[EVENT_BATCH];
+	struct loop *lp;
+	int i, n;
+
+	lp = getloop(L);
+	if (lp->running)
+		return luaL_error(L, "event loop is already running");
+	lp->running = 1;
+	for (;;) {
+		while (lp->nready > 0) {
+			if (!resume(L, lp)) {
+				lp->running = 0;
+				return lua_error(L);
+			}
+		}
+		if (lp->waiting == 0)
+			break;
+		if ((n = epoll_wait(lp->epfd, evs, EVENT_BATCH, -1)) == -1) {
+			if (errno != EINTR) {
+				lp->running = 0;
+				return luaL_error(L, "epoll_wait: %s", strerror(errno));
+			}
+			/* let a hook set by a signal handler run */
+			lua_pushcfunction(L, noop);
+			if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+				lp->running = 0;
+				return lua_error(L);
+			}
+			continue;
+		}
+		for (i = 0; i < n; i++)
+			dispatch(L, lp, &evs[i]);
+	}
+	lp->running = 0;
+	return 0;
+}
+
+/* }================================================================== */
+
+#else
+
+static int
+event_unsupported(lua_State *L)
+{
+	return luaL_error(L, "the event library is only available on Linux");
+}
+
+#define event_child    event_unsupported
+#define event_readable event_unsupported
+#define event_run      event_unsupported
+#define event_signal   event_unsupported
+#define event_sleep    event_unsupported
+#define event_spawn    event_unsupported
+#define event_writable event_unsupported
+
+#endif
+
+/* clang-format off */
+
+static const luaL_Reg eventlib[] = {
+	{"child",    event_child},
+	{"readable", event_readable},
+	{"run",      event_run},
+	{"signal",   event_signal},
+	{"sleep",    event_sleep},
+	{"spawn",    event_spawn},
+	{"writable", event_writable},
+	{NULL, NULL}
+};
+
+int
+luaopen_event(lua_State *L)
+{
+	luaL_newlib(L, eventlib);
+	return 1;
+}
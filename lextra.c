@@ -20,6 +20,9 @@
 /***
  * Waits the specified amount of seconds.
  *
+ * This blocks the whole program; tasks of the event loop should use
+ * `event.sleep` instead.
+ *
  * @function sleep
  * @usage
 local minutes = 5
@@ -54,6 +54,10 @@ local j = json.encode(t)
 /***
  * Returns the given JSON object decoded into a Lua table.
  *
+ * The JSON can also be given in a buffer from the buffer library,
+ * which is decoded without being copied to a string; the buffer is
+ * left as it was.
+ *
  * @function decode
  * @usage
 local j = [[
@@ -67,7 +71,184 @@ local j = [[
 }
 ]]
 local t = json.decode(j)
- * @tparam string j The JSON object to decode.
+ * @tparam string|Buffer j The JSON object to decode.
+ */
+
+/***
+ * Parses a JSON document without converting it to Lua values.
+ *
+ * The document is validated and its structure recorded in a compact
+ * index. Objects and arrays are returned as proxies that convert
+ * values only when they are indexed, so reading a few fields of a
+ * large document avoids building the whole table tree. Proxies
+ * support indexing, the length operator and *pairs*. Scalar
+ * documents are returned as plain values.
+ *
+ * Calling *node:decode([pointer])* converts the node, or the value
+ * at the given JSON Pointer relative to it, into ordinary tables.
+ * Object members named *decode* can be reached this way as well.
+ *
+ * @function parse
+ * @usage
+local doc = json.parse(body)
+print(doc.items[5].id)
+local user = doc:decode("/items/5/user")
+ * @tparam string j The JSON document to parse.
+ */
+
+/***
+ * Returns the value a JSON Pointer refers to, without decoding
+ * the rest of the document.
+ *
+ * The document is scanned once; unrelated values are skipped
+ * without creating Lua values, and scanning stops as soon as the
+ * value has been found. Returns nil if there is no such value.
+ *
+ * Because scanning stops at the first match, an object with the same
+ * key more than once yields the first of its values, whereas
+ * *json.decode* keeps the last one.
+ *
+ * @function get
+ * @usage
+local service = json.get(body, "/route/service")
+ * @tparam string j The JSON document.
+ * @tparam string pointer The JSON Pointer (RFC 6901) of the value.
+ */
+
+/***
+ * Returns the values several JSON Pointers refer to, scanning the
+ * document only once.
+ *
+ * The result table uses the same keys as the *pointers* table.
+ * Duplicate object keys are resolved as by *json.get*.
+ *
+ * @function extract
+ * @usage
+local r = json.extract(body, {service = "/route/service", id = "/id"})
+print(r.service, r.id)
+ * @tparam string j The JSON document.
+ * @tparam table pointers A table of JSON Pointers.
+ */
+
+/***
+ * Checks that a string is valid JSON without decoding it.
+ *
+ * No Lua values are created for the contents of the document and
+ * strings are checked in place rather than copied, so this is much
+ * cheaper than a protected call to *json.decode*.
+ * The options table may override *max_depth* and *invalid_numbers*
+ * (see *json.config*) for this call only; if *stats* is true, a
+ * table describing the document is returned as well, with the
+ * fields *depth*, *objects*, *arrays*, *keys*, *strings*, *numbers*,
+ * *booleans*, *nulls* and *string_bytes*.
+ *
+ * Returns true on success, or nil, an error message and the
+ * zero-based byte offset of the error.
+ *
+ * @function validate
+ * @usage
+local ok, stats = json.validate(body, {max_depth = 32, stats = true})
+if ok then
+	print(stats.objects, stats.depth)
+end
+ * @tparam string j The JSON document.
+ * @tparam[opt] table options Validation options.
+ */
+
+/***
+ * Compiles a codec for objects of a fixed shape.
+ *
+ * The schema is a list of fields, each a table holding the field
+ * name, its type and optionally *optional = true*. The type is one of
+ * "string", "number", "integer", "boolean" or "any" (the default),
+ * another codec for a nested object, or a table holding a codec for
+ * an array of such objects.
+ *
+ * The returned codec has *encode* and *decode* methods. Encoding
+ * emits the schema fields in order, with their keys escaped in
+ * advance; other keys of the table are not encoded, and optional
+ * fields are left out when nil. Decoding sets known fields using
+ * interned keys, and converts integral "integer" fields to integers.
+ * Values that do not have the declared type, and unknown keys when
+ * decoding, are handled as by *json.encode* and *json.decode*.
+ *
+ * @function compile
+ * @usage
+local point = json.compile{{"x", "number"}, {"y", "number"}}
+local user = json.compile{
+	{"id", "integer"},
+	{"name", "string"},
+	{"email", "string", optional = true},
+	{"home", point},
+}
+local s = user:encode{id = 1, name = "a", home = {x = 1, y = 2}}
+print(user:decode(s).home.y)
+ * @tparam table schema The list of fields.
+ */
+
+/***
+ * Returns an iterator that decodes each line of a
+ * JSON Lines (newline-delimited JSON) stream.
+ *
+ * The stream is read in large blocks, and blank lines are skipped.
+ * Errors report the line number and the byte offset of the
+ * failing line within the stream.
+ *
+ * @function lines
+ * @usage
+for record in json.lines("events.ndjson") do
+	print(record.id)
+end
+ * @tparam file|string f An open file, or the path of a file to read.
+ */
+
+/***
+ * Encodes a sequence of values as JSON Lines and writes them to a file.
+ *
+ * Values are taken from a table (from index 1 until the first nil),
+ * or by calling a function until it returns nil. Output is written
+ * in large blocks using the persistent encoding buffer.
+ *
+ * Returns the number of records written on success, or nil, an error
+ * message and an error code if writing failed.
+ *
+ * @function writelines
+ * @usage
+local f = io.open("events.ndjson", "w")
+json.writelines(f, {
+	{id = 1, event = "start"},
+	{id = 2, event = "stop"}
+})
+f:close()
+ * @tparam file f The file to write to.
+ * @tparam table|function values The values to encode.
+ */
+
+/***
+ * Encodes a value as JSON directly to a file or file descriptor.
+ *
+ * Output is written whenever the encoding buffer holds more than
+ * *flush_threshold* bytes (64 KiB by default), so large documents
+ * are never held in memory as a whole. If *indent* is given, the
+ * output is pretty-printed, indenting nested values by the given
+ * string, or by the given number of spaces (at most 16).
+ *
+ * Returns true on success, or nil, an error message and an error code
+ * if writing failed; output written before the failure is not undone.
+ *
+ * Given a buffer from the buffer library, the JSON is appended to the
+ * buffer instead, and *flush_threshold* is ignored. If encoding raises
+ * an error, the buffer is left unchanged.
+ *
+ * @function encodeto
+ * @usage
+local f = io.open("dump.json", "w")
+json.encodeto(f, data, {indent = 2})
+f:close()
+ * @tparam file|integer|Buffer f The file, file descriptor or buffer to
+ *   write to.
+ * @param value The value to encode.
+ * @tparam[opt] table options Output options.
  */
 
 /***
@@ -138,6 +319,24 @@ local t = json.decode(j)
  * @usage json.config("decode:invalid-numbers", false)
  * @tparam boolean convert Whether or not to accept and decode invalid numbers.
  */
+/***
+ * Determine whether or not the JSON decoding buffer
+ * should be reused after each call to *decode*.
+ *
+ * If *true*, the buffer is kept between calls as long as
+ * it is no larger than *limit* bytes (1 MiB by default).
+ * This is the default setting.
+ *
+ * If *false*, the decode buffer is shrunk back to its
+ * initial size after each call.
+ *
+ * **Parameters:**
+ *
+ * @setting decode:keep-buffer
+ * @usage json.config("decode:keep-buffer", true, 64 * 1024)
+ * @tparam boolean keep Whether or not the JSON decoding buffer should be reused.
+ * @tparam[opt] integer limit Largest buffer size kept between calls.
+ */
 /***
  * Configures the maximum number of nested
  * arrays/objects allowed when decoding.
@@ -0,0 +1,119 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Encoding and decoding of MessagePack values.
+ *
+ * MessagePack is a compact binary alternative to JSON, well suited to
+ * passing data between processes. Integers and floats are stored in
+ * binary, so they are decoded exactly as they were encoded, and
+ * strings are copied without escaping.
+ *
+ * Tables are handled as in the *json* library, and the *json*
+ * configuration (see *json.config*) also applies here: maximum
+ * nesting depth, sparse arrays, empty tables, the array metatables
+ * and skipping of unsupported types. As in the *json* library, nil
+ * values inside tables decode to *msgpack.null*.
+ *
+ * @module msgpack
+ */
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "callisto.h"
+#include "pack.h"
+
+/***
+ * Returns the given value encoded as MessagePack.
+ *
+ * Values of types MessagePack cannot represent, such as functions,
+ * are passed to *ext* if it is given. It should return an extension
+ * type number between -128 and 127 and a string of data, or nil to
+ * treat the value as unsupported.
+ *
+ * @function encode
+ * @usage
+local data = msgpack.encode({id = 1, tags = {"a", "b"}})
+ * @param value The value to encode.
+ * @tparam[opt] function ext The extension hook.
+ */
+
+/***
+ * Returns the value encoded in the given MessagePack string.
+ *
+ * Extension types are passed to *ext* as a type number and a string
+ * of data, and are replaced by what it returns. Without *ext*,
+ * extension types raise an error.
+ *
+ * @function decode
+ * @usage
+local t = msgpack.decode(data)
+print(t.id)
+ * @tparam string data The MessagePack data.
+ * @tparam[opt] function ext The extension hook.
+ */
+
+/***
+ * Returns a streaming decoder, which decodes values from data
+ * that arrives in chunks.
+ *
+ * *decoder:feed(chunk)* adds data to the decoder, and *decoder:next()*
+ * returns the next complete value, or nil if the data fed so far
+ * does not contain one.
+ *
+ * @function decoder
+ * @usage
+local d = msgpack.decoder()
+for chunk in chunks do
+	d:feed(chunk)
+	for value in d.next, d do
+		print(value)
+	end
+end
+ * @tparam[opt] function ext The extension hook, as for *msgpack.decode*.
+ */
+
+/***
+ * The value that nil is decoded to inside tables, equal to *json.null*.
+ *
+ * @field null
+ */
+
+static int
+msgpack_encode(lua_State *L)
+{
+	return pack_encode(L, PACK_MSGPACK);
+}
+
+static int
+msgpack_decode(lua_State *L)
+{
+	return pack_decode(L, PACK_MSGPACK);
+}
+
+static int
+msgpack_decoder(lua_State *L)
+{
+	return pack_decoder(L, PACK_MSGPACK);
+}
+
+/* clang-format off */
+
+static const luaL_Reg msgpacklib[] = {
+	{"decode",  msgpack_decode},
+	{"decoder", msgpack_decoder},
+	{"encode",  msgpack_encode},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+int
+luaopen_msgpack(lua_State *L)
+{
+	pack_newlib(L, msgpacklib);
+	return 1;
+}
@@ -9,7 +9,13 @@
  * @module process
  */
 
+#include <sys/wait.h>
+
+#include <errno.h>
+#include <poll.h>
 #include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -361,10 +367,380 @@ process_terminate(lua_State *L)
 	return sigsend(L, pid, "SIGTERM");
 }
 
+/*
+ * {==================================================================
+ * Parallel map
+ * ===================================================================
+ */
+
+#define PARALLEL_CHUNKS 4 /* chunks per worker by default */
+
+/* a forked worker */
+struct worker {
+	pid_t pid;
+	int cmd;          /* chunks to run, written by the parent */
+	int res;          /* results, read by the parent */
+	lua_Integer busy; /* first item of the chunk it runs, or 0 */
+};
+
+struct parallel {
+	struct worker *w;
+	int nw;
+	lua_Integer n;     /* items */
+	lua_Integer chunk; /* items in a chunk */
+	lua_Integer next;  /* first item of the next chunk to give out */
+};
+
+static int
+writefull(int fd, const void *p, size_t n)
+{
+	const char *s = p;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = write(fd, s, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		s += r;
+		n -= r;
+	}
+	return 0;
+}
+
+static int
+readfull(int fd, void *p, size_t n)
+{
+	char *s = p;
+	ssize_t r;
+
+	while (n > 0) {
+		if ((r = read(fd, s, n)) == -1) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0)
+			return -1;
+		s += r;
+		n -= r;
+	}
+	return 0;
+}
+
+/* pushes the function of the msgpack library called 'name' */
+static void
+getmsgpack(lua_State *L, const char *name)
+{
+	lua_getglobal(L, "require");
+	lua_pushliteral(L, "msgpack");
+	lua_call(L, 1, 1);
+	lua_getfield(L, -1, name);
+	lua_remove(L, -2);
+}
+
+/*
+ * Runs the chunks the parent sends, in a worker. A chunk's results are
+ * sent back as a status byte, a length and the results encoded with
+ * msgpack; status 1 means the function raised the error sent instead.
+ */
+static int
+workermain(lua_State *L)
+{
+	struct parallel *p = lua_touserdata(L, 3);
+	lua_Integer first, i, last;
+	int cmd, res, items, fn, encode;
+	uint32_t len;
+	const char *s;
+	size_t n;
+	char status;
+
+	items = 1;
+	fn = 2;
+	cmd = (int)lua_tointeger(L, 4);
+	res = (int)lua_tointeger(L, 5);
+	getmsgpack(L, "encode");
+	encode = lua_gettop(L);
+
+	while (readfull(cmd, &first, sizeof(first)) == 0) {
+		last = first + p->chunk - 1;
+		if (last > p->n)
+			last = p->n;
+		lua_pushvalue(L, encode);
+		lua_createtable(L, (int)(last - first + 1), 0);
+		status = 0;
+		for (i = first; i <= last; i++) {
+			lua_pushvalue(L, fn);
+			lua_geti(L, items, i);
+			lua_pushinteger(L, i);
+			if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+				status = 1;
+				lua_replace(L, -3);
+				lua_pop(L, 1);
+				luaL_tolstring(L, -1, NULL);
+				break;
+			}
+			lua_rawseti(L, -2, i - first + 1);
+		}
+		if (!status)
+			lua_call(L, 1, 1);
+		s = lua_tolstring(L, -1, &n);
+		len = (uint32_t)n;
+		if (writefull(res, &status, 1) == -1
+		    || writefull(res, &len, sizeof(len)) == -1
+		    || writefull(res, s, n) == -1 || status)
+			break;
+		lua_settop(L, encode);
+	}
+	return 0;
+}
+
+/* gives the next chunk to worker 'w', or tells it to exit */
+static void
+sendchunk(struct parallel *p, struct worker *w)
+{
+	if (p->next > p->n) {
+		close(w->cmd);
+		w->cmd = -1;
+		w->busy = 0;
+		return;
+	}
+	w->busy = p->next;
+	p->next += p->chunk;
+	if (writefull(w->cmd, &w->busy, sizeof(w->busy)) == -1)
+		w->busy = -1; /* it died; its results pipe reports that */
+}
+
+/*
+ * Reads the results of a chunk from worker 'w' into the table at
+ * index 2.
+ */
+static void
+readchunk(lua_State *L, struct parallel *p, struct worker *w)
+{
+	luaL_Buffer b;
+	lua_Integer i, last;
+	uint32_t len;
+	char status;
+
+	if (readfull(w->res, &status, 1) == -1
+	    || readfull(w->res, &len, sizeof(len)) == -1) {
+		luaL_error(L, "worker %d exited unexpectedly", (int)w->pid);
+		return;
+	}
+	getmsgpack(L, "decode");
+	luaL_buffinit(L, &b);
+	if (readfull(w->res, luaL_prepbuffsize(&b, len), len) == -1)
+		luaL_error(L, "worker %d exited unexpectedly", (int)w->pid);
+	luaL_addsize(&b, len);
+	luaL_pushresult(&b);
+	if (status) {
+		lua_error(L);
+		return;
+	}
+	lua_call(L, 1, 1);
+	last = w->busy + p->chunk - 1;
+	for (i = w->busy; i <= last && i <= p->n; i++) {
+		lua_geti(L, -1, i - w->busy + 1);
+		lua_seti(L, 2, i);
+	}
+	lua_pop(L, 1);
+}
+
+/* the parent's part of parallel, called protected */
+static int
+runparallel(lua_State *L)
+{
+	struct parallel *p = lua_touserdata(L, 1);
+	struct pollfd *fds;
+	int i, left, nfds;
+
+	lua_settop(L, 1);
+	lua_createtable(L, (int)p->n, 0);
+	fds = lua_newuserdatauv(L, p->nw * sizeof(*fds), 0);
+
+	for (i = 0; i < p->nw; i++)
+		sendchunk(p, &p->w[i]);
+	for (left = p->nw; left > 0;) {
+		for (nfds = 0, i = 0; i < p->nw; i++) {
+			if (p->w[i].busy == 0)
+				continue;
+			fds[nfds].fd = p->w[i].res;
+			fds[nfds].events = POLLIN;
+			fds[nfds++].revents = 0;
+		}
+		if (poll(fds, nfds, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			return luaL_error(L, "poll: %s", strerror(errno));
+		}
+		for (nfds = 0, i = 0; i < p->nw; i++) {
+			if (p->w[i].busy == 0)
+				continue;
+			if (fds[nfds++].revents == 0)
+				continue;
+			readchunk(L, p, &p->w[i]);
+			sendchunk(p, &p->w[i]);
+			if (p->w[i].busy == 0)
+				left--;
+		}
+	}
+	lua_pushvalue(L, 2);
+	return 1;
+}
+
+/***
+ * Maps a function over an array in forked worker processes.
+ *
+ * Calls `fn(item, index)` for each item of *items* and returns an
+ * array of the first value each call returned, in the order of the
+ * items. The calls are made by *jobs* processes forked from this one,
+ * which share its memory copy-on-write, so the items and anything
+ * else *fn* uses do not have to be copied to them; the garbage
+ * collector is stopped in the workers so that it does not copy pages
+ * by touching them. Changes *fn* makes to tables and globals stay in
+ * the worker that made them.
+ *
+ * The items are handed out in chunks of *chunk* items, giving a new
+ * chunk to each worker that finishes one. Results are sent back
+ * encoded with msgpack, so they can be any value *msgpack.encode*
+ * supports.
+ *
+ * *options* can have the following fields:
+ *
+ * - *jobs*: the number of workers; the default is the number of
+ *   processors.
+ * - *chunk*: the number of items in a chunk; by default each worker
+ *   gets about four chunks.
+ *
+ * If *fn* raises an error, the workers are killed and the error is
+ * raised again, converted to a string.
+ *
+ * @function parallel
+ * @usage
+local sizes = process.parallel(paths, function (path)
+	local f <close> = assert(io.open(path))
+	return #f:read("a")
+end, {jobs = 4})
+ * @tparam table items The array of items.
+ * @tparam function fn The function to call on each item.
+ * @tparam[opt] table options Options.
+ * @treturn table The results.
+ */
+static int
+process_parallel(lua_State *L)
+{
+	struct parallel p;
+	struct worker *w;
+	lua_Integer jobs, chunk, nchunks;
+	int cmd[2], res[2], error, i, j, status;
+	long cpus;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+	cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	jobs = cpus > 0 ? cpus : 1;
+	chunk = 0;
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "jobs");
+		jobs = luaL_optinteger(L, -1, jobs);
+		lua_getfield(L, 3, "chunk");
+		chunk = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 2);
+	}
+	luaL_argcheck(L, jobs > 0 && jobs <= PROCESS_MAX, 3,
+	    "jobs out of range");
+	luaL_argcheck(L, chunk >= 0, 3, "chunk must be positive");
+	lua_settop(L, 2);
+
+	memset(&p, 0, sizeof(p));
+	p.n = luaL_len(L, 1);
+	if (p.n <= 0) {
+		lua_newtable(L);
+		return 1;
+	}
+	if (chunk == 0)
+		chunk = (p.n + jobs * PARALLEL_CHUNKS - 1)
+		    / (jobs * PARALLEL_CHUNKS);
+	nchunks = (p.n + chunk - 1) / chunk;
+	p.chunk = chunk;
+	p.next = 1;
+	p.nw = (int)(jobs < nchunks ? jobs : nchunks);
+	p.w = lua_newuserdatauv(L, p.nw * sizeof(*p.w), 0);
+
+	fflush(NULL); /* or the workers write out what is buffered again */
+	for (i = 0; i < p.nw; i++) {
+		w = &p.w[i];
+		if (pipe(cmd) == -1)
+			break;
+		if (pipe(res) == -1) {
+			close(cmd[0]);
+			close(cmd[1]);
+			break;
+		}
+		if ((w->pid = fork()) == 0) {
+			for (j = 0; j < i; j++) {
+				close(p.w[j].cmd);
+				close(p.w[j].res);
+			}
+			close(cmd[1]);
+			close(res[0]);
+			lua_gc(L, LUA_GCSTOP);
+			lua_pushcfunction(L, workermain);
+			lua_pushvalue(L, 1);
+			lua_pushvalue(L, 2);
+			lua_pushlightuserdata(L, &p);
+			lua_pushinteger(L, cmd[0]);
+			lua_pushinteger(L, res[1]);
+			lua_pcall(L, 5, 0, 0);
+			fflush(NULL);
+			_exit(0);
+		}
+		error = errno;
+		close(cmd[0]);
+		close(res[1]);
+		w->cmd = cmd[1];
+		w->res = res[0];
+		if (w->pid == -1) {
+			close(w->cmd);
+			close(w->res);
+			errno = error;
+			break;
+		}
+	}
+	p.nw = i; /* fewer if some could not be started */
+
+	if (p.nw > 0) {
+		lua_pushcfunction(L, runparallel);
+		lua_pushlightuserdata(L, &p);
+		status = lua_pcall(L, 1, 1, 0);
+	} else {
+		status = LUA_ERRRUN;
+		lua_pushfstring(L, "cannot start workers: %s", strerror(errno));
+	}
+	for (i = 0; i < p.nw; i++) {
+		if (status != LUA_OK)
+			kill(p.w[i].pid, SIGKILL);
+		if (p.w[i].cmd != -1)
+			close(p.w[i].cmd);
+		close(p.w[i].res);
+		while (waitpid(p.w[i].pid, NULL, 0) == -1 && errno == EINTR)
+			;
+	}
+	if (status != LUA_OK)
+		return lua_error(L);
+	return 1;
+}
+
+/* }================================================================== */
+
 /* clang-format off */
 
 static const luaL_Reg proclib[] = {
 	{"kill",      process_kill},
+	{"parallel",  process_parallel},
 	{"pid",       process_pid},
 	{"pidof",     process_pidof},
 	{"send",      process_send},
@@ -0,0 +1,1522 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Sampling profiler.
+ *
+ * While the profiler is running, a CPU timer interrupts the program at
+ * a fixed interval. Each interruption records the Lua call stack of
+ * the thread that started the profiler, the next time that thread
+ * executes a Lua instruction. Stacks are kept in folded form: frames
+ * from the outermost to the innermost, separated by semicolons, as
+ * read by flame graph tools.
+ *
+ * Samples are taken in the thread that called *profiler.start*; time
+ * spent in coroutines is recorded when they return control to it.
+ * Time spent in a C function is counted in the Lua function that
+ * called it, and C functions called without a name, such as the
+ * interpreter itself, are left out of the stacks.
+ *
+ * The *-P* option of csto profiles a whole script.
+ *
+ * @module profiler
+ */
+
+#include <sys/time.h>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+#include <lua/lualib.h>
+
+#include "callisto.h"
+#include "util.h"
+
+#define PROF_INTERVAL 1000 /* default sampling interval, microseconds */
+#define PROF_MAXDEPTH 128  /* deepest stack recorded */
+#define PROF_BUFSIZE  16384
+#define PROF_NSTACKS  4096      /* slots for distinct stacks, a power of 2 */
+#define PROF_ARENA    (1 << 20) /* bytes for their folded text */
+
+/*
+ * The samples of a run, kept in a buffer allocated by profiler.start
+ * so that taking a sample allocates nothing from Lua. Each distinct
+ * stack is stored once, in an open-addressed table of slots whose
+ * folded text is in 'arena'. Samples that find neither a free slot
+ * nor room in the arena are only counted.
+ */
+struct profstack {
+	uint32_t hash;
+	uint32_t off; /* of the folded stack in the arena */
+	uint32_t len;
+	lua_Integer count; /* samples, 0 for a free slot */
+};
+
+struct profdata {
+	struct profstack stacks[PROF_NSTACKS];
+	int nstacks;
+	size_t used; /* bytes of the arena in use */
+	lua_Integer dropped;
+	char arena[PROF_ARENA];
+};
+
+static struct {
+	lua_State *L;  /* thread being sampled */
+	int running;
+	volatile sig_atomic_t pending;
+	/* hook displaced by a pending sample */
+	lua_Hook hook;
+	int mask;
+	int count;
+	lua_Integer samples;
+	struct profdata *data;
+	struct sigaction oldsa;
+	struct itimerval oldit;
+} prof;
+
+/* preallocated space for assembling samples */
+static char framebuf[PROF_BUFSIZE];  /* frame names, innermost first */
+static size_t frameoff[PROF_MAXDEPTH + 1];
+static char stackbuf[PROF_BUFSIZE];  /* the folded stack */
+
+static const char stackskey = 's'; /* registry key anchoring prof.data */
+static const char threadkey = 't'; /* registry key anchoring prof.L */
+
+/*
+ * Writes the name of the function described by 'ar' to 'buf'.
+ * Semicolons separate frames, so any in the name are replaced.
+ */
+static size_t
+framename(char *buf, size_t size, lua_Debug *ar)
+{
+	const char *name = ar->name ? ar->name : "?";
+	size_t i;
+	int n;
+
+	if (size == 0)
+		return 0;
+	if (*ar->what == 'm')
+		n = snprintf(buf, size, "main chunk (%s)", ar->short_src);
+	else if (*ar->what == 'C')
+		n = snprintf(buf, size, "%s [C]", name);
+	else
+		n = snprintf(buf, size, "%s (%s:%d)", name, ar->short_src,
+		    ar->linedefined);
+	if (n < 0)
+		return 0;
+	if ((size_t)n >= size)
+		n = size - 1;
+	for (i = 0; i < (size_t)n; i++) {
+		if (buf[i] == ';')
+			buf[i] = ':';
+	}
+	return n;
+}
+
+/*
+ * Counts a sample of the folded stack in 'stackbuf', of 'len' bytes.
+ */
+static void
+addsample(struct profdata *d, size_t len)
+{
+	struct profstack *st;
+	uint32_t hash, i;
+	size_t j;
+
+	hash = 2166136261u; /* FNV-1a */
+	for (j = 0; j < len; j++)
+		hash = (hash ^ (unsigned char)stackbuf[j]) * 16777619u;
+	for (i = hash;; i++) {
+		st = &d->stacks[i & (PROF_NSTACKS - 1)];
+		if (st->count == 0)
+			break;
+		if (st->hash == hash && st->len == len
+		    && memcmp(d->arena + st->off, stackbuf, len) == 0) {
+			st->count++;
+			return;
+		}
+	}
+	/* keep a quarter of the slots free so that probes stay short */
+	if (d->nstacks >= PROF_NSTACKS / 4 * 3 || len > PROF_ARENA - d->used) {
+		d->dropped++;
+		return;
+	}
+	memcpy(d->arena + d->used, stackbuf, len);
+	st->hash = hash;
+	st->off = d->used;
+	st->len = len;
+	st->count = 1;
+	d->used += len;
+	d->nstacks++;
+}
+
+/*
+ * Records the current stack of L.
+ */
+static void
+sample(lua_State *L)
+{
+	lua_Debug ar;
+	size_t len, out;
+	int depth, level, i;
+
+	len = 0;
+	depth = 0;
+	for (level = 0; depth < PROF_MAXDEPTH
+	    && lua_getstack(L, level, &ar); level++) {
+		lua_getinfo(L, "Sn", &ar);
+		if (*ar.what == 'C' && ar.name == NULL)
+			continue; /* called from C, such as the interpreter */
+		frameoff[depth++] = len;
+		len += framename(framebuf + len, sizeof(framebuf) - len, &ar);
+	}
+	frameoff[depth] = len;
+	if (depth == 0)
+		return;
+
+	out = 0;
+	if (lua_getstack(L, level, &ar)) { /* stack too deep? */
+		memcpy(stackbuf, "[truncated];", 12);
+		out = 12;
+	}
+	for (i = depth - 1; i >= 0; i--) {
+		len = frameoff[i + 1] - frameoff[i];
+		if (out + len + 1 > sizeof(stackbuf))
+			break;
+		memcpy(stackbuf + out, framebuf + frameoff[i], len);
+		out += len;
+		if (i > 0)
+			stackbuf[out++] = ';';
+	}
+
+	addsample(prof.data, out);
+	prof.samples++;
+}
+
+/*
+ * Hook set by the signal handler; takes one sample and restores the
+ * hook that was in place before.
+ */
+static void
+profhook(lua_State *L, lua_Debug *ar)
+{
+	(void)ar;
+	lua_sethook(L, prof.hook, prof.mask, prof.count);
+	prof.pending = 0;
+	if (prof.running) /* not displaced until after profiler.stop? */
+		sample(L);
+}
+
+/*
+ * Function called at each SIGPROF. As with SIGINT in csto, a signal
+ * cannot safely change a Lua state, so this only sets a hook that
+ * takes the sample.
+ */
+static void
+profaction(int sig)
+{
+	(void)sig;
+	if (prof.pending)
+		return;
+	prof.pending = 1;
+	prof.hook = lua_gethook(prof.L);
+	prof.mask = lua_gethookmask(prof.L);
+	prof.count = lua_gethookcount(prof.L);
+	lua_sethook(prof.L, profhook, LUA_MASKCOUNT, 1);
+}
+
+/*
+ * Pushes a table mapping each stack recorded in 'd' to its samples.
+ */
+static void
+pushstacks(lua_State *L, struct profdata *d)
+{
+	struct profstack *st;
+
+	lua_createtable(L, 0, d->nstacks + (d->dropped > 0));
+	for (st = d->stacks; st < d->stacks + PROF_NSTACKS; st++) {
+		if (st->count == 0)
+			continue;
+		lua_pushlstring(L, d->arena + st->off, st->len);
+		lua_pushinteger(L, st->count);
+		lua_rawset(L, -3);
+	}
+	if (d->dropped > 0) {
+		lua_pushinteger(L, d->dropped);
+		lua_setfield(L, -2, "[dropped]");
+	}
+}
+
+/*
+ * Returns the per-function table for the stack counts at the top of
+ * the stack: for each frame name, the samples in which it was the
+ * innermost frame (self) and those it appeared in at all (total).
+ */
+static void
+pushfunctions(lua_State *L)
+{
+	const char *stack, *p, *q, *end;
+	lua_Integer n, serial;
+	size_t len;
+	int stacks, funcs, seen;
+
+	stacks = lua_gettop(L);
+	lua_newtable(L);
+	funcs = lua_gettop(L);
+	lua_newtable(L); /* last stack each name was counted in */
+	seen = lua_gettop(L);
+
+	serial = 0;
+	lua_pushnil(L);
+	while (lua_next(L, stacks)) {
+		stack = lua_tolstring(L, -2, &len);
+		n = lua_tointeger(L, -1);
+		end = stack + len;
+		serial++;
+		for (p = stack; p <= end; p = q + 1) {
+			if ((q = memchr(p, ';', end - p)) == NULL)
+				q = end;
+			lua_pushlstring(L, p, q - p);
+			if (lua_rawget(L, funcs) != LUA_TTABLE) {
+				lua_pop(L, 1);
+				lua_createtable(L, 0, 2);
+				lua_pushinteger(L, 0);
+				lua_setfield(L, -2, "self");
+				lua_pushinteger(L, 0);
+				lua_setfield(L, -2, "total");
+				lua_pushlstring(L, p, q - p);
+				lua_pushvalue(L, -2);
+				lua_rawset(L, funcs);
+			}
+			/* count recursive functions once per stack */
+			lua_pushlstring(L, p, q - p);
+			if (lua_rawget(L, seen) != LUA_TNUMBER
+			    || lua_tointeger(L, -1) != serial) {
+				lua_getfield(L, -2, "total");
+				lua_pushinteger(L, lua_tointeger(L, -1) + n);
+				lua_setfield(L, -4, "total");
+				lua_pop(L, 1);
+				lua_pushlstring(L, p, q - p);
+				lua_pushinteger(L, serial);
+				lua_rawset(L, seen);
+			}
+			lua_pop(L, 1);
+			if (q == end) { /* innermost frame */
+				lua_getfield(L, -1, "self");
+				lua_pushinteger(L, lua_tointeger(L, -1) + n);
+				lua_setfield(L, -3, "self");
+				lua_pop(L, 1);
+			}
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1); /* seen */
+}
+
+/***
+ * Starts the profiler.
+ *
+ * Samples are taken every *interval* microseconds of CPU time used by
+ * the process; the default is 1000 (1 millisecond), though the system
+ * may round it up to its clock tick. Any samples from a previous run
+ * are discarded.
+ *
+ * @function start
+ * @usage
+profiler.start()
+work()
+local stacks, functions = profiler.stop()
+ * @tparam[opt] integer interval The sampling interval in microseconds.
+ */
+static int
+profiler_start(lua_State *L)
+{
+	struct sigaction sa;
+	struct itimerval it;
+	lua_Integer interval;
+
+	interval = luaL_optinteger(L, 1, PROF_INTERVAL);
+	luaL_argcheck(L, interval > 0, 1, "interval must be positive");
+	if (prof.running)
+		return luaL_error(L, "profiler already running");
+
+	prof.data = lua_newuserdatauv(L, sizeof(*prof.data), 0);
+	memset(prof.data->stacks, 0, sizeof(prof.data->stacks));
+	prof.data->nstacks = 0;
+	prof.data->used = 0;
+	prof.data->dropped = 0;
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &stackskey);
+	lua_pushthread(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &threadkey);
+	prof.L = L;
+	prof.pending = 0;
+	prof.samples = 0;
+
+	sa.sa_handler = profaction;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, &prof.oldsa) != 0)
+		return luaL_error(L, "cannot set SIGPROF handler: %s",
+		    strerror(errno));
+	it.it_interval.tv_sec = interval / 1000000;
+	it.it_interval.tv_usec = interval % 1000000;
+	it.it_value = it.it_interval;
+	if (setitimer(ITIMER_PROF, &it, &prof.oldit) != 0) {
+		sigaction(SIGPROF, &prof.oldsa, NULL);
+		return luaL_error(L, "cannot start profiling timer: %s",
+		    strerror(errno));
+	}
+	prof.running = 1;
+	return 0;
+}
+
+/***
+ * Stops the profiler and returns what it recorded.
+ *
+ * The first result maps each folded stack to the number of samples
+ * taken in it. Samples taken once about 3000 distinct stacks, or 1 MiB
+ * of them, have been recorded are counted under *[dropped]* unless
+ * their stack was seen before. The second maps each function, named as in the stacks,
+ * to a table with fields *self*, the samples in which it was running,
+ * and *total*, the samples in which it was on the stack.
+ *
+ * @function stop
+ * @usage
+local stacks = profiler.stop()
+for stack, count in pairs(stacks) do
+	print(stack, count)
+end
+ * @treturn table The sample counts of each stack.
+ * @treturn table The sample counts of each function.
+ */
+static int
+profiler_stop(lua_State *L)
+{
+	if (!prof.running)
+		return luaL_error(L, "profiler not running");
+
+	setitimer(ITIMER_PROF, &prof.oldit, NULL);
+	sigaction(SIGPROF, &prof.oldsa, NULL);
+	if (prof.pending && lua_gethook(prof.L) == profhook)
+		lua_sethook(prof.L, prof.hook, prof.mask, prof.count);
+	prof.pending = 0;
+	prof.running = 0;
+
+	pushstacks(L, prof.data);
+	pushfunctions(L);
+	prof.data = NULL;
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &stackskey);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &threadkey);
+	return 2;
+}
+
+/***
+ * Returns whether the profiler is running and the number of samples
+ * taken since it was started.
+ *
+ * @function status
+ * @usage
+local running, samples = profiler.status()
+ * @treturn boolean Whether the profiler is running.
+ * @treturn integer The number of samples taken.
+ */
+static int
+profiler_status(lua_State *L)
+{
+	lua_pushboolean(L, prof.running);
+	lua_pushinteger(L, prof.samples);
+	return 2;
+}
+
+/*
+ * Call tracing.
+ *
+ * While tracing, call and return hooks time every function call in
+ * the thread that started the trace. Completed calls go into a ring
+ * buffer of fixed size, so a long trace keeps its most recent events.
+ * Functions are named once, the first time they are called, and the
+ * name is cached by function.
+ *
+ * Frames are told apart by their depth in the call stack, which a
+ * counter follows from call to return. Errors leave frames without a
+ * return, and another hook may displace this one for a while, so the
+ * counter is checked against the stack at each event and recounted
+ * when it is wrong.
+ */
+
+#define TRACE_SIZE  65536 /* default ring buffer size, in events */
+#define TRACE_DEPTH 256   /* deepest call tracked */
+
+struct traceevent {
+	uint64_t ts;  /* start, in nanoseconds */
+	uint64_t dur;
+	int id;       /* index of the name */
+};
+
+struct traceframe {
+	int level; /* depth in the call stack, identifies the frame */
+	uint64_t ts;
+	int id;
+};
+
+static struct {
+	lua_State *L;  /* thread being traced */
+	int running;
+	struct traceevent *events;
+	size_t size;
+	size_t count;  /* events recorded, including overwritten ones */
+	uint64_t min;  /* shortest call recorded, in nanoseconds */
+	int filter;    /* whether a category filter is set */
+	int nids;
+	int level;     /* depth of the call stack at the last event */
+	int depth;
+	struct traceframe frames[TRACE_DEPTH];
+	/* hook in place before tracing */
+	lua_Hook hook;
+	int hookmask;
+	int hookcount;
+} trace;
+
+static const char cachekey = 'c';  /* function -> name index */
+static const char nameskey = 'n';  /* name index -> {name, category} */
+static const char eventskey = 'e'; /* anchors trace.events */
+static const char tracethrkey = 'T'; /* anchors trace.L */
+static const char filterkey = 'f'; /* {string.find, pattern} */
+
+static uint64_t
+monotime(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Pushes the name under which the function on the top of the stack
+ * is found in a loaded library, such as "fs.copy", and the name of
+ * the library. Returns 0 and pushes nothing if it is not found.
+ */
+static int
+pushlibname(lua_State *L)
+{
+	int fn, global, loaded;
+
+	luaL_checkstack(L, 8, "not enough stack");
+	fn = lua_gettop(L);
+	lua_pushnil(L); /* name in the global table, if any */
+	global = fn + 1;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	loaded = fn + 2;
+	lua_pushnil(L);
+	while (lua_next(L, loaded)) {
+		if (lua_type(L, -2) != LUA_TSTRING || !lua_istable(L, -1)) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_pushnil(L);
+		while (lua_next(L, -2)) {
+			if (lua_type(L, -2) != LUA_TSTRING
+			    || !lua_rawequal(L, -1, fn)) {
+				lua_pop(L, 1);
+				continue;
+			}
+			/* prefer a library over the global table */
+			if (strcmp(lua_tostring(L, loaded + 1), LUA_GNAME) != 0) {
+				lua_pushfstring(L, "%s.%s",
+				    lua_tostring(L, loaded + 1),
+				    lua_tostring(L, loaded + 3));
+				lua_replace(L, fn + 1);
+				lua_pushvalue(L, loaded + 1);
+				lua_replace(L, fn + 2);
+				lua_settop(L, fn + 2);
+				return 1;
+			}
+			lua_pushvalue(L, -2);
+			lua_replace(L, global);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+	}
+	if (lua_isnil(L, global)) {
+		lua_settop(L, fn);
+		return 0;
+	}
+	lua_pushliteral(L, LUA_GNAME);
+	lua_replace(L, loaded);
+	return 1;
+}
+
+/*
+ * Returns whether 'cat' passes the filter.
+ */
+static int
+tracefilter(lua_State *L, int cat)
+{
+	int pass;
+
+	if (!trace.filter)
+		return 1;
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &filterkey);
+	lua_rawgeti(L, -1, 1);
+	lua_pushvalue(L, cat);
+	lua_rawgeti(L, -3, 2);
+	lua_call(L, 2, 1);
+	pass = lua_toboolean(L, -1);
+	lua_pop(L, 2);
+	return pass;
+}
+
+/*
+ * Gives the function on the top of the stack a name index, or -1 if
+ * it is filtered out.
+ */
+static int
+newid(lua_State *L, lua_Debug *ar)
+{
+	char buf[LUA_IDSIZE + 64];
+	int top, id;
+
+	top = lua_gettop(L);
+	lua_getinfo(L, "Sn", ar);
+	if (*ar->what == 'C') {
+		if (!pushlibname(L)) {
+			lua_pushstring(L, ar->name ? ar->name : "?");
+			lua_pushliteral(L, "C");
+		}
+	} else {
+		lua_pushlstring(L, buf, framename(buf, sizeof(buf), ar));
+		lua_pushstring(L, ar->short_src);
+	}
+	id = -1;
+	if (tracefilter(L, top + 2)) {
+		id = ++trace.nids;
+		lua_rawgetp(L, LUA_REGISTRYINDEX, &nameskey);
+		lua_createtable(L, 2, 0);
+		lua_pushvalue(L, top + 1);
+		lua_rawseti(L, -2, 1);
+		lua_pushvalue(L, top + 2);
+		lua_rawseti(L, -2, 2);
+		lua_rawseti(L, -2, id);
+	}
+	lua_settop(L, top);
+	return id;
+}
+
+/*
+ * Returns the name index of the function running in 'ar'.
+ */
+static int
+funcid(lua_State *L, lua_Debug *ar)
+{
+	int id;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &cachekey);
+	lua_getinfo(L, "f", ar);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, -3) == LUA_TNUMBER) {
+		id = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+		return id;
+	}
+	lua_pop(L, 1);
+	id = newid(L, ar);
+	lua_pushinteger(L, id);
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+	return id;
+}
+
+static void
+record(struct traceframe *f, uint64_t now)
+{
+	struct traceevent *ev;
+
+	if (f->id < 0 || now - f->ts < trace.min)
+		return;
+	ev = &trace.events[trace.count++ % trace.size];
+	ev->ts = f->ts;
+	ev->dur = now - f->ts;
+	ev->id = f->id;
+}
+
+/*
+ * Returns the number of active functions in L, expected to be 'hint'.
+ */
+static int
+stackdepth(lua_State *L, int hint)
+{
+	lua_Debug ar;
+	int lo, hi, mid;
+
+	if (hint > 0 && lua_getstack(L, hint - 1, &ar)
+	    && !lua_getstack(L, hint, &ar))
+		return hint;
+	if (!lua_getstack(L, 0, &ar))
+		return 0;
+	/* level lo - 1 exists and level hi does not */
+	lo = hi = 1;
+	while (lua_getstack(L, hi, &ar)) {
+		lo = hi + 1;
+		hi *= 2;
+	}
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (lua_getstack(L, mid, &ar))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Call and return hook. Frames deeper than the function called or
+ * returning were left by an error and are dropped.
+ */
+static void
+tracehook(lua_State *L, lua_Debug *ar)
+{
+	int i, level, match;
+
+	if (!trace.running) { /* restored by a hook that displaced it */
+		if (L == trace.L)
+			lua_sethook(L, trace.hook, trace.hookmask, trace.hookcount);
+		else
+			lua_sethook(L, NULL, 0, 0);
+		return;
+	}
+	if (L != trace.L)
+		return;
+	level = stackdepth(L, trace.level);
+	for (i = trace.depth; i > 0 && trace.frames[i - 1].level >= level; i--)
+		;
+	match = i < trace.depth && trace.frames[i].level == level;
+	if (ar->event == LUA_HOOKRET) {
+		if (match) /* not entered before tracing started? */
+			record(&trace.frames[i], monotime());
+		trace.depth = i;
+		trace.level = level - 1;
+		return;
+	}
+	if (match && ar->event == LUA_HOOKTAILCALL)
+		record(&trace.frames[i], monotime());
+	trace.depth = i;
+	trace.level = level;
+	if (trace.depth == TRACE_DEPTH)
+		return;
+	i = trace.depth++;
+	trace.frames[i].level = level;
+	trace.frames[i].id = funcid(L, ar);
+	trace.frames[i].ts = monotime();
+}
+
+/***
+ * Starts tracing calls.
+ *
+ * Every call made by the calling thread, to Lua and C functions
+ * alike, is timed until *profiler.tracestop* is called. The most
+ * recent calls are kept, up to the buffer size.
+ *
+ * *options* can have the following fields:
+ *
+ * - *filter*: a pattern matched against the category of each
+ *   function, which is the library name for library functions
+ *   (for instance `fs` or `json`) and the source for Lua functions.
+ *   Calls to functions that do not match are not recorded.
+ * - *min*: the shortest call recorded, in microseconds.
+ * - *size*: the number of calls kept; the default is 65536.
+ *
+ * @function tracestart
+ * @usage
+profiler.tracestart({filter = "^fs$", min = 10})
+fs.copy("a", "b")
+profiler.tracestop("trace.json")
+ * @tparam[opt] table options Tracing options.
+ */
+static int
+profiler_tracestart(lua_State *L)
+{
+	lua_Integer size;
+	lua_Number min;
+
+	size = TRACE_SIZE;
+	min = 0;
+	if (!lua_isnoneornil(L, 1)) {
+		luaL_checktype(L, 1, LUA_TTABLE);
+		lua_getfield(L, 1, "size");
+		size = luaL_optinteger(L, -1, TRACE_SIZE);
+		lua_getfield(L, 1, "min");
+		min = luaL_optnumber(L, -1, 0);
+		lua_getfield(L, 1, "filter");
+		luaL_argexpected(L, lua_isnoneornil(L, -1)
+		    || lua_type(L, -1) == LUA_TSTRING, 1, "filter string");
+	} else
+		lua_pushnil(L);
+	luaL_argcheck(L, size > 0 && (size_t)size < SIZE_MAX
+	    / sizeof(struct traceevent), 1, "size out of range");
+	luaL_argcheck(L, min >= 0, 1, "min must not be negative");
+	if (trace.running)
+		return luaL_error(L, "trace already running");
+
+	trace.filter = !lua_isnil(L, -1);
+	if (trace.filter) {
+		lua_createtable(L, 2, 0);
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+		lua_getfield(L, -1, LUA_STRLIBNAME);
+		lua_getfield(L, -1, "find");
+		lua_rawseti(L, -4, 1);
+		lua_pop(L, 2);
+		lua_pushvalue(L, -2);
+		lua_rawseti(L, -2, 2);
+		lua_rawsetp(L, LUA_REGISTRYINDEX, &filterkey);
+	}
+	trace.events = lua_newuserdatauv(L, size * sizeof(struct traceevent),
+	    0);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &eventskey);
+	lua_newtable(L);
+	lua_createtable(L, 0, 1);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &cachekey);
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &nameskey);
+	lua_pushthread(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &tracethrkey);
+
+	trace.L = L;
+	trace.size = size;
+	trace.count = 0;
+	trace.min = min * 1000;
+	trace.nids = 0;
+	trace.level = stackdepth(L, 0);
+	trace.depth = 0;
+	trace.hook = lua_gethook(L);
+	trace.hookmask = lua_gethookmask(L);
+	trace.hookcount = lua_gethookcount(L);
+	trace.running = 1;
+	lua_sethook(L, tracehook, LUA_MASKCALL | LUA_MASKRET, 0);
+	return 0;
+}
+
+static void
+addjsonstr(luaL_Buffer *b, const char *s)
+{
+	char esc[8];
+
+	luaL_addchar(b, '"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			luaL_addchar(b, '\\');
+			luaL_addchar(b, *s);
+		} else if ((unsigned char)*s < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+			luaL_addstring(b, esc);
+		} else
+			luaL_addchar(b, *s);
+	}
+	luaL_addchar(b, '"');
+}
+
+/*
+ * Pushes the recorded events in the trace event format.
+ */
+static void
+pushtrace(lua_State *L)
+{
+	char num[128];
+	const char *name, *cat;
+	luaL_Buffer b;
+	struct traceevent *ev;
+	size_t i, first;
+	int frags, id, pid;
+
+	/* the name and category of each function, quoted */
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &nameskey);
+	lua_createtable(L, trace.nids, 0);
+	frags = lua_gettop(L);
+	for (id = 1; id <= trace.nids; id++) {
+		lua_rawgeti(L, frags - 1, id);
+		lua_rawgeti(L, -1, 1);
+		lua_rawgeti(L, -2, 2);
+		name = lua_tostring(L, -2);
+		cat = lua_tostring(L, -1);
+		luaL_buffinit(L, &b);
+		luaL_addstring(&b, "\n{\"name\":");
+		addjsonstr(&b, name);
+		luaL_addstring(&b, ",\"cat\":");
+		addjsonstr(&b, cat);
+		luaL_pushresult(&b);
+		lua_rawseti(L, frags, id);
+		lua_pop(L, 3);
+	}
+
+	pid = getpid();
+	first = trace.count > trace.size ? trace.count - trace.size : 0;
+	luaL_buffinit(L, &b);
+	luaL_addstring(&b, "{\"traceEvents\":[");
+	for (i = first; i < trace.count; i++) {
+		ev = &trace.events[i % trace.size];
+		if (i > first)
+			luaL_addchar(&b, ',');
+		lua_rawgeti(L, frags, ev->id);
+		luaL_addvalue(&b);
+		snprintf(num, sizeof(num),
+		    ",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d}",
+		    ev->ts / 1e3, ev->dur / 1e3, pid, pid);
+		luaL_addstring(&b, num);
+	}
+	snprintf(num, sizeof(num),
+	    "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%lu}}\n",
+	    (unsigned long)first);
+	luaL_addstring(&b, num);
+	luaL_pushresult(&b);
+	lua_replace(L, frags - 1);
+	lua_pop(L, 1);
+}
+
+/***
+ * Stops tracing calls and returns the trace.
+ *
+ * The trace is a JSON document in the trace event format read by
+ * chrome://tracing and Perfetto. If *file* is given, the trace is
+ * written to it and the number of calls recorded is returned instead.
+ * The number of older calls that did not fit in the buffer is given
+ * as *otherData.dropped* in the trace.
+ *
+ * @function tracestop
+ * @usage
+profiler.tracestart()
+work()
+fs.writefile("trace.json", profiler.tracestop())
+ * @tparam[opt] string file The file to write the trace to.
+ * @treturn string|integer The trace, or the number of calls in it.
+ */
+static int
+profiler_tracestop(lua_State *L)
+{
+	const char *file, *s;
+	size_t len, n;
+	FILE *fp;
+	int ok;
+
+	file = luaL_optstring(L, 1, NULL);
+	if (!trace.running)
+		return luaL_error(L, "trace not running");
+
+	if (lua_gethook(trace.L) == tracehook)
+		lua_sethook(trace.L, trace.hook, trace.hookmask, trace.hookcount);
+	trace.running = 0;
+	pushtrace(L);
+	n = trace.count > trace.size ? trace.size : trace.count;
+
+	trace.events = NULL;
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &eventskey);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &cachekey);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &nameskey);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &tracethrkey);
+	lua_pushnil(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &filterkey);
+
+	if (file == NULL)
+		return 1;
+	if ((fp = fopen(file, "w")) == NULL)
+		return lfail(L);
+	s = lua_tolstring(L, -1, &len);
+	ok = fwrite(s, 1, len, fp) == len;
+	if (fclose(fp) != 0 || !ok)
+		return lfail(L);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+/*
+ * Heap profiling.
+ *
+ * While heap profiling, the state's allocator is wrapped by one that
+ * takes a sample every HEAP_RATE bytes allocated. A sample stands for
+ * the bytes since the one before, and stays live until its block is
+ * freed. The allocator may run while the state is half updated, for
+ * instance while the stack is being moved, so it does not read the
+ * frames: a new sample is left pending with the depth of the main
+ * thread's stack, and a hook attributes it at the next instruction or
+ * return in the main thread, to the innermost Lua line among the
+ * frames that were there when it was allocated. When the profiler
+ * is off, the allocator is not wrapped at all.
+ */
+
+#define HEAP_RATE 16384 /* default sampling rate, in bytes */
+#define HEAP_TOP  50    /* sites listed in each part of a report */
+
+struct memsample {
+	void *p;       /* the sampled block, or NULL */
+	size_t weight; /* bytes the sample stands for */
+	int site;
+};
+
+struct mempending {
+	void *p;
+	size_t weight;
+	int depth; /* of the main thread's stack when allocated */
+};
+
+struct memsite {
+	char *name;
+	size_t live;
+	size_t total;
+	size_t samples;
+};
+
+static struct {
+	lua_State *L;    /* main thread, where samples are attributed */
+	int running;
+	lua_Alloc alloc; /* the allocator wrapped */
+	void *ud;
+	size_t rate;
+	long long next;  /* bytes left until the next sample */
+	/* live samples, by address */
+	struct memsample *samples;
+	size_t nsamples;
+	size_t samplecap;
+	/* samples not yet attributed to a site */
+	struct mempending *pending;
+	size_t npending;
+	size_t pendingcap;
+	/* sites, with an index by name */
+	struct memsite *sites;
+	size_t nsites;
+	size_t sitecap;
+	int *siteidx;
+	size_t idxcap;
+	size_t lost;     /* samples not recorded for lack of memory */
+} mem;
+
+/* hook displaced by memhook, kept apart as memclear would clear it */
+static struct {
+	lua_Hook hook;
+	int mask;
+	int count;
+} memprev;
+
+static size_t
+ptrhash(void *p)
+{
+	uint64_t x = (uintptr_t)p;
+
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdULL;
+	x ^= x >> 33;
+	return (size_t)x;
+}
+
+static size_t
+strhash(const char *s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	for (; *s != '\0'; s++)
+		h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+	return (size_t)h;
+}
+
+/*
+ * Returns the slot of 'p' in the sample table, or of the empty slot
+ * where it would go.
+ */
+static size_t
+sampleslot(void *p)
+{
+	size_t i;
+
+	for (i = ptrhash(p) & (mem.samplecap - 1); mem.samples[i].p != NULL
+	    && mem.samples[i].p != p; i = (i + 1) & (mem.samplecap - 1))
+		;
+	return i;
+}
+
+static int
+samplegrow(void)
+{
+	struct memsample *old;
+	size_t i, oldcap;
+
+	old = mem.samples;
+	oldcap = mem.samplecap;
+	mem.samplecap = oldcap ? oldcap * 2 : 1024;
+	if ((mem.samples = calloc(mem.samplecap, sizeof(*old))) == NULL) {
+		mem.samples = old;
+		mem.samplecap = oldcap;
+		return 0;
+	}
+	for (i = 0; i < oldcap; i++) {
+		if (old[i].p != NULL)
+			mem.samples[sampleslot(old[i].p)] = old[i];
+	}
+	free(old);
+	return 1;
+}
+
+/*
+ * Removes the sample of the block 'p', if it has one.
+ */
+static void
+sampleremove(void *p)
+{
+	struct memsample *s;
+	size_t i, j, k;
+
+	i = sampleslot(p);
+	s = &mem.samples[i];
+	if (s->p == NULL)
+		return;
+	if (s->site >= 0) /* attributed? */
+		mem.sites[s->site].live -= s->weight;
+	mem.nsamples--;
+
+	/* shift back the entries after it */
+	for (j = (i + 1) & (mem.samplecap - 1); mem.samples[j].p != NULL;
+	    j = (j + 1) & (mem.samplecap - 1)) {
+		k = ptrhash(mem.samples[j].p) & (mem.samplecap - 1);
+		if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+			mem.samples[i] = mem.samples[j];
+			i = j;
+		}
+	}
+	mem.samples[i].p = NULL;
+}
+
+/*
+ * Returns the index of the site 'name', adding it if needed, or -1.
+ */
+static int
+siteget(const char *name)
+{
+	struct memsite *ns;
+	size_t i, cap;
+	int *ni;
+
+	if ((mem.nsites + 1) * 2 > mem.idxcap) {
+		cap = mem.idxcap ? mem.idxcap * 2 : 256;
+		if ((ni = malloc(cap * sizeof(*ni))) == NULL)
+			return -1;
+		for (i = 0; i < cap; i++)
+			ni[i] = -1;
+		free(mem.siteidx);
+		mem.siteidx = ni;
+		mem.idxcap = cap;
+		for (i = 0; i < mem.nsites; i++) {
+			size_t j = strhash(mem.sites[i].name) & (cap - 1);
+			while (ni[j] >= 0)
+				j = (j + 1) & (cap - 1);
+			ni[j] = i;
+		}
+	}
+	for (i = strhash(name) & (mem.idxcap - 1); mem.siteidx[i] >= 0;
+	    i = (i + 1) & (mem.idxcap - 1)) {
+		if (strcmp(mem.sites[mem.siteidx[i]].name, name) == 0)
+			return mem.siteidx[i];
+	}
+
+	if (mem.nsites == mem.sitecap) {
+		cap = mem.sitecap ? mem.sitecap * 2 : 64;
+		if ((ns = realloc(mem.sites, cap * sizeof(*ns))) == NULL)
+			return -1;
+		mem.sites = ns;
+		mem.sitecap = cap;
+	}
+	ns = &mem.sites[mem.nsites];
+	if ((ns->name = strdup(name)) == NULL)
+		return -1;
+	ns->live = ns->total = ns->samples = 0;
+	mem.siteidx[i] = mem.nsites;
+	return mem.nsites++;
+}
+
+/*
+ * Returns the index of the site of the code running in the main
+ * thread, from stack level 'from' outwards, or -1.
+ */
+static int
+memsite(int from)
+{
+	char name[LUA_IDSIZE + 32];
+	lua_Debug ar;
+	int level;
+
+	strcpy(name, "[C]");
+	for (level = from; lua_getstack(mem.L, level, &ar); level++) {
+		lua_getinfo(mem.L, "Sl", &ar);
+		if (ar.currentline > 0) {
+			snprintf(name, sizeof(name), "%s:%d", ar.short_src,
+			    ar.currentline);
+			break;
+		}
+	}
+	return siteget(name);
+}
+
+/*
+ * Attributes the pending samples to the code running in the main
+ * thread. Only called where its stack can be read.
+ */
+static void
+memattribute(void)
+{
+	struct mempending *pd;
+	struct memsample *s;
+	int depth, from, site, last;
+
+	if (mem.npending == 0)
+		return;
+	depth = stackdepth(mem.L, 0);
+	site = last = -1;
+	for (pd = mem.pending; pd < mem.pending + mem.npending; pd++) {
+		/* skip the frames entered since the allocation */
+		from = pd->depth < depth ? depth - pd->depth : 0;
+		if (from != last) {
+			site = memsite(from);
+			last = from;
+		}
+		if (site < 0) {
+			mem.lost++;
+			continue;
+		}
+		mem.sites[site].total += pd->weight;
+		mem.sites[site].samples++;
+		/* the block may have been freed since */
+		s = &mem.samples[sampleslot(pd->p)];
+		if (s->p == pd->p && s->site < 0) {
+			s->site = site;
+			mem.sites[site].live += s->weight;
+		}
+	}
+	mem.npending = 0;
+}
+
+/*
+ * Hook set by the allocator to attribute pending samples, at the next
+ * instruction or return, whichever comes first: memory allocated by a
+ * C function is attributed before the function returns.
+ */
+static void
+memhook(lua_State *L, lua_Debug *ar)
+{
+	(void)ar;
+	lua_sethook(L, memprev.hook, memprev.mask, memprev.count);
+	if (mem.running)
+		memattribute();
+}
+
+static void
+sampleadd(void *p, size_t weight)
+{
+	struct mempending *pd;
+	struct memsample *s;
+	size_t cap;
+
+	if ((mem.nsamples + 1) * 2 > mem.samplecap && !samplegrow()) {
+		mem.lost++;
+		return;
+	}
+	if (mem.npending == mem.pendingcap) {
+		cap = mem.pendingcap ? mem.pendingcap * 2 : 16;
+		if ((pd = realloc(mem.pending, cap * sizeof(*pd))) == NULL) {
+			mem.lost++;
+			return;
+		}
+		mem.pending = pd;
+		mem.pendingcap = cap;
+	}
+	pd = &mem.pending[mem.npending++];
+	pd->p = p;
+	pd->weight = weight;
+	pd->depth = stackdepth(mem.L, 0); /* follows links, reads no frame */
+	s = &mem.samples[sampleslot(p)];
+	s->p = p;
+	s->weight = weight;
+	s->site = -1;
+	mem.nsamples++;
+
+	if (lua_gethook(mem.L) != memhook) {
+		memprev.hook = lua_gethook(mem.L);
+		memprev.mask = lua_gethookmask(mem.L);
+		memprev.count = lua_gethookcount(mem.L);
+		lua_sethook(mem.L, memhook, LUA_MASKCOUNT | LUA_MASKRET, 1);
+	}
+}
+
+/*
+ * The allocator used while heap profiling.
+ */
+static void *
+memalloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	void *np;
+	long long k;
+
+	(void)ud;
+	np = mem.alloc(mem.ud, ptr, osize, nsize);
+	if (nsize > 0 && np == NULL)
+		return NULL; /* nothing changed */
+	if (ptr != NULL && mem.nsamples > 0)
+		sampleremove(ptr);
+	if (nsize > 0 && (mem.next -= nsize) <= 0) {
+		k = 1 + -mem.next / mem.rate;
+		mem.next += k * mem.rate;
+		sampleadd(np, k * mem.rate);
+	}
+	return np;
+}
+
+static void
+memclear(void)
+{
+	size_t i;
+
+	for (i = 0; i < mem.nsites; i++)
+		free(mem.sites[i].name);
+	free(mem.sites);
+	free(mem.siteidx);
+	free(mem.samples);
+	free(mem.pending);
+	memset(&mem, 0, sizeof(mem));
+}
+
+/***
+ * Starts profiling memory allocation.
+ *
+ * A sample is taken every *rate* bytes allocated, 16384 by default,
+ * and attributed to the line of Lua code that was running. For memory
+ * allocated by a C function, that is the line calling it, and for
+ * memory allocated inside a coroutine, the line resuming it.
+ *
+ * @function heapstart
+ * @usage
+profiler.heapstart()
+work()
+print(profiler.heapreport())
+profiler.heapstop()
+ * @tparam[opt] integer rate The sampling rate in bytes.
+ */
+static int
+profiler_heapstart(lua_State *L)
+{
+	lua_Integer rate;
+
+	rate = luaL_optinteger(L, 1, HEAP_RATE);
+	luaL_argcheck(L, rate > 0, 1, "rate must be positive");
+	if (mem.running)
+		return luaL_error(L, "heap profiler already running");
+
+	memclear();
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	mem.L = lua_tothread(L, -1);
+	lua_pop(L, 1);
+	mem.rate = rate;
+	mem.next = rate;
+	mem.alloc = lua_getallocf(L, &mem.ud);
+	mem.running = 1;
+	lua_setallocf(L, memalloc, NULL);
+	return 0;
+}
+
+static int
+sitelive(const void *a, const void *b)
+{
+	const struct memsite *x = &mem.sites[*(const int *)a];
+	const struct memsite *y = &mem.sites[*(const int *)b];
+
+	if (x->live != y->live)
+		return x->live < y->live ? 1 : -1;
+	return (x->total < y->total) - (x->total > y->total);
+}
+
+static int
+sitetotal(const void *a, const void *b)
+{
+	const struct memsite *x = &mem.sites[*(const int *)a];
+	const struct memsite *y = &mem.sites[*(const int *)b];
+
+	if (x->total != y->total)
+		return x->total < y->total ? 1 : -1;
+	return (x->live < y->live) - (x->live > y->live);
+}
+
+static void
+addsites(luaL_Buffer *b, int *order, const char *title)
+{
+	char line[LUA_IDSIZE + 96];
+	struct memsite *s;
+	size_t i;
+
+	snprintf(line, sizeof(line), "\ntop sites by %s bytes:\n"
+	    "%12s %12s %8s  %s\n", title, "live", "total", "samples", "site");
+	luaL_addstring(b, line);
+	for (i = 0; i < mem.nsites && i < HEAP_TOP; i++) {
+		s = &mem.sites[order[i]];
+		snprintf(line, sizeof(line), "%12lu %12lu %8lu  %s\n",
+		    (unsigned long)s->live, (unsigned long)s->total,
+		    (unsigned long)s->samples, s->name);
+		luaL_addstring(b, line);
+	}
+}
+
+/*
+ * Pushes the text of a heap report.
+ */
+static void
+pushreport(lua_State *L)
+{
+	char line[256];
+	luaL_Buffer b;
+	size_t i, live, total;
+	int *order;
+
+	order = lua_newuserdatauv(L, (mem.nsites + 1) * sizeof(int), 0);
+	live = total = 0;
+	for (i = 0; i < mem.nsites; i++) {
+		order[i] = i;
+		live += mem.sites[i].live;
+		total += mem.sites[i].total;
+	}
+
+	luaL_buffinit(L, &b);
+	snprintf(line, sizeof(line), "heap profile: one sample per %lu "
+	    "bytes allocated\nestimated bytes: %lu live, %lu in total\n",
+	    (unsigned long)mem.rate, (unsigned long)live,
+	    (unsigned long)total);
+	luaL_addstring(&b, line);
+	if (mem.lost > 0) {
+		snprintf(line, sizeof(line), "%lu samples lost for lack of "
+		    "memory\n", (unsigned long)mem.lost);
+		luaL_addstring(&b, line);
+	}
+	qsort(order, mem.nsites, sizeof(int), sitelive);
+	addsites(&b, order, "live");
+	qsort(order, mem.nsites, sizeof(int), sitetotal);
+	addsites(&b, order, "total");
+	luaL_pushresult(&b);
+	lua_remove(L, -2);
+}
+
+/***
+ * Returns a report of the memory allocated since the heap profiler was
+ * started.
+ *
+ * The report lists the lines that hold the most memory still in use
+ * (live bytes), and those that allocated the most memory overall
+ * (total bytes). The figures are estimates based on the samples. If
+ * *file* is given, the report is written to it instead.
+ *
+ * @function heapreport
+ * @usage
+profiler.heapreport("heap.txt")
+ * @tparam[opt] string file The file to write the report to.
+ * @treturn string|boolean The report, or true if it was written.
+ */
+static int
+profiler_heapreport(lua_State *L)
+{
+	const char *file, *s;
+	size_t len;
+	FILE *fp;
+	int ok;
+
+	file = luaL_optstring(L, 1, NULL);
+	if (!mem.running)
+		return luaL_error(L, "heap profiler not running");
+
+	memattribute();
+	pushreport(L);
+	if (file == NULL)
+		return 1;
+	if ((fp = fopen(file, "w")) == NULL)
+		return lfail(L);
+	s = lua_tolstring(L, -1, &len);
+	ok = fwrite(s, 1, len, fp) == len;
+	if (fclose(fp) != 0 || !ok)
+		return lfail(L);
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/***
+ * Stops the heap profiler and returns what it recorded.
+ *
+ * The table returned maps each line, as *source:line*, to a table
+ * with fields *live* and *total*, the estimated bytes it holds and
+ * has allocated, and *samples*, the number of samples taken there.
+ *
+ * @function heapstop
+ * @usage
+for site, s in pairs(profiler.heapstop()) do
+	print(site, s.live, s.total)
+end
+ * @treturn table The bytes allocated at each line.
+ */
+static int
+profiler_heapstop(lua_State *L)
+{
+	size_t i;
+
+	if (!mem.running)
+		return luaL_error(L, "heap profiler not running");
+
+	lua_setallocf(L, mem.alloc, mem.ud);
+	memattribute();
+	if (lua_gethook(mem.L) == memhook)
+		lua_sethook(mem.L, memprev.hook, memprev.mask, memprev.count);
+
+	lua_createtable(L, 0, mem.nsites);
+	for (i = 0; i < mem.nsites; i++) {
+		lua_createtable(L, 0, 3);
+		lua_pushinteger(L, mem.sites[i].live);
+		lua_setfield(L, -2, "live");
+		lua_pushinteger(L, mem.sites[i].total);
+		lua_setfield(L, -2, "total");
+		lua_pushinteger(L, mem.sites[i].samples);
+		lua_setfield(L, -2, "samples");
+		lua_setfield(L, -2, mem.sites[i].name);
+	}
+	memclear();
+	return 1;
+}
+
+/* clang-format off */
+
+static const luaL_Reg proflib[] = {
+	{"heapreport", profiler_heapreport},
+	{"heapstart",  profiler_heapstart},
+	{"heapstop",   profiler_heapstop},
+	{"start",      profiler_start},
+	{"status",     profiler_status},
+	{"stop",       profiler_stop},
+	{"tracestart", profiler_tracestart},
+	{"tracestop",  profiler_tracestop},
+	{NULL, NULL}
+};
+
+int
+luaopen_profiler(lua_State *L)
+{
+	luaL_newlib(L, proflib);
+	return 1;
+}
@@ -0,0 +1,1006 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/***
+ * Threads running Lua code in parallel, and channels between them.
+ *
+ * Each thread runs a function in a state of its own, with the
+ * Callisto libraries, on a POSIX thread. States share no Lua values:
+ * the arguments of a thread, its results and the values sent over
+ * channels are copied. Only nil, booleans, numbers, strings, channels
+ * and tables of these can be copied. Tables are copied without their
+ * metatables, and a table found more than once in a value is copied
+ * once, so cycles are kept.
+ *
+ * The profiler library keeps its state per process, so only one
+ * thread can use it at a time.
+ *
+ * @module thread
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include "callisto.h"
+#include "util.h"
+
+#define CHANNEL_SIZE  64  /* default capacity of a channel */
+#define MESSAGE_DEPTH 200 /* deepest nesting of tables copied */
+#define MESSAGE_BOX   "thread message"
+
+/* kinds of values in a message */
+enum {
+	M_NIL,
+	M_FALSE,
+	M_TRUE,
+	M_INTEGER,
+	M_NUMBER,
+	M_STRING,
+	M_TABLE,   /* followed by keys and values up to M_END */
+	M_END,
+	M_REF,     /* a table or channel seen before, by number */
+	M_CHANNEL  /* an index into chans */
+};
+
+/*
+ * Copied values, outside of any state. A message is kept in a box, a
+ * userdata that frees it when collected, while a state works on it,
+ * so that it is not lost when an error is raised.
+ */
+struct message {
+	char *data;
+	size_t len;
+	size_t size;
+	struct channel **chans; /* holding a reference each */
+	size_t nchans;
+	size_t chanssize;
+};
+
+struct channel {
+	pthread_mutex_t lock;
+	pthread_cond_t readable;  /* signalled when a message is added */
+	pthread_cond_t writable;  /* signalled when a message is taken */
+	struct message **queue;
+	size_t size;
+	size_t head;
+	size_t count;
+	int closed;
+	int refs;                 /* userdata and messages holding it */
+};
+
+struct thread {
+	pthread_t id;
+	pthread_mutex_t lock;
+	int refs;                 /* the handle and the running thread */
+	int joined;
+	int ok;                   /* whether the function returned */
+	struct message *in;       /* the function and its arguments */
+	struct message *out;      /* its results, or its error */
+};
+
+struct encoder {
+	struct message *m;
+	int seen;                 /* numbers of the tables and channels seen */
+	lua_Integer n;
+};
+
+struct decoder {
+	struct message *m;
+	size_t pos;
+	int seen;                 /* the tables and channels decoded */
+	lua_Integer n;
+};
+
+static void msgfree(struct message *);
+static void pushchannel(lua_State *, struct channel *);
+
+/*
+ * {==================================================================
+ * Messages
+ * ===================================================================
+ */
+
+static void
+chanrelease(struct channel *c)
+{
+	size_t i;
+	int last;
+
+	pthread_mutex_lock(&c->lock);
+	last = --c->refs == 0;
+	pthread_mutex_unlock(&c->lock);
+	if (!last)
+		return;
+
+	for (i = 0; i < c->count; i++)
+		msgfree(c->queue[(c->head + i) % c->size]);
+	pthread_cond_destroy(&c->readable);
+	pthread_cond_destroy(&c->writable);
+	pthread_mutex_destroy(&c->lock);
+	free(c->queue);
+	free(c);
+}
+
+static void
+msgfree(struct message *m)
+{
+	size_t i;
+
+	if (m == NULL)
+		return;
+	for (i = 0; i < m->nchans; i++) {
+		if (m->chans[i] != NULL)
+			chanrelease(m->chans[i]);
+	}
+	free(m->chans);
+	free(m->data);
+	free(m);
+}
+
+static int
+box_gc(lua_State *L)
+{
+	struct message **box = lua_touserdata(L, 1);
+
+	msgfree(*box);
+	*box = NULL;
+	return 0;
+}
+
+/*
+ * Pushes a new box holding 'm', or an empty message if 'm' is NULL.
+ */
+static struct message **
+newbox(lua_State *L, struct message *m)
+{
+	struct message **box;
+
+	box = lua_newuserdatauv(L, sizeof(*box), 0);
+	*box = NULL;
+	if (luaL_newmetatable(L, MESSAGE_BOX)) {
+		lua_pushcfunction(L, box_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	if (m == NULL && (m = calloc(1, sizeof(*m))) == NULL)
+		luaL_error(L, "not enough memory");
+	*box = m;
+	return box;
+}
+
+/*
+ * Takes the message out of a box.
+ */
+static struct message *
+unbox(struct message **box)
+{
+	struct message *m = *box;
+
+	*box = NULL;
+	return m;
+}
+
+static void
+msgput(lua_State *L, struct message *m, const void *p, size_t n)
+{
+	size_t size;
+	char *data;
+
+	if (m->size - m->len < n) {
+		size = m->size ? m->size : 64;
+		while (size - m->len < n)
+			size *= 2;
+		if ((data = realloc(m->data, size)) == NULL)
+			luaL_error(L, "not enough memory");
+		m->data = data;
+		m->size = size;
+	}
+	memcpy(m->data + m->len, p, n);
+	m->len += n;
+}
+
+static void
+msgputbyte(lua_State *L, struct message *m, int b)
+{
+	char c = (char)b;
+
+	msgput(L, m, &c, 1);
+}
+
+static void
+msgputsize(lua_State *L, struct message *m, size_t n)
+{
+	msgput(L, m, &n, sizeof(n));
+}
+
+/*
+ * Adds a reference to channel 'c' to the message.
+ */
+static void
+msgputchannel(lua_State *L, struct message *m, struct channel *c)
+{
+	struct channel **chans;
+	size_t size;
+
+	if (m->nchans == m->chanssize) {
+		size = m->chanssize ? m->chanssize * 2 : 4;
+		if ((chans = realloc(m->chans, size * sizeof(*chans))) == NULL)
+			luaL_error(L, "not enough memory");
+		m->chans = chans;
+		m->chanssize = size;
+	}
+	pthread_mutex_lock(&c->lock);
+	c->refs++;
+	pthread_mutex_unlock(&c->lock);
+	m->chans[m->nchans] = c;
+	msgputbyte(L, m, M_CHANNEL);
+	msgputsize(L, m, m->nchans++);
+}
+
+static void
+encode(lua_State *L, struct encoder *e, int idx, int depth)
+{
+	struct channel **c;
+	lua_Integer i;
+	lua_Number n;
+	const char *s;
+	size_t len;
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		msgputbyte(L, e->m, M_NIL);
+		return;
+	case LUA_TBOOLEAN:
+		msgputbyte(L, e->m, lua_toboolean(L, idx) ? M_TRUE : M_FALSE);
+		return;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			i = lua_tointeger(L, idx);
+			msgputbyte(L, e->m, M_INTEGER);
+			msgput(L, e->m, &i, sizeof(i));
+		} else {
+			n = lua_tonumber(L, idx);
+			msgputbyte(L, e->m, M_NUMBER);
+			msgput(L, e->m, &n, sizeof(n));
+		}
+		return;
+	case LUA_TSTRING:
+		s = lua_tolstring(L, idx, &len);
+		msgputbyte(L, e->m, M_STRING);
+		msgputsize(L, e->m, len);
+		msgput(L, e->m, s, len);
+		return;
+	case LUA_TTABLE:
+	case LUA_TUSERDATA:
+		break;
+	default:
+		luaL_error(L, "cannot copy a %s value", luaL_typename(L, idx));
+	}
+
+	/* tables and channels are numbered so that they are copied once */
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, e->seen) == LUA_TNUMBER) {
+		msgputbyte(L, e->m, M_REF);
+		msgputsize(L, e->m, (size_t)lua_tointeger(L, -1));
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	c = luaL_testudata(L, idx, CALLISTO_CHANNEL);
+	if (lua_type(L, idx) == LUA_TUSERDATA && c == NULL)
+		luaL_error(L, "cannot copy a userdata value");
+	lua_pushvalue(L, idx);
+	lua_pushinteger(L, ++e->n);
+	lua_rawset(L, e->seen);
+
+	if (c != NULL) {
+		msgputchannel(L, e->m, *c);
+		return;
+	}
+	if (depth >= MESSAGE_DEPTH)
+		luaL_error(L, "table too deep to copy");
+	luaL_checkstack(L, 3, "table too deep to copy");
+	msgputbyte(L, e->m, M_TABLE);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		encode(L, e, lua_gettop(L) - 1, depth + 1);
+		encode(L, e, lua_gettop(L), depth + 1);
+		lua_pop(L, 1);
+	}
+	msgputbyte(L, e->m, M_END);
+}
+
+/*
+ * Copies the values from index 'first' to the top of the stack into
+ * the message in 'box'.
+ */
+static void
+encodevalues(lua_State *L, struct message **box, int first)
+{
+	struct encoder e;
+	int i, top;
+
+	top = lua_gettop(L);
+	lua_newtable(L);
+	e.m = *box;
+	e.seen = lua_gettop(L);
+	e.n = 0;
+	for (i = first; i <= top; i++)
+		encode(L, &e, i, 0);
+	lua_pop(L, 1);
+}
+
+static void
+msgget(struct decoder *d, void *p, size_t n)
+{
+	memcpy(p, d->m->data + d->pos, n);
+	d->pos += n;
+}
+
+static size_t
+msggetsize(struct decoder *d)
+{
+	size_t n;
+
+	msgget(d, &n, sizeof(n));
+	return n;
+}
+
+static void
+decode(lua_State *L, struct decoder *d)
+{
+	lua_Integer i;
+	lua_Number n;
+	size_t len;
+
+	luaL_checkstack(L, 3, "table too deep to copy");
+	switch (d->m->data[d->pos++]) {
+	case M_NIL:
+		lua_pushnil(L);
+		break;
+	case M_FALSE:
+		lua_pushboolean(L, 0);
+		break;
+	case M_TRUE:
+		lua_pushboolean(L, 1);
+		break;
+	case M_INTEGER:
+		msgget(d, &i, sizeof(i));
+		lua_pushinteger(L, i);
+		break;
+	case M_NUMBER:
+		msgget(d, &n, sizeof(n));
+		lua_pushnumber(L, n);
+		break;
+	case M_STRING:
+		len = msggetsize(d);
+		lua_pushlstring(L, d->m->data + d->pos, len);
+		d->pos += len;
+		break;
+	case M_TABLE:
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, d->seen, ++d->n);
+		while (d->m->data[d->pos] != M_END) {
+			decode(L, d);
+			decode(L, d);
+			lua_rawset(L, -3);
+		}
+		d->pos++;
+		break;
+	case M_REF:
+		lua_rawgeti(L, d->seen, (lua_Integer)msggetsize(d));
+		break;
+	case M_CHANNEL:
+		len = msggetsize(d);
+		pushchannel(L, d->m->chans[len]);
+		d->m->chans[len] = NULL; /* the userdata has the reference now */
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, d->seen, ++d->n);
+		break;
+	}
+}
+
+/*
+ * Pushes the values in the message in 'box', returning how many there
+ * are.
+ */
+static int
+decodevalues(lua_State *L, struct message **box)
+{
+	struct decoder d;
+	int n;
+
+	lua_newtable(L);
+	d.m = *box;
+	d.pos = 0;
+	d.seen = lua_gettop(L);
+	d.n = 0;
+	for (n = 0; d.pos < d.m->len; n++)
+		decode(L, &d);
+	lua_remove(L, d.seen);
+	return n;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Channels
+ * ===================================================================
+ */
+
+/*
+ * Turns a timeout in seconds into the time it ends. Returns NULL if
+ * there is no timeout.
+ */
+static struct timespec *
+deadline(lua_State *L, int idx, struct timespec *ts)
+{
+	lua_Number t;
+
+	if (lua_isnoneornil(L, idx))
+		return NULL;
+	t = luaL_checknumber(L, idx);
+	luaL_argcheck(L, t >= 0, idx, "timeout must not be negative");
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += (time_t)t;
+	ts->tv_nsec += (long)((t - (time_t)t) * 1e9);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+	return ts;
+}
+
+/*
+ * Waits on 'cond' until it is signalled or 'ts' passes. Returns 0 if
+ * the time passed.
+ */
+static int
+chanwait(struct channel *c, pthread_cond_t *cond, struct timespec *ts)
+{
+	if (ts == NULL)
+		return pthread_cond_wait(cond, &c->lock) == 0;
+	return pthread_cond_timedwait(cond, &c->lock, ts) != ETIMEDOUT;
+}
+
+static int
+channel_gc(lua_State *L)
+{
+	struct channel **c = lua_touserdata(L, 1);
+
+	if (*c != NULL)
+		chanrelease(*c);
+	*c = NULL;
+	return 0;
+}
+
+static struct channel *
+checkchannel(lua_State *L, int idx)
+{
+	return *(struct channel **)luaL_checkudata(L, idx, CALLISTO_CHANNEL);
+}
+
+/***
+ * Closes the channel.
+ *
+ * Values sent before the channel was closed can still be received;
+ * after that, and for any value sent after, *recv* and *send* fail at
+ * once. Threads waiting on the channel are woken up.
+ *
+ * @function Channel:close
+ */
+static int
+channel_close(lua_State *L)
+{
+	struct channel *c = checkchannel(L, 1);
+
+	pthread_mutex_lock(&c->lock);
+	c->closed = 1;
+	pthread_cond_broadcast(&c->readable);
+	pthread_cond_broadcast(&c->writable);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
+
+/***
+ * Receives a value from the channel.
+ *
+ * Waits until a value is available, for at most *timeout* seconds if
+ * it is given. If no value comes in time or the channel is closed and
+ * empty, returns nil and an error message.
+ *
+ * @function Channel:recv
+ * @usage
+local line = ch:recv()
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ * @return The value received.
+ */
+static int
+channel_recv(lua_State *L)
+{
+	struct channel *c;
+	struct message **box;
+	struct timespec ts, *tsp;
+	int timedout;
+
+	c = checkchannel(L, 1);
+	tsp = deadline(L, 2, &ts);
+	lua_settop(L, 2);
+	box = newbox(L, NULL);
+	msgfree(unbox(box));
+
+	timedout = 0;
+	pthread_mutex_lock(&c->lock);
+	while (c->count == 0 && !c->closed && !timedout)
+		timedout = !chanwait(c, &c->readable, tsp);
+	if (c->count == 0) {
+		pthread_mutex_unlock(&c->lock);
+		return lfailm(L, c->closed ? "channel is closed" : "timed out");
+	}
+	*box = c->queue[c->head];
+	c->head = (c->head + 1) % c->size;
+	c->count--;
+	pthread_cond_signal(&c->writable);
+	pthread_mutex_unlock(&c->lock);
+
+	decodevalues(L, box);
+	msgfree(unbox(box));
+	return 1;
+}
+
+/***
+ * Sends a copy of a value over the channel.
+ *
+ * If the channel is full, waits until a value is received from it, for
+ * at most *timeout* seconds if it is given. Returns true if the value
+ * was sent, or nil and an error message if there was no room in time
+ * or the channel is closed.
+ *
+ * @function Channel:send
+ * @usage
+ch:send({id = 1, body = "..."})
+ * @param value The value to send, which cannot be nil.
+ * @tparam[opt] number timeout Seconds to wait for at most.
+ */
+static int
+channel_send(lua_State *L)
+{
+	struct channel *c;
+	struct message **box;
+	struct timespec ts, *tsp;
+	int closed, timedout;
+
+	c = checkchannel(L, 1);
+	luaL_argcheck(L, !lua_isnoneornil(L, 2), 2, "cannot send nil");
+	tsp = deadline(L, 3, &ts);
+	lua_settop(L, 2);
+	box = newbox(L, NULL);
+	lua_insert(L, 2);
+	encodevalues(L, box, 3);
+
+	timedout = 0;
+	pthread_mutex_lock(&c->lock);
+	while (c->count == c->size && !c->closed && !timedout)
+		timedout = !chanwait(c, &c->writable, tsp);
+	if ((closed = c->closed) || c->count == c->size) {
+		pthread_mutex_unlock(&c->lock);
+		return lfailm(L, closed ? "channel is closed" : "timed out");
+	}
+	c->queue[(c->head + c->count) % c->size] = unbox(box);
+	c->count++;
+	pthread_cond_signal(&c->readable);
+	pthread_mutex_unlock(&c->lock);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/* clang-format off */
+
+static const luaL_Reg channelmethods[] = {
+	{"close", channel_close},
+	{"recv",  channel_recv},
+	{"send",  channel_send},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+/*
+ * Pushes a userdata for channel 'c', which takes over a reference to
+ * it.
+ */
+static void
+pushchannel(lua_State *L, struct channel *c)
+{
+	struct channel **ud;
+
+	ud = lua_newuserdatauv(L, sizeof(*ud), 0);
+	*ud = c;
+	if (luaL_newmetatable(L, CALLISTO_CHANNEL)) {
+		luaL_newlib(L, channelmethods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, channel_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+}
+
+/***
+ * Returns a new channel.
+ *
+ * A channel holds up to *size* values sent by any number of threads
+ * until other threads receive them, in the order they were sent.
+ * Channels can be passed to threads and sent over channels; the copies
+ * all refer to the same channel.
+ *
+ * @function channel
+ * @usage
+local ch = thread.channel(16)
+ * @tparam[opt] integer size The number of values the channel can
+ *   hold, 64 by default.
+ * @treturn Channel The channel.
+ */
+static int
+thread_channel(lua_State *L)
+{
+	struct channel *c, **ud;
+	lua_Integer size;
+
+	size = luaL_optinteger(L, 1, CHANNEL_SIZE);
+	luaL_argcheck(L, size > 0 && size <= 1 << 24, 1, "size out of range");
+
+	pushchannel(L, NULL);
+	ud = lua_touserdata(L, -1);
+	if ((c = calloc(1, sizeof(*c))) == NULL
+	    || (c->queue = calloc(size, sizeof(*c->queue))) == NULL) {
+		free(c);
+		return luaL_error(L, "not enough memory");
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->readable, NULL);
+	pthread_cond_init(&c->writable, NULL);
+	c->size = (size_t)size;
+	c->refs = 1;
+	*ud = c;
+	return 1;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Threads
+ * ===================================================================
+ */
+
+static void
+threadrelease(struct thread *t)
+{
+	int last;
+
+	pthread_mutex_lock(&t->lock);
+	last = --t->refs == 0;
+	pthread_mutex_unlock(&t->lock);
+	if (!last)
+		return;
+	msgfree(t->in);
+	msgfree(t->out);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+/*
+ * Runs in the state of the thread: calls the function with its
+ * arguments and copies its results out.
+ */
+static int
+runthread(lua_State *L)
+{
+	struct thread *t = lua_touserdata(L, 1);
+	struct message **box;
+	const char *code;
+	size_t len;
+	int n;
+
+	box = newbox(L, t->in);
+	t->in = NULL;
+	n = decodevalues(L, box);
+	code = lua_tolstring(L, 3, &len);
+	if (luaL_loadbufferx(L, code, len, "=thread", NULL) != LUA_OK)
+		return lua_error(L);
+	lua_replace(L, 3);
+	lua_call(L, n - 1, LUA_MULTRET);
+
+	msgfree(unbox(box));
+	*box = calloc(1, sizeof(**box));
+	if (*box == NULL)
+		return luaL_error(L, "not enough memory");
+	encodevalues(L, box, 3);
+	t->out = unbox(box);
+	t->ok = 1;
+	return 0;
+}
+
+/*
+ * Copies out the error raised by the function of the thread, or a
+ * description of it if it cannot be copied.
+ */
+static int
+threaderror(lua_State *L)
+{
+	struct thread *t = lua_touserdata(L, 1);
+	struct message **box;
+
+	lua_settop(L, 2);
+	switch (lua_type(L, 2)) {
+	case LUA_TNIL:
+	case LUA_TBOOLEAN:
+	case LUA_TNUMBER:
+	case LUA_TSTRING:
+	case LUA_TTABLE:
+		break;
+	default:
+		luaL_tolstring(L, 2, NULL);
+		lua_replace(L, 2);
+	}
+	box = newbox(L, NULL);
+	lua_insert(L, 2);
+	encodevalues(L, box, 3);
+	t->out = unbox(box);
+	return 0;
+}
+
+static void *
+threadmain(void *arg)
+{
+	struct thread *t = arg;
+	lua_State *L;
+	int i;
+
+	if ((L = callisto_newstate()) != NULL) {
+		lua_pushcfunction(L, runthread);
+		lua_pushlightuserdata(L, t);
+		if (lua_pcall(L, 1, 0, 0) != LUA_OK) {
+			/* if the error cannot be copied, send why instead */
+			for (i = 0; i < 2; i++) {
+				lua_pushcfunction(L, threaderror);
+				lua_pushlightuserdata(L, t);
+				lua_rotate(L, -3, 2);
+				if (lua_pcall(L, 2, 0, 0) == LUA_OK)
+					break;
+			}
+		}
+		lua_close(L);
+	}
+	threadrelease(t);
+	return NULL;
+}
+
+static int
+handle_gc(lua_State *L)
+{
+	struct thread **t = lua_touserdata(L, 1);
+
+	if (*t == NULL)
+		return 0;
+	if (!(*t)->joined)
+		pthread_detach((*t)->id);
+	threadrelease(*t);
+	*t = NULL;
+	return 0;
+}
+
+/***
+ * Waits for the thread to finish and returns copies of the values
+ * returned by its function.
+ *
+ * If the function raised an error, the error is raised again here;
+ * an error value that cannot be copied is turned into a string. A
+ * thread can only be joined once.
+ *
+ * @function Thread:join
+ * @usage
+local t = thread.spawn(function (n) return n * 2 end, 21)
+print(t:join()) -- 42
+ * @return The values returned by the function.
+ */
+static int
+handle_join(lua_State *L)
+{
+	struct thread *t;
+	struct message **box;
+	int n;
+
+	t = *(struct thread **)luaL_checkudata(L, 1, CALLISTO_THREAD);
+	if (t->joined)
+		return luaL_error(L, "thread already joined");
+	lua_settop(L, 1);
+	box = newbox(L, NULL);
+	msgfree(unbox(box));
+
+	pthread_join(t->id, NULL);
+	t->joined = 1;
+	if (t->out == NULL) /* the state could not be made or failed */
+		return luaL_error(L, "thread failed: not enough memory");
+	*box = t->out;
+	t->out = NULL;
+
+	n = decodevalues(L, box);
+	msgfree(unbox(box));
+	if (!t->ok)
+		return lua_error(L);
+	return n;
+}
+
+/* clang-format off */
+
+static const luaL_Reg handlemethods[] = {
+	{"join", handle_join},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+static int
+writechunk(lua_State *L, const void *p, size_t n, void *ud)
+{
+	msgput(L, ud, p, n);
+	return 0;
+}
+
+/***
+ * Starts a new thread running a function.
+ *
+ * *f* is either a Lua function or a string of Lua code, which is run
+ * with copies of the other arguments in a new state. A function is
+ * copied without its upvalues, so it can only use its arguments and
+ * the global variables of the new state; a function with upvalues
+ * other than *_ENV* is refused.
+ *
+ * If the thread cannot be started, returns nil, an error message and
+ * an error code.
+ *
+ * @function spawn
+ * @usage
+local ch = thread.channel()
+local t = thread.spawn(function (ch)
+	for i = 1, 3 do
+		ch:send(i)
+	end
+	ch:close()
+end, ch)
+while true do
+	local n = ch:recv()
+	if n == nil then
+		break
+	end
+	print(n)
+end
+t:join()
+ * @tparam function|string f The function or code to run.
+ * @param ... The arguments to give it.
+ * @treturn Thread The thread.
+ */
+static int
+thread_spawn(lua_State *L)
+{
+	struct thread *t, **ud;
+	struct message **box;
+	const char *code, *name;
+	sigset_t all, old;
+	size_t off, len;
+	int err, i;
+
+	if (lua_type(L, 1) != LUA_TSTRING) {
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+		luaL_argcheck(L, !lua_iscfunction(L, 1), 1,
+		    "cannot run a C function");
+		for (i = 1; (name = lua_getupvalue(L, 1, i)) != NULL; i++) {
+			lua_pop(L, 1);
+			if (i > 1 || strcmp(name, "_ENV") != 0) {
+				return luaL_argerror(L, 1, lua_pushfstring(L,
+				    "function has upvalue '%s'", name));
+			}
+		}
+	}
+
+	/* the code goes first, as a string, then the arguments */
+	box = newbox(L, NULL);
+	lua_insert(L, 2);
+	msgputbyte(L, *box, M_STRING);
+	off = (*box)->len;
+	msgputsize(L, *box, 0);
+	if (lua_type(L, 1) == LUA_TSTRING) {
+		code = lua_tolstring(L, 1, &len);
+		msgput(L, *box, code, len);
+	} else {
+		lua_pushvalue(L, 1);
+		lua_dump(L, writechunk, *box, 0);
+		lua_pop(L, 1);
+		len = (*box)->len - off - sizeof(len);
+	}
+	memcpy((*box)->data + off, &len, sizeof(len));
+	encodevalues(L, box, 3);
+
+	ud = lua_newuserdatauv(L, sizeof(*ud), 0);
+	*ud = NULL;
+	if (luaL_newmetatable(L, CALLISTO_THREAD)) {
+		luaL_newlib(L, handlemethods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, handle_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return luaL_error(L, "not enough memory");
+	pthread_mutex_init(&t->lock, NULL);
+	t->in = unbox(box);
+	t->refs = 1;
+	*ud = t;
+
+	/* signals are left to the thread running the interpreter */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	t->refs++;
+	err = pthread_create(&t->id, NULL, threadmain, t);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err != 0) {
+		t->refs--;
+		t->joined = 1; /* nothing to detach */
+		errno = err;
+		return lfail(L);
+	}
+	return 1;
+}
+
+/* }================================================================== */
+
+/***
+ * Returns the number of processors online.
+ *
+ * @function cpus
+ * @usage
+local workers = {}
+for i = 1, thread.cpus() do
+	workers[i] = thread.spawn(work, i)
+end
+ * @treturn integer The number of processors.
+ */
+static int
+thread_cpus(lua_State *L)
+{
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	lua_pushinteger(L, n > 0 ? n : 1);
+	return 1;
+}
+
+/* clang-format off */
+
+static const luaL_Reg threadlib[] = {
+	{"channel", thread_channel},
+	{"cpus",    thread_cpus},
+	{"spawn",   thread_spawn},
+	{NULL, NULL}
+};
+
+int
+luaopen_thread(lua_State *L)
+{
+	luaL_newlib(L, threadlib);
+	return 1;
+}
@@ -0,0 +1,1299 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/*
+ * pack.c
+ *
+ * Encoder and decoder of the msgpack and cbor libraries.
+ *
+ * MessagePack and CBOR share the table conventions of the JSON
+ * encoder (array detection, sparse arrays, empty tables and the array
+ * metatables) and the depth limits of the config they were opened
+ * with, which is the config of the json library. Numbers are stored
+ * in binary, so integers and floats survive a round trip exactly.
+ */
+
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include <json/lua_cjson.h>
+#include <json/strbuf.h>
+
+#include "pack.h"
+
+#define PACK_STREAM "PackDecoder" /* metatable of decoder objects */
+
+enum packkind {
+	PACK_STR,
+	PACK_ARRAY,
+	PACK_MAP
+};
+
+struct encoder {
+	json_config_t *cfg;
+	enum packformat format;
+	strbuf_t *buf;
+	int ext; /* stack index of the ext hook, or 0 */
+};
+
+struct decoder {
+	json_config_t *cfg;
+	enum packformat format;
+	const unsigned char *data;
+	const unsigned char *ptr;
+	const unsigned char *end;
+	int depth;
+	int ext;        /* stack index of the ext hook, or 0 */
+	int incomplete; /* the input ended inside a value */
+};
+
+struct stream {
+	strbuf_t buf;
+	size_t pos;       /* start of undecoded data in buf */
+	enum packformat format;
+	int busy;         /* an ext hook is running in next() */
+
+	/* progress of the scan for the end of the next value */
+	size_t scan;      /* end of the items scanned so far */
+	uint64_t pending; /* items still to be scanned */
+	strbuf_t frames;  /* 'pending' outside each open indefinite item */
+};
+
+/*
+ * {==================================================================
+ * Encoding
+ * ===================================================================
+ */
+
+/* writes 'lead' followed by the low 'bytes' bytes of 'v', big endian */
+static void
+put(strbuf_t *buf, unsigned char lead, uint64_t v, int bytes)
+{
+	char *p;
+	int i;
+
+	strbuf_ensure_empty_length(buf, 1 + bytes);
+	p = strbuf_empty_ptr(buf);
+	p[0] = lead;
+	for (i = bytes; i > 0; i--) {
+		p[i] = v & 0xff;
+		v >>= 8;
+	}
+	strbuf_extend_length(buf, 1 + bytes);
+}
+
+/*
+ * Builds the header of a string, array or map of 'n' elements in
+ * 'hdr' and returns its size.
+ */
+static int
+header(enum packformat format, enum packkind kind, uint64_t n,
+    unsigned char *hdr)
+{
+	static const unsigned char msgpackfix[] = {0xa0, 0x90, 0x80};
+	static const unsigned char msgpackfixmax[] = {32, 16, 16};
+	static const unsigned char msgpacklead[][3] = {
+		{0xd9, 0xda, 0xdb},
+		{0x00, 0xdc, 0xdd},
+		{0x00, 0xde, 0xdf}
+	};
+	unsigned char lead;
+	int bytes, i;
+
+	if (format == PACK_CBOR) {
+		lead = (3 + kind) << 5;
+		if (n < 24) {
+			hdr[0] = lead | n;
+			return 1;
+		}
+		if (n <= 0xff) {
+			lead |= 24;
+			bytes = 1;
+		} else if (n <= 0xffff) {
+			lead |= 25;
+			bytes = 2;
+		} else if (n <= 0xffffffff) {
+			lead |= 26;
+			bytes = 4;
+		} else {
+			lead |= 27;
+			bytes = 8;
+		}
+	} else {
+		if (n < msgpackfixmax[kind]) {
+			hdr[0] = msgpackfix[kind] | n;
+			return 1;
+		}
+		if (kind == PACK_STR && n <= 0xff) {
+			lead = msgpacklead[kind][0];
+			bytes = 1;
+		} else if (n <= 0xffff) {
+			lead = msgpacklead[kind][1];
+			bytes = 2;
+		} else {
+			lead = msgpacklead[kind][2];
+			bytes = 4;
+		}
+	}
+
+	hdr[0] = lead;
+	for (i = bytes; i > 0; i--) {
+		hdr[i] = n & 0xff;
+		n >>= 8;
+	}
+	return 1 + bytes;
+}
+
+static void
+putheader(struct encoder *pk, enum packkind kind, uint64_t n)
+{
+	unsigned char hdr[9];
+	int len;
+
+	len = header(pk->format, kind, n, hdr);
+	strbuf_append_mem(pk->buf, (char *)hdr, len);
+}
+
+/* writes a CBOR head of the given major type and argument */
+static void
+putcborhead(struct encoder *pk, int major, uint64_t n)
+{
+	unsigned char hdr[9];
+	int len;
+
+	len = header(PACK_CBOR, PACK_STR, n, hdr);
+	hdr[0] = (hdr[0] & 0x1f) | major << 5;
+	strbuf_append_mem(pk->buf, (char *)hdr, len);
+}
+
+static void
+putinteger(struct encoder *pk, lua_Integer v)
+{
+	strbuf_t *buf;
+
+	buf = pk->buf;
+	if (pk->format == PACK_CBOR) {
+		/* negative integers are stored as -1 - v */
+		if (v >= 0)
+			putcborhead(pk, 0, v);
+		else
+			putcborhead(pk, 1, ~(uint64_t)v);
+		return;
+	}
+
+	if (v >= 0) {
+		if (v < 128)
+			strbuf_append_char(buf, v);
+		else if (v <= 0xff)
+			put(buf, 0xcc, v, 1);
+		else if (v <= 0xffff)
+			put(buf, 0xcd, v, 2);
+		else if (v <= 0xffffffff)
+			put(buf, 0xce, v, 4);
+		else
+			put(buf, 0xcf, v, 8);
+	} else {
+		if (v >= -32)
+			strbuf_append_char(buf, v);
+		else if (v >= -128)
+			put(buf, 0xd0, v, 1);
+		else if (v >= -32768)
+			put(buf, 0xd1, v, 2);
+		else if (v >= INT32_MIN)
+			put(buf, 0xd2, v, 4);
+		else
+			put(buf, 0xd3, v, 8);
+	}
+}
+
+/* floats are stored in single precision when that is exact */
+static void
+putfloat(struct encoder *pk, double d)
+{
+	uint64_t u64;
+	uint32_t u32;
+	float f;
+
+	if (isinf(d) || (fabs(d) <= FLT_MAX && (double)(float)d == d)) {
+		f = d;
+		memcpy(&u32, &f, sizeof(u32));
+		put(pk->buf, pk->format == PACK_CBOR ? 0xfa : 0xca, u32, 4);
+	} else {
+		memcpy(&u64, &d, sizeof(u64));
+		put(pk->buf, pk->format == PACK_CBOR ? 0xfb : 0xcb, u64, 8);
+	}
+}
+
+static void
+putnil(struct encoder *pk)
+{
+	strbuf_append_char(pk->buf, pk->format == PACK_CBOR ? 0xf6 : 0xc0);
+}
+
+static int putvalue(lua_State *, struct encoder *, int);
+
+static void
+putarray(lua_State *L, struct encoder *pk, int depth, int n)
+{
+	int i;
+
+	putheader(pk, PACK_ARRAY, n);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti(L, -1, i);
+		/* skipped values become nil to keep the element count */
+		if (putvalue(L, pk, depth))
+			putnil(pk);
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * The size of a map is only known once its members have been written,
+ * so a one byte header is reserved and widened if needed.
+ */
+static void
+putmap(lua_State *L, struct encoder *pk, int depth)
+{
+	strbuf_t *buf;
+	unsigned char hdr[9];
+	size_t hdrpos, memberpos;
+	uint64_t n;
+	int len, keytype;
+
+	buf = pk->buf;
+	hdrpos = strbuf_length(buf);
+	strbuf_append_char(buf, 0);
+
+	n = 0;
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		memberpos = strbuf_length(buf);
+		keytype = lua_type(L, -2);
+		if (keytype != LUA_TNUMBER && keytype != LUA_TSTRING)
+			json_encode_exception(L, pk->cfg, buf, -2,
+			    "table key must be a number or string");
+
+		lua_pushvalue(L, -2);
+		putvalue(L, pk, depth);
+		lua_pop(L, 1);
+		if (putvalue(L, pk, depth))
+			strbuf_set_length(buf, memberpos);
+		else
+			n++;
+		lua_pop(L, 1);
+	}
+
+	len = header(pk->format, PACK_MAP, n, hdr);
+	if (len > 1) {
+		strbuf_ensure_empty_length(buf, len - 1);
+		memmove(buf->buf + hdrpos + len, buf->buf + hdrpos + 1,
+		    strbuf_length(buf) - hdrpos - 1);
+		strbuf_extend_length(buf, len - 1);
+	}
+	memcpy(buf->buf + hdrpos, hdr, len);
+}
+
+/*
+ * Encodes a value the formats have no type for through the ext hook.
+ * Returns 1 if the hook did not handle it.
+ */
+static int
+putext(lua_State *L, struct encoder *pk, int depth)
+{
+	static const unsigned char fixext[17] = {
+		0, 0xd4, 0xd5, 0, 0xd6, 0, 0, 0, 0xd7,
+		0, 0, 0, 0, 0, 0, 0, 0xd8
+	};
+	const char *data;
+	lua_Integer type;
+	size_t len;
+
+	if (!pk->ext)
+		return 1;
+
+	luaL_checkstack(L, 3, NULL);
+	lua_pushvalue(L, pk->ext);
+	lua_pushvalue(L, -2);
+	lua_call(L, 1, 2);
+	if (lua_isnil(L, -2)) {
+		lua_pop(L, 2);
+		return 1;
+	}
+
+	type = luaL_checkinteger(L, -2);
+	if (pk->format == PACK_CBOR) {
+		/* a tag followed by the tagged value */
+		if (type < 0)
+			luaL_error(L, "ext hook returned a negative tag");
+		putcborhead(pk, 6, type);
+		if (putvalue(L, pk, depth))
+			putnil(pk);
+		lua_pop(L, 2);
+		return 0;
+	}
+
+	if (type < -128 || type > 127)
+		luaL_error(L, "ext hook returned an invalid type (%d)", (int)type);
+	data = luaL_checklstring(L, -1, &len);
+	if (len <= 16 && fixext[len]) {
+		strbuf_append_char(pk->buf, fixext[len]);
+	} else if (len <= 0xff) {
+		put(pk->buf, 0xc7, len, 1);
+	} else if (len <= 0xffff) {
+		put(pk->buf, 0xc8, len, 2);
+	} else {
+		luaL_argcheck(L, len <= 0xffffffff, 1, "ext data too large");
+		put(pk->buf, 0xc9, len, 4);
+	}
+	strbuf_append_char(pk->buf, type);
+	strbuf_append_mem(pk->buf, data, len);
+	lua_pop(L, 2);
+	return 0;
+}
+
+/*
+ * Encodes the value on the top of the stack. Returns 1 if it was
+ * skipped as an unsupported type, else 0.
+ */
+static int
+putvalue(lua_State *L, struct encoder *pk, int depth)
+{
+	const char *str;
+	size_t len;
+	int n;
+
+	switch (lua_type(L, -1)) {
+	case LUA_TSTRING:
+		str = lua_tolstring(L, -1, &len);
+		putheader(pk, PACK_STR, len);
+		strbuf_append_mem(pk->buf, str, len);
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, -1))
+			putinteger(pk, lua_tointeger(L, -1));
+		else
+			putfloat(pk, lua_tonumber(L, -1));
+		break;
+	case LUA_TBOOLEAN:
+		if (pk->format == PACK_CBOR)
+			strbuf_append_char(pk->buf,
+			    lua_toboolean(L, -1) ? 0xf5 : 0xf4);
+		else
+			strbuf_append_char(pk->buf,
+			    lua_toboolean(L, -1) ? 0xc3 : 0xc2);
+		break;
+	case LUA_TTABLE:
+		depth++;
+		json_check_encode_depth(L, pk->cfg, depth, pk->buf);
+		n = json_table_length(L, pk->cfg, pk->buf);
+		if (n >= 0)
+			putarray(L, pk, depth, n);
+		else
+			putmap(L, pk, depth);
+		break;
+	case LUA_TNIL:
+		putnil(pk);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		if (lua_touserdata(L, -1) == NULL) {
+			putnil(pk);
+			break;
+		}
+		if (json_is_empty_array(L, -1)) {
+			putheader(pk, PACK_ARRAY, 0);
+			break;
+		}
+		/* FALLTHROUGH */
+	default:
+		depth++;
+		json_check_encode_depth(L, pk->cfg, depth, pk->buf);
+		if (!putext(L, pk, depth))
+			break;
+		if (json_encode_skip_unsupported(pk->cfg))
+			return 1;
+		json_encode_exception(L, pk->cfg, pk->buf, -1,
+		    "type not supported");
+	}
+	return 0;
+}
+
+int
+pack_encode(lua_State *L, enum packformat format)
+{
+	struct encoder pk;
+	const char *data;
+	size_t len;
+
+	luaL_argcheck(L, lua_gettop(L) >= 1 && lua_gettop(L) <= 2, 2,
+	    "expected 1 or 2 arguments");
+
+	pk.cfg = json_fetch_config(L);
+	pk.format = format;
+	pk.ext = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		pk.ext = 2;
+	}
+	lua_settop(L, 2);
+
+	/*
+	 * The ext hook runs Lua code in the middle of encoding, which may
+	 * encode into the shared buffer itself.
+	 */
+	pk.buf = NULL;
+	if (!pk.ext)
+		pk.buf = json_shared_encode_buffer(pk.cfg);
+	if (pk.buf == NULL)
+		pk.buf = json_new_strbuf(L, 0);
+
+	lua_pushvalue(L, 1);
+	putvalue(L, &pk, 0);
+
+	data = strbuf_string(pk.buf, &len);
+	lua_pushlstring(L, data, len);
+	return 1;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Decoding
+ * ===================================================================
+ */
+
+static void
+decodeerror(lua_State *L, struct decoder *d, const char *msg)
+{
+	luaL_error(L, "%s at byte %d", msg, (int)(d->ptr - d->data));
+}
+
+static void
+need(lua_State *L, struct decoder *d, uint64_t n)
+{
+	if ((uint64_t)(d->end - d->ptr) < n) {
+		d->incomplete = 1;
+		decodeerror(L, d, "Unexpected end of data");
+	}
+}
+
+static uint64_t
+readbytes(lua_State *L, struct decoder *d, int bytes)
+{
+	uint64_t v;
+	int i;
+
+	need(L, d, bytes);
+	v = 0;
+	for (i = 0; i < bytes; i++)
+		v = (v << 8) | *d->ptr++;
+	return v;
+}
+
+static void
+pushunsigned(lua_State *L, uint64_t v)
+{
+	if (v <= LUA_MAXINTEGER)
+		lua_pushinteger(L, v);
+	else
+		lua_pushnumber(L, (lua_Number)v);
+}
+
+static void
+pushfloat(lua_State *L, uint64_t bits, int bytes)
+{
+	uint32_t u32;
+	double d;
+	float f;
+	int exp, mant;
+
+	if (bytes == 4) {
+		u32 = bits;
+		memcpy(&f, &u32, sizeof(f));
+		lua_pushnumber(L, f);
+	} else if (bytes == 8) {
+		memcpy(&d, &bits, sizeof(d));
+		lua_pushnumber(L, d);
+	} else {
+		/* IEEE 754 half precision */
+		exp = (bits >> 10) & 0x1f;
+		mant = bits & 0x3ff;
+		if (exp == 0)
+			d = ldexp(mant, -24);
+		else if (exp != 31)
+			d = ldexp(mant + 1024, exp - 25);
+		else
+			d = mant == 0 ? HUGE_VAL : NAN;
+		lua_pushnumber(L, bits & 0x8000 ? -d : d);
+	}
+}
+
+static void
+pushstring(lua_State *L, struct decoder *d, uint64_t n)
+{
+	need(L, d, n);
+	lua_pushlstring(L, (const char *)d->ptr, n);
+	d->ptr += n;
+}
+
+static void
+descend(lua_State *L, struct decoder *d)
+{
+	if (++d->depth > json_decode_max_depth(d->cfg))
+		luaL_error(L,
+		    "Found too many nested data structures (%d) at byte %d",
+		    d->depth, (int)(d->ptr - d->data));
+	luaL_checkstack(L, 4, NULL);
+}
+
+static void decodevalue(lua_State *, struct decoder *);
+
+/* decodes 'n' elements, or elements up to a CBOR break if 'n' is -1 */
+static void
+decodearray(lua_State *L, struct decoder *d, int64_t n)
+{
+	int64_t i;
+
+	descend(L, d);
+	lua_createtable(L, n > 0 && n <= d->end - d->ptr ? n : 0, 0);
+	json_set_array_mt(L, d->cfg);
+
+	for (i = 1; n < 0 || i <= n; i++) {
+		if (n < 0) {
+			need(L, d, 1);
+			if (*d->ptr == 0xff) {
+				d->ptr++;
+				break;
+			}
+		}
+		decodevalue(L, d);
+		lua_rawseti(L, -2, i);
+	}
+	d->depth--;
+}
+
+static void
+decodemap(lua_State *L, struct decoder *d, int64_t n)
+{
+	int64_t i;
+
+	descend(L, d);
+	lua_createtable(L, 0, n > 0 && n <= (d->end - d->ptr) / 2 ? n : 0);
+
+	for (i = 0; n < 0 || i < n; i++) {
+		if (n < 0) {
+			need(L, d, 1);
+			if (*d->ptr == 0xff) {
+				d->ptr++;
+				break;
+			}
+		}
+		decodevalue(L, d);
+		decodevalue(L, d);
+		lua_rawset(L, -3);
+	}
+	d->depth--;
+}
+
+static void
+decodemsgpack(lua_State *L, struct decoder *d)
+{
+	unsigned char c;
+	uint64_t n;
+	int type;
+
+	need(L, d, 1);
+	c = *d->ptr++;
+
+	if (c <= 0x7f) {
+		lua_pushinteger(L, c);
+		return;
+	}
+	if (c >= 0xe0) {
+		lua_pushinteger(L, (int8_t)c);
+		return;
+	}
+	if (c <= 0x8f) {
+		decodemap(L, d, c & 0x0f);
+		return;
+	}
+	if (c <= 0x9f) {
+		decodearray(L, d, c & 0x0f);
+		return;
+	}
+	if (c <= 0xbf) {
+		pushstring(L, d, c & 0x1f);
+		return;
+	}
+
+	switch (c) {
+	case 0xc0:
+		lua_pushlightuserdata(L, NULL);
+		break;
+	case 0xc2:
+	case 0xc3:
+		lua_pushboolean(L, c == 0xc3);
+		break;
+	case 0xc4:
+	case 0xc5:
+	case 0xc6:
+		/* bin 8, 16 and 32 */
+		n = readbytes(L, d, 1 << (c - 0xc4));
+		pushstring(L, d, n);
+		break;
+	case 0xc7:
+	case 0xc8:
+	case 0xc9:
+		/* ext 8, 16 and 32 */
+		n = readbytes(L, d, 1 << (c - 0xc7));
+		goto ext;
+	case 0xca:
+		pushfloat(L, readbytes(L, d, 4), 4);
+		break;
+	case 0xcb:
+		pushfloat(L, readbytes(L, d, 8), 8);
+		break;
+	case 0xcc:
+	case 0xcd:
+	case 0xce:
+	case 0xcf:
+		pushunsigned(L, readbytes(L, d, 1 << (c - 0xcc)));
+		break;
+	case 0xd0:
+		lua_pushinteger(L, (int8_t)readbytes(L, d, 1));
+		break;
+	case 0xd1:
+		lua_pushinteger(L, (int16_t)readbytes(L, d, 2));
+		break;
+	case 0xd2:
+		lua_pushinteger(L, (int32_t)readbytes(L, d, 4));
+		break;
+	case 0xd3:
+		lua_pushinteger(L, (int64_t)readbytes(L, d, 8));
+		break;
+	case 0xd4:
+	case 0xd5:
+	case 0xd6:
+	case 0xd7:
+	case 0xd8:
+		/* fixext 1, 2, 4, 8 and 16 */
+		n = 1 << (c - 0xd4);
+		goto ext;
+	case 0xd9:
+	case 0xda:
+	case 0xdb:
+		n = readbytes(L, d, 1 << (c - 0xd9));
+		pushstring(L, d, n);
+		break;
+	case 0xdc:
+	case 0xdd:
+		decodearray(L, d, readbytes(L, d, c == 0xdc ? 2 : 4));
+		break;
+	case 0xde:
+	case 0xdf:
+		decodemap(L, d, readbytes(L, d, c == 0xde ? 2 : 4));
+		break;
+	default:
+		d->ptr--;
+		decodeerror(L, d, "Found an invalid type byte");
+	}
+	return;
+
+ext:
+	type = (int8_t)readbytes(L, d, 1);
+	if (!d->ext) {
+		d->ptr--;
+		decodeerror(L, d, "Found an extension type without an ext hook");
+	}
+	lua_pushvalue(L, d->ext);
+	lua_pushinteger(L, type);
+	pushstring(L, d, n);
+	lua_call(L, 2, 1);
+}
+
+/*
+ * Reads the argument of a CBOR head with additional information
+ * 'info'. Returns -1 for an indefinite length.
+ */
+static int
+cborargument(lua_State *L, struct decoder *d, int info, uint64_t *arg)
+{
+	*arg = 0;
+	if (info < 24) {
+		*arg = info;
+		return 0;
+	}
+	if (info <= 27) {
+		*arg = readbytes(L, d, 1 << (info - 24));
+		return 0;
+	}
+	if (info == 31)
+		return -1;
+
+	d->ptr--;
+	decodeerror(L, d, "Found an invalid additional information value");
+	return 0;
+}
+
+static void
+decodecbor(lua_State *L, struct decoder *d)
+{
+	luaL_Buffer b;
+	unsigned char c;
+	uint64_t arg;
+	int major, info, indefinite;
+
+	need(L, d, 1);
+	c = *d->ptr++;
+	major = c >> 5;
+	info = c & 0x1f;
+
+	if (major == 7) {
+		switch (info) {
+		case 20:
+		case 21:
+			lua_pushboolean(L, info == 21);
+			return;
+		case 22:
+		case 23:
+			/* null and undefined */
+			lua_pushlightuserdata(L, NULL);
+			return;
+		case 25:
+		case 26:
+		case 27:
+			pushfloat(L, readbytes(L, d, 1 << (info - 24)),
+			    1 << (info - 24));
+			return;
+		}
+		d->ptr--;
+		decodeerror(L, d, "Found an unsupported simple value");
+	}
+
+	indefinite = cborargument(L, d, info, &arg) < 0;
+	if (indefinite && major != 2 && major != 3 && major != 4
+	    && major != 5) {
+		d->ptr--;
+		decodeerror(L, d, "Found an invalid indefinite length item");
+	}
+
+	switch (major) {
+	case 0:
+		pushunsigned(L, arg);
+		break;
+	case 1:
+		if (arg <= LUA_MAXINTEGER)
+			lua_pushinteger(L, -1 - (lua_Integer)arg);
+		else
+			lua_pushnumber(L, -1.0 - (lua_Number)arg);
+		break;
+	case 2:
+	case 3:
+		if (!indefinite) {
+			pushstring(L, d, arg);
+			break;
+		}
+		/* concatenate definite length chunks up to the break */
+		luaL_buffinit(L, &b);
+		for (;;) {
+			need(L, d, 1);
+			if (*d->ptr == 0xff) {
+				d->ptr++;
+				break;
+			}
+			c = *d->ptr++;
+			if (c >> 5 != major
+			    || cborargument(L, d, c & 0x1f, &arg) < 0) {
+				d->ptr--;
+				decodeerror(L, d, "Found an invalid string chunk");
+			}
+			need(L, d, arg);
+			luaL_addlstring(&b, (const char *)d->ptr, arg);
+			d->ptr += arg;
+		}
+		luaL_pushresult(&b);
+		break;
+	case 4:
+		decodearray(L, d, indefinite ? -1 : (int64_t)arg);
+		break;
+	case 5:
+		decodemap(L, d, indefinite ? -1 : (int64_t)arg);
+		break;
+	case 6:
+		/*
+		 * tags are passed to the ext hook with the tagged value,
+		 * and are otherwise ignored
+		 */
+		descend(L, d);
+		if (d->ext) {
+			lua_pushvalue(L, d->ext);
+			pushunsigned(L, arg);
+			decodevalue(L, d);
+			lua_call(L, 2, 1);
+		} else {
+			decodevalue(L, d);
+		}
+		d->depth--;
+		break;
+	}
+}
+
+static void
+decodevalue(lua_State *L, struct decoder *d)
+{
+	if (d->format == PACK_CBOR)
+		decodecbor(L, d);
+	else
+		decodemsgpack(L, d);
+}
+
+static void
+decoderinit(struct decoder *d, json_config_t *cfg, enum packformat format,
+    const char *data, size_t len, int ext)
+{
+	d->cfg = cfg;
+	d->format = format;
+	d->data = (const unsigned char *)data;
+	d->ptr = d->data;
+	d->end = d->data + len;
+	d->depth = 0;
+	d->ext = ext;
+	d->incomplete = 0;
+}
+
+int
+pack_decode(lua_State *L, enum packformat format)
+{
+	struct decoder d;
+	const char *data;
+	size_t len;
+	int ext;
+
+	luaL_argcheck(L, lua_gettop(L) >= 1 && lua_gettop(L) <= 2, 2,
+	    "expected 1 or 2 arguments");
+
+	data = luaL_checklstring(L, 1, &len);
+	ext = 0;
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TFUNCTION);
+		ext = 2;
+	}
+
+	decoderinit(&d, json_fetch_config(L), format, data, len, ext);
+	decodevalue(L, &d);
+	if (d.ptr != d.end)
+		decodeerror(L, &d, "Found trailing data");
+	return 1;
+}
+
+/* }================================================================== */
+
+/*
+ * {==================================================================
+ * Streaming decoder
+ * ===================================================================
+ */
+
+/*
+ * Before a value is decoded, the stream is scanned for its end. The
+ * scan only reads the heads of items, which tell how many bytes and
+ * items follow, and it stops at the first item that has not been fed
+ * completely, so each call to next() carries on where the last one
+ * stopped instead of decoding the incomplete value from its start.
+ *
+ * 'pending' counts the items still to be scanned. An indefinite
+ * length CBOR item ends at a break instead, so its enclosing count is
+ * pushed on 'frames' until the break is seen.
+ */
+
+static uint64_t
+readbe(const unsigned char *p, int bytes)
+{
+	uint64_t v;
+	int i;
+
+	v = 0;
+	for (i = 0; i < bytes; i++)
+		v = (v << 8) | p[i];
+	return v;
+}
+
+/*
+ * Measures the msgpack item at 'p': the size of its head in 'head',
+ * of its payload in 'len' and the number of items it contains in
+ * 'items'. Returns 1 if at most 'avail' bytes had to be read, -1 if
+ * the item is invalid, or 0 if more data is needed.
+ */
+static int
+measuremsgpack(const unsigned char *p, size_t avail, size_t *head,
+    uint64_t *len, uint64_t *items)
+{
+	unsigned char c;
+	int k;
+
+	c = p[0];
+	*head = 1;
+	*len = *items = 0;
+	if (c <= 0x7f || c >= 0xe0)
+		return 1;
+	if (c <= 0x8f) {
+		*items = 2 * (c & 0x0f);
+		return 1;
+	}
+	if (c <= 0x9f) {
+		*items = c & 0x0f;
+		return 1;
+	}
+	if (c <= 0xbf) {
+		*len = c & 0x1f;
+		return 1;
+	}
+
+	switch (c) {
+	case 0xc0:
+	case 0xc2:
+	case 0xc3:
+		return 1;
+	case 0xc4:
+	case 0xc5:
+	case 0xc6:
+	case 0xd9:
+	case 0xda:
+	case 0xdb:
+		/* bin and str with a length */
+		k = 1 << (c >= 0xd9 ? c - 0xd9 : c - 0xc4);
+		*head = 1 + k;
+		if (avail < *head)
+			return 0;
+		*len = readbe(p + 1, k);
+		return 1;
+	case 0xc7:
+	case 0xc8:
+	case 0xc9:
+		/* ext with a length, followed by the type */
+		k = 1 << (c - 0xc7);
+		*head = 2 + k;
+		if (avail < *head)
+			return 0;
+		*len = readbe(p + 1, k);
+		return 1;
+	case 0xca:
+	case 0xcb:
+		*head = c == 0xca ? 5 : 9;
+		return 1;
+	case 0xcc:
+	case 0xcd:
+	case 0xce:
+	case 0xcf:
+	case 0xd0:
+	case 0xd1:
+	case 0xd2:
+	case 0xd3:
+		*head = 1 + (1 << ((c - 0xcc) & 3));
+		return 1;
+	case 0xd4:
+	case 0xd5:
+	case 0xd6:
+	case 0xd7:
+	case 0xd8:
+		*head = 2;
+		*len = 1 << (c - 0xd4);
+		return 1;
+	case 0xdc:
+	case 0xdd:
+	case 0xde:
+	case 0xdf:
+		k = c == 0xdc || c == 0xde ? 2 : 4;
+		*head = 1 + k;
+		if (avail < *head)
+			return 0;
+		*items = readbe(p + 1, k);
+		if (c >= 0xde)
+			*items *= 2;
+		return 1;
+	}
+	return -1;
+}
+
+/*
+ * As measuremsgpack(), for the CBOR item at 'p'. 'items' is set to
+ * UINT64_MAX for an indefinite length item.
+ */
+static int
+measurecbor(const unsigned char *p, size_t avail, size_t *head,
+    uint64_t *len, uint64_t *items)
+{
+	uint64_t arg;
+	int major, info;
+
+	major = p[0] >> 5;
+	info = p[0] & 0x1f;
+	*head = 1;
+	*len = *items = 0;
+
+	if (info == 31) {
+		if (major < 2 || major > 5)
+			return -1;
+		*items = UINT64_MAX;
+		return 1;
+	}
+	if (info >= 28)
+		return -1;
+	if (info >= 24)
+		*head = 1 + (1 << (info - 24));
+	if (major == 7)
+		return info >= 20 && info != 24 ? 1 : -1;
+	if (avail < *head)
+		return 0;
+	arg = info < 24 ? (uint64_t)info : readbe(p + 1, *head - 1);
+
+	switch (major) {
+	case 2:
+	case 3:
+		*len = arg;
+		break;
+	case 4:
+		*items = arg == UINT64_MAX ? UINT64_MAX - 1 : arg;
+		break;
+	case 5:
+		*items = arg > UINT64_MAX / 2 ? UINT64_MAX - 1 : 2 * arg;
+		break;
+	case 6:
+		*items = 1;
+		break;
+	}
+	return 1;
+}
+
+/*
+ * Scans the stream for the end of the next value. Returns 1 if the
+ * value has been fed completely or it is invalid, so decoding it will
+ * not run out of data, else 0.
+ */
+static int
+streamscan(struct stream *s, json_config_t *cfg)
+{
+	const unsigned char *p, *end;
+	uint64_t len, items;
+	size_t head, avail, nframes;
+	int ret;
+
+	end = (const unsigned char *)s->buf.buf + strbuf_length(&s->buf);
+	for (;;) {
+		nframes = strbuf_length(&s->frames) / sizeof(uint64_t);
+		if (s->pending == 0 && nframes == 0)
+			return 1;
+		p = (const unsigned char *)s->buf.buf + s->scan;
+		if (p == end)
+			return 0;
+
+		if (s->pending == 0 && *p == 0xff) {
+			/* the break closing an indefinite length item */
+			memcpy(&s->pending, s->frames.buf + (nframes - 1)
+			    * sizeof(uint64_t), sizeof(uint64_t));
+			strbuf_set_length(&s->frames,
+			    (nframes - 1) * sizeof(uint64_t));
+			s->scan++;
+			continue;
+		}
+
+		avail = end - p;
+		if (s->format == PACK_CBOR)
+			ret = measurecbor(p, avail, &head, &len, &items);
+		else
+			ret = measuremsgpack(p, avail, &head, &len, &items);
+		if (ret < 0)
+			return 1;
+		if (ret == 0 || avail < head || avail - head < len)
+			return 0;
+
+		s->scan += head + len;
+		if (s->pending > 0)
+			s->pending--;
+		if (items == UINT64_MAX) {
+			if (nframes >= (size_t)json_decode_max_depth(cfg))
+				return 1;
+			strbuf_append_mem(&s->frames, (char *)&s->pending,
+			    sizeof(uint64_t));
+			s->pending = 0;
+		} else {
+			s->pending = items > UINT64_MAX - 1 - s->pending
+			    ? UINT64_MAX - 1 : s->pending + items;
+		}
+	}
+}
+
+/* starts the scan for the value after the one just decoded */
+static void
+streamrestart(struct stream *s)
+{
+	s->scan = s->pos;
+	s->pending = 1;
+	strbuf_reset(&s->frames);
+}
+
+/*
+ * Decodes one value for stream_next() in protected mode, with the ext
+ * hook as the second argument.
+ */
+static int
+streamdecode(lua_State *L)
+{
+	struct decoder *d;
+
+	d = lua_touserdata(L, 1);
+	if (d->ext)
+		d->ext = 2;
+	decodevalue(L, d);
+	return 1;
+}
+
+static int
+stream_gc(lua_State *L)
+{
+	struct stream *s;
+
+	s = luaL_checkudata(L, 1, PACK_STREAM);
+	strbuf_free(&s->buf);
+	strbuf_free(&s->frames);
+	return 0;
+}
+
+/* decoder:feed(chunk) appends data to the stream */
+static int
+stream_feed(lua_State *L)
+{
+	struct stream *s;
+	const char *chunk;
+	size_t len;
+
+	s = luaL_checkudata(L, 1, PACK_STREAM);
+	chunk = luaL_checklstring(L, 2, &len);
+	if (s->busy)
+		return luaL_error(L, "decoder is in use");
+
+	/* drop decoded data once it is at least half of the buffer */
+	if (s->pos > 0 && s->pos >= strbuf_length(&s->buf) / 2) {
+		memmove(s->buf.buf, s->buf.buf + s->pos,
+		    strbuf_length(&s->buf) - s->pos);
+		strbuf_set_length(&s->buf, strbuf_length(&s->buf) - s->pos);
+		s->scan -= s->pos;
+		s->pos = 0;
+	}
+	strbuf_append_mem(&s->buf, chunk, len);
+
+	lua_settop(L, 1);
+	return 1;
+}
+
+/*
+ * decoder:next() returns the next value, or nil if the data fed so far
+ * does not hold a complete value.
+ */
+static int
+stream_next(lua_State *L)
+{
+	struct stream *s;
+	struct decoder d;
+	json_config_t *cfg;
+	int ret;
+
+	s = luaL_checkudata(L, 1, PACK_STREAM);
+	lua_settop(L, 1);
+	if (s->busy)
+		return luaL_error(L, "decoder is in use");
+	if (s->pos == strbuf_length(&s->buf))
+		return 0;
+
+	lua_getiuservalue(L, 1, 1);
+	cfg = lua_touserdata(L, -1);
+	if (!streamscan(s, cfg))
+		return 0;
+	decoderinit(&d, cfg, s->format, s->buf.buf + s->pos,
+	    strbuf_length(&s->buf) - s->pos, 0);
+
+	lua_pushcfunction(L, streamdecode);
+	lua_pushlightuserdata(L, &d);
+	lua_getiuservalue(L, 1, 2);
+	d.ext = !lua_isnil(L, -1);
+
+	s->busy = 1;
+	ret = lua_pcall(L, 2, 1, 0);
+	s->busy = 0;
+	if (ret != LUA_OK) {
+		if (d.incomplete)
+			return 0;
+		return lua_error(L);
+	}
+	s->pos += d.ptr - d.data;
+	streamrestart(s);
+	return 1;
+}
+
+int
+pack_decoder(lua_State *L, enum packformat format)
+{
+	struct stream *s;
+
+	if (!lua_isnoneornil(L, 1))
+		luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+
+	s = lua_newuserdatauv(L, sizeof(*s), 2);
+	strbuf_init(&s->buf, 0);
+	strbuf_init(&s->frames, 0);
+	s->pos = 0;
+	s->format = format;
+	s->busy = 0;
+	streamrestart(s);
+	luaL_setmetatable(L, PACK_STREAM);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_setiuservalue(L, -2, 1);
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 2);
+	return 1;
+}
+
+/* }================================================================== */
+
+/* clang-format off */
+
+static const luaL_Reg streammethods[] = {
+	{"feed", stream_feed},
+	{"next", stream_next},
+	{NULL, NULL}
+};
+
+/* clang-format on */
+
+/*
+ * Creates a library table of the functions in 'funcs', which get the
+ * config shared with the json library as their upvalue.
+ */
+void
+pack_newlib(lua_State *L, const luaL_Reg *funcs)
+{
+	if (luaL_newmetatable(L, PACK_STREAM)) {
+		luaL_newlib(L, streammethods);
+		lua_setfield(L, -2, "__index");
+		lua_pushcfunction(L, stream_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_pop(L, 1);
+
+	lua_newtable(L);
+	json_push_shared_config(L);
+	luaL_setfuncs(L, funcs, 1);
+
+	/* null, which nil decodes to as in the json library */
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+}
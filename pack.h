@@ -0,0 +1,22 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+#ifndef _PACK_H_
+#define _PACK_H_
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+enum packformat {
+	PACK_MSGPACK,
+	PACK_CBOR
+};
+
+int pack_encode(lua_State *, enum packformat);
+int pack_decode(lua_State *, enum packformat);
+int pack_decoder(lua_State *, enum packformat);
+void pack_newlib(lua_State *, const luaL_Reg *);
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Callisto - standalone scripting platform for Lua 5.4
+ * Copyright (c) 2023-2024 Jeremy Baxter.
+ */
+
+/*
+ * State pools.
+ *
+ * A pool keeps states made by callisto_newstate with every library
+ * opened, for programs embedding Callisto that run each request in a
+ * state of its own. callisto_checkout hands out an idle state, or
+ * makes one if none is idle, and callisto_checkin resets a state and
+ * keeps it for the next request. Both can be called from any thread;
+ * a state itself must only be used by one thread at a time.
+ *
+ * When a state is made, the tables reachable from the registry in up
+ * to three steps are copied: the registry itself, the global table,
+ * package.loaded and package.preload, each library and the tables in
+ * its fields, like package.searchers and the metatables of files.
+ * The string metatable is copied too. Resetting a state sets the
+ * fields and metatables of those tables back to what was copied, so
+ * globals, loaded modules and registry entries added by a request are
+ * removed and library functions it replaced are put back; the tables
+ * the request made are left to the garbage collector. The options
+ * set with json.config, which live in a userdata shared by the json,
+ * msgpack and cbor libraries, are set back to their defaults. Changes
+ * to other values, such as the contents of a userdata or the upvalues
+ * of a function, are not undone.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua/lauxlib.h>
+#include <lua/lua.h>
+
+#include <json/lua_cjson.h>
+
+#include "callisto.h"
+
+#define POOL_DEPTH  3 /* steps from the registry to the tables copied */
+#define POOL_REGKEY "_CALLISTO_POOL" /* registry field of the copies */
+
+struct callisto_pool {
+	pthread_mutex_t lock;
+	lua_State **idle;
+	int nidle;
+	int size; /* idle states kept at most */
+};
+
+/*
+ * Adds the table at 'idx' to the copies, as the table, its copy, its
+ * number of fields and its metatable or false, then the tables in its
+ * fields down to 'depth' steps. 'seen' is the index of a table of the tables copied.
+ */
+static void
+copytable(lua_State *L, int idx, int copies, int seen, int depth)
+{
+	lua_Integer n, fields;
+
+	idx = lua_absindex(L, idx);
+	lua_pushvalue(L, idx);
+	if (lua_rawget(L, seen) != LUA_TNIL) {
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 1);
+	lua_pushvalue(L, idx);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen);
+
+	n = luaL_len(L, copies);
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, copies, n + 1);
+	lua_newtable(L);
+	lua_pushnil(L);
+	for (fields = 0; lua_next(L, idx); fields++) {
+		lua_pushvalue(L, -2);
+		lua_insert(L, -2);
+		lua_rawset(L, -4);
+	}
+	lua_rawseti(L, copies, n + 2);
+	lua_pushinteger(L, fields);
+	lua_rawseti(L, copies, n + 3);
+	if (!lua_getmetatable(L, idx))
+		lua_pushboolean(L, 0);
+	lua_rawseti(L, copies, n + 4);
+
+	if (depth == 0)
+		return;
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		if (lua_istable(L, -1))
+			copytable(L, -1, copies, seen, depth - 1);
+		lua_pop(L, 1);
+	}
+}
+
+/* copies the tables of the state */
+static int
+snapshot(lua_State *L)
+{
+	int copies, seen;
+
+	callisto_openall(L); /* so each request finds them opened */
+	lua_newtable(L);
+	copies = lua_gettop(L);
+	lua_pushvalue(L, copies);
+	lua_setfield(L, LUA_REGISTRYINDEX, POOL_REGKEY);
+	lua_newtable(L);
+	seen = lua_gettop(L);
+	lua_pushvalue(L, copies);
+	lua_pushboolean(L, 1);
+	lua_rawset(L, seen);
+
+	lua_pushliteral(L, "");
+	if (lua_getmetatable(L, -1))
+		copytable(L, -1, copies, seen, 0);
+	copytable(L, LUA_REGISTRYINDEX, copies, seen, POOL_DEPTH);
+	return 0;
+}
+
+/*
+ * Sets the fields of the table at 'idx' to those of the copy on top,
+ * which has 'n' fields.
+ */
+static void
+restoretable(lua_State *L, int idx, lua_Integer n)
+{
+	int copy;
+
+	copy = lua_gettop(L);
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		lua_pushvalue(L, -2);
+		lua_rawget(L, copy);
+		if (lua_rawequal(L, -1, -2)) {
+			n--;
+			lua_pop(L, 2);
+			continue;
+		}
+		if (!lua_isnil(L, -1))
+			n--;
+		/* changing an existing field is allowed while traversing */
+		lua_pushvalue(L, -3);
+		lua_insert(L, -2);
+		lua_rawset(L, idx);
+		lua_pop(L, 1);
+	}
+	if (n == 0)
+		return; /* no field was removed */
+	lua_pushnil(L);
+	while (lua_next(L, copy)) {
+		lua_pushvalue(L, -2);
+		if (lua_rawget(L, idx) == LUA_TNIL) {
+			lua_pop(L, 1);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, idx);
+		} else
+			lua_pop(L, 1);
+		lua_pop(L, 1);
+	}
+}
+
+static int
+reset(lua_State *L)
+{
+	lua_Integer i, n;
+	int t;
+
+	lua_sethook(L, NULL, 0, 0);
+	if (lua_getfield(L, LUA_REGISTRYINDEX, POOL_REGKEY) != LUA_TTABLE)
+		return luaL_error(L, "state is not from a pool");
+	n = luaL_len(L, 1);
+	for (i = 1; i <= n; i += 4) {
+		lua_rawgeti(L, 1, i);
+		t = lua_gettop(L);
+		lua_rawgeti(L, 1, i + 2);
+		lua_rawgeti(L, 1, i + 1);
+		restoretable(L, t, lua_tointeger(L, -2));
+		lua_pop(L, 2);
+		if (lua_rawgeti(L, 1, i + 3) == LUA_TBOOLEAN) {
+			lua_pop(L, 1);
+			lua_pushnil(L);
+		}
+		lua_setmetatable(L, t);
+		lua_pop(L, 1);
+	}
+	json_reset_shared_config(L);
+	return 0;
+}
+
+/* makes a state with every library opened, and copies its tables */
+static lua_State *
+warmstate(void)
+{
+	lua_State *L;
+
+	if ((L = callisto_newstate()) == NULL)
+		return NULL;
+	lua_pushcfunction(L, snapshot);
+	if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+		lua_close(L);
+		return NULL;
+	}
+	return L;
+}
+
+/*
+ * Returns a new pool keeping up to 'size' idle states, made up front,
+ * or NULL if it cannot be made.
+ */
+struct callisto_pool *
+callisto_newpool(int size)
+{
+	struct callisto_pool *p;
+
+	if (size < 0 || (p = calloc(1, sizeof(*p))) == NULL)
+		return NULL;
+	if ((p->idle = calloc(size > 0 ? size : 1, sizeof(*p->idle))) == NULL
+	    || pthread_mutex_init(&p->lock, NULL) != 0) {
+		free(p->idle);
+		free(p);
+		return NULL;
+	}
+	p->size = size;
+	for (; p->nidle < size; p->nidle++) {
+		if ((p->idle[p->nidle] = warmstate()) == NULL) {
+			callisto_closepool(p);
+			return NULL;
+		}
+	}
+	return p;
+}
+
+/*
+ * Returns an idle state of the pool, or a new one if none is idle, or
+ * NULL if one cannot be made. The state is given back with
+ * callisto_checkin, or closed with lua_close.
+ */
+lua_State *
+callisto_checkout(struct callisto_pool *p)
+{
+	lua_State *L = NULL;
+
+	pthread_mutex_lock(&p->lock);
+	if (p->nidle > 0)
+		L = p->idle[--p->nidle];
+	pthread_mutex_unlock(&p->lock);
+	return L != NULL ? L : warmstate();
+}
+
+/*
+ * Resets a state from callisto_checkout and keeps it in the pool, or
+ * closes it if the pool is full or it cannot be reset.
+ */
+void
+callisto_checkin(struct callisto_pool *p, lua_State *L)
+{
+	lua_settop(L, 0);
+	lua_pushcfunction(L, reset);
+	if (lua_pcall(L, 0, 0, 0) == LUA_OK) {
+		pthread_mutex_lock(&p->lock);
+		if (p->nidle < p->size) {
+			p->idle[p->nidle++] = L;
+			L = NULL;
+		}
+		pthread_mutex_unlock(&p->lock);
+	}
+	if (L != NULL)
+		lua_close(L);
+}
+
+/*
+ * Closes the idle states of a pool and frees it. States checked out
+ * are not closed, and must not be checked in afterwards.
+ */
+void
+callisto_closepool(struct callisto_pool *p)
+{
+	while (p->nidle > 0)
+		lua_close(p->idle[--p->nidle]);
+	pthread_mutex_destroy(&p->lock);
+	free(p->idle);
+	free(p);
+}
@@ -27,6 +27,119 @@ end
 -- The cl library is excluded from here as it is almost
 -- impossible to test without user interaction.
 local tests = {
+	callisto = {
+		allocstats = function ()
+			local before, after
+			local keep = {}
+
+			before = callisto.allocstats()
+			for i = 1, 1000 do
+				keep[i] = {i}
+			end
+			after = callisto.allocstats()
+			assert(after.inuse > before.inuse)
+			assert(after.peak >= after.inuse)
+			assert(after.pages >= 1)
+			assert(#after.classes == 32)
+			assert(after.classes[1].size == 8)
+			for i, c in ipairs(after.classes) do
+				assert(c.allocs >= before.classes[i].allocs)
+				assert(c.allocs >= c.inuse)
+			end
+			return "callisto.allocstats()"
+		end,
+		stats = function ()
+			local before, after
+
+			before = callisto.stats()
+			fs.exists("/")
+			collectgarbage()
+			after = callisto.stats()
+			assert(after.wall >= before.wall and after.cpu > 0)
+			assert(after.rss > 0)
+			assert(after.allocated > before.allocated)
+			assert(after.gc.major > before.gc.major)
+			assert(after.gc.pauses > before.gc.pauses)
+			assert(after.gc.maxpause <= after.gc.pausetime)
+			-- calls are only counted with -S
+			assert(next(after.calls) == nil)
+			hdl = io.popen(arg[-1] .. [[ -S -e 'fs.exists("/")' 2>&1]])
+			assert(hdl:read("a"):match("calls: fs 1\n"))
+			hdl:close()
+			return "callisto.stats()"
+		end
+	},
+
+	bench = {
+		run = function ()
+			local n = 0
+			local r
+
+			r = bench.run("count", function ()
+				n = n + 1
+			end, {warmup = 0, min_time = 0.01, gc = "stop"})
+			assert(r.name == "count" and r.samples >= 5)
+			assert(r.iterations == r.samples * r.batch)
+			assert(n >= r.iterations)
+			assert(r.min <= r.median and r.median <= r.p95)
+			assert(r.p95 <= r.max and r.stddev >= 0)
+			assert(not pcall(bench.run, "e", error, {min_time = 0}))
+			assert(collectgarbage("isrunning"))
+			assert(bench.report({r}):find("count", 1, true))
+			return 'bench.run("count", function () ... end)'
+		end
+	},
+
+	buffer = {
+		new = function ()
+			local buf = buffer.new()
+
+			buf:put("a", 1, 2.5):putf("|%5.2f|%-3s|%x", math.pi, "b", 255)
+			assert(#buf == 18)
+			assert(buf:tostring() == "a12.5| 3.14|b  |ff")
+			assert(buf:get(1, 1) == "a")
+			assert(buf:skip(3):get() == "| 3.14|b  |ff")
+			assert(#buf == 0 and buf:get() == "")
+			buf:put("ab"):put(buf)
+			assert(tostring(buf) == "abab")
+			assert(not pcall(buf.put, buf, {}))
+			assert(not pcall(buf.putf, buf, "%d", "x"))
+			return "buffer.new():put(...)"
+		end
+	},
+
+	cbor = {
+		decode = function ()
+			local t = {1, 2.5, "three", {four = 4}}
+			local d = cbor.decode(cbor.encode(t))
+
+			assert(d[1] == 1 and math.type(d[1]) == "integer")
+			assert(d[2] == 2.5)
+			assert(d[3] == "three")
+			assert(d[4].four == 4)
+			return "cbor.decode(cbor.encode({...}))"
+		end,
+		decoder = function ()
+			-- [1, [2], "ab", {"k": 3}] with indefinite lengths, then 5
+			local s = "\x9f\x01\x9f\x02\xff\x7f\x61a\x61b\xff"
+				.. "\xbf\x61k\x03\xff\xff\x05"
+			local d = cbor.decoder()
+			local t
+
+			for i = 1, #s - 1 do
+				assert(d:next() == nil)
+				d:feed(s:sub(i, i))
+			end
+			t = d:next()
+			assert(t[1] == 1 and t[2][1] == 2)
+			assert(t[3] == "ab" and t[4].k == 3)
+			assert(d:next() == nil)
+			d:feed(s:sub(-1))
+			assert(d:next() == 5)
+			return "cbor.decoder():next()"
+		end
+	},
+
 	environ = {
 		getvar = function ()
 			local var = "HOME"
@@ -58,6 +171,45 @@ local tests = {
 	extra = {
 	},
 
+	event = {
+		readable = function ()
+			local f = io.popen("sleep 0.05; echo done")
+			local results = {}
+
+			event.spawn(function ()
+				local ok, err = event.readable(f, 0)
+				assert(not ok and err == "timed out")
+				assert(event.readable(f))
+				results[#results + 1] = f:read("l")
+			end)
+			event.spawn(function ()
+				assert(not event.readable(f))
+			end)
+			event.run()
+			assert(results[1] == "done")
+			f:close()
+			return "event.readable(f)"
+		end,
+		sleep = function ()
+			local order = {}
+
+			for i = 3, 1, -1 do
+				event.spawn(function (n)
+					event.sleep(n / 100)
+					order[#order + 1] = n
+				end, i)
+			end
+			event.spawn(function ()
+				coroutine.yield()
+				order[#order + 1] = 0
+			end)
+			event.run()
+			assert(table.concat(order, " ") == "0 1 2 3")
+			assert(not pcall(event.sleep, 0))
+			return "event.sleep(n / 100)"
+		end
+	},
+
 	fs = {
 		copy = function ()
 			local src, dst = "testfile", "testfile.cp"
@@ -190,6 +342,11 @@ fs.dirname("]] .. dpath .. '")'
 				assert(t.a[5] == 16)
 			end
 
+			t = json.decode('{"k": 1, "k": 2}')
+			assert(t.k == 2)
+			t = json.decode("[" .. string.rep("0,", 99) .. "100]")
+			assert(#t == 100 and t[100] == 100)
+
 			return "json.decode('" .. j:gsub("%s", "") .. "')"
 		end,
 		encode = function()
@@ -211,8 +368,168 @@ fs.dirname("]] .. dpath .. '")'
 			assert(t.a[3] == 4)
 			assert(t.a[4] == 8)
 			assert(t.a[5] == 16)
+			assert(json.encode({1, nil, -3}) == "[1,null,-3]")
+			assert(json.encode({1, 2, x = 3}):match("^{"))
+			t = {}
+			for i = 5, 1, -1 do t[i] = i end -- keys in the hash part
+			assert(json.encode({t, {1, 2}}) == "[[1,2,3,4,5],[1,2]]")
+			-- the '/' option of one instance does not reach another
+			local j2 = json.new()
+			j2.config("encode:escape-forward-slash", false)
+			assert(j2.encode("a/b") == '"a/b"')
+			assert(json.encode("a/b") == '"a\\/b"')
 
 			return "json.decode(json.encode({...}))"
+		end,
+		encodeto = function()
+			local file = "testfile.json"
+			local f, err = io.open(file, 'w')
+			local t = {a = {1, 2, 3}}
+
+			assert(f, err)
+			assert(json.encodeto(f, t, {flush_threshold = 1}))
+			f:close()
+			f = io.open(file)
+			assert(f:read('a') == json.encode(t))
+			f:close()
+			os.remove(file)
+
+			-- a failed pretty encode leaves later encodes compact
+			assert(not pcall(json.encodeto, 1, {{print}}, {indent = 2}))
+			assert(json.encode(t) == '{"a":[1,2,3]}')
+
+			-- a failed encode into a buffer leaves it as it was
+			local buf = buffer.new():put("x")
+			assert(json.encodeto(buf, t))
+			assert(not pcall(json.encodeto, buf, {1, {print}}))
+			assert(buf:tostring() == 'x{"a":[1,2,3]}')
+			json.config("encode:keep-buffer", false)
+			assert(not pcall(json.encodeto, buf, {print}))
+			assert(not pcall(json.encode, {print}))
+			json.config("encode:keep-buffer", true)
+			assert(buf:put("y"):tostring() == 'x{"a":[1,2,3]}y')
+
+			return 'json.encodeto(io.open("' .. file .. '"), t)'
+		end,
+		lines = function()
+			local file = "testfile.ndjson"
+			local f, err = io.open(file, 'w')
+			local n = 0
+
+			assert(f, err)
+			assert(json.writelines(f, {{n = 1}, {n = 2}, {n = 3}}) == 3)
+			f:close()
+
+			for t in json.lines(file) do
+				n = n + 1
+				assert(t.n == n)
+			end
+			assert(n == 3)
+			os.remove(file)
+
+			-- an iterator encoding values of its own
+			f = assert(io.open(file, 'w'))
+			assert(json.writelines(f, function ()
+				n = n + 1
+				json.encode({junk = ("z"):rep(8)})
+				return n <= 6 and {n = n} or nil
+			end) == 3)
+			f:close()
+			for t in json.lines(file) do
+				n = n + 1
+				assert(t.n == n - 4)
+			end
+			assert(n == 10)
+			os.remove(file)
+
+			return 'json.lines("' .. file .. '")'
+		end,
+		parse = function()
+			local j = '{"a": [1, {"b": "c"}], "n": null}'
+			local doc = json.parse(j)
+
+			assert(#doc.a == 2)
+			assert(doc.a[1] == 1)
+			assert(doc.a[2].b == "c")
+			assert(doc.n == json.null)
+			assert(doc.missing == nil)
+			assert(doc:decode("/a/1").b == "c")
+
+			return "json.parse('" .. j .. "')"
+		end,
+		get = function()
+			local j = '{"a": [1, {"b": "c"}], "d~e": true}'
+			local r
+
+			assert(json.get(j, "/a/1/b") == "c")
+			assert(json.get(j, "/d~0e") == true)
+			assert(json.get(j, "/a/2") == nil)
+			assert(json.get('{"k": 1, "k": 2}', "/k") == 1) -- first of duplicates
+
+			r = json.extract(j, {b = "/a/1/b", n = "/a/0"})
+			assert(r.b == "c" and r.n == 1)
+
+			return "json.get('" .. j .. "', \"/a/1/b\")"
+		end,
+		compile = function()
+			local point = json.compile{{"x", "integer"}, {"y", "integer"}}
+			local path = json.compile{
+				{"name", "string"},
+				{"note", "string", optional = true},
+				{"points", {point}}
+			}
+			local j = '{"name":"p","points":[{"x":1,"y":2}]}'
+			local t = path:decode(j)
+
+			assert(t.name == "p")
+			assert(math.type(t.points[1].y) == "integer")
+			assert(path:encode(t) == j)
+
+			return "json.compile({...}):decode('" .. j .. "')"
+		end,
+		validate = function()
+			local j = '{"a": [1, 2, {"b": "c"}], "d": null}'
+			local ok, stats = json.validate(j, {stats = true})
+
+			assert(ok)
+			assert(stats.depth == 3 and stats.objects == 2)
+			assert(stats.keys == 3 and stats.numbers == 2)
+			assert(not json.validate('[1, 2,]'))
+			assert(not json.validate(j, {max_depth = 2}))
+
+			return "json.validate('" .. j .. "')"
+		end
+	},
+
+	msgpack = {
+		decode = function ()
+			local t = {1, -300, 2^60 // 1, 0.1, "s", {k = true}}
+			local d = msgpack.decode(msgpack.encode(t))
+
+			assert(d[1] == 1 and d[2] == -300 and d[3] == 2^60 // 1)
+			assert(d[4] == 0.1)
+			assert(d[5] == "s" and d[6].k == true)
+			-- an ext hook that encodes must not clobber the output
+			d = msgpack.decode(msgpack.encode({1, print, 3}, function ()
+				msgpack.encode({4, 5, 6})
+				return 1, "ab"
+			end), function (type, data)
+				return type .. data
+			end)
+			assert(d[1] == 1 and d[2] == "1ab" and d[3] == 3)
+			return "msgpack.decode(msgpack.encode({...}))"
+		end,
+		decoder = function ()
+			local s = msgpack.encode({1, 2}) .. msgpack.encode("x")
+			local d = msgpack.decoder()
+
+			d:feed(s:sub(1, 2))
+			assert(d:next() == nil)
+			d:feed(s:sub(3))
+			assert(d:next()[2] == 2)
+			assert(d:next() == "x")
+			assert(d:next() == nil)
+			return "msgpack.decoder():next()"
 		end
 	},
 
@@ -241,6 +558,24 @@ fs.dirname("]] .. dpath .. '")'
 			assert(math.type(process.signum(sig)) == "integer")
 			return 'process.signum("' .. sig .. '")'
 		end,
+		parallel = function ()
+			local items = {}
+			local r
+
+			for i = 1, 100 do
+				items[i] = {n = i}
+			end
+			r = process.parallel(items, function (item, i)
+				items = nil -- only in the worker
+				return {i, item.n * 2}
+			end, {jobs = 3, chunk = 7})
+			assert(#r == 100 and items ~= nil)
+			for i = 1, 100 do
+				assert(r[i][1] == i and r[i][2] == i * 2)
+			end
+			assert(not pcall(process.parallel, items, error))
+			return "process.parallel(items, function (item, i) ... end)"
+		end,
 		send = function ()
 			local hdl = io.popen("sleep 8")
 			local pid = process.pidof("sleep")
@@ -250,6 +585,108 @@ fs.dirname("]] .. dpath .. '")'
 
 			return "process.send(" .. tostring(pid) .. ', "SIGKILL")'
 		end
+	},
+
+	profiler = {
+		heapstart = function ()
+			local info, sites, site
+			local keep = {}
+
+			profiler.heapstart(64)
+			assert(not pcall(profiler.heapstart))
+			info = debug.getinfo(1, "Sl")
+			for i = 1, 1000 do
+				keep[i] = {i} -- two lines down from 'info'
+			end
+			assert(profiler.heapreport():match("^heap profile"))
+			sites = profiler.heapstop()
+			site = sites[info.short_src .. ":" .. info.currentline + 2]
+			assert(site and site.live > 0)
+			assert(site.total >= site.live)
+			return "profiler.heapstart(64)"
+		end,
+		start = function ()
+			local stacks, functions
+			local x = 0
+
+			profiler.start(100)
+			assert(not pcall(profiler.start))
+			assert(profiler.status())
+			-- spin until at least one sample is taken
+			repeat
+				for i = 1, 1e5 do
+					x = x + i
+				end
+			until select(2, profiler.status()) > 0
+			stacks, functions = profiler.stop()
+			assert(not profiler.status())
+			assert(next(stacks))
+			for stack, n in pairs(stacks) do
+				local inner = stack:match("[^;]*$")
+				assert(math.type(n) == "integer")
+				assert(functions[inner].self > 0)
+				assert(functions[inner].total >= functions[inner].self)
+			end
+			return "profiler.start()"
+		end,
+		tracestart = function ()
+			local trace
+
+			profiler.tracestart({filter = "^json$"})
+			json.encode({1, 2, 3})
+			fs.basename("/")
+			trace = json.decode(profiler.tracestop())
+			assert(#trace.traceEvents == 1)
+			assert(trace.traceEvents[1].name == "json.encode")
+			assert(trace.traceEvents[1].ph == "X")
+			assert(trace.traceEvents[1].dur >= 0)
+			return 'profiler.tracestart({filter = "^json$"})'
+		end
+	},
+
+	thread = {
+		channel = function ()
+			local ch = thread.channel(2)
+			local t = {name = "x", list = {1, 2.5, true}}
+			local v
+
+			t.self = t
+			assert(ch:send(t))
+			assert(ch:send("second"))
+			assert(not ch:send("third", 0))
+			v = ch:recv()
+			assert(v ~= t and v.self == v)
+			assert(v.name == "x" and v.list[2] == 2.5 and v.list[3])
+			assert(ch:recv() == "second")
+			assert(not ch:recv(0.01))
+			ch:close()
+			assert(not ch:send(1))
+			assert(not pcall(ch.send, ch, print))
+			return "thread.channel(2)"
+		end,
+		spawn = function ()
+			local ch = thread.channel()
+			local t, ok, err
+
+			t = thread.spawn(function (ch, n)
+				for i = 1, n do
+					ch:send(i)
+				end
+				ch:close()
+				return n * 2, "done"
+			end, ch, 10)
+			for i = 1, 10 do
+				assert(ch:recv() == i)
+			end
+			assert(ch:recv() == nil)
+			assert(select("#", t:join()) == 2)
+			assert(not pcall(t.join, t))
+			t = thread.spawn("error('failed', 0)")
+			ok, err = pcall(t.join, t)
+			assert(not ok and err == "failed")
+			assert(not pcall(thread.spawn, function () return ch end))
+			return "thread.spawn(function (ch, n) ... end, ch, 10)"
+		end
 	}
 }
 
@@ -259,11 +696,29 @@ do
 	env.test = test
 	local _ENV = env
 
+	-- callisto
+	test(callisto.allocstats)
+	test(callisto.stats)
+
+	-- bench
+	test(bench.run)
+
+	-- buffer
+	test(buffer.new)
+
+	-- cbor
+	test(cbor.decode)
+	test(cbor.decoder)
+
 	-- environ
 	test(environ.getvar)
 	test(environ.setvar)
 	test(environ.pairs)
 
+	-- event
+	test(event.readable)
+	test(event.sleep)
+
 	-- fs
 	test(fs.copy)
 	test(fs.directory)
@@ -275,15 +730,35 @@ do
 	-- json
 	test(json.decode)
 	test(json.encode)
+	test(json.encodeto)
+	test(json.lines)
+	test(json.parse)
+	test(json.get)
+	test(json.validate)
+	test(json.compile)
+
+	-- msgpack
+	test(msgpack.decode)
+	test(msgpack.decoder)
 
 	-- os
 	test(os.hostname)
 
 	-- process
+	test(process.parallel)
 	test(process.pid)
 	test(process.pidof)
 	test(process.signum)
 	test(process.send)
+
+	-- profiler
+	test(profiler.heapstart)
+	test(profiler.start)
+	test(profiler.tracestart)
+
+	-- thread
+	test(thread.channel)
+	test(thread.spawn)
 end
 
 cl.mesg("all tests completed successfully")
@@ -10,6 +10,14 @@
 
 #include <lua/lua.h>
 
+#define CALLS_REGKEY "_CALLISTO_CALLS" /* registry field of call counters */
+
+/* calls to a library function, counted for callisto.stats */
+struct callcount {
+	size_t calls;
+	lua_CFunction func;
+};
+
 int lfail(lua_State *);
 int lfailm(lua_State *, const char *);
 